@@ -0,0 +1,170 @@
+#include "compression.hpp"
+
+#include <cstring>
+
+#include <time.h>
+
+namespace {
+
+// 4 KB of history each way, and deflate state to match
+const int WINDOW_BITS = 12;
+const int MEM_LEVEL = 5;
+// a frame this far under the limit fits once compressed, however little
+// it compresses
+const size_t COMPRESSION_HEADROOM = 1024;
+const size_t OUTPUT_CHUNK_SIZE = 16384;
+
+uint64_t nowNanos()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void putUint32(char *out, uint32_t value)
+{
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
+
+}
+
+FrameCompression::FrameCompression() : deflating(false), inflating(false), deflate_failed(false)
+{
+	memset(&deflater, 0, sizeof(deflater));
+	memset(&inflater, 0, sizeof(inflater));
+}
+
+FrameCompression::~FrameCompression()
+{
+	if (deflating) {
+		deflateEnd(&deflater);
+	}
+	if (inflating) {
+		inflateEnd(&inflater);
+	}
+}
+
+bool FrameCompression::worthCompressing(const std::string &frame) const
+{
+	return !deflate_failed && frame.size() >= FRAME_HEADER_SIZE + COMPRESSION_THRESHOLD && frame.size() <= FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD - COMPRESSION_HEADROOM;
+}
+
+bool FrameCompression::compress(std::string &frame, CompressionStats &stats)
+{
+	// replaces an encoded frame with its compressed version; returns false
+	// and leaves the frame as it is if zlib fails, in which case it is sent
+	// as it is, and so is every frame after it
+	uint64_t start = nowNanos();
+	if (!deflating) {
+		if (deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -WINDOW_BITS, MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+			deflate_failed = true;
+			return false;
+		}
+		deflating = true;
+	}
+
+	std::string out(FRAME_HEADER_SIZE, '\0');
+	size_t produced = 0;
+	deflater.next_in = (Bytef*)frame.data() + FRAME_HEADER_SIZE;
+	deflater.avail_in = frame.size() - FRAME_HEADER_SIZE;
+	do {
+		out.resize(FRAME_HEADER_SIZE + produced + OUTPUT_CHUNK_SIZE);
+		deflater.next_out = (Bytef*)&out[FRAME_HEADER_SIZE + produced];
+		deflater.avail_out = OUTPUT_CHUNK_SIZE;
+		int status = deflate(&deflater, Z_SYNC_FLUSH);
+		if (status != Z_OK && status != Z_BUF_ERROR) {
+			deflate_failed = true;
+			return false;
+		}
+		produced += OUTPUT_CHUNK_SIZE - deflater.avail_out;
+	} while (deflater.avail_out == 0);
+	out.resize(FRAME_HEADER_SIZE + produced);
+	putUint32(&out[0], produced);
+	out[4] = frame[4] | COMPRESSED_FRAME;
+
+	stats.frames++;
+	stats.raw_bytes += frame.size() - FRAME_HEADER_SIZE;
+	stats.compressed_bytes += produced;
+	frame.swap(out);
+	stats.elapsed_ns += nowNanos() - start;
+	return true;
+}
+
+bool FrameCompression::decompress(Frame &frame, CompressionStats &stats)
+{
+	// frames sent as they are are left alone; returns false if a compressed
+	// one does not continue the stream. The payload of a decompressed frame
+	// is only valid until the next one is decompressed.
+	if (!((uint8_t)frame.opcode & COMPRESSED_FRAME)) {
+		return true;
+	}
+	uint64_t start = nowNanos();
+	if (!inflating && !startInflating()) {
+		return false;
+	}
+
+	inflated.clear();
+	char chunk[OUTPUT_CHUNK_SIZE];
+	inflater.next_in = (Bytef*)frame.payload.data();
+	inflater.avail_in = frame.payload.size();
+	do {
+		inflater.next_out = (Bytef*)chunk;
+		inflater.avail_out = sizeof(chunk);
+		int status = inflate(&inflater, Z_SYNC_FLUSH);
+		if (status != Z_OK && status != Z_BUF_ERROR) {
+			return false;
+		}
+		inflated.append(chunk, sizeof(chunk) - inflater.avail_out);
+		if (inflated.size() > MAX_FRAME_PAYLOAD) {
+			return false;
+		}
+	} while (inflater.avail_in > 0 || inflater.avail_out == 0);
+
+	stats.frames++;
+	stats.raw_bytes += inflated.size();
+	stats.compressed_bytes += frame.payload.size();
+	frame.opcode = (Opcode)((uint8_t)frame.opcode & ~COMPRESSED_FRAME);
+	frame.payload = inflated;
+	stats.elapsed_ns += nowNanos() - start;
+	return true;
+}
+
+std::string FrameCompression::dictionary()
+{
+	// the history compressed frames received so far may refer back to, for
+	// another process to carry on decompressing with; what is sent can start
+	// a new stream at any frame, so its history is not needed
+	if (!inflating) {
+		return "";
+	}
+	std::string window(1 << WINDOW_BITS, '\0');
+	uInt length = window.size();
+	if (inflateGetDictionary(&inflater, (Bytef*)&window[0], &length) != Z_OK) {
+		return "";
+	}
+	window.resize(length);
+	return window;
+}
+
+bool FrameCompression::setDictionary(const std::string &window)
+{
+	if (window.empty()) {
+		return true;
+	}
+	if (!inflating && !startInflating()) {
+		return false;
+	}
+	return inflateSetDictionary(&inflater, (const Bytef*)window.data(), window.size()) == Z_OK;
+}
+
+bool FrameCompression::startInflating()
+{
+	if (inflateInit2(&inflater, -WINDOW_BITS) != Z_OK) {
+		return false;
+	}
+	inflating = true;
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,66 @@
+#ifndef COMPRESSION_HPP
+#define COMPRESSION_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <zlib.h>
+
+#include "protocol.hpp"
+
+/*
+	Frame compression
+
+	Connections that agree on FEATURE_COMPRESSION in the HELLO may send a
+	frame with its payload compressed, which is marked by COMPRESSED_FRAME
+	in the opcode byte. Each direction of a connection is a single raw
+	deflate stream that every compressed frame continues and ends with a
+	sync flush, so a frame can refer back to what earlier frames said: the
+	usernames, addresses and command words that come up again and again.
+
+	Payloads smaller than COMPRESSION_THRESHOLD are not worth it and are
+	sent as they are, as are ones too close to MAX_FRAME_PAYLOAD to be sure
+	to fit once compressed. Frames sent as they are never enter the stream,
+	so either side may send any frame uncompressed.
+
+	The window is kept small, as every connection has a stream each way.
+*/
+
+const uint8_t COMPRESSED_FRAME = 0x80;
+const size_t COMPRESSION_THRESHOLD = 128;
+
+// frames compressed or decompressed, their payload sizes before and after
+// compression and the time spent on them
+struct CompressionStats {
+	uint64_t frames;
+	uint64_t raw_bytes;
+	uint64_t compressed_bytes;
+	uint64_t elapsed_ns;
+};
+
+class FrameCompression {
+public:
+	FrameCompression();
+	~FrameCompression();
+	FrameCompression(const FrameCompression&) = delete;
+	FrameCompression &operator=(const FrameCompression&) = delete;
+	bool worthCompressing(const std::string&) const;
+	bool compress(std::string&, CompressionStats&);
+	bool decompress(Frame&, CompressionStats&);
+	std::string dictionary();
+	bool setDictionary(const std::string&);
+private:
+	bool startInflating();
+	z_stream deflater;
+	z_stream inflater;
+	// the streams are only set up once the first frame needs them
+	bool deflating;
+	bool inflating;
+	// nothing more is compressed once zlib has failed to
+	bool deflate_failed;
+	// payload of the last frame decompressed, reused for the next one
+	std::string inflated;
+};
+
+#endif
\ No newline at end of file
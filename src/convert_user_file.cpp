@@ -0,0 +1,37 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "user_directory.hpp"
+#include "user_store.hpp"
+
+const char USAGE[] = "usage: ./convert_user_file input_user_file output_user_file\n";
+
+int main(int argc, char *argv[])
+{
+	// converts a text user file to a binary one, or a binary one back to text
+	if (argc != 3) {
+		std::cerr << USAGE;
+		exit(EXIT_FAILURE);
+	}
+
+	UserDirectory users;
+	bool binary = isUserStoreFile(argv[1]);
+	bool loaded = binary ? users.loadBinary(argv[1]) : users.loadText(argv[1]);
+	if (!loaded) {
+		std::cerr << "Failed to open user information file " << argv[1] << '\n';
+		exit(EXIT_FAILURE);
+	}
+
+	std::ofstream output(argv[2], std::ios::trunc | std::ios::binary);
+	output << (binary ? users.toText() : users.toBinary());
+	output.close();
+	if (!output) {
+		std::cerr << "Failed to write user information file " << argv[2] << '\n';
+		exit(EXIT_FAILURE);
+	}
+
+	std::cout << "Converted " << users.size() << " users to " << (binary ? "text" : "binary") << '\n';
+	return EXIT_SUCCESS;
+}
\ No newline at end of file
@@ -0,0 +1,241 @@
+#ifndef COW_MAP_HPP
+#define COW_MAP_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <pthread.h>
+
+#include "epoch.hpp"
+
+// Hash map that is read without locks. Buckets are chains of nodes that are
+// never changed once published: a write copies the nodes in front of the
+// one it changes, publishes the new chain with an atomic store and retires
+// the nodes it replaced. Writers take a mutex between themselves.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class CowMap {
+public:
+	CowMap();
+	~CowMap();
+	CowMap(const CowMap&) = delete;
+	CowMap &operator=(const CowMap&) = delete;
+	bool find(const Key&, Value&) const;
+	bool contains(const Key&) const;
+	size_t size() const;
+	template <typename Function>
+	void forEach(Function) const;
+	bool insert(const Key&, const Value&);
+	void assign(const Key&, const Value&);
+	bool erase(const Key&);
+private:
+	struct Node {
+		Key key;
+		Value value;
+		const Node *next;
+	};
+	struct Table {
+		size_t bucket_count;
+		std::unique_ptr<std::atomic<const Node*>[]> buckets;
+	};
+	static Table *createTable(size_t);
+	const Node *findNode(const Table*, const Key&) const;
+	void replace(const Key&, const Value*);
+	void grow();
+	std::atomic<Table*> table;
+	std::atomic<size_t> count;
+	pthread_mutex_t write_mutex;
+	Hash hash;
+};
+
+template <typename Key, typename Value, typename Hash>
+CowMap<Key, Value, Hash>::CowMap()
+{
+	table = createTable(16);
+	count = 0;
+	pthread_mutex_init(&write_mutex, nullptr);
+}
+
+template <typename Key, typename Value, typename Hash>
+CowMap<Key, Value, Hash>::~CowMap()
+{
+	Table *current = table.load();
+	for (size_t i = 0; i < current->bucket_count; ++i) {
+		const Node *node = current->buckets[i].load();
+		while (node != nullptr) {
+			const Node *next = node->next;
+			delete node;
+			node = next;
+		}
+	}
+	delete current;
+	pthread_mutex_destroy(&write_mutex);
+}
+
+template <typename Key, typename Value, typename Hash>
+bool CowMap<Key, Value, Hash>::find(const Key &key, Value &value) const
+{
+	EpochGuard guard;
+	const Node *node = findNode(table.load(std::memory_order_acquire), key);
+	if (node == nullptr) {
+		return false;
+	}
+	value = node->value;
+	return true;
+}
+
+template <typename Key, typename Value, typename Hash>
+bool CowMap<Key, Value, Hash>::contains(const Key &key) const
+{
+	EpochGuard guard;
+	return findNode(table.load(std::memory_order_acquire), key) != nullptr;
+}
+
+template <typename Key, typename Value, typename Hash>
+size_t CowMap<Key, Value, Hash>::size() const
+{
+	return count.load(std::memory_order_relaxed);
+}
+
+template <typename Key, typename Value, typename Hash>
+template <typename Function>
+void CowMap<Key, Value, Hash>::forEach(Function function) const
+{
+	// sees every entry that was there for the whole call, and may or may
+	// not see entries written meanwhile
+	EpochGuard guard;
+	const Table *current = table.load(std::memory_order_acquire);
+	for (size_t i = 0; i < current->bucket_count; ++i) {
+		for (const Node *node = current->buckets[i].load(std::memory_order_acquire); node != nullptr; node = node->next) {
+			function(node->key, node->value);
+		}
+	}
+}
+
+template <typename Key, typename Value, typename Hash>
+bool CowMap<Key, Value, Hash>::insert(const Key &key, const Value &value)
+{
+	// returns false, and changes nothing, if the key is already there
+	pthread_mutex_lock(&write_mutex);
+	bool inserted = findNode(table.load(), key) == nullptr;
+	if (inserted) {
+		replace(key, &value);
+	}
+	pthread_mutex_unlock(&write_mutex);
+	return inserted;
+}
+
+template <typename Key, typename Value, typename Hash>
+void CowMap<Key, Value, Hash>::assign(const Key &key, const Value &value)
+{
+	pthread_mutex_lock(&write_mutex);
+	replace(key, &value);
+	pthread_mutex_unlock(&write_mutex);
+}
+
+template <typename Key, typename Value, typename Hash>
+bool CowMap<Key, Value, Hash>::erase(const Key &key)
+{
+	pthread_mutex_lock(&write_mutex);
+	bool erased = findNode(table.load(), key) != nullptr;
+	if (erased) {
+		replace(key, nullptr);
+	}
+	pthread_mutex_unlock(&write_mutex);
+	return erased;
+}
+
+template <typename Key, typename Value, typename Hash>
+typename CowMap<Key, Value, Hash>::Table *CowMap<Key, Value, Hash>::createTable(size_t bucket_count)
+{
+	Table *created = new Table;
+	created->bucket_count = bucket_count;
+	created->buckets.reset(new std::atomic<const Node*>[bucket_count]);
+	for (size_t i = 0; i < bucket_count; ++i) {
+		created->buckets[i].store(nullptr, std::memory_order_relaxed);
+	}
+	return created;
+}
+
+template <typename Key, typename Value, typename Hash>
+const typename CowMap<Key, Value, Hash>::Node *CowMap<Key, Value, Hash>::findNode(const Table *current, const Key &key) const
+{
+	size_t bucket = hash(key) & (current->bucket_count - 1);
+	for (const Node *node = current->buckets[bucket].load(std::memory_order_acquire); node != nullptr; node = node->next) {
+		if (node->key == key) {
+			return node;
+		}
+	}
+	return nullptr;
+}
+
+template <typename Key, typename Value, typename Hash>
+void CowMap<Key, Value, Hash>::replace(const Key &key, const Value *value)
+{
+	// caller holds write_mutex; sets the key to value, or removes it if
+	// value is null
+	Table *current = table.load();
+	std::atomic<const Node*> &bucket = current->buckets[hash(key) & (current->bucket_count - 1)];
+	const Node *head = bucket.load();
+
+	// copy the nodes in front of the key, the ones behind it are shared
+	std::vector<const Node*> replaced;
+	const Node *rest = head;
+	while (rest != nullptr && !(rest->key == key)) {
+		replaced.push_back(rest);
+		rest = rest->next;
+	}
+	bool existed = rest != nullptr;
+	if (existed) {
+		replaced.push_back(rest);
+		rest = rest->next;
+	}
+	if (value != nullptr) {
+		rest = new Node{key, *value, rest};
+	}
+	for (auto itr = replaced.rbegin() + (existed ? 1 : 0); itr != replaced.rend(); ++itr) {
+		rest = new Node{(*itr)->key, (*itr)->value, rest};
+	}
+	bucket.store(rest, std::memory_order_release);
+
+	if (!replaced.empty()) {
+		retire([replaced]() {
+			for (auto itr = replaced.begin(); itr != replaced.end(); ++itr) {
+				delete *itr;
+			}
+		});
+	}
+	if (!existed && value != nullptr && count.fetch_add(1) + 1 > current->bucket_count) {
+		grow();
+	} else if (existed && value == nullptr) {
+		count.fetch_sub(1);
+	}
+}
+
+template <typename Key, typename Value, typename Hash>
+void CowMap<Key, Value, Hash>::grow()
+{
+	// caller holds write_mutex; readers keep using the old table, and its
+	// nodes, until they are done
+	Table *old_table = table.load();
+	Table *new_table = createTable(old_table->bucket_count * 2);
+	std::vector<const Node*> old_nodes;
+	for (size_t i = 0; i < old_table->bucket_count; ++i) {
+		for (const Node *node = old_table->buckets[i].load(); node != nullptr; node = node->next) {
+			std::atomic<const Node*> &bucket = new_table->buckets[hash(node->key) & (new_table->bucket_count - 1)];
+			bucket.store(new Node{node->key, node->value, bucket.load()}, std::memory_order_relaxed);
+			old_nodes.push_back(node);
+		}
+	}
+	table.store(new_table, std::memory_order_release);
+	retire([old_table, old_nodes]() {
+		for (auto itr = old_nodes.begin(); itr != old_nodes.end(); ++itr) {
+			delete *itr;
+		}
+		delete old_table;
+	});
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,286 @@
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "cow_map.hpp"
+#include "epoch.hpp"
+
+/*
+	CowMap and epoch reclamation check
+
+	Runs random writes against a CowMap and a std::map side by side and
+	compares them, checks that nothing retired is deleted while a reader,
+	on this thread or another one, could still see it, and then has more
+	readers than fit in a block of reader slots look up and walk a map
+	while writers keep changing it. Values know when they have been
+	deleted, so a reader that gets to one after it was reclaimed notices.
+	Exits with failure on the first thing that is wrong.
+*/
+
+const char USAGE[] = "usage: ./cow_map_check [seconds]\n";
+const int DEFAULT_SECONDS = 2;
+const int OPERATIONS = 200000;
+// keys are drawn from a small range, so they collide and are written again
+const int KEY_RANGE = 5000;
+// keys below this are never written once the readers start
+const int STABLE_KEYS = 1000;
+const int READER_THREADS = 70;
+const int WRITER_THREADS = 2;
+const int ALIVE = 0x5a5a5a5a;
+
+std::atomic<int> live_values(0);
+std::atomic<bool> stopping(false);
+std::atomic<bool> failed(false);
+
+// a value that counts how many copies of it exist, and can tell whether it
+// was deleted
+struct Tracked {
+	int key;
+	int alive;
+	explicit Tracked(int k = -1) : key(k), alive(ALIVE)
+	{
+		++live_values;
+	}
+	Tracked(const Tracked &other) : key(other.key), alive(other.alive)
+	{
+		++live_values;
+	}
+	Tracked &operator=(const Tracked&) = default;
+	~Tracked()
+	{
+		alive = 0;
+		--live_values;
+	}
+};
+
+// deleting one of these marks it in reclaimed
+struct Retired {
+	std::vector<bool> *reclaimed;
+	size_t index;
+	~Retired()
+	{
+		(*reclaimed)[index] = true;
+	}
+};
+
+void fail(const std::string &what)
+{
+	std::cerr << "cow_map_check: " << what << '\n';
+	exit(EXIT_FAILURE);
+}
+
+void flushRetired()
+{
+	// with nobody reading, a few more retirements reclaim everything
+	for (int i = 0; i < 4; ++i) {
+		retire([]() {});
+	}
+}
+
+void checkAgainstMap()
+{
+	CowMap<int, Tracked> map;
+	std::map<int, int> model;
+	for (int i = 0; i < OPERATIONS; ++i) {
+		int key = rand() % KEY_RANGE;
+		int operation = rand() % 4;
+		if (operation == 0) {
+			bool inserted = map.insert(key, Tracked(key));
+			if (inserted != model.insert(std::make_pair(key, key)).second) {
+				fail("insert disagrees with std::map");
+			}
+		} else if (operation == 1) {
+			map.assign(key, Tracked(key + 1));
+			model[key] = key + 1;
+		} else if (operation == 2) {
+			if (map.erase(key) != (model.erase(key) > 0)) {
+				fail("erase disagrees with std::map");
+			}
+		} else {
+			Tracked found;
+			auto itr = model.find(key);
+			if (map.find(key, found) != (itr != model.end()) || map.contains(key) != (itr != model.end())) {
+				fail("find disagrees with std::map");
+			}
+			if (itr != model.end() && found.key != itr->second) {
+				fail("find returned the wrong value");
+			}
+		}
+		if (map.size() != model.size()) {
+			fail("size disagrees with std::map");
+		}
+	}
+	std::map<int, int> walked;
+	map.forEach([&walked](int key, const Tracked &value) {
+		walked[key] = value.key;
+	});
+	if (walked != model) {
+		fail("forEach disagrees with std::map");
+	}
+}
+
+void *pinThread(void *arg)
+{
+	// holds a guard until told to let go
+	std::atomic<int> *state = (std::atomic<int>*)arg;
+	EpochGuard guard;
+	state->store(1);
+	while (state->load() != 2) {
+		usleep(1000);
+	}
+	return nullptr;
+}
+
+void checkReclamation()
+{
+	std::vector<bool> reclaimed(200, false);
+
+	// a reader on another thread keeps everything retired after it pinned
+	std::atomic<int> state(0);
+	pthread_t reader;
+	pthread_create(&reader, nullptr, pinThread, &state);
+	while (state.load() != 1) {
+		usleep(1000);
+	}
+	for (size_t i = 0; i < 100; ++i) {
+		retireObject(new Retired{&reclaimed, i});
+	}
+	for (size_t i = 0; i < 100; ++i) {
+		if (reclaimed[i]) {
+			fail("an object was reclaimed while another thread could see it");
+		}
+	}
+	state.store(2);
+	pthread_join(reader, nullptr);
+	flushRetired();
+	for (size_t i = 0; i < 100; ++i) {
+		if (!reclaimed[i]) {
+			fail("an object was never reclaimed");
+		}
+	}
+
+	// nested guards only let go with the outermost one
+	{
+		EpochGuard outer;
+		{
+			EpochGuard inner;
+		}
+		for (size_t i = 100; i < 200; ++i) {
+			retireObject(new Retired{&reclaimed, i});
+		}
+		flushRetired();
+		for (size_t i = 100; i < 200; ++i) {
+			if (reclaimed[i]) {
+				fail("an object was reclaimed inside a nested guard");
+			}
+		}
+	}
+	flushRetired();
+	for (size_t i = 100; i < 200; ++i) {
+		if (!reclaimed[i]) {
+			fail("an object was never reclaimed after a nested guard");
+		}
+	}
+}
+
+struct Shared {
+	CowMap<int, Tracked> map;
+};
+
+void *readerThread(void *arg)
+{
+	Shared *shared = (Shared*)arg;
+	unsigned seed = (unsigned)(size_t)pthread_self();
+	while (!stopping.load() && !failed.load()) {
+		int key = rand_r(&seed) % KEY_RANGE;
+		Tracked found;
+		if (shared->map.find(key, found) && (found.alive != ALIVE || found.key != key)) {
+			failed.store(true);
+		}
+		if (key < STABLE_KEYS && !shared->map.contains(key)) {
+			failed.store(true);
+		}
+		if (rand_r(&seed) % 100 == 0) {
+			// every key that is never written is walked over
+			int stable = 0;
+			shared->map.forEach([&stable](int k, const Tracked &value) {
+				if (value.alive != ALIVE || value.key != k) {
+					failed.store(true);
+				}
+				stable += k < STABLE_KEYS ? 1 : 0;
+			});
+			if (stable != STABLE_KEYS) {
+				failed.store(true);
+			}
+		}
+	}
+	return nullptr;
+}
+
+void *writerThread(void *arg)
+{
+	Shared *shared = (Shared*)arg;
+	unsigned seed = (unsigned)(size_t)pthread_self();
+	while (!stopping.load()) {
+		int key = STABLE_KEYS + rand_r(&seed) % (KEY_RANGE - STABLE_KEYS);
+		if (rand_r(&seed) % 2 == 0) {
+			shared->map.assign(key, Tracked(key));
+		} else {
+			shared->map.erase(key);
+		}
+	}
+	return nullptr;
+}
+
+void checkConcurrent(int seconds)
+{
+	Shared *shared = new Shared;
+	for (int key = 0; key < STABLE_KEYS; ++key) {
+		shared->map.insert(key, Tracked(key));
+	}
+	std::vector<pthread_t> threads(READER_THREADS + WRITER_THREADS);
+	for (int i = 0; i < READER_THREADS; ++i) {
+		pthread_create(&threads[i], nullptr, readerThread, shared);
+	}
+	for (int i = 0; i < WRITER_THREADS; ++i) {
+		pthread_create(&threads[READER_THREADS + i], nullptr, writerThread, shared);
+	}
+	sleep(seconds);
+	stopping.store(true);
+	for (auto itr = threads.begin(); itr != threads.end(); ++itr) {
+		pthread_join(*itr, nullptr);
+	}
+	if (failed.load()) {
+		fail("a reader saw a missing or reclaimed value");
+	}
+	delete shared;
+	flushRetired();
+	if (live_values.load() != 0) {
+		fail(std::to_string(live_values.load()) + " values were never reclaimed");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int seconds = argc > 1 ? atoi(argv[1]) : DEFAULT_SECONDS;
+	if (argc > 2 || seconds <= 0) {
+		std::cerr << USAGE;
+		exit(EXIT_FAILURE);
+	}
+	srand(1);
+	checkAgainstMap();
+	flushRetired();
+	if (live_values.load() != 0) {
+		fail(std::to_string(live_values.load()) + " values were never reclaimed");
+	}
+	checkReclamation();
+	checkConcurrent(seconds);
+	std::cout << "CowMap and epoch reclamation checks passed\n";
+	return EXIT_SUCCESS;
+}
\ No newline at end of file
@@ -0,0 +1,160 @@
+#include "epoch.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+
+namespace {
+
+// reader slots are handed out from blocks of this many, and another block is
+// added whenever every slot is taken
+const size_t SLOTS_PER_BLOCK = 64;
+// epoch of a reader that is not looking at shared data
+const uint64_t QUIESCENT = UINT64_MAX;
+
+struct alignas(64) ReaderSlot {
+	std::atomic<bool> used{false};
+	std::atomic<uint64_t> epoch{QUIESCENT};
+};
+
+// blocks are only ever added, so a slot stays where it is for good and a
+// thread that exits hands its slot on to the next one
+struct SlotBlock {
+	ReaderSlot slots[SLOTS_PER_BLOCK];
+	std::atomic<SlotBlock*> next{nullptr};
+};
+
+// slot of the calling thread, released when the thread exits
+struct ThreadSlot {
+	ReaderSlot *slot = nullptr;
+	int depth = 0;
+	~ThreadSlot()
+	{
+		if (slot != nullptr) {
+			slot->epoch.store(QUIESCENT);
+			slot->used.store(false);
+		}
+	}
+};
+
+SlotBlock reader_slots;
+std::atomic<uint64_t> global_epoch(1);
+pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+// deleters along with the epoch they were retired in
+std::vector<std::pair<uint64_t, std::function<void()>>> retired;
+thread_local ThreadSlot thread_slot;
+
+ReaderSlot *claimSlot()
+{
+	// take the first free slot, or add a block with one taken for us
+	SlotBlock *block = &reader_slots;
+	while (true) {
+		for (size_t i = 0; i < SLOTS_PER_BLOCK; ++i) {
+			ReaderSlot &slot = block->slots[i];
+			bool expected = false;
+			if (!slot.used.load() && slot.used.compare_exchange_strong(expected, true)) {
+				slot.epoch.store(QUIESCENT);
+				return &slot;
+			}
+		}
+		SlotBlock *next = block->next.load();
+		if (next == nullptr) {
+			// slots are kept on cache lines of their own, which plain new
+			// does not promise
+			void *memory;
+			if (posix_memalign(&memory, alignof(SlotBlock), sizeof(SlotBlock)) != 0) {
+				std::cerr << "Failed to allocate reader slots\n";
+				exit(EXIT_FAILURE);
+			}
+			SlotBlock *added = new (memory) SlotBlock();
+			added->slots[0].used.store(true);
+			if (block->next.compare_exchange_strong(next, added)) {
+				return &added->slots[0];
+			}
+			// another thread added one first, look through that instead
+			added->~SlotBlock();
+			free(memory);
+		}
+		block = next;
+	}
+}
+
+bool tryAdvance()
+{
+	// the epoch only moves on once every pinned reader has seen it
+	uint64_t epoch = global_epoch.load();
+	for (SlotBlock *block = &reader_slots; block != nullptr; block = block->next.load()) {
+		for (size_t i = 0; i < SLOTS_PER_BLOCK; ++i) {
+			const ReaderSlot &slot = block->slots[i];
+			if (!slot.used.load()) {
+				continue;
+			}
+			uint64_t reader_epoch = slot.epoch.load();
+			if (reader_epoch != QUIESCENT && reader_epoch != epoch) {
+				return false;
+			}
+		}
+	}
+	return global_epoch.compare_exchange_strong(epoch, epoch + 1);
+}
+
+}
+
+EpochGuard::EpochGuard()
+{
+	// guards nest, only the outermost one pins
+	if (thread_slot.depth++ > 0) {
+		return;
+	}
+	if (thread_slot.slot == nullptr) {
+		thread_slot.slot = claimSlot();
+	}
+	// the epoch may move on between reading and publishing it, so publish
+	// until it stays put
+	uint64_t epoch = global_epoch.load();
+	while (true) {
+		thread_slot.slot->epoch.store(epoch);
+		uint64_t current = global_epoch.load();
+		if (current == epoch) {
+			break;
+		}
+		epoch = current;
+	}
+}
+
+EpochGuard::~EpochGuard()
+{
+	if (--thread_slot.depth == 0) {
+		thread_slot.slot->epoch.store(QUIESCENT, std::memory_order_release);
+	}
+}
+
+void retire(const std::function<void()> &deleter)
+{
+	// whatever was retired two epochs ago can no longer be seen by anyone
+	std::vector<std::function<void()>> reclaimable;
+	pthread_mutex_lock(&retired_mutex);
+	retired.push_back(std::make_pair(global_epoch.load(), deleter));
+	tryAdvance();
+	uint64_t epoch = global_epoch.load();
+	size_t kept = 0;
+	for (size_t i = 0; i < retired.size(); ++i) {
+		if (retired[i].first + 2 <= epoch) {
+			reclaimable.push_back(std::move(retired[i].second));
+		} else {
+			retired[kept++] = std::move(retired[i]);
+		}
+	}
+	retired.resize(kept);
+	pthread_mutex_unlock(&retired_mutex);
+
+	for (auto itr = reclaimable.begin(); itr != reclaimable.end(); ++itr) {
+		(*itr)();
+	}
+}
\ No newline at end of file
@@ -0,0 +1,33 @@
+#ifndef EPOCH_HPP
+#define EPOCH_HPP
+
+#include <functional>
+
+/*
+	Epoch-based reclamation
+
+	Data that is read without locks is never changed in place. A writer
+	builds a new version, publishes it with an atomic store and retires the
+	old one. Readers pin the current epoch with an EpochGuard for as long as
+	they look at shared data, and a retired version is only deleted once the
+	epoch has moved on twice, i.e. once every reader that could still see it
+	has let go.
+*/
+
+class EpochGuard {
+public:
+	EpochGuard();
+	~EpochGuard();
+	EpochGuard(const EpochGuard&) = delete;
+	EpochGuard &operator=(const EpochGuard&) = delete;
+};
+
+void retire(const std::function<void()>&);
+
+template <typename T>
+void retireObject(const T *object)
+{
+	retire([object]() { delete object; });
+}
+
+#endif
\ No newline at end of file
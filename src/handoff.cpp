@@ -0,0 +1,427 @@
+#include "handoff.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "utils.hpp"
+
+namespace {
+
+enum RecordType {
+	LISTENER = 1,
+	CONNECTION,
+	RELAY_END,
+	PENDING_RELAY,
+	DONE,
+	ROOM,
+	ROSTER,
+	PARKED_SESSION,
+	ACK,
+	ABORT
+};
+
+// payload length, record type and number of descriptors
+const size_t RECORD_HEADER_SIZE = 6;
+// a relay end carries its socket and both ends of its pipe
+const size_t MAX_RECORD_FDS = 3;
+
+void putUint32(std::string &out, uint32_t value)
+{
+	uint32_t net = htonl(value);
+	out.append((const char*)&net, sizeof(net));
+}
+
+void putUint64(std::string &out, uint64_t value)
+{
+	putUint32(out, value >> 32);
+	putUint32(out, value & 0xffffffff);
+}
+
+void putString(std::string &out, const std::string &value)
+{
+	putUint32(out, value.size());
+	out += value;
+}
+
+bool getUint32(const std::string &data, size_t &offset, uint32_t &value)
+{
+	if (data.size() - offset < sizeof(value)) {
+		return false;
+	}
+	memcpy(&value, data.data() + offset, sizeof(value));
+	value = ntohl(value);
+	offset += sizeof(value);
+	return true;
+}
+
+bool getInt(const std::string &data, size_t &offset, int &value)
+{
+	uint32_t raw;
+	if (!getUint32(data, offset, raw)) {
+		return false;
+	}
+	value = (int32_t)raw;
+	return true;
+}
+
+bool getUint64(const std::string &data, size_t &offset, uint64_t &value)
+{
+	uint32_t high;
+	uint32_t low;
+	if (!getUint32(data, offset, high) || !getUint32(data, offset, low)) {
+		return false;
+	}
+	value = (uint64_t)high << 32 | low;
+	return true;
+}
+
+bool getString(const std::string &data, size_t &offset, std::string &value)
+{
+	uint32_t length;
+	if (!getUint32(data, offset, length) || data.size() - offset < length) {
+		return false;
+	}
+	value.assign(data, offset, length);
+	offset += length;
+	return true;
+}
+
+bool sendRecord(int socket, RecordType type, const std::string &payload, const int *fds, size_t fd_count)
+{
+	char header[RECORD_HEADER_SIZE];
+	uint32_t length = htonl(payload.size());
+	memcpy(header, &length, sizeof(length));
+	header[4] = type;
+	header[5] = fd_count;
+
+	struct iovec iov;
+	iov.iov_base = header;
+	iov.iov_len = sizeof(header);
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	char control[CMSG_SPACE(sizeof(int) * MAX_RECORD_FDS)];
+	if (fd_count > 0) {
+		memset(control, 0, sizeof(control));
+		message.msg_control = control;
+		message.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+	}
+
+	ssize_t sent;
+	while ((sent = sendmsg(socket, &message, 0)) < 0 && errno == EINTR) {
+	}
+	// the descriptors go with the first bytes sent, the rest is plain data
+	return sent > 0 && writeAll(socket, header + sent, sizeof(header) - sent) && writeAll(socket, payload.data(), payload.size());
+}
+
+bool receiveRecord(int socket, int &type, std::string &payload, std::vector<int> &fds)
+{
+	char header[RECORD_HEADER_SIZE];
+	struct iovec iov;
+	iov.iov_base = header;
+	iov.iov_len = sizeof(header);
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	char control[CMSG_SPACE(sizeof(int) * MAX_RECORD_FDS)];
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	ssize_t received;
+	while ((received = recvmsg(socket, &message, 0)) < 0 && errno == EINTR) {
+	}
+	if (received <= 0 || (message.msg_flags & MSG_CTRUNC)) {
+		return false;
+	}
+	fds.clear();
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != nullptr; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			fds.resize(count);
+			memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(int) * count);
+		}
+	}
+	if (!readAll(socket, header + received, sizeof(header) - received)) {
+		return false;
+	}
+
+	uint32_t length;
+	memcpy(&length, header, sizeof(length));
+	length = ntohl(length);
+	type = header[4];
+	if ((unsigned char)header[5] != fds.size()) {
+		return false;
+	}
+	payload.resize(length);
+	return length == 0 || readAll(socket, &payload[0], length);
+}
+
+std::string encodeConnection(const HandoffConnection &connection)
+{
+	std::string out;
+	putUint32(out, connection.fd);
+	putUint32(out, (uint32_t)connection.format);
+	putUint32(out, connection.features);
+	putString(out, connection.username);
+	putString(out, connection.location.hostname);
+	putString(out, connection.location.port);
+	putUint32(out, connection.location.version);
+	putUint32(out, connection.location.family);
+	putString(out, connection.pending);
+	putString(out, connection.outbound);
+	putUint32(out, connection.jobs.size());
+	for (auto itr = connection.jobs.begin(); itr != connection.jobs.end(); ++itr) {
+		putUint32(out, itr->kind);
+		putString(out, itr->username);
+		putString(out, itr->password);
+		putString(out, itr->stored);
+	}
+	putString(out, connection.inflate_dictionary);
+	putString(out, connection.resume_token);
+	return out;
+}
+
+bool decodeConnection(const std::string &data, HandoffConnection &connection)
+{
+	size_t offset = 0;
+	uint32_t format;
+	uint32_t version;
+	uint32_t job_count;
+	if (!getInt(data, offset, connection.old_fd) || !getUint32(data, offset, format) || !getUint32(data, offset, connection.features) || !getString(data, offset, connection.username)) {
+		return false;
+	}
+	if (!getString(data, offset, connection.location.hostname) || !getString(data, offset, connection.location.port) || !getUint32(data, offset, version) || !getInt(data, offset, connection.location.family)) {
+		return false;
+	}
+	if (!getString(data, offset, connection.pending) || !getString(data, offset, connection.outbound) || !getUint32(data, offset, job_count)) {
+		return false;
+	}
+	connection.format = (WireFormat)format;
+	connection.location.version = version;
+	connection.jobs.clear();
+	for (uint32_t i = 0; i < job_count; ++i) {
+		PasswordJob job;
+		uint32_t kind;
+		if (!getUint32(data, offset, kind) || !getString(data, offset, job.username) || !getString(data, offset, job.password) || !getString(data, offset, job.stored)) {
+			return false;
+		}
+		job.kind = (PasswordJob::Kind)kind;
+		job.verified = false;
+		connection.jobs.push_back(job);
+	}
+	// servers from before compression stop after the jobs, and servers from
+	// before session resumption after the dictionary
+	connection.inflate_dictionary.clear();
+	connection.resume_token.clear();
+	if (offset == data.size()) {
+		return true;
+	}
+	if (!getString(data, offset, connection.inflate_dictionary)) {
+		return false;
+	}
+	return offset == data.size() || getString(data, offset, connection.resume_token);
+}
+
+}
+
+bool sendHandoff(int socket, const HandoffState &state)
+{
+	// the socket blocks, the new server reads as fast as it can; returns
+	// true once it acknowledged everything, and false if it did not in time
+	struct timeval timeout;
+	timeout.tv_sec = HANDOFF_TIMEOUT_SECONDS;
+	timeout.tv_usec = 0;
+	setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	for (auto itr = state.listeners.begin(); itr != state.listeners.end(); ++itr) {
+		if (!sendRecord(socket, LISTENER, "", &*itr, 1)) {
+			return false;
+		}
+	}
+	for (auto itr = state.connections.begin(); itr != state.connections.end(); ++itr) {
+		if (!sendRecord(socket, CONNECTION, encodeConnection(*itr), &itr->fd, 1)) {
+			return false;
+		}
+	}
+	for (auto itr = state.relay_ends.begin(); itr != state.relay_ends.end(); ++itr) {
+		std::string payload;
+		putUint32(payload, itr->fd);
+		putUint32(payload, itr->end.peer);
+		putUint64(payload, itr->end.buffered);
+		putUint32(payload, itr->end.eof);
+		putUint32(payload, itr->end.shut);
+		int fds[3] = {itr->fd, itr->end.pipe_read, itr->end.pipe_write};
+		if (!sendRecord(socket, RELAY_END, payload, fds, 3)) {
+			return false;
+		}
+	}
+	for (auto itr = state.pending_relays.begin(); itr != state.pending_relays.end(); ++itr) {
+		std::string payload;
+		putString(payload, itr->token);
+		putUint64(payload, itr->created);
+		putUint32(payload, itr->old_fd);
+		if (!sendRecord(socket, PENDING_RELAY, payload, nullptr, 0)) {
+			return false;
+		}
+	}
+	for (auto itr = state.rooms.begin(); itr != state.rooms.end(); ++itr) {
+		std::string payload;
+		putString(payload, itr->name);
+		putUint32(payload, itr->members.size());
+		for (auto member_itr = itr->members.begin(); member_itr != itr->members.end(); ++member_itr) {
+			putString(payload, *member_itr);
+		}
+		if (!sendRecord(socket, ROOM, payload, nullptr, 0)) {
+			return false;
+		}
+	}
+	for (auto itr = state.parked_sessions.begin(); itr != state.parked_sessions.end(); ++itr) {
+		std::string payload;
+		putString(payload, itr->username);
+		putString(payload, itr->token);
+		putUint64(payload, itr->parked);
+		putString(payload, itr->location.hostname);
+		putString(payload, itr->location.port);
+		putUint32(payload, itr->location.version);
+		putUint32(payload, itr->location.family);
+		if (!sendRecord(socket, PARKED_SESSION, payload, nullptr, 0)) {
+			return false;
+		}
+	}
+	std::string roster;
+	putString(roster, state.roster.instance);
+	putUint64(roster, state.roster.last);
+	putUint32(roster, state.roster.changes.size());
+	for (auto itr = state.roster.changes.begin(); itr != state.roster.changes.end(); ++itr) {
+		putUint64(roster, itr->first);
+		putString(roster, itr->second);
+	}
+	if (!sendRecord(socket, ROSTER, roster, nullptr, 0) || !sendRecord(socket, DONE, "", nullptr, 0)) {
+		return false;
+	}
+	int type;
+	std::string payload;
+	std::vector<int> fds;
+	if (!receiveRecord(socket, type, payload, fds)) {
+		return false;
+	}
+	for (auto itr = fds.begin(); itr != fds.end(); ++itr) {
+		close(*itr);
+	}
+	return type == ACK;
+}
+
+void abortHandoff(int socket)
+{
+	// tells a new server that acknowledged too late not to take over
+	sendRecord(socket, ABORT, "", nullptr, 0);
+}
+
+bool receiveHandoff(int socket, HandoffState &state)
+{
+	// returns once the old server has sent everything and gone, or false
+	// if it failed along the way
+	while (true) {
+		int type;
+		std::string payload;
+		std::vector<int> fds;
+		if (!receiveRecord(socket, type, payload, fds)) {
+			return false;
+		}
+		size_t offset = 0;
+		if (type == LISTENER && fds.size() == 1) {
+			state.listeners.push_back(fds[0]);
+		} else if (type == CONNECTION && fds.size() == 1) {
+			HandoffConnection connection;
+			connection.fd = fds[0];
+			if (!decodeConnection(payload, connection)) {
+				return false;
+			}
+			state.connections.push_back(connection);
+		} else if (type == RELAY_END && fds.size() == 3) {
+			HandoffRelayEnd relay_end;
+			uint64_t buffered;
+			uint32_t eof;
+			uint32_t shut;
+			if (!getInt(payload, offset, relay_end.old_fd) || !getInt(payload, offset, relay_end.end.peer) || !getUint64(payload, offset, buffered) || !getUint32(payload, offset, eof) || !getUint32(payload, offset, shut)) {
+				return false;
+			}
+			relay_end.fd = fds[0];
+			relay_end.end.pipe_read = fds[1];
+			relay_end.end.pipe_write = fds[2];
+			relay_end.end.buffered = buffered;
+			relay_end.end.eof = eof;
+			relay_end.end.shut = shut;
+			state.relay_ends.push_back(relay_end);
+		} else if (type == PENDING_RELAY && fds.empty()) {
+			HandoffPendingRelay relay;
+			uint64_t created;
+			if (!getString(payload, offset, relay.token) || !getUint64(payload, offset, created) || !getInt(payload, offset, relay.old_fd)) {
+				return false;
+			}
+			relay.created = created;
+			state.pending_relays.push_back(relay);
+		} else if (type == ROOM && fds.empty()) {
+			HandoffRoom room;
+			uint32_t member_count;
+			if (!getString(payload, offset, room.name) || !getUint32(payload, offset, member_count)) {
+				return false;
+			}
+			for (uint32_t i = 0; i < member_count; ++i) {
+				std::string member;
+				if (!getString(payload, offset, member)) {
+					return false;
+				}
+				room.members.push_back(member);
+			}
+			state.rooms.push_back(room);
+		} else if (type == ROSTER && fds.empty()) {
+			uint64_t last;
+			uint32_t change_count;
+			if (!getString(payload, offset, state.roster.instance) || !getUint64(payload, offset, last) || !getUint32(payload, offset, change_count)) {
+				return false;
+			}
+			state.roster.last = last;
+			for (uint32_t i = 0; i < change_count; ++i) {
+				uint64_t number;
+				std::string username;
+				if (!getUint64(payload, offset, number) || !getString(payload, offset, username)) {
+					return false;
+				}
+				state.roster.changes.push_back(std::make_pair(number, username));
+			}
+		} else if (type == PARKED_SESSION && fds.empty()) {
+			HandoffParkedSession session;
+			uint64_t parked;
+			uint32_t version;
+			if (!getString(payload, offset, session.username) || !getString(payload, offset, session.token) || !getUint64(payload, offset, parked)) {
+				return false;
+			}
+			if (!getString(payload, offset, session.location.hostname) || !getString(payload, offset, session.location.port) || !getUint32(payload, offset, version) || !getInt(payload, offset, session.location.family)) {
+				return false;
+			}
+			session.parked = parked;
+			session.location.version = version;
+			state.parked_sessions.push_back(session);
+		} else if (type == DONE) {
+			// the old server exits once it has the acknowledgement, unless
+			// it gave up on us and aborts
+			sendRecord(socket, ACK, "", nullptr, 0);
+			return !receiveRecord(socket, type, payload, fds) || type != ABORT;
+		} else {
+			return false;
+		}
+	}
+}
\ No newline at end of file
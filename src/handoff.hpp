@@ -0,0 +1,111 @@
+#ifndef HANDOFF_HPP
+#define HANDOFF_HPP
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "password_workers.hpp"
+#include "protocol.hpp"
+#include "relay.hpp"
+#include "user.hpp"
+
+/*
+	Hot restart
+
+	A server started with -u path takes over from the server already running
+	with the same path. It connects to the running server's handoff socket
+	there, and the running server stops, sends over its listening sockets,
+	every client connection, relay, room, parked session and the roster log,
+	and exits. No connection is closed along the way and sessions carry on in
+	the new server, so clients do not notice the upgrade.
+
+	The new server acknowledges the last record, and only takes over once
+	the running server has exited after that. Until then nothing is lost if
+	the handoff fails: the running server aborts it and carries on serving.
+
+	Everything is sent as records: a header holding the payload length, the
+	record type and the number of file descriptors, which travel with the
+	header as SCM_RIGHTS ancillary data, followed by the payload. The
+	descriptors arrive under new numbers, so records refer to each other by
+	the numbers the old server used.
+*/
+
+struct HandoffConnection {
+	int fd;
+	// descriptor number in the server that sent the connection
+	int old_fd;
+	WireFormat format;
+	uint32_t features;
+	// empty unless the client is logged in
+	std::string username;
+	Location location;
+	// input not handled yet, and output not written yet
+	std::string pending;
+	std::string outbound;
+	// history of the compressed frames received, empty unless compression
+	// was agreed; frames sent start a new stream in the new server
+	std::string inflate_dictionary;
+	// token the client may resume its session with, empty if it has none
+	std::string resume_token;
+	// password jobs the old server never started
+	std::vector<PasswordJob> jobs;
+};
+
+// one socket of a relayed pair; the end's peer is an old descriptor number
+struct HandoffRelayEnd {
+	int fd;
+	int old_fd;
+	Relays::End end;
+};
+
+// relay token that not both clients have joined yet
+struct HandoffPendingRelay {
+	std::string token;
+	time_t created;
+	// old descriptor number of the first client to join, -1 until one has
+	int old_fd;
+};
+
+// group chat room and who is in it
+struct HandoffRoom {
+	std::string name;
+	std::vector<std::string> members;
+};
+
+// session of a client whose connection dropped, waiting for it to resume
+struct HandoffParkedSession {
+	std::string username;
+	std::string token;
+	time_t parked;
+	Location location;
+};
+
+// roster log, see roster_log.hpp; the instance is empty if the server sent
+// none, in which case the new server starts a log of its own
+struct HandoffRoster {
+	std::string instance;
+	uint64_t last;
+	std::vector<std::pair<uint64_t, std::string>> changes;
+};
+
+struct HandoffState {
+	std::vector<int> listeners;
+	std::vector<HandoffConnection> connections;
+	std::vector<HandoffRelayEnd> relay_ends;
+	std::vector<HandoffPendingRelay> pending_relays;
+	std::vector<HandoffRoom> rooms;
+	std::vector<HandoffParkedSession> parked_sessions;
+	HandoffRoster roster;
+};
+
+// how long the running server waits on the new one before carrying on
+const int HANDOFF_TIMEOUT_SECONDS = 10;
+
+bool sendHandoff(int, const HandoffState&);
+void abortHandoff(int);
+bool receiveHandoff(int, HandoffState&);
+
+#endif
\ No newline at end of file
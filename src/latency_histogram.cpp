@@ -0,0 +1,103 @@
+#include "latency_histogram.hpp"
+
+#include <cmath>
+
+namespace {
+
+const size_t EXACT_BUCKETS = 32;
+const size_t BUCKETS_PER_POWER = 16;
+const size_t BUCKET_COUNT = EXACT_BUCKETS + (64 - 5) * BUCKETS_PER_POWER;
+
+int highestBit(uint64_t value)
+{
+	return 63 - __builtin_clzll(value);
+}
+
+}
+
+LatencyHistogram::LatencyHistogram()
+	: counts(BUCKET_COUNT, 0)
+{
+	total = 0;
+	largest = 0;
+}
+
+void LatencyHistogram::record(uint64_t micros)
+{
+	counts[bucketOf(micros)]++;
+	total++;
+	if (micros > largest) {
+		largest = micros;
+	}
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+	for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+		counts[i] += other.counts[i];
+	}
+	total += other.total;
+	if (other.largest > largest) {
+		largest = other.largest;
+	}
+}
+
+void LatencyHistogram::clear()
+{
+	counts.assign(BUCKET_COUNT, 0);
+	total = 0;
+	largest = 0;
+}
+
+uint64_t LatencyHistogram::count() const
+{
+	return total;
+}
+
+uint64_t LatencyHistogram::max() const
+{
+	return largest;
+}
+
+uint64_t LatencyHistogram::percentile(double fraction) const
+{
+	// smallest bucket limit that at least fraction of the latencies are
+	// within, never more than the largest latency seen
+	if (total == 0) {
+		return 0;
+	}
+	uint64_t wanted = (uint64_t)ceil(fraction * total);
+	if (wanted == 0) {
+		wanted = 1;
+	}
+	uint64_t seen = 0;
+	for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+		seen += counts[i];
+		if (seen >= wanted) {
+			uint64_t limit = bucketLimit(i);
+			return limit < largest ? limit : largest;
+		}
+	}
+	return largest;
+}
+
+size_t LatencyHistogram::bucketOf(uint64_t micros)
+{
+	if (micros < EXACT_BUCKETS) {
+		return micros;
+	}
+	// top five bits pick the bucket within the power of two
+	int bit = highestBit(micros);
+	return EXACT_BUCKETS + (bit - 5) * BUCKETS_PER_POWER + ((micros >> (bit - 4)) - BUCKETS_PER_POWER);
+}
+
+uint64_t LatencyHistogram::bucketLimit(size_t bucket)
+{
+	// largest latency that falls in the bucket
+	if (bucket < EXACT_BUCKETS) {
+		return bucket;
+	}
+	int bit = (bucket - EXACT_BUCKETS) / BUCKETS_PER_POWER + 5;
+	uint64_t top = (bucket - EXACT_BUCKETS) % BUCKETS_PER_POWER + BUCKETS_PER_POWER;
+	return ((top + 1) << (bit - 4)) - 1;
+}
\ No newline at end of file
@@ -0,0 +1,27 @@
+#ifndef LATENCY_HISTOGRAM_HPP
+#define LATENCY_HISTOGRAM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Counts of latencies in microseconds. Buckets are exact below 32us and
+// then 16 to a power of two, so a percentile is off by at most 1/16th.
+class LatencyHistogram {
+public:
+	LatencyHistogram();
+	void record(uint64_t);
+	void merge(const LatencyHistogram&);
+	void clear();
+	uint64_t count() const;
+	uint64_t max() const;
+	uint64_t percentile(double) const;
+private:
+	static size_t bucketOf(uint64_t);
+	static uint64_t bucketLimit(size_t);
+	std::vector<uint64_t> counts;
+	uint64_t total;
+	uint64_t largest;
+};
+
+#endif
\ No newline at end of file
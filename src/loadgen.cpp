@@ -0,0 +1,1145 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compression.hpp"
+#include "latency_histogram.hpp"
+#include "outbound_queue.hpp"
+#include "protocol.hpp"
+#include "utils.hpp"
+
+/*
+	Load generator
+
+	Simulates many clients of messenger_server from a single event loop. Each
+	client registers, logs in and sends its location, then picks one of the
+	commands in the mix after every think time: registering a throwaway
+	user, sending its location again, inviting another simulated user,
+	messaging an online friend, logging out (and back in one think time
+	later) or dropping its connection and resuming the session on a new one.
+	Invites are always accepted. Messages go peer to peer, to a
+	listening socket all simulated clients share.
+
+	Commands the server answers are timed until the answer; the others until
+	the server has passed them on: LOCATION and LOGOUT until a friend hears
+	about them, INVITE until the invited user gets it, INVITE_ACCEPT until
+	the inviter does and MESSAGE until the friend has read it.
+
+	Clients that log in again present the version of the roster they have,
+	so the server only sends the friends that changed in the meantime.
+
+	With -z the clients offer the server compression, and the summary shows
+	how well the frames compressed both ways and what it cost.
+*/
+
+const int MAX_EVENTS = 256;
+// peer connections a client keeps open to its friends
+const size_t MAX_PEER_CONNECTIONS = 4;
+const char USAGE[] = "usage: ./loadgen [-c clients] [-d seconds] [-r connects_per_second] [-t think_ms] [-m command=weight,...] [-s message_bytes] [-u username_prefix] [-i report_seconds] [-z] server_hostname server_port\n";
+
+enum class ClientState {
+	CONNECTING,
+	WAITING_FOR_HELLO,
+	REGISTERING,
+	LOGGING_IN,
+	ONLINE,
+	LOGGED_OUT,
+	CLOSED
+};
+
+// actions a client picks from once it is online
+enum class Action {
+	REGISTER,
+	LOCATION,
+	INVITE,
+	MESSAGE,
+	LOGOUT,
+	RECONNECT
+};
+
+struct SimClient {
+	std::string username;
+	int fd;
+	ClientState state;
+	// bytes received that do not yet make up a whole frame
+	std::string pending;
+	OutboundQueue outbound;
+	uint32_t events;
+	// when the next action is due, heap entries for other times are stale
+	uint64_t next_action;
+	std::set<std::string> friends;
+	// online friends and the port they are listening on
+	std::map<std::string, std::string> online_friends;
+	// connections to friends opened to send messages, by friend
+	std::map<std::string, int> peers;
+	// version of the roster online_friends holds, kept over a logout
+	std::string roster_version;
+	// another ROSTER frame is on its way
+	bool roster_continues;
+	// token to resume the session with, also set while a resume is on its way
+	std::string resume_token;
+	// null unless the server agreed to compression
+	std::shared_ptr<FrameCompression> compression;
+};
+
+// what a file descriptor registered with epoll belongs to
+enum class FdKind {
+	NONE,
+	SERVER,
+	PEER_OUT,
+	PEER_IN,
+	LISTENER
+};
+
+struct FdOwner {
+	FdKind kind;
+	// simulated client the server or outgoing peer connection belongs to
+	size_t client;
+};
+
+// connection a friend opened to us to send messages
+struct IncomingPeer {
+	bool answered_hello;
+	std::string pending;
+	OutboundQueue outbound;
+};
+
+// connection opened to a friend to send messages
+struct OutgoingPeer {
+	std::string friend_username;
+	bool connected;
+	OutboundQueue outbound;
+	uint32_t events;
+};
+
+struct CommandStats {
+	LatencyHistogram latency;
+	uint64_t sent;
+	uint64_t failed;
+	// completed during the current report interval
+	uint64_t interval_completed;
+};
+
+void parseMix(const char*);
+void raiseFileLimit();
+void openListener();
+void connectClient(size_t);
+void scheduleClient(size_t, uint64_t);
+uint64_t thinkTime();
+void runAction(size_t);
+Action pickAction();
+void sendToServer(size_t, Opcode, const std::string&);
+void readServer(size_t);
+void handleServerFrame(size_t, const Frame&);
+void handlePresence(size_t, Opcode, const TextView&);
+void flushClient(size_t);
+void closeClient(size_t);
+void login(size_t);
+void sendLocation(size_t);
+void sendInvite(size_t);
+void sendPeerMessage(size_t);
+void closePeer(size_t, const std::string&);
+void acceptPeers();
+void readIncomingPeer(int);
+void flushOutgoingPeer(int);
+void watch(int, uint32_t, FdKind, size_t);
+void record(Opcode, uint64_t);
+void recordSince(std::map<std::string, uint64_t>&, const std::string&, Opcode);
+void report(uint64_t, uint64_t);
+void printSummary(uint64_t);
+uint64_t nowMicros();
+std::string randomUsername(size_t);
+void termination_handler(int);
+
+int epoll_fd;
+int listen_fd;
+std::string listen_port;
+struct sockaddr_in server_address;
+size_t client_count = 1000;
+int duration_seconds = 30;
+size_t connects_per_second = 1000;
+double think_ms = 1000;
+size_t message_bytes = 64;
+std::string username_prefix = "lg";
+int report_seconds = 5;
+bool offer_compression = false;
+std::vector<std::pair<Action, unsigned>> mix;
+unsigned mix_total = 0;
+std::vector<SimClient> clients;
+std::vector<FdOwner> owners;
+std::map<int, IncomingPeer> incoming_peers;
+std::map<int, OutgoingPeer> outgoing_peers;
+// pending timed commands, by what the answer will name
+std::map<std::string, uint64_t> replies_due;
+std::map<std::string, uint64_t> locations_sent;
+std::map<std::string, uint64_t> logouts_sent;
+std::map<std::string, uint64_t> invites_sent;
+std::map<std::string, uint64_t> accepts_sent;
+std::map<uint64_t, uint64_t> messages_sent;
+uint64_t next_message_seq = 1;
+uint64_t next_register_seq = 1;
+std::map<Opcode, CommandStats> stats;
+std::priority_queue<std::pair<uint64_t, size_t>, std::vector<std::pair<uint64_t, size_t>>, std::greater<std::pair<uint64_t, size_t>>> timers;
+std::mt19937_64 random_engine;
+size_t online_clients = 0;
+// both ends of a peer connection are ours, so they are capped to leave
+// enough file descriptors for the server connections
+size_t peer_connection_limit = 0;
+size_t peer_connections = 0;
+size_t peer_limit_hits = 0;
+size_t connection_failures = 0;
+// frames to and from the server that went compressed
+CompressionStats compression_sent;
+CompressionStats compression_received;
+// rosters received whole and as deltas, and the friends listed in them
+uint64_t full_rosters = 0;
+uint64_t delta_rosters = 0;
+uint64_t roster_friends = 0;
+volatile sig_atomic_t stopping = 0;
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	parseMix("register=1,location=2,invite=2,message=10,logout=1");
+	while ((opt = getopt(argc, argv, "c:d:r:t:m:s:u:i:z")) != -1) {
+		if (opt == 'c' && atol(optarg) > 0) {
+			client_count = atol(optarg);
+		} else if (opt == 'd' && atoi(optarg) > 0) {
+			duration_seconds = atoi(optarg);
+		} else if (opt == 'r' && atol(optarg) > 0) {
+			connects_per_second = atol(optarg);
+		} else if (opt == 't' && atof(optarg) > 0) {
+			think_ms = atof(optarg);
+		} else if (opt == 'm') {
+			parseMix(optarg);
+		} else if (opt == 's' && atol(optarg) > 0) {
+			message_bytes = atol(optarg);
+		} else if (opt == 'u' && strlen(optarg) > 0) {
+			username_prefix = optarg;
+		} else if (opt == 'i' && atoi(optarg) > 0) {
+			report_seconds = atoi(optarg);
+		} else if (opt == 'z') {
+			offer_compression = true;
+		} else {
+			std::cerr << USAGE;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (argc - optind != 2 || message_bytes >= MAX_FRAME_PAYLOAD) {
+		std::cerr << USAGE;
+		exit(EXIT_FAILURE);
+	}
+
+	struct addrinfo hints;
+	struct addrinfo *info;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(argv[optind], argv[optind + 1], &hints, &info) != 0) {
+		std::cerr << "Failed to get server address information\n";
+		exit(EXIT_FAILURE);
+	}
+	memcpy(&server_address, info->ai_addr, sizeof(server_address));
+	freeaddrinfo(info);
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, termination_handler);
+	raiseFileLimit();
+	random_engine.seed(nowMicros());
+
+	if ((epoll_fd = epoll_create1(0)) < 0) {
+		std::cerr << "Failed to create epoll instance\n";
+		exit(EXIT_FAILURE);
+	}
+	openListener();
+
+	clients.resize(client_count);
+	for (size_t i = 0; i < client_count; ++i) {
+		std::ostringstream name;
+		name << username_prefix << i;
+		clients[i].username = name.str();
+		clients[i].fd = -1;
+		clients[i].state = ClientState::CLOSED;
+		clients[i].events = 0;
+		clients[i].next_action = 0;
+		clients[i].roster_continues = false;
+	}
+
+	// clients connect at the given rate, starting now
+	uint64_t start = nowMicros();
+	uint64_t end = start + (uint64_t)duration_seconds * 1000000;
+	uint64_t next_report = start + (uint64_t)report_seconds * 1000000;
+	size_t connected = 0;
+	struct epoll_event events[MAX_EVENTS];
+	while (!stopping && nowMicros() < end) {
+		uint64_t now = nowMicros();
+		while (connected < client_count && connected * 1000000 / connects_per_second <= now - start) {
+			connectClient(connected++);
+		}
+		while (!timers.empty() && timers.top().first <= now) {
+			std::pair<uint64_t, size_t> timer = timers.top();
+			timers.pop();
+			if (clients[timer.second].next_action == timer.first) {
+				runAction(timer.second);
+			}
+		}
+		if (now >= next_report) {
+			report(now - start, (uint64_t)report_seconds * 1000000);
+			next_report += (uint64_t)report_seconds * 1000000;
+		}
+
+		// sleep until the next connect, action or report is due
+		uint64_t wake = next_report < end ? next_report : end;
+		if (connected < client_count) {
+			uint64_t next_connect = start + connected * 1000000 / connects_per_second;
+			wake = next_connect < wake ? next_connect : wake;
+		}
+		if (!timers.empty() && timers.top().first < wake) {
+			wake = timers.top().first;
+		}
+		now = nowMicros();
+		int timeout = wake > now ? (int)((wake - now + 999) / 1000) : 0;
+		int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+		if (num_events < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			std::cerr << "Failed to wait for socket events\n";
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < num_events; ++i) {
+			int fd = events[i].data.fd;
+			FdOwner owner = owners[fd];
+			if (owner.kind == FdKind::LISTENER) {
+				acceptPeers();
+			} else if (owner.kind == FdKind::SERVER) {
+				if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+					readServer(owner.client);
+				}
+				if (owners[fd].kind == FdKind::SERVER && (events[i].events & EPOLLOUT)) {
+					flushClient(owner.client);
+				}
+			} else if (owner.kind == FdKind::PEER_OUT) {
+				flushOutgoingPeer(fd);
+			} else if (owner.kind == FdKind::PEER_IN) {
+				readIncomingPeer(fd);
+			}
+		}
+	}
+
+	printSummary(nowMicros() - start);
+	return EXIT_SUCCESS;
+}
+
+void parseMix(const char *text)
+{
+	// comma separated command=weight, commands left out are never picked
+	const std::pair<const char*, Action> NAMES[] = {
+		{"register", Action::REGISTER},
+		{"location", Action::LOCATION},
+		{"invite", Action::INVITE},
+		{"message", Action::MESSAGE},
+		{"logout", Action::LOGOUT},
+		{"reconnect", Action::RECONNECT}
+	};
+	mix.clear();
+	mix_total = 0;
+	std::istringstream strm(text);
+	std::string entry;
+	while (getline(strm, entry, ',')) {
+		size_t equals = entry.find('=');
+		std::string name = entry.substr(0, equals);
+		int weight = equals == std::string::npos ? -1 : atoi(entry.c_str() + equals + 1);
+		bool known = false;
+		for (size_t i = 0; i < sizeof(NAMES) / sizeof(NAMES[0]); ++i) {
+			if (name == NAMES[i].first && weight >= 0) {
+				mix.push_back(std::make_pair(NAMES[i].second, (unsigned)weight));
+				mix_total += weight;
+				known = true;
+			}
+		}
+		if (!known) {
+			std::cerr << "Unknown command in mix: " << entry << '\n';
+			std::cerr << USAGE;
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+void raiseFileLimit()
+{
+	// every simulated client needs a socket, and up to twice
+	// MAX_PEER_CONNECTIONS more for its messages
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+		return;
+	}
+	if (limit.rlim_cur < client_count + 64) {
+		std::cerr << "Only " << limit.rlim_cur << " file descriptors are allowed, some clients will fail to connect\n";
+	} else {
+		peer_connection_limit = (limit.rlim_cur - client_count - 64) / 2;
+	}
+}
+
+void openListener()
+{
+	// every simulated client advertises this socket as its location
+	struct sockaddr_in address;
+	socklen_t address_length = sizeof(address);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = 0;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 || bind(listen_fd, (struct sockaddr *)&address, address_length) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+		std::cerr << "Failed to create listening socket for peer messages\n";
+		exit(EXIT_FAILURE);
+	}
+	if (getsockname(listen_fd, (struct sockaddr *)&address, &address_length) < 0 || setNonBlocking(listen_fd) < 0) {
+		std::cerr << "Failed to set up listening socket for peer messages\n";
+		exit(EXIT_FAILURE);
+	}
+	listen_port = std::to_string(ntohs(address.sin_port));
+	watch(listen_fd, EPOLLIN, FdKind::LISTENER, 0);
+}
+
+void connectClient(size_t index)
+{
+	SimClient &client = clients[index];
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || setNonBlocking(fd) < 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		connection_failures++;
+		return;
+	}
+	if (connect(fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0 && errno != EINPROGRESS) {
+		close(fd);
+		connection_failures++;
+		return;
+	}
+	client.fd = fd;
+	client.state = ClientState::CONNECTING;
+	client.pending.clear();
+	client.outbound.clear();
+	client.compression.reset();
+	// the HELLO goes out as soon as the connection is up
+	Hello hello;
+	hello.min_version = MIN_PROTOCOL_VERSION;
+	hello.max_version = MAX_PROTOCOL_VERSION;
+	hello.features = offer_compression ? SUPPORTED_FEATURES : SUPPORTED_FEATURES & ~FEATURE_COMPRESSION;
+	client.outbound.push(std::make_shared<const std::string>(encodeHello(hello)), false);
+	client.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+	watch(fd, client.events, FdKind::SERVER, index);
+}
+
+void scheduleClient(size_t index, uint64_t delay)
+{
+	// a later schedule replaces an earlier one
+	SimClient &client = clients[index];
+	client.next_action = nowMicros() + delay;
+	timers.push(std::make_pair(client.next_action, index));
+}
+
+uint64_t thinkTime()
+{
+	std::exponential_distribution<double> think(1.0 / think_ms);
+	return (uint64_t)(think(random_engine) * 1000) + 1;
+}
+
+void runAction(size_t index)
+{
+	SimClient &client = clients[index];
+	if (client.state == ClientState::LOGGED_OUT) {
+		login(index);
+		return;
+	}
+	if (client.state != ClientState::ONLINE) {
+		return;
+	}
+	Action action = pickAction();
+	if (action == Action::REGISTER) {
+		// a new user each time, so the server really registers one
+		std::ostringstream name;
+		name << username_prefix << "r" << nowMicros() << "x" << next_register_seq++;
+		replies_due["REGISTER " + name.str()] = nowMicros();
+		stats[Opcode::REGISTER].sent++;
+		sendToServer(index, Opcode::REGISTER, name.str() + " pw");
+	} else if (action == Action::LOCATION) {
+		sendLocation(index);
+	} else if (action == Action::INVITE) {
+		sendInvite(index);
+	} else if (action == Action::MESSAGE) {
+		sendPeerMessage(index);
+	} else if (action == Action::LOGOUT) {
+		locations_sent.erase(client.username);
+		logouts_sent[client.username] = nowMicros();
+		stats[Opcode::LOGOUT].sent++;
+		sendToServer(index, Opcode::LOGOUT, "");
+		for (auto itr = client.peers.begin(); itr != client.peers.end(); ) {
+			std::string friend_username = (itr++)->first;
+			closePeer(index, friend_username);
+		}
+		// friends are kept for the roster to update at the next login
+		if (client.roster_version.empty()) {
+			client.online_friends.clear();
+		}
+		client.resume_token.clear();
+		client.state = ClientState::LOGGED_OUT;
+		online_clients--;
+	} else if (action == Action::RECONNECT && !client.resume_token.empty()) {
+		// the connection goes without a word, and the session with its
+		// roster is picked up again on a new one, timed until the server
+		// answers the RESUME
+		std::string token = client.resume_token;
+		std::string version = client.roster_version;
+		std::map<std::string, std::string> online_friends = client.online_friends;
+		closeClient(index);
+		client.resume_token = token;
+		client.roster_version = version;
+		client.online_friends = online_friends;
+		replies_due["RESUME " + client.username] = nowMicros();
+		stats[Opcode::RESUME].sent++;
+		connectClient(index);
+		return;
+	} else if (action == Action::RECONNECT) {
+		// the server gave no token to resume with
+		sendLocation(index);
+	}
+	scheduleClient(index, thinkTime());
+}
+
+Action pickAction()
+{
+	std::uniform_int_distribution<unsigned> pick(0, mix_total > 0 ? mix_total - 1 : 0);
+	unsigned choice = pick(random_engine);
+	for (auto itr = mix.begin(); itr != mix.end(); ++itr) {
+		if (choice < itr->second) {
+			return itr->first;
+		}
+		choice -= itr->second;
+	}
+	return Action::LOCATION;
+}
+
+void login(size_t index)
+{
+	SimClient &client = clients[index];
+	client.state = ClientState::LOGGING_IN;
+	replies_due["LOGIN " + client.username] = nowMicros();
+	stats[Opcode::LOGIN].sent++;
+	sendToServer(index, Opcode::LOGIN, client.username + " pw" + (client.roster_version.empty() ? "" : " " + client.roster_version));
+}
+
+void sendLocation(size_t index)
+{
+	SimClient &client = clients[index];
+	// a friend that hears about the location times it
+	if (!client.online_friends.empty()) {
+		locations_sent[client.username] = nowMicros();
+	}
+	stats[Opcode::LOCATION].sent++;
+	sendToServer(index, Opcode::LOCATION, "127.0.0.1 " + listen_port + " " + std::to_string(MAX_PROTOCOL_VERSION));
+}
+
+void sendInvite(size_t index)
+{
+	// invite a user that is not a friend yet
+	SimClient &client = clients[index];
+	std::string username = randomUsername(index);
+	if (username.empty() || client.friends.count(username) > 0) {
+		return;
+	}
+	invites_sent[client.username + " " + username] = nowMicros();
+	stats[Opcode::INVITE].sent++;
+	sendToServer(index, Opcode::INVITE, username + " load test");
+}
+
+void sendPeerMessage(size_t index)
+{
+	SimClient &client = clients[index];
+	if (client.online_friends.empty()) {
+		return;
+	}
+	std::uniform_int_distribution<size_t> pick(0, client.online_friends.size() - 1);
+	auto friend_itr = client.online_friends.begin();
+	std::advance(friend_itr, pick(random_engine));
+	const std::string &friend_username = friend_itr->first;
+
+	auto peer_itr = client.peers.find(friend_username);
+	int fd;
+	if (peer_itr != client.peers.end()) {
+		fd = peer_itr->second;
+	} else {
+		// open a connection to the friend, closing the least recently
+		// opened one if there are too many
+		if (client.peers.size() >= MAX_PEER_CONNECTIONS) {
+			closePeer(index, client.peers.begin()->first);
+		}
+		if (peer_connections >= peer_connection_limit) {
+			peer_limit_hits++;
+			return;
+		}
+		struct sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_port = htons(atoi(friend_itr->second.c_str()));
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0 || setNonBlocking(fd) < 0 || (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0 && errno != EINPROGRESS)) {
+			if (fd >= 0) {
+				close(fd);
+			}
+			stats[Opcode::MESSAGE].failed++;
+			return;
+		}
+		OutgoingPeer &peer = outgoing_peers[fd];
+		peer.friend_username = friend_username;
+		peer.connected = false;
+		peer.outbound.clear();
+		peer.events = EPOLLOUT;
+		Hello hello;
+		hello.min_version = MIN_PROTOCOL_VERSION;
+		hello.max_version = MAX_PROTOCOL_VERSION;
+		hello.features = 0;
+		peer.outbound.push(std::make_shared<const std::string>(encodeHello(hello)), false);
+		peer.outbound.push(std::make_shared<const std::string>(encodeFrame(Opcode::USER, client.username)), false);
+		client.peers[friend_username] = fd;
+		peer_connections++;
+		watch(fd, EPOLLOUT, FdKind::PEER_OUT, index);
+	}
+
+	// the sequence number lets the receiving end time the message
+	uint64_t seq = next_message_seq++;
+	std::string message = std::to_string(seq) + " ";
+	message.resize(message_bytes > message.size() ? message_bytes : message.size(), 'x');
+	messages_sent[seq] = nowMicros();
+	stats[Opcode::MESSAGE].sent++;
+	outgoing_peers[fd].outbound.push(std::make_shared<const std::string>(encodeFrame(Opcode::MESSAGE, message)), false);
+	if (outgoing_peers[fd].connected) {
+		flushOutgoingPeer(fd);
+	}
+}
+
+void closePeer(size_t index, const std::string &friend_username)
+{
+	SimClient &client = clients[index];
+	auto itr = client.peers.find(friend_username);
+	if (itr == client.peers.end()) {
+		return;
+	}
+	int fd = itr->second;
+	client.peers.erase(itr);
+	outgoing_peers.erase(fd);
+	peer_connections--;
+	owners[fd].kind = FdKind::NONE;
+	close(fd);
+}
+
+void sendToServer(size_t index, Opcode opcode, const std::string &payload)
+{
+	SimClient &client = clients[index];
+	std::string frame = encodeFrame(opcode, payload);
+	if (client.compression && client.compression->worthCompressing(frame)) {
+		client.compression->compress(frame, compression_sent);
+	}
+	client.outbound.push(std::make_shared<const std::string>(frame), false);
+	if (client.state != ClientState::CONNECTING) {
+		flushClient(index);
+	}
+}
+
+void flushClient(size_t index)
+{
+	SimClient &client = clients[index];
+	if (client.state == ClientState::CONNECTING) {
+		int error = 0;
+		socklen_t error_length = sizeof(error);
+		if (getsockopt(client.fd, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0 || error != 0) {
+			connection_failures++;
+			closeClient(index);
+			return;
+		}
+		client.state = ClientState::WAITING_FOR_HELLO;
+	}
+	if (client.outbound.flush(client.fd) < 0) {
+		closeClient(index);
+		return;
+	}
+	uint32_t events = EPOLLIN | EPOLLRDHUP;
+	if (!client.outbound.empty()) {
+		events |= EPOLLOUT;
+	}
+	if (events != client.events) {
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = events;
+		event.data.fd = client.fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client.fd, &event);
+		client.events = events;
+	}
+}
+
+void readServer(size_t index)
+{
+	SimClient &client = clients[index];
+	char chunk[16384];
+	ssize_t bytes_read = read(client.fd, chunk, sizeof(chunk));
+	if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (bytes_read <= 0) {
+		if (client.state == ClientState::CONNECTING) {
+			connection_failures++;
+		}
+		closeClient(index);
+		return;
+	}
+	client.pending.append(chunk, bytes_read);
+
+	size_t offset = 0;
+	if (client.state == ClientState::WAITING_FOR_HELLO) {
+		Hello hello;
+		if (!decodeHello(client.pending.data(), client.pending.size(), hello)) {
+			if (client.pending.size() >= HELLO_SIZE) {
+				connection_failures++;
+				closeClient(index);
+			}
+			return;
+		}
+		if (hello.max_version == 0) {
+			std::cerr << "Server does not speak a framed protocol version we do\n";
+			exit(EXIT_FAILURE);
+		}
+		offset = HELLO_SIZE;
+		if (hello.features & FEATURE_COMPRESSION) {
+			client.compression = std::make_shared<FrameCompression>();
+		}
+		if (!client.resume_token.empty()) {
+			// reconnected to resume the session
+			client.state = ClientState::LOGGING_IN;
+			sendToServer(index, Opcode::RESUME, client.username + " " + client.resume_token + (client.roster_version.empty() ? "" : " " + client.roster_version));
+		} else {
+			// register our own user, the answer is the same if it already exists
+			client.state = ClientState::REGISTERING;
+			replies_due["REGISTER " + client.username] = nowMicros();
+			stats[Opcode::REGISTER].sent++;
+			sendToServer(index, Opcode::REGISTER, client.username + " pw");
+		}
+	}
+
+	Frame frame;
+	int status;
+	while ((status = decodeFrame(client.pending, offset, frame)) > 0) {
+		if (((uint8_t)frame.opcode & COMPRESSED_FRAME) && (!client.compression || !client.compression->decompress(frame, compression_received))) {
+			status = -1;
+			break;
+		}
+		handleServerFrame(index, frame);
+		if (clients[index].state == ClientState::CLOSED) {
+			return;
+		}
+	}
+	if (status < 0) {
+		closeClient(index);
+		return;
+	}
+	client.pending.erase(0, offset);
+}
+
+void handleServerFrame(size_t index, const Frame &frame)
+{
+	SimClient &client = clients[index];
+	PayloadReader strm(frame.payload);
+	std::string username;
+	std::string status;
+	if (frame.opcode == Opcode::REGISTER) {
+		strm >> username >> status;
+		// the user already existing from an earlier run is fine
+		recordSince(replies_due, "REGISTER " + username, status == "200" || username == client.username ? Opcode::REGISTER : Opcode::UNKNOWN);
+		if (status != "200" && username != client.username) {
+			stats[Opcode::REGISTER].failed++;
+		}
+		if (username == client.username && client.state == ClientState::REGISTERING) {
+			login(index);
+		}
+	} else if (frame.opcode == Opcode::LOGIN) {
+		strm >> username >> status;
+		if (status == "200") {
+			recordSince(replies_due, "LOGIN " + username, Opcode::LOGIN);
+			strm >> client.resume_token;
+			client.state = ClientState::ONLINE;
+			online_clients++;
+			logouts_sent.erase(client.username);
+			sendLocation(index);
+			scheduleClient(index, thinkTime());
+		} else {
+			// still logged in from a connection that has not been reaped
+			replies_due.erase("LOGIN " + username);
+			stats[Opcode::LOGIN].failed++;
+			client.state = ClientState::LOGGED_OUT;
+			scheduleClient(index, thinkTime());
+		}
+	} else if (frame.opcode == Opcode::RESUME) {
+		strm >> username >> status;
+		client.resume_token.clear();
+		if (status == "200") {
+			recordSince(replies_due, "RESUME " + username, Opcode::RESUME);
+			strm >> client.resume_token;
+			client.state = ClientState::ONLINE;
+			online_clients++;
+		} else {
+			// the session ended in the meantime, so log in again
+			replies_due.erase("RESUME " + username);
+			stats[Opcode::RESUME].failed++;
+			client.state = ClientState::LOGGED_OUT;
+		}
+		scheduleClient(index, thinkTime());
+	} else if (frame.opcode == Opcode::INVITE_FROM) {
+		strm >> username;
+		recordSince(invites_sent, username + " " + client.username, Opcode::INVITE);
+		if (client.state == ClientState::ONLINE) {
+			accepts_sent[client.username + " " + username] = nowMicros();
+			stats[Opcode::INVITE_ACCEPT].sent++;
+			sendToServer(index, Opcode::INVITE_ACCEPT, username + " ok");
+		}
+	} else if (frame.opcode == Opcode::INVITE_FAILED) {
+		strm >> username;
+		invites_sent.erase(client.username + " " + username);
+		stats[Opcode::INVITE].failed++;
+	} else if (frame.opcode == Opcode::INVITE_ACCEPT) {
+		strm >> username;
+		recordSince(accepts_sent, username + " " + client.username, Opcode::INVITE_ACCEPT);
+		client.friends.insert(username);
+	} else if (frame.opcode == Opcode::PRESENCE) {
+		std::string line;
+		while (strm.getLine(line)) {
+			Frame presence = parseLegacyCommand(line.c_str());
+			handlePresence(index, presence.opcode, presence.payload);
+		}
+	} else if (frame.opcode == Opcode::ROSTER) {
+		// friends online at login, which are not timed like the LOCATION and
+		// LOGOUT they stand for
+		std::string version;
+		std::string kind;
+		int more = 0;
+		std::string line;
+		strm >> version >> kind >> more;
+		strm.getLine(line);
+		if (!client.roster_continues) {
+			if (kind == "full") {
+				client.online_friends.clear();
+				full_rosters++;
+			} else {
+				delta_rosters++;
+			}
+		}
+		while (strm.getLine(line)) {
+			Frame change = parseLegacyCommand(line.c_str());
+			PayloadReader change_strm(change.payload);
+			std::string address;
+			std::string port;
+			change_strm >> username >> address >> port;
+			roster_friends++;
+			if (change.opcode == Opcode::LOCATION) {
+				client.friends.insert(username);
+				client.online_friends[username] = port;
+			} else {
+				client.online_friends.erase(username);
+				closePeer(index, username);
+			}
+		}
+		client.roster_continues = more != 0;
+		if (!client.roster_continues) {
+			client.roster_version = version;
+		}
+	} else if (frame.opcode == Opcode::HEARTBEAT) {
+		// a simulated client is never silent for long, but answers probes
+		if (!frame.payload.empty()) {
+			sendToServer(index, Opcode::HEARTBEAT, "");
+		}
+	} else {
+		handlePresence(index, frame.opcode, frame.payload);
+	}
+}
+
+void handlePresence(size_t index, Opcode opcode, const TextView &payload)
+{
+	SimClient &client = clients[index];
+	PayloadReader strm(payload);
+	std::string username;
+	strm >> username;
+	if (opcode == Opcode::LOCATION) {
+		std::string address;
+		std::string port;
+		strm >> address >> port;
+		// an accepted invite is announced with the new friend's location,
+		// which is empty until the friend has sent one
+		client.friends.insert(username);
+		if (port.empty()) {
+			return;
+		}
+		recordSince(locations_sent, username, Opcode::LOCATION);
+		if (client.state == ClientState::ONLINE) {
+			client.online_friends[username] = port;
+		}
+	} else if (opcode == Opcode::LOGOUT || opcode == Opcode::TERMINATE) {
+		recordSince(logouts_sent, username, Opcode::LOGOUT);
+		client.online_friends.erase(username);
+		closePeer(index, username);
+	}
+}
+
+void closeClient(size_t index)
+{
+	SimClient &client = clients[index];
+	if (client.state == ClientState::ONLINE) {
+		online_clients--;
+	}
+	for (auto itr = client.peers.begin(); itr != client.peers.end(); ) {
+		std::string friend_username = (itr++)->first;
+		closePeer(index, friend_username);
+	}
+	client.online_friends.clear();
+	client.roster_version.clear();
+	client.roster_continues = false;
+	client.resume_token.clear();
+	if (client.fd >= 0) {
+		owners[client.fd].kind = FdKind::NONE;
+		close(client.fd);
+	}
+	client.fd = -1;
+	client.state = ClientState::CLOSED;
+	client.next_action = 0;
+}
+
+void acceptPeers()
+{
+	int fd;
+	while ((fd = accept(listen_fd, nullptr, nullptr)) >= 0) {
+		if (setNonBlocking(fd) < 0) {
+			close(fd);
+			continue;
+		}
+		IncomingPeer &peer = incoming_peers[fd];
+		peer.answered_hello = false;
+		peer.pending.clear();
+		peer.outbound.clear();
+		watch(fd, EPOLLIN | EPOLLRDHUP, FdKind::PEER_IN, 0);
+	}
+}
+
+void readIncomingPeer(int fd)
+{
+	IncomingPeer &peer = incoming_peers[fd];
+	char chunk[16384];
+	ssize_t bytes_read = read(fd, chunk, sizeof(chunk));
+	if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (bytes_read <= 0) {
+		incoming_peers.erase(fd);
+		owners[fd].kind = FdKind::NONE;
+		close(fd);
+		return;
+	}
+	peer.pending.append(chunk, bytes_read);
+
+	size_t offset = 0;
+	if (!peer.answered_hello) {
+		Hello hello;
+		if (!decodeHello(peer.pending.data(), peer.pending.size(), hello)) {
+			return;
+		}
+		Hello reply;
+		reply.min_version = reply.max_version = negotiateVersion(hello);
+		reply.features = 0;
+		// the answer is tiny, so it always fits in the socket buffer
+		std::string out = encodeHello(reply);
+		write(fd, out.data(), out.size());
+		peer.answered_hello = true;
+		offset = HELLO_SIZE;
+	}
+	Frame frame;
+	while (decodeFrame(peer.pending, offset, frame) > 0) {
+		if (frame.opcode == Opcode::MESSAGE) {
+			uint64_t seq = strtoull(frame.payload.str().c_str(), nullptr, 10);
+			auto itr = messages_sent.find(seq);
+			if (itr != messages_sent.end()) {
+				record(Opcode::MESSAGE, nowMicros() - itr->second);
+				messages_sent.erase(itr);
+			}
+		}
+	}
+	peer.pending.erase(0, offset);
+}
+
+void flushOutgoingPeer(int fd)
+{
+	auto peer_itr = outgoing_peers.find(fd);
+	if (peer_itr == outgoing_peers.end()) {
+		return;
+	}
+	OutgoingPeer &peer = peer_itr->second;
+	size_t index = owners[fd].client;
+	if (!peer.connected) {
+		int error = 0;
+		socklen_t error_length = sizeof(error);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0 || error != 0) {
+			stats[Opcode::MESSAGE].failed++;
+			closePeer(index, peer.friend_username);
+			return;
+		}
+		peer.connected = true;
+	}
+	// the friend's answer to the HELLO is never read, the connection only
+	// carries messages to it
+	if (peer.outbound.flush(fd) < 0) {
+		stats[Opcode::MESSAGE].failed++;
+		closePeer(index, peer.friend_username);
+		return;
+	}
+	uint32_t events = peer.outbound.empty() ? 0 : EPOLLOUT;
+	if (events != peer.events) {
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = events;
+		event.data.fd = fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+		peer.events = events;
+	}
+}
+
+void watch(int fd, uint32_t events, FdKind kind, size_t index)
+{
+	if ((size_t)fd >= owners.size()) {
+		FdOwner none;
+		none.kind = FdKind::NONE;
+		none.client = 0;
+		owners.resize(fd + 1024, none);
+	}
+	owners[fd].kind = kind;
+	owners[fd].client = index;
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		std::cerr << "Failed to register socket with epoll\n";
+		exit(EXIT_FAILURE);
+	}
+}
+
+void record(Opcode opcode, uint64_t micros)
+{
+	CommandStats &command = stats[opcode];
+	command.latency.record(micros);
+	command.interval_completed++;
+}
+
+void recordSince(std::map<std::string, uint64_t> &sent, const std::string &key, Opcode opcode)
+{
+	// time a command from when it was sent, once
+	auto itr = sent.find(key);
+	if (itr == sent.end()) {
+		return;
+	}
+	if (opcode != Opcode::UNKNOWN) {
+		record(opcode, nowMicros() - itr->second);
+	}
+	sent.erase(itr);
+}
+
+void report(uint64_t elapsed, uint64_t interval)
+{
+	uint64_t completed = 0;
+	for (auto itr = stats.begin(); itr != stats.end(); ++itr) {
+		completed += itr->second.interval_completed;
+		itr->second.interval_completed = 0;
+	}
+	printf("%6.1fs  online %zu  completed %.0f/s  failed connects %zu\n", elapsed / 1e6, online_clients, completed * 1e6 / interval, connection_failures);
+	fflush(stdout);
+}
+
+void printSummary(uint64_t elapsed)
+{
+	printf("\n%-14s %10s %10s %10s %8s %10s %10s %10s %10s\n", "command", "sent", "completed", "per sec", "failed", "p50 ms", "p99 ms", "p999 ms", "max ms");
+	for (auto itr = stats.begin(); itr != stats.end(); ++itr) {
+		const LatencyHistogram &latency = itr->second.latency;
+		// messages are the only command without a name of their own
+		const char *name = itr->first == Opcode::MESSAGE ? "MESSAGE" : opcodeName(itr->first);
+		printf("%-14s %10lu %10lu %10.1f %8lu %10.3f %10.3f %10.3f %10.3f\n", name, itr->second.sent, latency.count(), latency.count() * 1e6 / elapsed, itr->second.failed,
+			latency.percentile(0.5) / 1e3, latency.percentile(0.99) / 1e3, latency.percentile(0.999) / 1e3, latency.max() / 1e3);
+	}
+	if (offer_compression) {
+		// ratio of payload bytes before compression to after
+		printf("\n%-14s %10s %14s %14s %8s %10s\n", "compressed", "frames", "raw bytes", "wire bytes", "ratio", "cpu ms");
+		const char *directions[2] = {"sent", "received"};
+		const CompressionStats *compression[2] = {&compression_sent, &compression_received};
+		for (size_t i = 0; i < 2; ++i) {
+			const CompressionStats &totals = *compression[i];
+			double ratio = totals.compressed_bytes > 0 ? (double)totals.raw_bytes / totals.compressed_bytes : 0;
+			printf("%-14s %10lu %14lu %14lu %8.2f %10.3f\n", directions[i], totals.frames, totals.raw_bytes, totals.compressed_bytes, ratio, totals.elapsed_ns / 1e6);
+		}
+	}
+	printf("\n%zu clients, %zu online at the end, %zu failed to connect, %.1fs\n", client_count, online_clients, connection_failures, elapsed / 1e6);
+	if (full_rosters + delta_rosters > 0) {
+		printf("%lu rosters sent whole and %lu as deltas, listing %lu friends\n", full_rosters, delta_rosters, roster_friends);
+	}
+	if (peer_limit_hits > 0) {
+		printf("%zu messages not sent for lack of file descriptors, raise the limit with ulimit -n\n", peer_limit_hits);
+	}
+}
+
+uint64_t nowMicros()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+std::string randomUsername(size_t index)
+{
+	// another simulated user, empty if there is none
+	if (client_count < 2) {
+		return "";
+	}
+	std::uniform_int_distribution<size_t> pick(0, client_count - 2);
+	size_t other = pick(random_engine);
+	if (other >= index) {
+		other++;
+	}
+	return clients[other].username;
+}
+
+void termination_handler(int signum)
+{
+	// stop and print what was measured so far
+	stopping = 1;
+}
\ No newline at end of file
@@ -1,6 +1,9 @@
+#include <algorithm>
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <map>
 #include <memory>
@@ -10,27 +13,179 @@
 #include <vector>
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
+#include "compression.hpp"
+#include "protocol.hpp"
 #include "user.hpp"
 #include "utils.hpp"
 
+// how long to wait for the server to set up a relayed connection
+const int RELAY_TIMEOUT_SECONDS = 10;
+// how long a connection to a friend may take before falling back to a relay
+const int CONNECT_TIMEOUT_SECONDS = 5;
+// how long to wait for a friend to answer the HELLO before assuming it only
+// speaks text
+const int HELLO_TIMEOUT_SECONDS = 2;
+// how long to keep trying to get the session back after the connection to
+// the server drops
+const int RESUME_TIMEOUT_SECONDS = 30;
+// how long the server may be silent before it is probed with a HEARTBEAT,
+// and how many such intervals before the connection is taken for dead
+const int HEARTBEAT_INTERVAL_SECONDS = 30;
+const int HEARTBEAT_MISSES = 3;
+// connections to friends nothing was sent or received on for this long are closed
+const int IDLE_TIMEOUT_SECONDS = 300;
+const int MAX_EVENTS = 64;
+const size_t READ_CHUNK_SIZE = 4096;
+// files are sent in FILE_DATA frames of this size, and a few frames at a time
+// so other friends get a turn
+const uint32_t FILE_CHUNK_SIZE = MAX_FRAME_PAYLOAD;
+const int FILE_CHUNKS_PER_WRITE = 16;
+// progress is shown each time another tenth of a file is through
+const int FILE_PROGRESS_STEPS = 10;
+
+enum class ConnectionState {
+	// waiting for a non-blocking connect to finish
+	CONNECTING,
+	// waiting for the server to answer the HELLO and the RELAY_JOIN of a
+	// relayed connection, which it does once the other client joins too
+	JOINING,
+	// waiting for the friend to answer the HELLO
+	HELLO,
+	READY
+};
+
+// a file being sent to a friend, streamed from disk with sendfile
+struct OutgoingFile {
+	// -1 unless a file is being sent
+	int fd;
+	std::string name;
+	uint64_t size;
+	uint32_t crc;
+	// false until the friend accepts, saying how much it already has
+	bool accepted;
+	uint64_t offset;
+	// bytes of the FILE_DATA frame being written that are still to go
+	uint32_t chunk_remaining;
+	int progress;
+};
+
+// a file being received from a friend, spliced from the socket to disk
+struct IncomingFile {
+	// -1 unless a file is being received
+	int fd;
+	// written to part_path, which is kept if the connection drops so that
+	// sending again resumes, and renamed to name once the checksum matches
+	std::string name;
+	std::string part_path;
+	uint64_t size;
+	uint32_t crc;
+	uint64_t received;
+	// bytes of the FILE_DATA frame being read that are still to come
+	uint32_t chunk_remaining;
+	int progress;
+	// data is moved from the socket to the file through this pipe
+	int pipe_fds[2];
+};
+
+// a connection to a friend, either one we made or one the friend made
+struct FriendConnection {
+	// empty until a friend that connected to us says who it is
+	std::string username;
+	// UNKNOWN until a friend that connected to us sends its first bytes
+	WireFormat format;
+	ConnectionState state;
+	// whether the friend gets a HELLO once connected
+	bool send_hello;
+	// whether the server relays this connection, rather than it being direct
+	bool relayed;
+	// token of the relay to join, empty once it is joined
+	std::string relay_token;
+	// messages typed before the connection was ready
+	std::vector<std::string> queued;
+	// when connecting or waiting for the HELLO answer gives up
+	time_t deadline;
+	time_t last_active;
+	// bytes received that do not make up a whole message yet
+	std::string pending;
+	// paths of files to send once the one being sent is done
+	std::vector<std::string> queued_files;
+	OutgoingFile sending;
+	IncomingFile receiving;
+	// bytes the socket did not take yet, written when it can take more
+	std::string outbound;
+	// messages held back until the FILE_DATA frame being written is done
+	std::string held;
+	// what the event loop waits for on the socket
+	uint32_t events;
+	// null unless the HELLO agreed on compression
+	std::shared_ptr<FrameCompression> compression;
+};
+
 void allowConnections();
-void *handleConnections(void*);
-void *handleFriend(void*);
-void *handleStdin(void*);
-void *handleServer(void*);
+void acceptFriends();
+bool addFriendConnection(int, const FriendConnection&, uint32_t);
+FriendConnection newFriendConnection(const std::string&, WireFormat, ConnectionState);
+bool connectToFriend(const std::string&, const std::shared_ptr<User>&, const std::string&);
+void finishConnect(int);
+void startHandshake(int, FriendConnection&);
+void friendConnectionReady(int, FriendConnection&);
+void failFriendConnection(int);
+void sweepFriendConnections();
+void readFriend(int);
+void readFriendMessages(int, FriendConnection&);
+void handleFriendMessage(int, const Frame&);
+size_t friendReadSize(const FriendConnection&);
+void setFriendEvents(int, uint32_t);
+void updateFriendEvents(int, FriendConnection&);
+void writeToFriend(int, FriendConnection&, const std::string&);
+void writeFriend(int);
+void queueFile(const std::string&, const std::string&);
+void offerNextFile(int, FriendConnection&);
+void acceptFileOffer(int, FriendConnection&, const std::string&);
+void startSendingFile(int, FriendConnection&, const std::string&);
+bool sendFileData(int, FriendConnection&);
+void finishSendingFile(int, FriendConnection&, const std::string&);
+bool storeBufferedFileData(int, FriendConnection&, const std::string&, size_t&);
+bool receiveFileData(int, FriendConnection&);
+void fileDataStored(int, FriendConnection&, uint64_t);
+void finishReceivingFile(int, FriendConnection&);
+void closeFileTransfers(FriendConnection&);
+bool checksumFile(int, uint64_t, uint32_t&);
+std::string formatChecksum(uint32_t);
+void showFileProgress(const std::string&, uint64_t, uint64_t, int&);
+void readStdin();
+void handleInput(std::string);
+void readServer();
+void handleServerMessage(const Frame&);
+void lostServerConnection();
+void resumeSession();
+void retryResume();
+void checkServer();
+void forgetSession();
 void closeLocalSockets();
-void terminateFriendThreads();
 void exitHandler();
 void termination_handler(int);
 int getUserFd(const std::string&);
 bool hasFriend(const std::string&);
-Location getFriendAddress(const std::string&);
+std::shared_ptr<User> getFriendInfo(const std::string&);
+void resolveFriendAddress(const std::shared_ptr<User>&);
+std::string storeFriendLocation(const TextView&);
 void removeFriendInfo(const std::string&);
 void removeConnectedFriend(const int&);
 bool hasInviteFrom(const std::string&);
@@ -38,27 +193,74 @@ void removeInviteFrom(const std::string&);
 bool hasSentInviteTo(const std::string&);
 void removeSentInviteTo(const std::string&);
 void displayHelp();
+void sendToServer(Opcode, const std::string&);
+void writeServer();
+void finishServerConnect();
+bool readServerHello();
+void abandonResume();
+void updateServerEvents();
+void sendToFriend(int, Opcode, const std::string&);
+bool requestRelay(const std::string&);
+void finishRelay(const std::string&, const std::string&);
+int connectToServer();
+bool joinRelay(const std::string&, FriendConnection);
+void sendRelayJoin(int, FriendConnection&);
+bool readRelayJoin(int, FriendConnection&);
+void acceptRelay(const std::string&);
 
 bool logged_in;
-int local_socket;
+int epoll_fd;
+int signal_fd;
+// ticks once a second to time out and evict connections to friends, and
+// to check on the server
+int sweep_timer_fd;
+int local_socket = -1;
 int server_socket;
+// where the server is, resolved once so reconnecting never waits on a lookup
+struct sockaddr_storage server_address;
+socklen_t server_address_length;
+// READY unless a new connection made to resume the session is still
+// connecting or waiting for the answer to its HELLO, which gives up at
+// server_deadline
+ConnectionState server_state = ConnectionState::READY;
+time_t server_deadline;
+// bytes the server socket did not take yet, and what the event loop waits
+// for on it
+std::string server_outbound;
+uint32_t server_events = EPOLLIN;
 std::string client_username;
 std::string server_hostname;
+WireFormat server_format;
+// HELLO features the server agreed to
+uint32_t server_features;
+// null unless the server agreed to compression
+std::shared_ptr<FrameCompression> server_compression;
+// bytes received from the server and standard input that do not make up a
+// whole message or line yet
+std::string server_pending;
+std::string stdin_pending;
 std::vector<std::shared_ptr<User>> friend_info;
+// version of the roster friend_info holds and whose roster it is, kept over
+// a logout so that logging in again only fetches the friends that changed
+std::string roster_version;
+std::string roster_username;
+// another ROSTER frame is on its way
+bool roster_continues = false;
+// token the server gave to resume the session with, empty if it gave none
+std::string resume_token;
+// when to give up on resuming the session, 0 unless the connection to the
+// server dropped and the session has not been resumed yet
+time_t resume_deadline = 0;
+// when anything last arrived from the server, and when it was last probed
+time_t server_last_received;
+time_t server_probed = 0;
 std::vector<std::string> received_invites;
 std::vector<std::string> sent_invites;
-std::map<int, std::string> connected_friends;
-std::map<int, pthread_t> connected_threads;
-pthread_t connection_thread;
-pthread_t stdin_thread;
-pthread_t server_thread;
-pthread_attr_t joined_thread_attr;
-pthread_attr_t detached_thread_attr;
-pthread_mutex_t friend_info_mutex;
-pthread_mutex_t received_invites_mutex;
-pthread_mutex_t sent_invites_mutex;
-pthread_mutex_t connected_friends_mutex;
-pthread_mutex_t connected_threads_mutex;
+std::map<int, FriendConnection> connected_friends;
+// messages waiting for the server to relay us to a friend, by friend username
+std::map<std::string, std::vector<std::string>> relay_messages;
+// and the paths of files waiting along with them
+std::map<std::string, std::vector<std::string>> relay_files;
 
 int main(int argc, char *argv[])
 {
@@ -67,7 +269,16 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	signal(SIGINT, termination_handler);
+	// SIGINT is handled by the event loop, so the TERMINATE it sends never
+	// interrupts a write to the server
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigprocmask(SIG_BLOCK, &signals, nullptr);
+	if ((signal_fd = signalfd(-1, &signals, 0)) < 0) {
+		std::cerr << "Failed to create signal file descriptor\n";
+		exit(EXIT_FAILURE);
+	}
 
 	struct addrinfo hints;
 	struct addrinfo *info;
@@ -92,53 +303,120 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	memcpy(&server_address, info->ai_addr, info->ai_addrlen);
+	server_address_length = info->ai_addrlen;
+	freeaddrinfo(info);
+
+	// newer servers answer the HELLO, older ones only speak text
+	if (sendHello(server_socket, SUPPORTED_FEATURES, server_features) > 0) {
+		server_format = WireFormat::FRAMED;
+		if (server_features & FEATURE_COMPRESSION) {
+			server_compression = std::make_shared<FrameCompression>();
+		}
+	} else {
+		server_format = WireFormat::LEGACY;
+	}
+
 	std::cout << "You are now connected to " << argv[1] << " on port " << argv[2] << ". Enter \"help\" for a list of commands.\n";
 
 	logged_in = false;
+	server_last_received = time(nullptr);
 	server_hostname = argv[1];
 
-	if (pthread_mutex_init(&friend_info_mutex, nullptr) != 0) {
-		std::cerr << "Failed to initialize friend_info_mutex\n";
+	if (setNonBlocking(server_socket) < 0) {
+		std::cerr << "Failed to make client-to-server socket non-blocking\n";
 		exit(EXIT_FAILURE);
 	}
 
-	if (pthread_mutex_init(&received_invites_mutex, nullptr) != 0) {
-		std::cerr << "Failed to initialize received_invites_mutex\n";
+	if ((epoll_fd = epoll_create1(0)) < 0) {
+		std::cerr << "Failed to create epoll instance\n";
 		exit(EXIT_FAILURE);
 	}
 
-	if (pthread_mutex_init(&sent_invites_mutex, nullptr) != 0) {
-		std::cerr << "Failed to initialize sent_invites_mutex\n";
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = STDIN_FILENO;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) < 0) {
+		std::cerr << "Failed to register standard input with epoll\n";
 		exit(EXIT_FAILURE);
 	}
 
-	if (pthread_mutex_init(&connected_friends_mutex, nullptr) != 0) {
-		std::cerr << "Failed to initialize connected_friends_mutex\n";
+	event.data.fd = server_socket;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &event) < 0) {
+		std::cerr << "Failed to register client-to-server socket with epoll\n";
 		exit(EXIT_FAILURE);
 	}
 
-	if (pthread_mutex_init(&connected_threads_mutex, nullptr) != 0) {
-		std::cerr << "Failed to initialize connected_threads_mutex\n";
+	event.data.fd = signal_fd;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) < 0) {
+		std::cerr << "Failed to register signal file descriptor with epoll\n";
 		exit(EXIT_FAILURE);
 	}
 
-	pthread_attr_init(&joined_thread_attr);
-	pthread_attr_setdetachstate(&joined_thread_attr, PTHREAD_CREATE_JOINABLE);
-	pthread_attr_init(&detached_thread_attr);
-    pthread_attr_setdetachstate(&detached_thread_attr, PTHREAD_CREATE_DETACHED);
-
-	if (pthread_create(&stdin_thread, &joined_thread_attr, handleStdin, nullptr) != 0) {
-		std::cerr << "Failed to create thread for standard input\n";
+	if ((sweep_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+		std::cerr << "Failed to create connection timer\n";
 		exit(EXIT_FAILURE);
 	}
 
-	if (pthread_create(&server_thread, &joined_thread_attr, handleServer, nullptr) != 0) {
-		std::cerr << "Failed to create thread for server messages\n";
+	struct itimerspec interval;
+	memset(&interval, 0, sizeof(interval));
+	interval.it_value.tv_sec = 1;
+	interval.it_interval.tv_sec = 1;
+	timerfd_settime(sweep_timer_fd, 0, &interval, nullptr);
+
+	event.data.fd = sweep_timer_fd;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sweep_timer_fd, &event) < 0) {
+		std::cerr << "Failed to register connection timer with epoll\n";
 		exit(EXIT_FAILURE);
 	}
 
-	pthread_join(stdin_thread, NULL);
-	pthread_join(server_thread, NULL);
+	// a single event loop services standard input, the server, the local
+	// socket and every friend
+	struct epoll_event events[MAX_EVENTS];
+	while (true) {
+		int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if (num_events < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			std::cerr << "Failed to wait for socket events\n";
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < num_events; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == STDIN_FILENO) {
+				readStdin();
+			} else if (fd == server_socket) {
+				if (events[i].events & EPOLLOUT) {
+					writeServer();
+				}
+				if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+					readServer();
+				}
+			} else if (fd == local_socket) {
+				acceptFriends();
+			} else if (fd == signal_fd) {
+				termination_handler(SIGINT);
+			} else if (fd == sweep_timer_fd) {
+				sweepFriendConnections();
+				retryResume();
+				checkServer();
+			} else {
+				if (events[i].events & EPOLLOUT) {
+					finishConnect(fd);
+					writeFriend(fd);
+				}
+				if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+					readFriend(fd);
+				}
+			}
+		}
+	}
 
 	return EXIT_SUCCESS;
 }
@@ -147,15 +425,7 @@ void allowConnections()
 {
 	struct sockaddr_in local_address;
 	socklen_t local_address_length;
-	struct addrinfo hints;
-	struct addrinfo *info;
-	char buffer[256];
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_CANONNAME;
-	
 	// create socket for other clients to connect to
 	if ((local_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
 		std::cerr << "Failed to create client's local socket\n";
@@ -184,397 +454,1650 @@ void allowConnections()
 		exit(EXIT_FAILURE);
 	}
 
-	char hostname[256];
+	// the address the server is reached from is numeric, so nothing needs
+	// looking up; newer servers pass on the address they see instead
+	struct sockaddr_storage server_side_address;
+	socklen_t server_side_address_length = sizeof(server_side_address);
+	char hostname[NI_MAXHOST];
 
-	if (gethostname(hostname, sizeof(hostname)) < 0) {
-		std::cerr << "Failed to get client's hostname\n";
+	if (getsockname(server_socket, (struct sockaddr *)&server_side_address, &server_side_address_length) < 0 || getnameinfo((struct sockaddr *)&server_side_address, server_side_address_length, hostname, sizeof(hostname), nullptr, 0, NI_NUMERICHOST) != 0) {
+		std::cerr << "Failed to get client address information\n";
 		exit(EXIT_FAILURE);
 	}
 
-	if (getaddrinfo(hostname, nullptr, &hints, &info) != 0) {
-		std::cerr << "Failed to get client address information\n";
+	// send client's address information to server, along with the newest
+	// protocol version friends can use when connecting
+	std::ostringstream location;
+	location << hostname << ' ' << ntohs(local_address.sin_port) << ' ' << MAX_PROTOCOL_VERSION;
+	sendToServer(Opcode::LOCATION, location.str());
+
+	// accept connections from friends in the event loop
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = local_socket;
+
+	if (setNonBlocking(local_socket) < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, local_socket, &event) < 0) {
+		std::cerr << "Failed to register client's local socket with epoll\n";
 		exit(EXIT_FAILURE);
 	}
+}
 
-	// send client's address information to server
-	snprintf(buffer, sizeof(buffer), "LOCATION %s %d", info->ai_canonname, ntohs(local_address.sin_port));
-	write(server_socket, buffer, sizeof(buffer));
+void acceptFriends()
+{
+	while (true) {
+		struct sockaddr_in new_addr;
+		socklen_t new_addr_len = sizeof(new_addr);
+		int new_socket = accept(local_socket, (struct sockaddr *)&new_addr, &new_addr_len);
+		if (new_socket < 0) {
+			return;
+		}
+		// friend says who it is, and whether it speaks framed messages, in
+		// what it sends first
+		addFriendConnection(new_socket, newFriendConnection("", WireFormat::UNKNOWN, ConnectionState::READY), EPOLLIN);
+	}
+}
 
-	// create thread for accepting connections from friends
-	if (pthread_create(&connection_thread, &detached_thread_attr, handleConnections, nullptr) != 0) {
-		std::cerr << "Failed to create thread for accepting connections\n";
-		exit(EXIT_FAILURE);
+FriendConnection newFriendConnection(const std::string &username, WireFormat format, ConnectionState state)
+{
+	FriendConnection conn;
+	conn.username = username;
+	conn.format = format;
+	conn.state = state;
+	conn.send_hello = false;
+	conn.relayed = false;
+	conn.deadline = 0;
+	conn.last_active = time(nullptr);
+	conn.events = 0;
+	conn.sending.fd = -1;
+	conn.sending.chunk_remaining = 0;
+	conn.receiving.fd = -1;
+	conn.receiving.chunk_remaining = 0;
+	conn.receiving.pipe_fds[0] = conn.receiving.pipe_fds[1] = -1;
+	return conn;
+}
+
+bool addFriendConnection(int fd, const FriendConnection &conn, uint32_t events)
+{
+	// connections to friends stay open for as long as they are used
+	int keep_alive = 1;
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &keep_alive, sizeof(keep_alive));
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.fd = fd;
+
+	if (setNonBlocking(fd) < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		close(fd);
+		return false;
 	}
+	connected_friends[fd] = conn;
+	connected_friends[fd].events = events;
+	return true;
 }
 
-void *handleConnections(void *arg)
+bool connectToFriend(const std::string &username, const std::shared_ptr<User> &info, const std::string &message)
 {
-	int new_socket;
-	struct sockaddr_in new_addr;
-	socklen_t new_addr_len = sizeof(new_addr);
-	pthread_t new_thread;
+	// start connecting to a friend without waiting for it; the message is
+	// sent once the connection is ready
+	struct sockaddr_storage address;
+	socklen_t address_length = info->getSocketAddress(address);
+	if (address_length == 0) {
+		std::cout << "Failed to get address information of friend " << username << '\n';
+		return false;
+	}
+	int new_socket = socket(address.ss_family, SOCK_STREAM, 0);
+	if (new_socket < 0 || setNonBlocking(new_socket) < 0) {
+		if (new_socket >= 0) {
+			close(new_socket);
+		}
+		std::cout << "Failed to create socket to friend " << username << '\n';
+		return false;
+	}
+	bool connected = connect(new_socket, (struct sockaddr *)&address, address_length) == 0;
+	bool in_progress = !connected && errno == EINPROGRESS;
+
+	FriendConnection conn = newFriendConnection(username, WireFormat::UNKNOWN, ConnectionState::CONNECTING);
+	// friends that advertised a protocol version get a HELLO first
+	conn.send_hello = info->getAddressInfo().version >= MIN_PROTOCOL_VERSION;
+	conn.deadline = time(nullptr) + CONNECT_TIMEOUT_SECONDS;
+	if (!message.empty()) {
+		conn.queued.push_back(message);
+	}
+	if (!addFriendConnection(new_socket, conn, EPOLLOUT)) {
+		std::cout << "Failed to establish connection with friend " << username << '\n';
+		return false;
+	}
+	if (connected) {
+		startHandshake(new_socket, connected_friends[new_socket]);
+	} else if (!in_progress) {
+		failFriendConnection(new_socket);
+	}
+	return true;
+}
 
-	while (true) {
-		if ((new_socket = accept(local_socket, (struct sockaddr *)&new_addr, &new_addr_len)) >= 0) {
-			if (pthread_create(&new_thread, &detached_thread_attr, handleFriend, (void*)&new_socket) != 0) {
+void finishConnect(int fd)
+{
+	auto conn_itr = connected_friends.find(fd);
+	if (conn_itr == connected_friends.end() || conn_itr->second.state != ConnectionState::CONNECTING) {
+		return;
+	}
+	int error = 0;
+	socklen_t error_length = sizeof(error);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0 || error != 0) {
+		failFriendConnection(fd);
+		return;
+	}
+	if (!conn_itr->second.relay_token.empty()) {
+		sendRelayJoin(fd, conn_itr->second);
+		return;
+	}
+	startHandshake(fd, conn_itr->second);
+}
+
+void startHandshake(int fd, FriendConnection &conn)
+{
+	// connected, now only wait for what the friend sends
+	if (!conn.send_hello) {
+		conn.format = WireFormat::LEGACY;
+		friendConnectionReady(fd, conn);
+		updateFriendEvents(fd, conn);
+		return;
+	}
+	Hello hello;
+	hello.min_version = MIN_PROTOCOL_VERSION;
+	hello.max_version = MAX_PROTOCOL_VERSION;
+	hello.features = SUPPORTED_FEATURES;
+	conn.state = ConnectionState::HELLO;
+	conn.deadline = time(nullptr) + HELLO_TIMEOUT_SECONDS;
+	writeToFriend(fd, conn, encodeHello(hello));
+}
+
+void friendConnectionReady(int fd, FriendConnection &conn)
+{
+	// let friend know of username, then send what was typed in the meantime
+	conn.state = ConnectionState::READY;
+	std::vector<std::string> messages;
+	messages.swap(conn.queued);
+	sendToFriend(fd, Opcode::USER, client_username);
+	for (auto itr = messages.begin(); itr != messages.end(); ++itr) {
+		sendToFriend(fd, Opcode::MESSAGE, *itr);
+	}
+	offerNextFile(fd, conn);
+}
+
+void failFriendConnection(int fd)
+{
+	// friend may not accept connections, e.g. from behind a NAT, so have
+	// the server relay between the two of us
+	FriendConnection &conn = connected_friends[fd];
+	std::string username = conn.username;
+	std::vector<std::string> messages;
+	messages.swap(conn.queued);
+	std::vector<std::string> files;
+	files.swap(conn.queued_files);
+	bool relayed = conn.relayed;
+	removeConnectedFriend(fd);
+	if (relayed || !requestRelay(username)) {
+		// a friend relayed to us has not said who it is yet
+		if (!username.empty()) {
+			std::cout << "Failed to establish connection with friend " << username << '\n';
+		}
+		return;
+	}
+	relay_messages[username] = messages;
+	relay_files[username] = files;
+}
+
+void sweepFriendConnections()
+{
+	uint64_t expirations;
+	while (read(sweep_timer_fd, &expirations, sizeof(expirations)) > 0) {
+	}
+	time_t now = time(nullptr);
+	std::vector<int> failed;
+	std::vector<int> idle;
+	for (auto itr = connected_friends.begin(); itr != connected_friends.end(); ++itr) {
+		const FriendConnection &conn = itr->second;
+		if ((conn.state == ConnectionState::CONNECTING || conn.state == ConnectionState::JOINING) && now >= conn.deadline) {
+			failed.push_back(itr->first);
+		} else if (conn.state == ConnectionState::HELLO && now >= conn.deadline) {
+			// friend did not answer, so it only speaks text
+			itr->second.format = WireFormat::LEGACY;
+			friendConnectionReady(itr->first, itr->second);
+		} else if (conn.state == ConnectionState::READY && now - conn.last_active >= IDLE_TIMEOUT_SECONDS) {
+			idle.push_back(itr->first);
+		}
+	}
+	for (auto itr = failed.begin(); itr != failed.end(); ++itr) {
+		failFriendConnection(*itr);
+	}
+	for (auto itr = idle.begin(); itr != idle.end(); ++itr) {
+		removeConnectedFriend(*itr);
+	}
+}
+
+void readFriend(int fd)
+{
+	auto conn_itr = connected_friends.find(fd);
+	if (conn_itr == connected_friends.end() || conn_itr->second.state == ConnectionState::CONNECTING) {
+		// closed while handling an earlier event, or connect has not finished
+		return;
+	}
+	if (conn_itr->second.receiving.chunk_remaining > 0) {
+		// in the middle of a FILE_DATA frame, which goes straight to disk
+		if (!receiveFileData(fd, conn_itr->second)) {
+			removeConnectedFriend(fd);
+		}
+		return;
+	}
+
+	char chunk[READ_CHUNK_SIZE];
+	ssize_t bytes_read = read(fd, chunk, friendReadSize(conn_itr->second));
+	if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (bytes_read <= 0) {
+		// friend has gone away, a later message connects again
+		removeConnectedFriend(fd);
+		return;
+	}
+	conn_itr->second.last_active = time(nullptr);
+	conn_itr->second.pending.append(chunk, bytes_read);
+	readFriendMessages(fd, conn_itr->second);
+}
+
+size_t friendReadSize(const FriendConnection &conn)
+{
+	// while a file comes in, read no further than the end of the next frame,
+	// so the data of a FILE_DATA frame is left in the socket for splice
+	Opcode opcode;
+	uint32_t length;
+	if (conn.receiving.fd < 0) {
+		return READ_CHUNK_SIZE;
+	}
+	if (!peekFrameHeader(conn.pending, 0, opcode, length)) {
+		return FRAME_HEADER_SIZE - conn.pending.size();
+	}
+	return std::min<uint64_t>(READ_CHUNK_SIZE, FRAME_HEADER_SIZE + (uint64_t)length - conn.pending.size());
+}
+
+void readFriendMessages(int fd, FriendConnection &conn)
+{
+	// handle every whole message received from a friend so far
+	std::string &pending = conn.pending;
+	size_t offset = 0;
+
+	if (conn.state == ConnectionState::JOINING && !readRelayJoin(fd, conn)) {
+		return;
+	}
+	if (conn.state == ConnectionState::HELLO) {
+		// friend we connected to answers the HELLO with the version to use
+		if (pending.size() < HELLO_SIZE) {
+			return;
+		}
+		Hello reply;
+		bool framed = decodeHello(pending.data(), pending.size(), reply) && reply.max_version > 0;
+		conn.format = framed ? WireFormat::FRAMED : WireFormat::LEGACY;
+		if (framed && (reply.features & FEATURE_COMPRESSION)) {
+			conn.compression = std::make_shared<FrameCompression>();
+		}
+		offset = HELLO_SIZE;
+		friendConnectionReady(fd, conn);
+	} else if (conn.format == WireFormat::UNKNOWN) {
+		// friend that connected to us opens with a HELLO if it speaks framed messages
+		conn.format = detectWireFormat(pending.data(), pending.size());
+		if (conn.format == WireFormat::UNKNOWN) {
+			return;
+		}
+		if (conn.format == WireFormat::FRAMED) {
+			Hello hello;
+			if (!decodeHello(pending.data(), pending.size(), hello)) {
+				conn.format = WireFormat::UNKNOWN;
+				return;
+			}
+			Hello reply;
+			reply.min_version = reply.max_version = negotiateVersion(hello);
+			reply.features = hello.features & SUPPORTED_FEATURES;
+			writeToFriend(fd, conn, encodeHello(reply));
+			if (reply.max_version == 0) {
+				// nothing in common, fall back to the text protocol
+				conn.format = WireFormat::LEGACY;
+			} else if (reply.features & FEATURE_COMPRESSION) {
+				conn.compression = std::make_shared<FrameCompression>();
+			}
+			offset = HELLO_SIZE;
+		}
+	}
+
+	if (conn.format == WireFormat::FRAMED) {
+		Frame frame;
+		int status = 0;
+		while (conn.receiving.chunk_remaining == 0) {
+			Opcode opcode;
+			uint32_t length;
+			if (conn.receiving.fd >= 0 && peekFrameHeader(pending, offset, opcode, length) && opcode == Opcode::FILE_DATA) {
+				// file data is not decoded, only the header is taken
+				if (length == 0 || length > MAX_FRAME_PAYLOAD || length > conn.receiving.size - conn.receiving.received) {
+					status = -1;
+					break;
+				}
+				offset += FRAME_HEADER_SIZE;
+				conn.receiving.chunk_remaining = length;
+				if (!storeBufferedFileData(fd, conn, pending, offset)) {
+					status = -1;
+					break;
+				}
 				continue;
 			}
-			pthread_mutex_lock(&connected_threads_mutex);
-			connected_threads.insert(std::make_pair(new_socket, new_thread));
-			pthread_mutex_unlock(&connected_threads_mutex);
+			if ((status = decodeFrame(pending, offset, frame)) <= 0) {
+				break;
+			}
+			CompressionStats stats = CompressionStats();
+			if (((uint8_t)frame.opcode & COMPRESSED_FRAME) && (!conn.compression || !conn.compression->decompress(frame, stats))) {
+				status = -1;
+				break;
+			}
+			handleFriendMessage(fd, frame);
+		}
+		if (status < 0) {
+			removeConnectedFriend(fd);
+			return;
+		}
+	} else {
+		while (pending.size() - offset >= LEGACY_COMMAND_SIZE) {
+			// the last byte of a command is always taken for its NUL
+			const char *response = pending.data() + offset;
+			offset += LEGACY_COMMAND_SIZE;
+			Frame frame = parseLegacyCommand(response, LEGACY_COMMAND_SIZE - 1);
+			if (frame.opcode != Opcode::USER) {
+				frame.opcode = Opcode::MESSAGE;
+				frame.payload = TextView(response, strnlen(response, LEGACY_COMMAND_SIZE - 1));
+			}
+			handleFriendMessage(fd, frame);
 		}
 	}
+	pending.erase(0, offset);
 }
 
-void *handleFriend(void *sock)
+void handleFriendMessage(int fd, const Frame &frame)
 {
-	int socket_fd = *(int*)sock;
-	char response[256];
-	while (true) {
-		if (read(socket_fd, response, sizeof(response)) > 0) {
-			std::istringstream strm(response);
-			std::string type;
-			strm >> type;
-			pthread_mutex_lock(&connected_friends_mutex);
-			if (type == "USER") {
-				// newly connected friend is informing client of username
-				std::string username;
-				strm >> username;
-				connected_friends.insert(std::make_pair(socket_fd, username));
-			} else {
-				// just a regular message
-				std::cout << '[' << connected_friends[socket_fd] << "]: " <<  response << '\n';
+	FriendConnection &conn = connected_friends[fd];
+	if (frame.opcode == Opcode::USER) {
+		// newly connected friend is informing client of username
+		PayloadReader strm(frame.payload);
+		std::string username;
+		strm >> username;
+		if (conn.username.empty()) {
+			conn.username = username;
+		}
+	} else if (frame.opcode == Opcode::MESSAGE) {
+		// just a regular message
+		std::cout << '[' << conn.username << "]: " <<  frame.payload << '\n';
+	} else if (frame.opcode == Opcode::FILE_OFFER) {
+		acceptFileOffer(fd, conn, frame.payload.str());
+	} else if (frame.opcode == Opcode::FILE_ACCEPT) {
+		startSendingFile(fd, conn, frame.payload.str());
+	} else if (frame.opcode == Opcode::FILE_DONE) {
+		finishSendingFile(fd, conn, frame.payload.str());
+	} else if (frame.opcode == Opcode::HEARTBEAT && !frame.payload.empty()) {
+		sendToFriend(fd, Opcode::HEARTBEAT, "");
+	}
+}
+
+void setFriendEvents(int fd, uint32_t events)
+{
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.fd = fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+void updateFriendEvents(int fd, FriendConnection &conn)
+{
+	// wait for the socket to take more only while there is something left
+	// to write to it, be it buffered messages or an accepted file
+	uint32_t events = EPOLLIN;
+	const OutgoingFile &file = conn.sending;
+	if (conn.state == ConnectionState::CONNECTING) {
+		events = EPOLLOUT;
+	} else if (!conn.outbound.empty() || (file.fd >= 0 && file.accepted && (file.chunk_remaining > 0 || file.offset < file.size))) {
+		events |= EPOLLOUT;
+	}
+	if (events != conn.events) {
+		setFriendEvents(fd, events);
+		conn.events = events;
+	}
+}
+
+void writeToFriend(int fd, FriendConnection &conn, const std::string &data)
+{
+	// never waits for the socket; what it does not take now is written from
+	// the event loop, and a lost connection is found by the next read
+	bool waiting = !conn.outbound.empty();
+	conn.outbound += data;
+	if (!waiting && !writeSome(fd, conn.outbound)) {
+		conn.outbound.clear();
+	}
+	updateFriendEvents(fd, conn);
+}
+
+void writeFriend(int fd)
+{
+	// the socket can take more, so write what is buffered and then carry on
+	// with the file being sent
+	auto conn_itr = connected_friends.find(fd);
+	if (conn_itr == connected_friends.end() || conn_itr->second.state == ConnectionState::CONNECTING) {
+		return;
+	}
+	FriendConnection &conn = conn_itr->second;
+	if (!writeSome(fd, conn.outbound) || !sendFileData(fd, conn)) {
+		removeConnectedFriend(fd);
+		return;
+	}
+	updateFriendEvents(fd, conn);
+}
+
+void queueFile(const std::string &username, const std::string &path)
+{
+	// files go out over the connection messages use, once it is ready
+	auto relay_itr = relay_files.find(username);
+	if (relay_itr != relay_files.end()) {
+		relay_itr->second.push_back(path);
+		return;
+	}
+	int friend_fd = getUserFd(username);
+	if (friend_fd < 0) {
+		// connecting failed, which has been reported already
+		return;
+	}
+	FriendConnection &conn = connected_friends[friend_fd];
+	conn.queued_files.push_back(path);
+	if (conn.state == ConnectionState::READY) {
+		offerNextFile(friend_fd, conn);
+	}
+}
+
+void offerNextFile(int fd, FriendConnection &conn)
+{
+	// files are sent one at a time, in the order they were queued
+	if (!conn.queued_files.empty() && conn.format != WireFormat::FRAMED) {
+		std::cout << "Friend " << conn.username << " can not receive files\n";
+		conn.queued_files.clear();
+		return;
+	}
+	while (conn.sending.fd < 0 && !conn.queued_files.empty()) {
+		std::string path = conn.queued_files.front();
+		conn.queued_files.erase(conn.queued_files.begin());
+
+		int file_fd = open(path.c_str(), O_RDONLY);
+		struct stat file_stat;
+		uint32_t crc;
+		if (file_fd < 0 || fstat(file_fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode) || !checksumFile(file_fd, file_stat.st_size, crc)) {
+			std::cout << "Failed to read file " << path << '\n';
+			if (file_fd >= 0) {
+				close(file_fd);
 			}
-			pthread_mutex_unlock(&connected_friends_mutex);
+			continue;
 		}
+		OutgoingFile &file = conn.sending;
+		file.fd = file_fd;
+		file.name = path.substr(path.find_last_of('/') + 1);
+		file.size = file_stat.st_size;
+		file.crc = crc;
+		file.accepted = false;
+		file.offset = 0;
+		file.chunk_remaining = 0;
+		file.progress = 0;
+
+		std::ostringstream offer;
+		offer << formatChecksum(crc) << ' ' << file.size << ' ' << file.name;
+		sendToFriend(fd, Opcode::FILE_OFFER, offer.str());
+		std::cout << "Offered file " << file.name << " (" << file.size << " bytes) to " << conn.username << '\n';
 	}
-	return nullptr;
 }
 
-void *handleStdin(void *arg)
+void acceptFileOffer(int fd, FriendConnection &conn, const std::string &payload)
 {
-	char buffer[256];
-	std::string input;
-	while (true) {
-		std::getline(std::cin, input);
-		trimString(input);
-		std::istringstream strm(input);
-		std::string command;
-		strm >> command;
-		if (!logged_in) {
-			if (command == "register") {
-				// register with server
-				std::string username;
-				std::string password;
-				strm >> username >> password;
-
-				if (username.empty() || password.empty()) {
-					std::cout << "Syntax: register [username] [password]\n";
-					continue;
-				}
+	// friend offers "crc size name"; files are saved under their name in the
+	// working directory, and one that was partly received before is resumed
+	std::istringstream strm(payload);
+	std::string crc;
+	uint64_t size = 0;
+	std::string name;
+	strm >> crc >> size;
+	strm.ignore();
+	getline(strm, name);
+
+	IncomingFile &file = conn.receiving;
+	if (file.fd >= 0 || crc.size() != 8 || name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos) {
+		sendToFriend(fd, Opcode::FILE_ACCEPT, crc + " 400");
+		return;
+	}
+	struct stat file_stat;
+	if (stat(name.c_str(), &file_stat) == 0) {
+		std::cout << "Declined file " << name << " from " << conn.username << ", a file of that name exists\n";
+		sendToFriend(fd, Opcode::FILE_ACCEPT, crc + " 409");
+		return;
+	}
 
-				snprintf(buffer, sizeof(buffer), "REGISTER %s %s", username.c_str(), createHash(password));
-				write(server_socket, buffer, sizeof(buffer));
-			} else if (command == "login") {
-				// login to server
-				std::string username;
-				std::string password;
-				strm >> username >> password;
-
-				if (username.empty() || password.empty()) {
-					std::cout << "Syntax: login [username] [password]\n";
-					continue;
-				}
+	std::string part_path = name + "." + crc + ".part";
+	int file_fd = open(part_path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (file_fd < 0 || fstat(file_fd, &file_stat) < 0 || pipe(file.pipe_fds) < 0) {
+		std::cout << "Failed to create file " << part_path << '\n';
+		if (file_fd >= 0) {
+			close(file_fd);
+		}
+		sendToFriend(fd, Opcode::FILE_ACCEPT, crc + " 500");
+		return;
+	}
+	uint64_t received = file_stat.st_size;
+	if (received > size) {
+		// not the same file after all
+		received = 0;
+		ftruncate(file_fd, 0);
+	}
+	file.fd = file_fd;
+	file.name = name;
+	file.part_path = part_path;
+	file.size = size;
+	file.crc = strtoul(crc.c_str(), nullptr, 16);
+	file.received = received;
+	file.chunk_remaining = 0;
+	file.progress = size > 0 ? received * FILE_PROGRESS_STEPS / size : 0;
+
+	if (received > 0) {
+		std::cout << "Resuming file " << name << " from " << conn.username << " at " << received << " of " << size << " bytes\n";
+	} else {
+		std::cout << "Receiving file " << name << " (" << size << " bytes) from " << conn.username << '\n';
+	}
+	std::ostringstream reply;
+	reply << crc << " 200 " << received;
+	sendToFriend(fd, Opcode::FILE_ACCEPT, reply.str());
+	if (received == size) {
+		// everything arrived before, but was never checked
+		finishReceivingFile(fd, conn);
+	}
+}
 
-				snprintf(buffer, sizeof(buffer), "LOGIN %s %s", username.c_str(), createHash(password));
-				write(server_socket, buffer, sizeof(buffer));
-			} else if (command == "help") {
-				displayHelp();
-			} else if (command == "exit") {
-				strncpy(buffer, "EXIT", sizeof(buffer));
-				write(server_socket, buffer, sizeof(buffer));
-				close(server_socket);
-				exit(EXIT_SUCCESS);
-			} else {
-				std::cout << "Unrecognized command\n";
+void startSendingFile(int fd, FriendConnection &conn, const std::string &payload)
+{
+	// friend answers "crc status offset", the offset being how much of the
+	// file it already has
+	std::istringstream strm(payload);
+	std::string crc;
+	int status_code = 0;
+	uint64_t offset = 0;
+	strm >> crc >> status_code >> offset;
+
+	OutgoingFile &file = conn.sending;
+	if (file.fd < 0 || file.accepted || crc != formatChecksum(file.crc)) {
+		return;
+	}
+	if (status_code != 200 || offset > file.size) {
+		if (status_code == 409) {
+			std::cout << "Friend " << conn.username << " already has a file named " << file.name << '\n';
+		} else {
+			std::cout << "Friend " << conn.username << " declined file " << file.name << '\n';
+		}
+		close(file.fd);
+		file.fd = -1;
+		offerNextFile(fd, conn);
+		return;
+	}
+	if (offset > 0) {
+		std::cout << "Resuming file " << file.name << " to " << conn.username << " at " << offset << " of " << file.size << " bytes\n";
+	}
+	file.accepted = true;
+	file.offset = offset;
+	file.progress = file.size > 0 ? offset * FILE_PROGRESS_STEPS / file.size : 0;
+	// sent from the event loop, which may close the connection if it fails
+	updateFriendEvents(fd, conn);
+}
+
+bool sendFileData(int fd, FriendConnection &conn)
+{
+	// stream the file straight from the page cache into the socket, a few
+	// frames at a time, and carry on when the socket can take more; the
+	// buffered bytes, a frame header among them, always go first. returns
+	// false if the connection is lost
+	OutgoingFile &file = conn.sending;
+	if (file.fd < 0 || !file.accepted) {
+		return true;
+	}
+	for (int chunks = 0; conn.outbound.empty() && (file.chunk_remaining > 0 || file.offset < file.size); ) {
+		if (file.chunk_remaining == 0) {
+			if (chunks++ == FILE_CHUNKS_PER_WRITE) {
+				return true;
+			}
+			file.chunk_remaining = std::min<uint64_t>(FILE_CHUNK_SIZE, file.size - file.offset);
+			conn.outbound = encodeFrameHeader(Opcode::FILE_DATA, file.chunk_remaining);
+			if (!writeSome(fd, conn.outbound)) {
+				return false;
+			}
+			continue;
+		}
+		off_t offset = file.offset;
+		ssize_t sent = sendfile(fd, file.fd, &offset, file.chunk_remaining);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		}
+		if (sent <= 0) {
+			// friend went away, or the file got shorter
+			return false;
+		}
+		file.offset += sent;
+		file.chunk_remaining -= sent;
+		conn.last_active = time(nullptr);
+		showFileProgress("Sending " + file.name + " to " + conn.username, file.offset, file.size, file.progress);
+		if (file.chunk_remaining == 0 && !conn.held.empty()) {
+			conn.outbound.swap(conn.held);
+			if (!writeSome(fd, conn.outbound)) {
+				return false;
+			}
+		}
+	}
+	// all sent, the friend answers once it has checked the file
+	return true;
+}
+
+void finishSendingFile(int fd, FriendConnection &conn, const std::string &payload)
+{
+	std::istringstream strm(payload);
+	std::string crc;
+	int status_code = 0;
+	strm >> crc >> status_code;
+
+	OutgoingFile &file = conn.sending;
+	if (file.fd < 0 || crc != formatChecksum(file.crc)) {
+		return;
+	}
+	if (status_code == 200) {
+		std::cout << "Friend " << conn.username << " received file " << file.name << '\n';
+	} else {
+		std::cout << "File " << file.name << " failed its integrity check at " << conn.username << ", send it again to retry\n";
+	}
+	close(file.fd);
+	file.fd = -1;
+	offerNextFile(fd, conn);
+}
+
+bool storeBufferedFileData(int fd, FriendConnection &conn, const std::string &pending, size_t &offset)
+{
+	// the part of a FILE_DATA frame that was read along with its header
+	IncomingFile &file = conn.receiving;
+	size_t length = std::min<size_t>(file.chunk_remaining, pending.size() - offset);
+	if (length == 0) {
+		return true;
+	}
+	ssize_t written = pwrite(file.fd, pending.data() + offset, length, file.received);
+	if (written != (ssize_t)length) {
+		std::cout << "Failed to write file " << file.part_path << '\n';
+		return false;
+	}
+	offset += length;
+	fileDataStored(fd, conn, length);
+	return true;
+}
+
+bool receiveFileData(int fd, FriendConnection &conn)
+{
+	// move the rest of a FILE_DATA frame from the socket to the file without
+	// it passing through user space; returns false if the connection is lost
+	IncomingFile &file = conn.receiving;
+	while (file.chunk_remaining > 0) {
+		ssize_t moved = splice(fd, nullptr, file.pipe_fds[1], nullptr, file.chunk_remaining, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (moved < 0 && errno == EINTR) {
+			continue;
+		}
+		if (moved < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		}
+		if (moved <= 0) {
+			return false;
+		}
+		loff_t offset = file.received;
+		loff_t end = file.received + moved;
+		while (offset < end) {
+			ssize_t written = splice(file.pipe_fds[0], nullptr, file.fd, &offset, end - offset, SPLICE_F_MOVE);
+			if (written < 0 && errno == EINTR) {
+				continue;
 			}
+			if (written <= 0) {
+				std::cout << "Failed to write file " << file.part_path << '\n';
+				return false;
+			}
+		}
+		conn.last_active = time(nullptr);
+		fileDataStored(fd, conn, moved);
+	}
+	return true;
+}
+
+void fileDataStored(int fd, FriendConnection &conn, uint64_t length)
+{
+	IncomingFile &file = conn.receiving;
+	file.received += length;
+	file.chunk_remaining -= length;
+	showFileProgress("Receiving " + file.name + " from " + conn.username, file.received, file.size, file.progress);
+	if (file.received == file.size) {
+		finishReceivingFile(fd, conn);
+	}
+}
+
+void finishReceivingFile(int fd, FriendConnection &conn)
+{
+	// the file is only given its name once it matches the sender's checksum;
+	// one that does not is thrown away, so sending it again starts over
+	IncomingFile &file = conn.receiving;
+	uint32_t crc;
+	bool intact = checksumFile(file.fd, file.size, crc) && crc == file.crc;
+	close(file.fd);
+	close(file.pipe_fds[0]);
+	close(file.pipe_fds[1]);
+	file.fd = file.pipe_fds[0] = file.pipe_fds[1] = -1;
+
+	if (intact && rename(file.part_path.c_str(), file.name.c_str()) == 0) {
+		std::cout << "Received file " << file.name << " from " << conn.username << '\n';
+		sendToFriend(fd, Opcode::FILE_DONE, formatChecksum(file.crc) + " 200");
+	} else {
+		std::cout << "File " << file.name << " from " << conn.username << " failed its integrity check\n";
+		unlink(file.part_path.c_str());
+		sendToFriend(fd, Opcode::FILE_DONE, formatChecksum(file.crc) + " 400");
+	}
+}
+
+void closeFileTransfers(FriendConnection &conn)
+{
+	// partly received files are kept, so sending them again resumes
+	if (conn.sending.fd >= 0) {
+		std::cout << "Sending file " << conn.sending.name << " to " << conn.username << " was interrupted, send it again to resume\n";
+		close(conn.sending.fd);
+		conn.sending.fd = -1;
+	}
+	if (conn.receiving.fd >= 0) {
+		std::cout << "Receiving file " << conn.receiving.name << " from " << conn.username << " was interrupted at " << conn.receiving.received << " of " << conn.receiving.size << " bytes\n";
+		close(conn.receiving.fd);
+		close(conn.receiving.pipe_fds[0]);
+		close(conn.receiving.pipe_fds[1]);
+		conn.receiving.fd = -1;
+	}
+}
+
+bool checksumFile(int fd, uint64_t size, uint32_t &crc)
+{
+	// CRC-32 of the whole file, read through a mapping of the page cache
+	crc = crc32(0L, Z_NULL, 0);
+	if (size == 0) {
+		return true;
+	}
+	void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+	madvise(data, size, MADV_SEQUENTIAL);
+	for (uint64_t done = 0; done < size; ) {
+		uInt length = std::min<uint64_t>(size - done, 1 << 30);
+		crc = crc32(crc, (const Bytef*)data + done, length);
+		done += length;
+	}
+	munmap(data, size);
+	return true;
+}
+
+std::string formatChecksum(uint32_t crc)
+{
+	std::ostringstream strm;
+	strm << std::hex << std::setw(8) << std::setfill('0') << crc;
+	return strm.str();
+}
+
+void showFileProgress(const std::string &label, uint64_t done, uint64_t size, int &progress)
+{
+	int step = size > 0 ? done * FILE_PROGRESS_STEPS / size : FILE_PROGRESS_STEPS;
+	if (step > progress) {
+		progress = step;
+		std::cout << label << ": " << step * 100 / FILE_PROGRESS_STEPS << "% (" << done << " of " << size << " bytes)\n";
+	}
+}
+
+void readStdin()
+{
+	char chunk[READ_CHUNK_SIZE];
+	ssize_t bytes_read = read(STDIN_FILENO, chunk, sizeof(chunk));
+	if (bytes_read < 0 && errno == EINTR) {
+		return;
+	}
+	if (bytes_read <= 0) {
+		// nothing more will be typed, but messages still arrive
+		if (!stdin_pending.empty()) {
+			handleInput(stdin_pending);
+			stdin_pending.clear();
+		}
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, nullptr);
+		return;
+	}
+	stdin_pending.append(chunk, bytes_read);
+	size_t start = 0;
+	size_t newline;
+	while ((newline = stdin_pending.find('\n', start)) != std::string::npos) {
+		handleInput(stdin_pending.substr(start, newline - start));
+		start = newline + 1;
+	}
+	stdin_pending.erase(0, start);
+}
+
+void handleInput(std::string input)
+{
+	trimString(input);
+	std::istringstream strm(input);
+	std::string command;
+	strm >> command;
+	if (!logged_in) {
+		if (command == "register") {
+			// register with server
+			std::string username;
+			std::string password;
+			strm >> username >> password;
+
+			if (username.empty() || password.empty()) {
+				std::cout << "Syntax: register [username] [password]\n";
+				return;
+			}
+
+			sendToServer(Opcode::REGISTER, username + " " + createHash(password));
+		} else if (command == "login") {
+			// login to server
+			std::string username;
+			std::string password;
+			strm >> username >> password;
+
+			if (username.empty() || password.empty()) {
+				std::cout << "Syntax: login [username] [password]\n";
+				return;
+			}
+
+			// servers that send rosters are told which one we already have
+			std::string payload = username + " " + createHash(password);
+			if ((server_features & FEATURE_ROSTER) && username == roster_username && !roster_version.empty()) {
+				payload += " " + roster_version;
+			}
+			sendToServer(Opcode::LOGIN, payload);
+		} else if (command == "help") {
+			displayHelp();
+		} else if (command == "exit") {
+			sendToServer(Opcode::EXIT, "");
+			close(server_socket);
+			exit(EXIT_SUCCESS);
 		} else {
-			if (command == "message") {
-				std::string username;
-				std::string message;
-				strm >> username;
-				strm.ignore();
-				getline(strm, message);
-
-				if (username.empty() || message.empty()) {
-					std::cout << "Syntax: message [friend username] [message]\n";
-					continue;
-				}
+			std::cout << "Unrecognized command\n";
+		}
+	} else {
+		if (command == "message") {
+			std::string username;
+			std::string message;
+			strm >> username;
+			strm.ignore();
+			getline(strm, message);
+
+			if (username.empty() || message.empty()) {
+				std::cout << "Syntax: message [friend username] [message]\n";
+				return;
+			}
 
-				if (username == client_username) {
-					std::cout << "You can't message yourself\n";
-					continue;
-				}
+			if (username == client_username) {
+				std::cout << "You can't message yourself\n";
+				return;
+			}
 
-				pthread_mutex_lock(&connected_friends_mutex);
-				// file descriptor to write to
-				int friend_fd = getUserFd(username);
-				if (friend_fd < 0) {
-					// not connected, need to first establish connection
-					Location friend_address;
-					pthread_mutex_lock(&friend_info_mutex);
-					try {
-						friend_address = getFriendAddress(username);	
-					} catch (std::string err) {
-						std::cout << err << '\n';
-						pthread_mutex_unlock(&friend_info_mutex);
-						continue;
-					}
-					pthread_mutex_unlock(&friend_info_mutex);
-				
-					struct addrinfo hints;
-					struct addrinfo *info;
-					int new_socket;
-
-					memset(&hints, 0, sizeof(hints));
-					hints.ai_family = AF_INET;
-					hints.ai_socktype = SOCK_STREAM;
-					hints.ai_flags = AI_CANONNAME;
-
-					if (getaddrinfo(friend_address.hostname.c_str(), friend_address.port.c_str(), &hints, &info) != 0) {
-						std::cout << "Failed to get address information of friend " << username << '\n';
-						continue;
-					}
-					if ((new_socket = socket(info->ai_family, info->ai_socktype, info->ai_protocol)) < 0) {
-						std::cout << "Failed to create socket to friend " << username << '\n';
-						continue;
-					}
-					if (connect(new_socket, info->ai_addr, info->ai_addrlen) < 0) {
-						std::cout << "Failed to establish connection with friend " << username << '\n';
-						continue;
-					}
-
-					friend_fd = new_socket;
-
-					// let friend know of username
-					sprintf(buffer, "USER %s", client_username.c_str());
-					write(friend_fd, buffer, sizeof(buffer));
-
-					// create thread to handle messages from newly connected friend
-					pthread_t new_thread;
-					if (pthread_create(&new_thread, &detached_thread_attr, handleFriend, (void*)&friend_fd) != 0) {
-						continue;
-					}
-					pthread_mutex_lock(&connected_threads_mutex);
-					connected_threads.insert(std::make_pair(friend_fd, new_thread));
-					pthread_mutex_unlock(&connected_threads_mutex);
-					connected_friends.insert(std::make_pair(friend_fd, username));
-				}
-				pthread_mutex_unlock(&connected_friends_mutex);
-				// send the message
-				strncpy(buffer, message.c_str(), sizeof(buffer));
-				write(friend_fd, buffer, sizeof(buffer));
-			} else if (command == "invite") {
-				std::string username;
-				std::string message;
-				strm >> username;
-				strm.ignore();
-				getline(strm, message);
-				
-				if (username.empty()) {
-					std::cout << "Syntax: invite [username] [optional message]\n";
-					continue;
-				}
+			auto relay_itr = relay_messages.find(username);
+			if (relay_itr != relay_messages.end()) {
+				// still waiting for the server to relay us to this friend
+				relay_itr->second.push_back(message);
+				return;
+			}
 
-				if (username == client_username) {
-					std::cout << "You can't invite yourself\n";
-					continue;
+			// connections to friends are kept open and used again
+			int friend_fd = getUserFd(username);
+			if (friend_fd >= 0) {
+				FriendConnection &conn = connected_friends[friend_fd];
+				if (conn.state == ConnectionState::READY) {
+					sendToFriend(friend_fd, Opcode::MESSAGE, message);
+				} else {
+					conn.queued.push_back(message);
 				}
+				return;
+			}
 
-				// check if this user is already a friend
-				pthread_mutex_lock(&friend_info_mutex);
-				if (hasFriend(username)) {
-					std::cout << "You are already friends with " << username << '\n';
-					continue;
-				}
-				pthread_mutex_unlock(&friend_info_mutex);
+			// not connected, need to first establish connection
+			std::shared_ptr<User> info;
+			try {
+				info = getFriendInfo(username);
+			} catch (std::string err) {
+				std::cout << err << '\n';
+				return;
+			}
+			connectToFriend(username, info, message);
+		} else if (command == "sendfile") {
+			std::string username;
+			std::string path;
+			strm >> username;
+			strm.ignore();
+			getline(strm, path);
+
+			if (username.empty() || path.empty()) {
+				std::cout << "Syntax: sendfile [friend username] [path]\n";
+				return;
+			}
 
-				// check if there is a pending invite to this user
-				pthread_mutex_lock(&sent_invites_mutex);
-				if (hasSentInviteTo(username)) {
-					std::cout << "You have already sent an invite to " << username << '\n';
-					continue;
-				}
-				pthread_mutex_unlock(&sent_invites_mutex);
+			if (username == client_username) {
+				std::cout << "You can't send files to yourself\n";
+				return;
+			}
 
-				// check if there is a pending invite from this user
-				pthread_mutex_lock(&received_invites_mutex);
-				if (hasInviteFrom(username)) {
-					std::cout << "You have a pending invite from " << username << '\n';
-					continue;
+			struct stat file_stat;
+			if (stat(path.c_str(), &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) {
+				std::cout << "There is no file at " << path << '\n';
+				return;
+			}
+
+			// goes over the connection to the friend, made first if need be
+			if (relay_messages.count(username) == 0 && getUserFd(username) < 0) {
+				std::shared_ptr<User> info;
+				try {
+					info = getFriendInfo(username);
+				} catch (std::string err) {
+					std::cout << err << '\n';
+					return;
 				}
-				pthread_mutex_unlock(&received_invites_mutex);
-
-				snprintf(buffer, sizeof(buffer), "INVITE %s %s", username.c_str(), message.c_str());
-				write(server_socket, buffer, sizeof(buffer));
-				pthread_mutex_lock(&sent_invites_mutex);
-				sent_invites.push_back(username);
-				pthread_mutex_unlock(&sent_invites_mutex);
-			} else if (command == "accept") {
-				std::string username;
-				std::string message;
-				strm >> username;
-				strm.ignore();
-				getline(strm, message);
-				
-				if (username.empty()) {
-					std::cout << "Syntax: accept [username] [optional message]\n";
-					continue;
+				if (!connectToFriend(username, info, "")) {
+					return;
 				}
+			}
+			queueFile(username, path);
+		} else if (command == "create" || command == "join" || command == "leave") {
+			std::string room;
+			strm >> room;
+
+			if (room.empty()) {
+				std::cout << "Syntax: " << command << " [room]\n";
+				return;
+			}
 
-				pthread_mutex_lock(&received_invites_mutex);
-				if (hasInviteFrom(username)) {
-					snprintf(buffer, sizeof(buffer), "INVITE_ACCEPT %s %s", username.c_str(), message.c_str());
-					write(server_socket, buffer, sizeof(buffer));
-					removeInviteFrom(username);
-				} else {
-					std::cout << "You have not received an invite from " << username << " to accept\n";
-				}
-				pthread_mutex_unlock(&received_invites_mutex);
-			} else if (command == "logout") {
-				strncpy(buffer, "LOGOUT", sizeof(buffer));
-				write(server_socket, buffer, sizeof(buffer));
-				// terminate connection and friend threads
-				pthread_cancel(connection_thread);
-				terminateFriendThreads();
-				// only close local sockets, keep server socket open
-				closeLocalSockets();
-				// clear friend information
-				friend_info.clear();
-				// clear online friends
-				connected_friends.clear();
-				// clear invites
-				received_invites.clear();
-				sent_invites.clear();
-				// reset username
-				client_username = "";
-				std::cout << "You have logged out of " << server_hostname << '\n';
-				logged_in = false;
-			} else if (command == "help") {
-				displayHelp();
+			Opcode opcode = command == "create" ? Opcode::ROOM_CREATE : command == "join" ? Opcode::ROOM_JOIN : Opcode::ROOM_LEAVE;
+			sendToServer(opcode, room);
+		} else if (command == "post") {
+			std::string room;
+			std::string message;
+			strm >> room;
+			strm.ignore();
+			getline(strm, message);
+
+			if (room.empty() || message.empty()) {
+				std::cout << "Syntax: post [room] [message]\n";
+				return;
+			}
+
+			// the server sends it on to everyone in the room
+			sendToServer(Opcode::ROOM_POST, room + " " + message);
+		} else if (command == "invite") {
+			std::string username;
+			std::string message;
+			strm >> username;
+			strm.ignore();
+			getline(strm, message);
+
+			if (username.empty()) {
+				std::cout << "Syntax: invite [username] [optional message]\n";
+				return;
+			}
+
+			if (username == client_username) {
+				std::cout << "You can't invite yourself\n";
+				return;
+			}
+
+			// check if this user is already a friend
+			if (hasFriend(username)) {
+				std::cout << "You are already friends with " << username << '\n';
+				return;
+			}
+
+			// check if there is a pending invite to this user
+			if (hasSentInviteTo(username)) {
+				std::cout << "You have already sent an invite to " << username << '\n';
+				return;
+			}
+
+			// check if there is a pending invite from this user
+			if (hasInviteFrom(username)) {
+				std::cout << "You have a pending invite from " << username << '\n';
+				return;
+			}
+
+			sendToServer(Opcode::INVITE, username + " " + message);
+			sent_invites.push_back(username);
+		} else if (command == "accept") {
+			std::string username;
+			std::string message;
+			strm >> username;
+			strm.ignore();
+			getline(strm, message);
+
+			if (username.empty()) {
+				std::cout << "Syntax: accept [username] [optional message]\n";
+				return;
+			}
+
+			if (hasInviteFrom(username)) {
+				sendToServer(Opcode::INVITE_ACCEPT, username + " " + message);
+				removeInviteFrom(username);
 			} else {
-				std::cout << "Unrecognized command\n";
+				std::cout << "You have not received an invite from " << username << " to accept\n";
 			}
+		} else if (command == "logout") {
+			sendToServer(Opcode::LOGOUT, "");
+			forgetSession();
+			std::cout << "You have logged out of " << server_hostname << '\n';
+		} else if (command == "help") {
+			displayHelp();
+		} else {
+			std::cout << "Unrecognized command\n";
 		}
 	}
-	return nullptr;
 }
 
-void *handleServer(void *arg)
+void readServer()
 {
-	char response[256];
-	while (true) {
-		if (read(server_socket, response, sizeof(response)) > 0) {
-			std::istringstream strm(response);
-			std::string type;
-			strm >> type;
-			if (type == "REGISTER") {
-				std::string username;
-				int status_code;
-				strm >> username >> status_code;
-				if (status_code == 200) {
-					std::cout << "You have successfully registered as " << username << ". Please login.\n";
-				} else {
-					std::cout << "Username " << username << " is unavailable. Please choose another.\n";
-				}
-			} else if (type == "LOGIN") {
-				std::string username;
-				int status_code;
-				strm >> username >> status_code;
-				if (status_code == 200) {
-					std::cout << "You have successfully logged in as " << username << ". Enter \"help\" for a list of commands.\n";
-					logged_in = true;
-					client_username = username;
-					allowConnections();
-				} else {
-					std::cout << "Credentials are incorrect, or user " << username << " is already logged in. Try again.\n";
-				}
-			} else if (type == "LOCATION") {
-				std::string username;
-				std::string address;
-				std::string port;
-				strm >> username >> address >> port;
-				std::cout << "Friend " << username << " is online\n";
-				pthread_mutex_lock(&friend_info_mutex);
-				friend_info.push_back(std::make_shared<User>(username, address, port));
-				pthread_mutex_unlock(&friend_info_mutex);
-			} else if (type == "INVITE_FROM") {
-				std::string username;
-				std::string message;
-				strm.ignore();
-				strm >> username;
-				getline(strm, message);
-				std::cout << "You have received an invite from " << username << ": " << message << '\n';
-				pthread_mutex_lock(&received_invites_mutex);
-				received_invites.push_back(username);
-				pthread_mutex_unlock(&received_invites_mutex);
-			} else if (type == "INVITE_ACCEPT") {
-				std::string username;
-				std::string message;
-				strm >> username;
-				strm.ignore();
-				getline(strm, message);
-				std::cout << username << " has accepted your invitation: " << message << '\n';
-				pthread_mutex_lock(&sent_invites_mutex);
-				removeSentInviteTo(username);
-				pthread_mutex_unlock(&sent_invites_mutex);
-			} else if (type == "INVITE_FAILED") {
-				std::string username;
-				strm >> username;
-				std::cout << "Failed to send invite to " << username << ". User does not exist.\n";
-				pthread_mutex_lock(&sent_invites_mutex);
-				removeSentInviteTo(username);
-				pthread_mutex_unlock(&sent_invites_mutex);
-			} else if (type == "SHUTDOWN") {
-				std::cout << server_hostname << " has shut down\n";
-				exitHandler();
-			} else if (type == "TERMINATE" || type == "LOGOUT") {
-				std::string username;
-				strm >> username;
-				std::cout << "Friend " << username << " has logged out\n";
-				// remove location information for friend
-				pthread_mutex_lock(&friend_info_mutex);
-				removeFriendInfo(username);
-				pthread_mutex_unlock(&friend_info_mutex);
-				pthread_mutex_lock(&connected_friends_mutex);
-				// if friend was connected, remove from connections and terminate thread
-				int fd = getUserFd(username);
-				if (fd != -1) {
-					removeConnectedFriend(fd);
-				}
-				pthread_mutex_unlock(&connected_friends_mutex);
+	if (server_socket < 0) {
+		// given up on while handling an earlier event
+		return;
+	}
+	char chunk[READ_CHUNK_SIZE];
+	ssize_t bytes_read = read(server_socket, chunk, sizeof(chunk));
+	if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (bytes_read <= 0) {
+		// server has gone away, nothing more will come from it; a session
+		// the server gave a token for is resumed on a new connection
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, server_socket, nullptr);
+		if (logged_in && !resume_token.empty()) {
+			lostServerConnection();
+		}
+		return;
+	}
+	server_last_received = time(nullptr);
+	server_pending.append(chunk, bytes_read);
+	if (server_state == ConnectionState::HELLO && !readServerHello()) {
+		return;
+	}
+
+	size_t offset = 0;
+	if (server_format == WireFormat::FRAMED) {
+		Frame frame;
+		while (decodeFrame(server_pending, offset, frame) > 0) {
+			CompressionStats stats = CompressionStats();
+			if (((uint8_t)frame.opcode & COMPRESSED_FRAME) && (!server_compression || !server_compression->decompress(frame, stats))) {
+				// nothing after it can be made sense of either
+				std::cerr << "Failed to decompress message from server\n";
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, server_socket, nullptr);
+				return;
+			}
+			handleServerMessage(frame);
+		}
+	} else {
+		while (server_pending.size() - offset >= LEGACY_COMMAND_SIZE) {
+			// the last byte of a command is always taken for its NUL
+			Frame frame = parseLegacyCommand(server_pending.data() + offset, LEGACY_COMMAND_SIZE - 1);
+			offset += LEGACY_COMMAND_SIZE;
+			handleServerMessage(frame);
+		}
+	}
+	server_pending.erase(0, offset);
+}
+
+void handleServerMessage(const Frame &frame)
+{
+	PayloadReader strm(frame.payload);
+	Opcode type = frame.opcode;
+	if (type == Opcode::REGISTER) {
+		std::string username;
+		int status_code;
+		strm >> username >> status_code;
+		if (status_code == 200) {
+			std::cout << "You have successfully registered as " << username << ". Please login.\n";
+		} else {
+			std::cout << "Username " << username << " is unavailable. Please choose another.\n";
+		}
+	} else if (type == Opcode::LOGIN) {
+		std::string username;
+		int status_code;
+		strm >> username >> status_code;
+		if (status_code == 200) {
+			std::cout << "You have successfully logged in as " << username << ". Enter \"help\" for a list of commands.\n";
+			resume_token.clear();
+			strm >> resume_token;
+			logged_in = true;
+			client_username = username;
+			allowConnections();
+		} else {
+			std::cout << "Credentials are incorrect, or user " << username << " is already logged in. Try again.\n";
+		}
+	} else if (type == Opcode::RESUME) {
+		// answer to resuming the session after the connection dropped; the
+		// token is only good once, so a new one comes with it
+		std::string username;
+		int status_code = 0;
+		strm >> username >> status_code;
+		resume_deadline = 0;
+		resume_token.clear();
+		if (status_code == 200) {
+			strm >> resume_token;
+			std::cout << "You are connected to " << server_hostname << " again\n";
+		} else {
+			forgetSession();
+			std::cout << "Your session on " << server_hostname << " has ended. Please login again.\n";
+		}
+	} else if (type == Opcode::LOCATION) {
+		std::cout << "Friend " << storeFriendLocation(frame.payload) << " is online\n";
+	} else if (type == Opcode::ROSTER) {
+		// friends online at login: all of them, or only the ones that changed
+		// since the roster we kept
+		std::string version;
+		std::string kind;
+		int more = 0;
+		std::string line;
+		strm >> version >> kind >> more;
+		strm.getLine(line);
+		if (kind == "full" && !roster_continues) {
+			friend_info.clear();
+		}
+		while (strm.getLine(line)) {
+			Frame change = parseLegacyCommand(line.c_str());
+			if (change.opcode == Opcode::LOCATION) {
+				storeFriendLocation(change.payload);
 			} else {
-				// some other message, just display it
-				std::cout << response << '\n';
+				removeFriendInfo(change.payload.str());
+			}
+		}
+		roster_continues = more != 0;
+		if (!roster_continues) {
+			roster_version = version;
+			roster_username = client_username;
+			for (auto itr = friend_info.begin(); itr != friend_info.end(); ++itr) {
+				std::cout << "Friend " << (*itr)->getUsername() << " is online\n";
 			}
 		}
+	} else if (type == Opcode::INVITE_FROM) {
+		std::string username;
+		std::string message;
+		strm >> username;
+		strm.ignore();
+		strm.getLine(message);
+		std::cout << "You have received an invite from " << username << ": " << message << '\n';
+		received_invites.push_back(username);
+	} else if (type == Opcode::INVITE_ACCEPT) {
+		std::string username;
+		std::string message;
+		strm >> username;
+		strm.ignore();
+		strm.getLine(message);
+		std::cout << username << " has accepted your invitation: " << message << '\n';
+		removeSentInviteTo(username);
+	} else if (type == Opcode::INVITE_FAILED) {
+		std::string username;
+		strm >> username;
+		std::cout << "Failed to send invite to " << username << ". User does not exist.\n";
+		removeSentInviteTo(username);
+	} else if (type == Opcode::RELAY) {
+		// answer to a relay request made by the message command
+		std::string username;
+		std::string reply;
+		strm >> username;
+		strm.ignore();
+		strm.getLine(reply);
+		finishRelay(username, reply);
+	} else if (type == Opcode::RELAY_FROM) {
+		// friend could not connect to us directly, join its relay
+		std::string username;
+		std::string token;
+		strm >> username >> token;
+		acceptRelay(token);
+	} else if (type == Opcode::PRESENCE) {
+		// batch of presence notifications, each line a command of its own
+		std::string line;
+		while (strm.getLine(line)) {
+			handleServerMessage(parseLegacyCommand(line.c_str()));
+		}
+	} else if (type == Opcode::ROOM_CREATE || type == Opcode::ROOM_JOIN || type == Opcode::ROOM_LEAVE || type == Opcode::ROOM_POST) {
+		std::string room;
+		int status_code = 0;
+		strm >> room >> status_code;
+		if (status_code == 200 && type == Opcode::ROOM_CREATE) {
+			std::cout << "You have created room " << room << '\n';
+		} else if (status_code == 200 && type == Opcode::ROOM_JOIN) {
+			std::cout << "You have joined room " << room << '\n';
+		} else if (status_code == 200) {
+			std::cout << "You have left room " << room << '\n';
+		} else if (type == Opcode::ROOM_CREATE) {
+			std::cout << "Room " << room << " already exists\n";
+		} else if (type == Opcode::ROOM_JOIN) {
+			std::cout << "There is no room " << room << '\n';
+		} else {
+			std::cout << "You are not in room " << room << '\n';
+		}
+	} else if (type == Opcode::ROOM_MESSAGE) {
+		std::string room;
+		std::string username;
+		std::string message;
+		strm >> room >> username;
+		strm.ignore();
+		strm.getLine(message);
+		std::cout << '[' << room << "] [" << username << "]: " << message << '\n';
+	} else if (type == Opcode::BROADCAST) {
+		std::cout << '[' << server_hostname << "]: " << frame.payload << '\n';
+	} else if (type == Opcode::HEARTBEAT) {
+		// the server checking on us, or answering our own probe
+		if (!frame.payload.empty()) {
+			sendToServer(Opcode::HEARTBEAT, "");
+		}
+	} else if (type == Opcode::SHUTDOWN) {
+		std::cout << server_hostname << " has shut down\n";
+		exitHandler();
+	} else if (type == Opcode::TERMINATE || type == Opcode::LOGOUT) {
+		std::string username;
+		strm >> username;
+		std::cout << "Friend " << username << " has logged out\n";
+		// remove location information for friend
+		removeFriendInfo(username);
+		// if friend was connected, remove from connections
+		int fd = getUserFd(username);
+		if (fd != -1) {
+			removeConnectedFriend(fd);
+		}
+	} else {
+		// some other message, just display it
+		std::cout << frame.payload << '\n';
+	}
+}
+
+void lostServerConnection()
+{
+	// keep everything as it is, friends included, while trying to get the
+	// session back
+	close(server_socket);
+	server_socket = -1;
+	server_state = ConnectionState::READY;
+	server_pending.clear();
+	server_outbound.clear();
+	if (resume_deadline == 0) {
+		std::cout << "Lost connection to " << server_hostname << ", reconnecting\n";
+		resume_deadline = time(nullptr) + RESUME_TIMEOUT_SECONDS;
+		resumeSession();
+	}
+}
+
+void resumeSession()
+{
+	// connect to the server again without waiting for it; the event loop
+	// finishes the connection and the HELLO, and then presents the token
+	int fd = connectToServer();
+	if (fd < 0) {
+		return;
+	}
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLOUT;
+	event.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		close(fd);
+		return;
+	}
+	server_socket = fd;
+	server_events = EPOLLOUT;
+	server_state = ConnectionState::CONNECTING;
+	server_deadline = time(nullptr) + CONNECT_TIMEOUT_SECONDS;
+}
+
+void finishServerConnect()
+{
+	int error = 0;
+	socklen_t error_length = sizeof(error);
+	if (getsockopt(server_socket, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0 || error != 0) {
+		abandonResume();
+		return;
+	}
+	Hello hello;
+	hello.min_version = MIN_PROTOCOL_VERSION;
+	hello.max_version = MAX_PROTOCOL_VERSION;
+	hello.features = SUPPORTED_FEATURES;
+	server_outbound = encodeHello(hello);
+	server_state = ConnectionState::HELLO;
+	server_deadline = time(nullptr) + HELLO_TIMEOUT_SECONDS;
+	if (!writeSome(server_socket, server_outbound)) {
+		abandonResume();
+		return;
+	}
+	updateServerEvents();
+}
+
+bool readServerHello()
+{
+	// the server answers the HELLO of a new connection, and only one that
+	// can resume sessions is given the token, along with the roster we have
+	// so only the friends that changed are sent; returns false unless what
+	// came after the answer is to be handled
+	if (server_pending.size() < HELLO_SIZE) {
+		return false;
+	}
+	Hello reply;
+	if (!decodeHello(server_pending.data(), HELLO_SIZE, reply) || reply.max_version == 0 || !(reply.features & FEATURE_RESUME)) {
+		abandonResume();
+		return false;
+	}
+	server_pending.erase(0, HELLO_SIZE);
+	server_state = ConnectionState::READY;
+	server_features = reply.features & SUPPORTED_FEATURES;
+	server_compression = nullptr;
+	if (server_features & FEATURE_COMPRESSION) {
+		server_compression = std::make_shared<FrameCompression>();
+	}
+	std::string payload = client_username + " " + resume_token;
+	if ((server_features & FEATURE_ROSTER) && client_username == roster_username && !roster_version.empty()) {
+		payload += " " + roster_version;
+	}
+	sendToServer(Opcode::RESUME, payload);
+	return true;
+}
+
+void abandonResume()
+{
+	// tried again on the next tick, until the session can not be resumed
+	close(server_socket);
+	server_socket = -1;
+	server_state = ConnectionState::READY;
+	server_pending.clear();
+	server_outbound.clear();
+}
+
+void retryResume()
+{
+	// once a second until the server can be reached again, or it is too late
+	if (resume_deadline == 0) {
+		return;
+	}
+	time_t now = time(nullptr);
+	if (server_socket >= 0 && server_state != ConnectionState::READY && now >= server_deadline) {
+		abandonResume();
+	}
+	if (server_socket >= 0) {
+		return;
+	}
+	if (now < resume_deadline) {
+		resumeSession();
+		return;
+	}
+	resume_deadline = 0;
+	std::cout << "Failed to reconnect to " << server_hostname << '\n';
+}
+
+void checkServer()
+{
+	// a server that went quiet is probed once an interval, and taken for
+	// dead when it stays silent, which a connection that was cut without
+	// being closed never shows otherwise
+	if (server_socket < 0 || server_state != ConnectionState::READY || !(server_features & FEATURE_HEARTBEAT)) {
+		return;
+	}
+	time_t now = time(nullptr);
+	if (now - server_last_received >= HEARTBEAT_MISSES * HEARTBEAT_INTERVAL_SECONDS) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, server_socket, nullptr);
+		if (logged_in && !resume_token.empty()) {
+			lostServerConnection();
+			return;
+		}
+		std::cout << "Lost connection to " << server_hostname << '\n';
+		close(server_socket);
+		server_socket = -1;
+		server_outbound.clear();
+	} else if (now - server_last_received >= HEARTBEAT_INTERVAL_SECONDS && now - server_probed >= HEARTBEAT_INTERVAL_SECONDS) {
+		sendToServer(Opcode::HEARTBEAT, std::to_string(HEARTBEAT_INTERVAL_SECONDS));
+		server_probed = now;
+	}
+}
+
+void forgetSession()
+{
+	// only close local sockets, keep server socket open
+	closeLocalSockets();
+	// clear friend information, unless the server only sends what
+	// changed when we log in again
+	if (!(server_features & FEATURE_ROSTER)) {
+		friend_info.clear();
+	}
+	// clear online friends
+	connected_friends.clear();
+	relay_messages.clear();
+	relay_files.clear();
+	// clear invites
+	received_invites.clear();
+	sent_invites.clear();
+	// reset username
+	client_username = "";
+	resume_token.clear();
+	logged_in = false;
+}
+
+void sendToServer(Opcode opcode, const std::string &payload)
+{
+	if (server_state != ConnectionState::READY) {
+		// the server can not be reached until the session is resumed
+		return;
+	}
+	std::string message = encodeMessage(server_format, opcode, payload);
+	CompressionStats stats = CompressionStats();
+	if (server_compression && server_compression->worthCompressing(message)) {
+		server_compression->compress(message, stats);
+	}
+	// like friends, the server is never waited on; what its socket does not
+	// take now is written from the event loop
+	bool waiting = !server_outbound.empty();
+	server_outbound += message;
+	if (!waiting && !writeSome(server_socket, server_outbound)) {
+		server_outbound.clear();
+	}
+	updateServerEvents();
+}
+
+void writeServer()
+{
+	if (server_socket < 0) {
+		return;
+	}
+	if (server_state == ConnectionState::CONNECTING) {
+		finishServerConnect();
+		return;
+	}
+	if (!writeSome(server_socket, server_outbound)) {
+		// found out by the next read
+		server_outbound.clear();
+	}
+	updateServerEvents();
+}
+
+void updateServerEvents()
+{
+	uint32_t events = server_outbound.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT;
+	if (server_socket < 0 || events == server_events) {
+		return;
+	}
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.fd = server_socket;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, server_socket, &event);
+	server_events = events;
+}
+
+void sendToFriend(int fd, Opcode opcode, const std::string &payload)
+{
+	// friends that have not opened with a HELLO only speak text
+	FriendConnection &conn = connected_friends[fd];
+	conn.last_active = time(nullptr);
+	WireFormat format = conn.format == WireFormat::FRAMED ? WireFormat::FRAMED : WireFormat::LEGACY;
+	std::string message = encodeMessage(format, opcode, payload);
+	CompressionStats stats = CompressionStats();
+	if (conn.compression && conn.compression->worthCompressing(message)) {
+		conn.compression->compress(message, stats);
+	}
+	if (conn.sending.chunk_remaining > 0) {
+		// must not land in the middle of a FILE_DATA frame
+		conn.held += message;
+		return;
+	}
+	writeToFriend(fd, conn, message);
+}
+
+bool requestRelay(const std::string &username)
+{
+	// asks the server to relay us to the friend, and returns false if it can
+	// not; servers that only speak text can not relay
+	if (server_format != WireFormat::FRAMED) {
+		return false;
+	}
+	sendToServer(Opcode::RELAY, username);
+	return true;
+}
+
+void finishRelay(const std::string &username, const std::string &reply)
+{
+	// join the relay the server answered with, and send what the message
+	// command queued up in the meantime
+	auto relay_itr = relay_messages.find(username);
+	if (relay_itr == relay_messages.end()) {
+		return;
+	}
+	std::vector<std::string> messages;
+	messages.swap(relay_itr->second);
+	relay_messages.erase(relay_itr);
+	std::vector<std::string> files;
+	files.swap(relay_files[username]);
+	relay_files.erase(username);
+
+	std::istringstream strm(reply);
+	int status_code = 0;
+	std::string token;
+	strm >> status_code >> token;
+	// only clients that speak framed messages can be relayed to
+	FriendConnection conn = newFriendConnection(username, WireFormat::UNKNOWN, ConnectionState::CONNECTING);
+	conn.send_hello = true;
+	conn.queued = messages;
+	conn.queued_files = files;
+	if (status_code != 200 || !joinRelay(token, conn)) {
+		std::cout << "Failed to establish connection with friend " << username << '\n';
+	}
+}
+
+int connectToServer()
+{
+	// a new non-blocking connection to the server, which may still be
+	// connecting, or -1 if it can not be made
+	int fd = socket(server_address.ss_family, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (setNonBlocking(fd) < 0 || (connect(fd, (struct sockaddr *)&server_address, server_address_length) < 0 && errno != EINPROGRESS)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool joinRelay(const std::string &token, FriendConnection conn)
+{
+	// connect to the server again without waiting for it; the event loop
+	// sends the join, and the connection is handed to the friend once the
+	// other client has joined as well, or dropped at the deadline
+	int relay_socket = connectToServer();
+	if (relay_socket < 0) {
+		return false;
+	}
+	conn.state = ConnectionState::CONNECTING;
+	conn.relayed = true;
+	conn.relay_token = token;
+	conn.deadline = time(nullptr) + RELAY_TIMEOUT_SECONDS;
+	return addFriendConnection(relay_socket, conn, EPOLLOUT);
+}
+
+void sendRelayJoin(int fd, FriendConnection &conn)
+{
+	// nothing but the join goes to the server itself, what follows is
+	// between us and the friend, who agree on features of their own
+	Hello hello;
+	hello.min_version = MIN_PROTOCOL_VERSION;
+	hello.max_version = MAX_PROTOCOL_VERSION;
+	hello.features = 0;
+	conn.state = ConnectionState::JOINING;
+	writeToFriend(fd, conn, encodeHello(hello) + encodeFrame(Opcode::RELAY_JOIN, conn.relay_token));
+}
+
+bool readRelayJoin(int fd, FriendConnection &conn)
+{
+	// the server answers the HELLO, then the join once both clients are
+	// there; whatever follows is from the friend. returns false until the
+	// relay is joined
+	if (conn.pending.size() < HELLO_SIZE) {
+		return false;
+	}
+	Hello reply;
+	Frame frame;
+	size_t offset = HELLO_SIZE;
+	int status = decodeHello(conn.pending.data(), HELLO_SIZE, reply) && reply.max_version > 0 ? decodeFrame(conn.pending, offset, frame) : -1;
+	if (status == 0) {
+		return false;
+	}
+	if (status < 0 || frame.opcode != Opcode::RELAY_JOIN || frame.payload != conn.relay_token + " 200") {
+		failFriendConnection(fd);
+		return false;
 	}
-	return nullptr;
+	conn.pending.erase(0, offset);
+	conn.relay_token.clear();
+	if (conn.send_hello) {
+		startHandshake(fd, conn);
+	} else {
+		// handled like a friend connecting to us
+		conn.state = ConnectionState::READY;
+		updateFriendEvents(fd, conn);
+	}
+	return true;
+}
+
+void acceptRelay(const std::string &token)
+{
+	joinRelay(token, newFriendConnection("", WireFormat::UNKNOWN, ConnectionState::CONNECTING));
 }
 
 void closeLocalSockets()
 {
 	for (auto itr = connected_friends.begin(); itr != connected_friends.end(); ++itr) {
+		closeFileTransfers(itr->second);
 		close(itr->first);
 	}
 	close(local_socket);
+	local_socket = -1;
 }
 
 int getUserFd(const std::string &username)
 {
 	// return file descriptor of friend with username username
 	for (auto itr = connected_friends.begin(); itr != connected_friends.end(); ++itr) {
-		if (itr->second == username) {
+		if (itr->second.username == username) {
 			return itr->first;
 		}
 	}
@@ -591,17 +2114,62 @@ bool hasFriend(const std::string &username)
 	return false;
 }
 
-Location getFriendAddress(const std::string &username)
+std::shared_ptr<User> getFriendInfo(const std::string &username)
 {
 	for (auto itr = friend_info.begin(); itr != friend_info.end(); ++itr) {
 		if ((*itr)->getUsername() == username) {
-			return (*itr)->getAddressInfo();
+			return *itr;
 		}
 	}
-	
+
 	throw "Friend " + username + " not found";
 }
 
+void resolveFriendAddress(const std::shared_ptr<User> &info)
+{
+	// resolve a friend's location once, when it arrives, rather than on every
+	// connect; numeric addresses need no lookup at all, and only servers that
+	// predate them send a hostname
+	Location location = info->getAddressInfo();
+	if (location.port.empty()) {
+		return;
+	}
+	struct addrinfo hints;
+	struct addrinfo *addresses;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	if (location.family != 0) {
+		hints.ai_family = location.family;
+		hints.ai_flags |= AI_NUMERICHOST;
+	}
+	if (getaddrinfo(location.hostname.c_str(), location.port.c_str(), &hints, &addresses) != 0) {
+		return;
+	}
+	info->setSocketAddress(addresses->ai_addr, addresses->ai_addrlen);
+	freeaddrinfo(addresses);
+}
+
+std::string storeFriendLocation(const TextView &payload)
+{
+	// a friend that moved replaces its old location; returns the friend's
+	// username
+	PayloadReader strm(payload);
+	std::string username;
+	std::string address;
+	std::string port;
+	unsigned version = 0;
+	std::string family;
+	strm >> username >> address >> port >> version >> family;
+	std::shared_ptr<User> u = std::make_shared<User>(username, address, port);
+	u->setAddressInfo(address, port, version, family == "6" ? AF_INET6 : family == "4" ? AF_INET : 0);
+	resolveFriendAddress(u);
+	removeFriendInfo(username);
+	friend_info.push_back(u);
+	return username;
+}
+
 void removeFriendInfo(const std::string &username)
 {
 	// remove friend's location information
@@ -615,10 +2183,13 @@ void removeFriendInfo(const std::string &username)
 
 void removeConnectedFriend(const int &fd)
 {
+	// closing the socket also takes it out of the event loop
+	auto conn_itr = connected_friends.find(fd);
+	if (conn_itr != connected_friends.end()) {
+		closeFileTransfers(conn_itr->second);
+	}
 	close(fd);
 	connected_friends.erase(fd);
-	pthread_cancel(connected_threads[fd]);
-	connected_threads.erase(fd);
 }
 
 bool hasInviteFrom(const std::string &username)
@@ -661,33 +2232,21 @@ void removeSentInviteTo(const std::string &username)
 	}
 }
 
-void terminateFriendThreads()
-{
-	for (auto itr = connected_threads.begin(); itr != connected_threads.end(); ++itr) {
-		pthread_cancel(itr->second);
-	}
-	connected_threads.clear();
-}
-
 void exitHandler()
 {
 	if (logged_in) {
-		terminateFriendThreads();
 		closeLocalSockets();
 	}
 	close(server_socket);
-	pthread_mutex_destroy(&friend_info_mutex);
-	pthread_mutex_destroy(&received_invites_mutex);
-	pthread_mutex_destroy(&sent_invites_mutex);
-	pthread_mutex_destroy(&connected_friends_mutex);
-	pthread_mutex_destroy(&connected_threads_mutex);
+	close(sweep_timer_fd);
+	close(signal_fd);
+	close(epoll_fd);
 	exit(EXIT_SUCCESS);
 }
 
 void termination_handler(int sig_num)
 {
-	char terminate_cmd[] = "TERMINATE";
-	write(server_socket, terminate_cmd, sizeof(terminate_cmd));
+	sendToServer(Opcode::TERMINATE, "");
 	exitHandler();
 }
 
@@ -699,6 +2258,11 @@ void displayHelp()
 		std::cout << "exit - exit the program\n";
 	} else {
 		std::cout << "message [friend username] [message] - send message to friend\n";
+		std::cout << "sendfile [friend username] [path] - send file to friend\n";
+		std::cout << "create [room] - create chat room and join it\n";
+		std::cout << "join [room] - join chat room\n";
+		std::cout << "leave [room] - leave chat room\n";
+		std::cout << "post [room] [message] - send message to everyone in chat room\n";
 		std::cout << "invite [username] [optional message] - send friend invite\n";
 		std::cout << "accept [username] [optional message] - accept friend invite\n";
 		std::cout << "logout - logout of the server\n";
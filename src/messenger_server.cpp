@@ -1,95 +1,449 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <set>
 #include <sstream>
 #include <string>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "compression.hpp"
+#include "metrics.hpp"
+#include "handoff.hpp"
+#include "outbound_queue.hpp"
+#include "password_workers.hpp"
+#include "presence.hpp"
+#include "presence_batch.hpp"
+#include "protocol.hpp"
+#include "relay.hpp"
+#include "rooms.hpp"
+#include "roster_log.hpp"
+#include "task_queue.hpp"
+#include "timed_mutex.hpp"
+#include "timer_wheel.hpp"
 #include "user.hpp"
+#include "user_directory.hpp"
+#include "user_log.hpp"
+#include "user_store.hpp"
 #include "utils.hpp"
 
+const int MAX_EVENTS = 64;
+// how long a relay token waits for both clients to join
+const int RELAY_TIMEOUT_SECONDS = 30;
+const size_t RELAY_TOKEN_BYTES = 16;
+// presence changes kept for sending rosters as deltas
+const size_t ROSTER_LOG_SIZE = 4096;
+const size_t ROSTER_INSTANCE_BYTES = 8;
+// how long the session of a client whose connection dropped waits for it to
+// come back with a RESUME
+const int RESUME_GRACE_SECONDS = 30;
+const size_t RESUME_TOKEN_BYTES = 16;
+// heartbeat intervals a connection may stay silent before it is dropped
+const int HEARTBEAT_MISSES = 3;
+const char USAGE[] = "usage: ./messenger_server [-o drop|disconnect] [-q max_queued_bytes] [-w presence_window_ms] [-a admin_socket_path] [-t hash_threads] [-r hash_rounds] [-n reactor_threads] [-u handoff_socket_path] [-k heartbeat_seconds] user_info_file port\n";
+
+// what to do when a client falls so far behind that its outbound queue is full
+enum class OverflowPolicy {
+	DROP_OLDEST_PRESENCE,
+	DISCONNECT
+};
+
+struct Connection {
+	// unknown until the client's first bytes arrive
+	WireFormat format;
+	// bytes received that do not yet make up a whole message
+	std::string pending;
+	// messages waiting for the socket to accept them
+	OutboundQueue outbound;
+	// events epoll is currently watching the socket for
+	uint32_t events;
+	// replies held back until the changes they confirm are logged
+	size_t held_replies;
+	// tells connections apart when a file descriptor is reused
+	uint64_t id;
+	// password is being checked by a worker
+	bool logging_in;
+	// HELLO features agreed with a framed protocol client
+	uint32_t features;
+	// null unless compression was agreed; shared so a connection can be
+	// copied to another reactor
+	std::shared_ptr<FrameCompression> compression;
+	// outbound bytes last added to the reactor's queued total
+	size_t reported_bytes;
+	// roster version the client logged in with, empty if it has none
+	std::string roster_version;
+	// token the client may resume its session with once this connection
+	// drops, empty if it was given none
+	std::string resume_token;
+	// when the client last sent anything, by the reactor's timer wheel
+	uint64_t last_received;
+};
+
+// reply held back until the change it confirms is safely in the user log
+struct UncommittedReply {
+	int fd;
+	uint64_t connection_id;
+	Opcode opcode;
+	std::string payload;
+};
+
+// one event loop thread with its own listening socket on the shared port; a
+// connection is only ever touched by the reactor that accepted it, and other
+// threads hand it work through the reactor's task queue
+struct Reactor {
+	size_t index;
+	pthread_t thread;
+	int epoll_fd;
+	int listen_socket;
+	int presence_timer_fd;
+	// ticks once a second to check the connections whose timers expired
+	int heartbeat_timer_fd;
+	TimerWheel timers;
+	TaskQueue tasks;
+	std::map<int, Connection> connections;
+	// connections with queued messages that have not been written yet
+	std::set<int> unflushed_connections;
+	// connections that failed or overflowed, dropped once no fan-out is in progress
+	std::set<int> dropped_connections;
+	PresenceBatch presence_batch;
+	std::multimap<uint64_t, UncommittedReply> uncommitted_replies;
+	Relays relays;
+	bool running;
+	// published for the metrics, which any reactor may format
+	std::atomic<size_t> connection_count;
+	std::atomic<size_t> queued_bytes;
+	std::atomic<size_t> relay_count;
+};
+
+// a message encoded once for each wire format, so fanning it out to many
+// connections only queues references to the same two buffers
+struct SharedMessage {
+	std::shared_ptr<const std::string> framed;
+	std::shared_ptr<const std::string> legacy;
+};
+
+// session kept online after its connection dropped, see parkSession
+struct ParkedSession {
+	std::string token;
+	time_t parked;
+};
+
+// relay handed out to two clients that neither has joined yet, or only one
+struct PendingRelay {
+	time_t created;
+	// first client to join, -1 until one has
+	int fd;
+	uint64_t connection_id;
+	// reactor the first client joined on
+	Reactor *reactor;
+};
+
 void loadUserFile(char*);
-void *handleConnection(void*);
+int openListener(int);
+void openReactor(Reactor*, int);
+void *runReactor(void*);
+void stopReactor();
+void runStoppedReactors();
+void shutdownReactor();
+void publishReactorStats();
+Reactor *ownerOf(int);
+void runOn(Reactor*, const std::function<void()>&);
+void runForUser(const std::string&, const std::function<void(int)>&);
+void acceptConnections();
+void readConnection(int);
+bool readMessages(int, Connection&);
+void dropConnection(int);
+bool parkSession(int);
+bool claimParkedSession(const std::string&, const std::string&);
+void endParkedSession(const std::string&);
+void expireParkedSessions();
+std::string issueResumeToken(Connection&);
+void checkConnections();
+void keepAlive(int);
+uint64_t secondsRunning();
+void forgetConnection(int);
+void handOverConnection(int, Reactor*, const std::function<void(int)>&);
+bool handleConnection(int, const Frame&);
+bool handleCommand(int, const Frame&);
+void sendCommand(int, Opcode, const std::string&);
+void sendPresence(int, Opcode, const std::string&, const std::string&);
+void sendToUser(const std::string&, Opcode, const std::string&);
+void sendPresenceToUser(const std::string&, Opcode, const std::string&, const std::string&);
+void sendPresenceBatches();
+SharedMessage shareMessage(Opcode, const std::string&);
+void sendShared(int, const SharedMessage&);
+void sendSharedToUsers(const std::vector<std::string>&, const SharedMessage&);
+void sendSharedToAll(const SharedMessage&);
+void broadcast(const std::string&);
+void queueMessage(int, const std::shared_ptr<const std::string>&, bool);
+void flushConnections();
+void flushConnection(int);
+bool flushNow(int);
+void expirePendingRelays();
+bool joinRelay(int, const std::string&);
+bool startRelay(int, int, const std::string&);
+void relayConnection(int);
+void notifyCommitted();
+void releaseCommittedReplies(uint64_t);
+void finishPasswordJobs();
+void finishPasswordJob(const PasswordJob&);
+void *compactUserFile(void*);
+std::string serializeUsers();
+std::string locationPayload(const std::string&, const Location&);
+void sendRoster(int, const std::string&, const std::string&);
 std::shared_ptr<User> getUserInfo(const std::string&);
 int getUserFd(const std::string&);
-void writeToUserFile();
+bool writeToUserFile(const std::string&);
 void createFriendship(const std::string&, const std::string&);
 bool isUsernameAvailable(const std::string&);
-bool isUserLoggedIn(const std::string&);
-bool isCorrectLogin(const std::string&, const std::string&);
+void setUnixAddress(const std::string&, struct sockaddr_un&);
+void openAdminSocket();
+void serveAdmin();
+std::string readAdminCommand(int);
+void takeOverServer(HandoffState&);
+void adoptHandoff(const HandoffState&);
+void openHandoffSocket();
+void handOffServer();
+void resumeServing(const std::vector<std::map<int, Relays::End>>&, const std::vector<PasswordJob>&);
+std::string formatMetrics();
 void termination_handler(int);
 
-int server_socket;
-std::set<int> all_connections;
-std::vector<std::shared_ptr<User>> user_info;
-std::map<int, std::shared_ptr<User>> online_users;
+int signal_fd;
+// ticks once a second to end the parked sessions that were not resumed in time
+int resume_timer_fd = -1;
+// how long a connection may be silent before it is probed with a HEARTBEAT,
+// or TCP keepalive for clients that do not know the command
+long heartbeat_seconds = 30;
+// when the server started, on the monotonic clock
+struct timespec started;
+OverflowPolicy overflow_policy = OverflowPolicy::DROP_OLDEST_PRESENCE;
+size_t max_queued_bytes = 256 * 1024;
+// how long presence notifications are collected before being sent, 0 sends
+// each one right away
+long presence_window_ms = 50;
+// local socket that answers every connection with the server's metrics
+std::string admin_socket_path;
+int admin_socket = -1;
+// local socket a new server connects to in order to take over from this one
+std::string handoff_socket_path;
+int handoff_socket = -1;
+// event loop threads sharing the port, 0 for one per core
+size_t reactor_threads = 0;
+std::vector<Reactor*> reactors;
+// reactor that runs on this thread
+thread_local Reactor *this_reactor = nullptr;
+// index of the reactor that owns each open file descriptor
+std::unique_ptr<std::atomic<size_t>[]> fd_owners;
+// CPUs the server may run on, reactors are pinned to them in turn
+std::vector<int> reactor_cpus;
+std::atomic<uint64_t> next_connection_id(1);
+UserDirectory user_info;
+UserLog user_log;
+PasswordWorkers password_workers;
+size_t hash_threads = 0;
+unsigned hash_rounds = DEFAULT_HASH_ROUNDS;
+// usernames whose passwords are being hashed for a registration, guarded by
+// user_info_mutex
+std::set<std::string> registering;
+Presence online_users;
+Rooms rooms;
+RosterLog roster_log(ROSTER_LOG_SIZE);
+std::map<std::string, PendingRelay> pending_relays;
+// parked sessions by username, guarded by session_mutex
+std::map<std::string, ParkedSession> parked_sessions;
 std::string user_filename;
-pthread_mutex_t connections_mutex;
-pthread_mutex_t user_info_mutex;
-pthread_mutex_t online_users_mutex;
+bool binary_user_file = false;
+// held while pending relays are looked up or changed
+TimedMutex relay_mutex("relay_mutex");
+// held while a change to user information is made and logged
+TimedMutex user_info_mutex("user_info_mutex");
+// held while the user file is compacted
+TimedMutex compaction_mutex("compaction_mutex");
+// held while parked sessions are looked up or changed
+TimedMutex session_mutex("session_mutex");
 
 int main(int argc, char *argv[])
 {
-	if (argc != 3) {
-		std::cerr << "usage: ./messenger_server user_info_file port\n";
+	clock_gettime(CLOCK_MONOTONIC, &started);
+
+	int opt;
+	while ((opt = getopt(argc, argv, "o:q:w:a:t:r:n:u:k:")) != -1) {
+		if (opt == 'o' && strcmp(optarg, "drop") == 0) {
+			overflow_policy = OverflowPolicy::DROP_OLDEST_PRESENCE;
+		} else if (opt == 'o' && strcmp(optarg, "disconnect") == 0) {
+			overflow_policy = OverflowPolicy::DISCONNECT;
+		} else if (opt == 'q' && atol(optarg) > 0) {
+			max_queued_bytes = atol(optarg);
+		} else if (opt == 'w' && atol(optarg) >= 0) {
+			presence_window_ms = atol(optarg);
+		} else if (opt == 'a') {
+			admin_socket_path = optarg;
+		} else if (opt == 't' && atol(optarg) > 0) {
+			hash_threads = atol(optarg);
+		} else if (opt == 'r' && atol(optarg) >= 1000) {
+			hash_rounds = atol(optarg);
+		} else if (opt == 'n' && atol(optarg) > 0) {
+			reactor_threads = atol(optarg);
+		} else if (opt == 'u') {
+			handoff_socket_path = optarg;
+		} else if (opt == 'k' && atol(optarg) > 0) {
+			heartbeat_seconds = atol(optarg);
+		} else {
+			std::cerr << USAGE;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (argc - optind != 2) {
+		std::cerr << USAGE;
 		exit(EXIT_FAILURE);
 	}
 
-	signal(SIGINT, termination_handler);
+	// SIGINT is handled by the event loop, so it never interrupts a command
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigprocmask(SIG_BLOCK, &signals, nullptr);
+	if ((signal_fd = signalfd(-1, &signals, 0)) < 0) {
+		std::cerr << "Failed to create signal file descriptor\n";
+		exit(EXIT_FAILURE);
+	}
+	// a client disappearing mid-write must not kill the server
+	signal(SIGPIPE, SIG_IGN);
 
-	int port = atoi(argv[2]);
+	int port = atoi(argv[optind + 1]);
 	socklen_t address_length;
 	char hostname[256];
 	struct addrinfo hints;
 	struct addrinfo *info;
 	struct sockaddr_in address;
 
-	loadUserFile(argv[1]);
-	user_filename = argv[1];
+	// a server already running with the same handoff socket hands everything
+	// over to this one, see handoff.hpp; it has synced the user log and
+	// exited by the time it is done
+	HandoffState inherited;
+	if (!handoff_socket_path.empty()) {
+		takeOverServer(inherited);
+	}
 
-	if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		std::cerr << "Failed to create server socket\n";
+	loadUserFile(argv[optind]);
+	user_filename = argv[optind];
+
+	// changes logged since the user file was last written are applied on
+	// top of it, and left to the next compaction to write into it
+	user_log.replay(user_filename, user_info);
+
+	if (!user_log.start()) {
+		std::cerr << "Failed to start user log for " << user_filename << '\n';
 		exit(EXIT_FAILURE);
 	}
 
-	memset(&address, 0, sizeof(address));
-	address.sin_family = AF_INET;
-	address.sin_port = htons(port);
-	address.sin_addr.s_addr = htonl(INADDR_ANY);
-	address_length = sizeof(address);
-
-	if (bind(server_socket, (struct sockaddr *)&address, address_length) < 0) {
-		std::cerr << "Failed to bind host address to server socket\n";
+	// by default hash passwords on every core
+	if (hash_threads == 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		hash_threads = cores > 0 ? cores : 1;
+	}
+	if (!password_workers.start(hash_threads, hash_rounds)) {
+		std::cerr << "Failed to start password workers\n";
 		exit(EXIT_FAILURE);
 	}
 
-	if (listen(server_socket, 5) < 0) {
-		std::cerr << "Failed to set server socket as passive\n";
+	pthread_t compaction_thread;
+	if (pthread_create(&compaction_thread, nullptr, compactUserFile, nullptr) != 0) {
+		std::cerr << "Failed to create thread for compacting the user log\n";
 		exit(EXIT_FAILURE);
 	}
+	pthread_detach(compaction_thread);
 
-	if (gethostname(hostname, sizeof(hostname)) < 0) {
-		std::cerr << "Failed to get server hostname\n";
+	// by default run a reactor on every core
+	if (reactor_threads == 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		reactor_threads = cores > 0 ? cores : 1;
+	}
+
+	// any reactor may have to find the one a connection belongs to
+	struct rlimit fd_limit;
+	if (getrlimit(RLIMIT_NOFILE, &fd_limit) < 0 || fd_limit.rlim_cur == RLIM_INFINITY) {
+		std::cerr << "Failed to get file descriptor limit\n";
 		exit(EXIT_FAILURE);
 	}
+	fd_owners.reset(new std::atomic<size_t>[fd_limit.rlim_cur]());
+
+	cpu_set_t cpus;
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &cpus)) {
+				reactor_cpus.push_back(cpu);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < reactor_threads; ++i) {
+		Reactor *reactor = new Reactor;
+		reactor->index = i;
+		reactor->running = true;
+		reactor->connection_count.store(0);
+		reactor->queued_bytes.store(0);
+		reactor->relay_count.store(0);
+		reactors.push_back(reactor);
+	}
 
-	if (getsockname(server_socket, (struct sockaddr *)&address, &address_length) < 0) {
+	// the first listening socket binds the port, which the kernel may have
+	// picked, and the others share it; listening sockets handed over by an
+	// old server are used as they are, and a surplus one is closed, which
+	// resets the connections still in its backlog
+	std::vector<int> listeners = inherited.listeners;
+	if (listeners.empty()) {
+		listeners.push_back(openListener(port));
+	}
+	address_length = sizeof(address);
+	if (getsockname(listeners[0], (struct sockaddr *)&address, &address_length) < 0) {
 		std::cerr << "Failed to get address to which server socket is bound\n";
 		exit(EXIT_FAILURE);
 	}
+	port = ntohs(address.sin_port);
+	while (listeners.size() < reactors.size()) {
+		listeners.push_back(openListener(port));
+	}
+	while (listeners.size() > reactors.size()) {
+		close(listeners.back());
+		listeners.pop_back();
+	}
+	for (size_t i = 0; i < reactors.size(); ++i) {
+		openReactor(reactors[i], listeners[i]);
+	}
+	adoptHandoff(inherited);
+
+	if (gethostname(hostname, sizeof(hostname)) < 0) {
+		std::cerr << "Failed to get server hostname\n";
+		exit(EXIT_FAILURE);
+	}
 
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = AF_INET;
@@ -102,298 +456,2064 @@ int main(int argc, char *argv[])
 	}
 
 	std::cout << "Hostname: " << info->ai_canonname << '\n';
-	std::cout << "Port: " << ntohs(address.sin_port) << '\n';
+	std::cout << "Port: " << port << '\n';
 	freeaddrinfo(info);
 
-	struct sockaddr_in client_addr;
-	socklen_t client_addr_len = sizeof(client_addr);
-	int client_socket;
-	pthread_t new_thread;
-	pthread_attr_t attr;
-	pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
-	while (true) {
-		if ((client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_addr_len)) >= 0) {
-			if (pthread_create(&new_thread, &attr, handleConnection, (void*)&client_socket) != 0) {
-				continue;
-			}
-			pthread_mutex_lock(&connections_mutex);
-			all_connections.insert(client_socket);
-			pthread_mutex_unlock(&connections_mutex);
+	// the first reactor runs on the main thread, and also handles what is not
+	// a client: signals, the user log, password workers and the admin socket
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = signal_fd;
+
+	if (epoll_ctl(reactors[0]->epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) < 0) {
+		std::cerr << "Failed to register signal file descriptor with epoll\n";
+		exit(EXIT_FAILURE);
+	}
+
+	event.data.fd = user_log.commitFd();
+
+	if (epoll_ctl(reactors[0]->epoll_fd, EPOLL_CTL_ADD, user_log.commitFd(), &event) < 0) {
+		std::cerr << "Failed to register user log with epoll\n";
+		exit(EXIT_FAILURE);
+	}
+
+	event.data.fd = password_workers.completionFd();
+
+	if (epoll_ctl(reactors[0]->epoll_fd, EPOLL_CTL_ADD, password_workers.completionFd(), &event) < 0) {
+		std::cerr << "Failed to register password workers with epoll\n";
+		exit(EXIT_FAILURE);
+	}
+
+	if ((resume_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+		std::cerr << "Failed to create session timer\n";
+		exit(EXIT_FAILURE);
+	}
+
+	struct itimerspec interval;
+	memset(&interval, 0, sizeof(interval));
+	interval.it_value.tv_sec = 1;
+	interval.it_interval.tv_sec = 1;
+	timerfd_settime(resume_timer_fd, 0, &interval, nullptr);
+
+	event.data.fd = resume_timer_fd;
+
+	if (epoll_ctl(reactors[0]->epoll_fd, EPOLL_CTL_ADD, resume_timer_fd, &event) < 0) {
+		std::cerr << "Failed to register session timer with epoll\n";
+		exit(EXIT_FAILURE);
+	}
+
+	if (!admin_socket_path.empty()) {
+		openAdminSocket();
+	}
+
+	if (!handoff_socket_path.empty()) {
+		openHandoffSocket();
+	}
+
+	for (size_t i = 1; i < reactors.size(); ++i) {
+		if (pthread_create(&reactors[i]->thread, nullptr, runReactor, reactors[i]) != 0) {
+			std::cerr << "Failed to create reactor thread\n";
+			exit(EXIT_FAILURE);
 		}
 	}
+	reactors[0]->thread = pthread_self();
+	runReactor(reactors[0]);
 
 	return EXIT_SUCCESS;
 }
 
-void loadUserFile(char *u_fname)
+int openListener(int port)
 {
-	std::ifstream user_file(u_fname);
+	int listen_socket;
+	if ((listen_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		std::cerr << "Failed to create server socket\n";
+		exit(EXIT_FAILURE);
+	}
 
-	if (!user_file.is_open()) {
-		std::cerr << "Failed to open user information file " << u_fname << '\n';
+	// every reactor listens on the port, and the kernel spreads new
+	// connections between them
+	int reuse = 1;
+	if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+		std::cerr << "Failed to let server sockets share a port\n";
 		exit(EXIT_FAILURE);
 	}
 
-	std::string line;
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if (bind(listen_socket, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		std::cerr << "Failed to bind host address to server socket\n";
+		exit(EXIT_FAILURE);
+	}
+
+	// a burst of clients connecting at once must not overflow the backlog
+	if (listen(listen_socket, SOMAXCONN) < 0) {
+		std::cerr << "Failed to set server socket as passive\n";
+		exit(EXIT_FAILURE);
+	}
+
+	if (setNonBlocking(listen_socket) < 0) {
+		std::cerr << "Failed to make server socket non-blocking\n";
+		exit(EXIT_FAILURE);
+	}
+	return listen_socket;
+}
 
-	/*
-		Each line of a non-empty user file should be in the format: 
+void openReactor(Reactor *reactor, int listen_socket)
+{
+	reactor->listen_socket = listen_socket;
 
-		username|password|friend1;friend2;...;friendN
+	if ((reactor->epoll_fd = epoll_create1(0)) < 0) {
+		std::cerr << "Failed to create epoll instance\n";
+		exit(EXIT_FAILURE);
+	}
 
-	*/
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = reactor->listen_socket;
 
+	if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listen_socket, &event) < 0) {
+		std::cerr << "Failed to register server socket with epoll\n";
+		exit(EXIT_FAILURE);
+	}
 
-	while (getline(user_file, line)) {
-		std::istringstream strm(line);
-		std::string username;
-		std::string password;
-		std::string contact;
-		getline(strm, username, '|');
-		getline(strm, password, '|');
-		std::shared_ptr<User> u(new User(username, password));
-		while (getline(strm, contact, ';')) {
-			u->addFriend(contact);
-		}
-		user_info.push_back(u);
+	if (!reactor->tasks.open()) {
+		std::cerr << "Failed to create reactor task queue\n";
+		exit(EXIT_FAILURE);
 	}
 
-	user_file.close();
-}
+	event.data.fd = reactor->tasks.wakeFd();
 
-void createFriendship(const std::string &user1, const std::string &user2)
-{
-	for (auto itr = user_info.begin(); itr != user_info.end(); ++itr) {
-		if ((*itr)->getUsername() == user1) {
-			(*itr)->addFriend(user2);
-		} else if ((*itr)->getUsername() == user2) {
-			(*itr)->addFriend(user1);
-		}
+	if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->tasks.wakeFd(), &event) < 0) {
+		std::cerr << "Failed to register reactor task queue with epoll\n";
+		exit(EXIT_FAILURE);
+	}
+
+	if ((reactor->presence_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+		std::cerr << "Failed to create presence timer\n";
+		exit(EXIT_FAILURE);
+	}
+
+	event.data.fd = reactor->presence_timer_fd;
+
+	if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->presence_timer_fd, &event) < 0) {
+		std::cerr << "Failed to register presence timer with epoll\n";
+		exit(EXIT_FAILURE);
+	}
+
+	if ((reactor->heartbeat_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+		std::cerr << "Failed to create heartbeat timer\n";
+		exit(EXIT_FAILURE);
+	}
+
+	struct itimerspec interval;
+	memset(&interval, 0, sizeof(interval));
+	interval.it_value.tv_sec = 1;
+	interval.it_interval.tv_sec = 1;
+	timerfd_settime(reactor->heartbeat_timer_fd, 0, &interval, nullptr);
+
+	event.data.fd = reactor->heartbeat_timer_fd;
+
+	if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->heartbeat_timer_fd, &event) < 0) {
+		std::cerr << "Failed to register heartbeat timer with epoll\n";
+		exit(EXIT_FAILURE);
 	}
 }
 
-void *handleConnection(void *sock)
+void *runReactor(void *arg)
 {
-	int socket_fd = *((int*)sock);
-	char response[256];
-	char buffer[256];
+	this_reactor = (Reactor*)arg;
 
-	while (true) {
-		if (read(socket_fd, response, sizeof(response)) > 0) {
-			std::istringstream strm(response);
-			std::string command;
-			strm >> command;
-			if (command == "REGISTER") {
-				std::string username;
-				std::string password;
-				strm >> username >> password;
-				pthread_mutex_lock(&user_info_mutex);
-				if (isUsernameAvailable(username)) {
-					user_info.push_back(std::make_shared<User>(username, password));
-					snprintf(buffer, sizeof(buffer), "REGISTER %s 200", username.c_str());
-				} else {
-					snprintf(buffer, sizeof(buffer), "REGISTER %s 500", username.c_str());
-				}
-				pthread_mutex_unlock(&user_info_mutex);
-				write(socket_fd, buffer, sizeof(buffer));
-			} else if (command == "LOGIN") {
-				std::string username;
-				std::string password;
-				strm >> username >> password;
-				pthread_mutex_lock(&user_info_mutex);
-				if (isCorrectLogin(username, password) && !isUserLoggedIn(username)) {
-					// retrieve stored information about this user, particularly friends
-					pthread_mutex_lock(&online_users_mutex);
-					online_users.insert(std::make_pair(socket_fd, getUserInfo(username)));
-					snprintf(buffer, sizeof(buffer), "LOGIN %s 200", username.c_str());
-					std::cout << "Online users: " << online_users.size() << '\n';
-					pthread_mutex_unlock(&online_users_mutex);
-				} else {
-					snprintf(buffer, sizeof(buffer), "LOGIN %s 500", username.c_str());
-				}
-				pthread_mutex_unlock(&user_info_mutex);
-				write(socket_fd, buffer, sizeof(buffer));
-			} else if (command == "LOCATION") {
-				std::string address;
-				std::string port;
-				strm >> address >> port;
-				char friend_location_buffer[256];
-				// store location information
-				pthread_mutex_lock(&online_users_mutex);
-				online_users[socket_fd]->setAddressInfo(address, port);
-				// exchange location information between client and online friends
-				std::string username = online_users[socket_fd]->getUsername();
-				snprintf(buffer, sizeof(buffer), "LOCATION %s %s %s", username.c_str(), address.c_str(), port.c_str());
-				for (auto itr = online_users.begin(); itr != online_users.end(); ++itr) {
-					int fd = itr->first;
-					if (fd != socket_fd && itr->second->hasFriend(username)) {
-						write(fd, buffer, sizeof(buffer));
-						std::string friend_username = itr->second->getUsername();
-						Location friend_address = itr->second->getAddressInfo();
-						snprintf(friend_location_buffer, sizeof(friend_location_buffer), "LOCATION %s %s %s", friend_username.c_str(), friend_address.hostname.c_str(), friend_address.port.c_str());
-						write(socket_fd, friend_location_buffer, sizeof(friend_location_buffer));
-					}
-				}
-				pthread_mutex_unlock(&online_users_mutex);
-			} else if (command == "INVITE") {
-				std::string potential_friend_username;
-				std::string message;
-				strm >> potential_friend_username;
-				strm.ignore();
-				getline(strm, message);
-				pthread_mutex_lock(&online_users_mutex);
-				int other_fd = getUserFd(potential_friend_username);
-				if (other_fd < 0) {
-					snprintf(buffer, sizeof(buffer), "INVITE_FAILED %s", potential_friend_username.c_str());
-					write(socket_fd, buffer, sizeof(buffer));
-				} else {
-					snprintf(buffer, sizeof(buffer), "INVITE_FROM %s %s", online_users[socket_fd]->getUsername().c_str(), message.c_str());
-					write(other_fd, buffer, sizeof(buffer));
-				}
-				pthread_mutex_unlock(&online_users_mutex);
-			} else if (command == "INVITE_ACCEPT") {
-				std::string inviter_username;
-				std::string message;
-				strm >> inviter_username;
-				strm.ignore();
-				getline(strm, message);
-				pthread_mutex_lock(&online_users_mutex);
-				int inviter_fd = getUserFd(inviter_username);
-				Location inviter_address = online_users[inviter_fd]->getAddressInfo();
-				std::string client_username = online_users[socket_fd]->getUsername();
-				Location client_address = online_users[socket_fd]->getAddressInfo();
-				// let inviter know client has accepted invite
-				snprintf(buffer, sizeof(buffer), "INVITE_ACCEPT %s %s", client_username.c_str(), message.c_str());
-				write(inviter_fd, buffer, sizeof(buffer));
-				// update friend lists
-				createFriendship(inviter_username, client_username);
-				// send location information of inviter to client
-				snprintf(buffer, sizeof(buffer), "LOCATION %s %s %s", inviter_username.c_str(), inviter_address.hostname.c_str(), inviter_address.port.c_str());
-				write(socket_fd, buffer, sizeof(buffer));
-				// send location information of client to inviter
-				snprintf(buffer, sizeof(buffer), "LOCATION %s %s %s", client_username.c_str(), client_address.hostname.c_str(), client_address.port.c_str());
-				write(inviter_fd, buffer, sizeof(buffer));
-				pthread_mutex_unlock(&online_users_mutex);
-			} else if (command == "LOGOUT") {
-				// client is logging out, but server will still maintain connection and thread
-				pthread_mutex_lock(&online_users_mutex);
-				std::string username = online_users[socket_fd]->getUsername();
-				online_users.erase(socket_fd);
-				// inform client's friends that client has logged out
-				snprintf(buffer, sizeof(buffer), "LOGOUT %s", username.c_str());
-				for (auto user_itr = online_users.begin(); user_itr != online_users.end(); ++user_itr) {
-					if (user_itr->second->hasFriend(username)) {
-						write(user_itr->first, buffer, sizeof(buffer));
-					}
+	// keep each reactor on a CPU of its own, as far as there are enough
+	if (!reactor_cpus.empty()) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(reactor_cpus[this_reactor->index % reactor_cpus.size()], &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+
+	// each reactor's event loop services its listening socket and every
+	// client it accepted
+	struct epoll_event events[MAX_EVENTS];
+	while (this_reactor->running) {
+		int num_events = epoll_wait(this_reactor->epoll_fd, events, MAX_EVENTS, -1);
+		if (num_events < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			std::cerr << "Failed to wait for socket events\n";
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < num_events && this_reactor->running; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == this_reactor->listen_socket) {
+				acceptConnections();
+			} else if (fd == this_reactor->tasks.wakeFd()) {
+				this_reactor->tasks.run();
+			} else if (fd == this_reactor->presence_timer_fd) {
+				sendPresenceBatches();
+			} else if (fd == this_reactor->heartbeat_timer_fd) {
+				checkConnections();
+			} else if (fd == signal_fd) {
+				termination_handler(SIGINT);
+			} else if (fd == user_log.commitFd()) {
+				notifyCommitted();
+			} else if (fd == password_workers.completionFd()) {
+				finishPasswordJobs();
+			} else if (fd == resume_timer_fd) {
+				expireParkedSessions();
+			} else if (fd == admin_socket) {
+				serveAdmin();
+			} else if (fd == handoff_socket) {
+				handOffServer();
+			} else if (this_reactor->relays.contains(fd)) {
+				relayConnection(fd);
+			} else {
+				if (events[i].events & EPOLLOUT) {
+					this_reactor->unflushed_connections.insert(fd);
 				}
-				printf("Online users: %lu\n", online_users.size());
-				pthread_mutex_unlock(&online_users_mutex);
-			} else if (command == "EXIT" || command == "TERMINATE") {
-				pthread_mutex_lock(&connections_mutex);
-				all_connections.erase(socket_fd);
-				pthread_mutex_unlock(&connections_mutex);
-				// close client's file descriptor
-				close(socket_fd);
-				pthread_mutex_lock(&online_users_mutex);
-				auto client_itr = online_users.find(socket_fd);
-				if (command == "TERMINATE" && client_itr != online_users.end()) {
-					// if client terminated while logged in, need to inform friends (if any)
-					std::string username = client_itr->second->getUsername();
-					online_users.erase(client_itr);
-					snprintf(buffer, sizeof(buffer), "TERMINATE %s", username.c_str());
-					for (auto user_itr = online_users.begin(); user_itr != online_users.end(); ++user_itr) {
-						if (user_itr->second->hasFriend(username)) {
-							write(user_itr->first, buffer, sizeof(buffer));
-						}
-					}
+				if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+					readConnection(fd);
 				}
-				printf("Online users: %lu\n", online_users.size());
-				pthread_mutex_unlock(&online_users_mutex);
-				// exit thread
-				pthread_exit(nullptr);
 			}
+			// write out whatever handling the event queued, with no locks held
+			flushConnections();
 		}
+		publishReactorStats();
 	}
 	return nullptr;
 }
 
-std::shared_ptr<User> getUserInfo(const std::string &username)
+void stopReactor()
+{
+	// leaves the reactor's state as it is, for another thread to take over
+	this_reactor->running = false;
+}
+
+void runStoppedReactors()
 {
-	// retrieve registered user information
-	for (auto itr = user_info.begin(); itr != user_info.end(); ++itr) {
-		if ((*itr)->getUsername() == username) {
-			return *itr;
+	// with the other reactors stopped, this thread does their work for them
+	// until every task queue stays empty
+	bool ran = true;
+	while (ran) {
+		ran = false;
+		for (auto itr = reactors.begin(); itr != reactors.end(); ++itr) {
+			this_reactor = *itr;
+			ran = this_reactor->tasks.run() || ran;
+			sendPresenceBatches();
+			flushConnections();
 		}
 	}
-	// will never get to this point, since a client needs to successfully
-	// login (to a registered account) for this function to be called
-	return nullptr;
+	this_reactor = reactors[0];
 }
 
-int getUserFd(const std::string &username)
+void shutdownReactor()
+{
+	// inform clients of shutdown, and close sockets
+	sendSharedToAll(shareMessage(Opcode::SHUTDOWN, ""));
+	for (auto itr = this_reactor->connections.begin(); itr != this_reactor->connections.end(); ++itr) {
+		itr->second.outbound.flush(itr->first);
+		close(itr->first);
+	}
+	this_reactor->connections.clear();
+	this_reactor->unflushed_connections.clear();
+	this_reactor->dropped_connections.clear();
+	this_reactor->relays.closeAll();
+
+	close(this_reactor->listen_socket);
+	close(this_reactor->presence_timer_fd);
+	close(this_reactor->heartbeat_timer_fd);
+	close(this_reactor->epoll_fd);
+	this_reactor->running = false;
+}
+
+void publishReactorStats()
+{
+	this_reactor->connection_count.store(this_reactor->connections.size(), std::memory_order_relaxed);
+	this_reactor->relay_count.store(this_reactor->relays.size(), std::memory_order_relaxed);
+}
+
+Reactor *ownerOf(int fd)
+{
+	return reactors[fd_owners[fd].load()];
+}
+
+void runOn(Reactor *reactor, const std::function<void()> &task)
+{
+	// run a task on the reactor that owns what it touches, right away if that
+	// is this one
+	if (reactor == this_reactor) {
+		task();
+	} else {
+		reactor->tasks.push(task);
+	}
+}
+
+void runForUser(const std::string &username, const std::function<void(int)> &task)
 {
-	for (auto itr = online_users.begin(); itr != online_users.end(); ++itr) {
-		if (itr->second->getUsername() == username) {
-			return itr->first;
+	// the reactor that owns a user's connection does the sending; by the time
+	// the task runs there the user may have logged out, or logged in again on
+	// another connection, so it looks the user up once more
+	int fd = online_users.getFd(username);
+	if (fd < 0) {
+		return;
+	}
+	runOn(ownerOf(fd), [username, task]() {
+		int fd = online_users.getFd(username);
+		if (fd >= 0 && this_reactor->connections.count(fd) > 0) {
+			task(fd);
 		}
+	});
+}
+
+void loadUserFile(char *u_fname)
+{
+	// a binary user file is mapped rather than read, so startup does not
+	// depend on how many users there are
+	binary_user_file = isUserStoreFile(u_fname);
+	bool loaded = binary_user_file ? user_info.loadBinary(u_fname) : user_info.loadText(u_fname);
+	if (!loaded) {
+		std::cerr << "Failed to open user information file " << u_fname << '\n';
+		exit(EXIT_FAILURE);
 	}
-	return -1;
 }
 
-bool isUsernameAvailable(const std::string &username)
+void createFriendship(const std::string &user1, const std::string &user2)
+{
+	std::shared_ptr<User> u1 = user_info.find(user1);
+	std::shared_ptr<User> u2 = user_info.find(user2);
+	if (u1 && u2) {
+		u1->addFriend(user2);
+		u2->addFriend(user1);
+	}
+}
+
+void acceptConnections()
+{
+	struct sockaddr_in client_addr;
+	socklen_t client_addr_len = sizeof(client_addr);
+	int client_socket;
+
+	// listening socket is non-blocking, so accept until the backlog is drained
+	while ((client_socket = accept(this_reactor->listen_socket, (struct sockaddr *)&client_addr, &client_addr_len)) >= 0) {
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN | EPOLLRDHUP;
+		event.data.fd = client_socket;
+		if (setNonBlocking(client_socket) < 0 || epoll_ctl(this_reactor->epoll_fd, EPOLL_CTL_ADD, client_socket, &event) < 0) {
+			close(client_socket);
+			continue;
+		}
+		fd_owners[client_socket].store(this_reactor->index);
+		Connection conn;
+		conn.format = WireFormat::UNKNOWN;
+		conn.events = event.events;
+		conn.held_replies = 0;
+		conn.id = next_connection_id++;
+		conn.logging_in = false;
+		conn.features = 0;
+		conn.reported_bytes = 0;
+		conn.last_received = this_reactor->timers.now();
+		this_reactor->connections.insert(std::make_pair(client_socket, conn));
+		this_reactor->timers.schedule(client_socket, conn.id, conn.last_received + heartbeat_seconds);
+		client_addr_len = sizeof(client_addr);
+	}
+}
+
+void readConnection(int socket_fd)
+{
+	// an event for a connection closed earlier in the same batch must not
+	// read from a reused descriptor, which may belong to another reactor
+	auto conn_itr = this_reactor->connections.find(socket_fd);
+	if (conn_itr == this_reactor->connections.end()) {
+		return;
+	}
+
+	char chunk[4096];
+	ssize_t bytes_read = read(socket_fd, chunk, sizeof(chunk));
+
+	if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+
+	if (bytes_read > 0) {
+		recordBytesReceived(bytes_read);
+		conn_itr->second.last_received = this_reactor->timers.now();
+		conn_itr->second.pending.append(chunk, bytes_read);
+		readMessages(socket_fd, conn_itr->second);
+		return;
+	}
+
+	if (conn_itr->second.format == WireFormat::LEGACY && !conn_itr->second.pending.empty()) {
+		// client has closed its end of the connection; a text protocol client
+		// interrupted with SIGINT writes a short TERMINATE just before closing
+		Frame frame = parseLegacyCommand(conn_itr->second.pending.c_str());
+		if (!handleConnection(socket_fd, frame)) {
+			return;
+		}
+	}
+	dropConnection(socket_fd);
+}
+
+bool readMessages(int socket_fd, Connection &conn)
 {
-	for (auto itr = user_info.begin(); itr != user_info.end(); ++itr) {
-		if ((*itr)->getUsername() == username) {
+	// handle every whole message received so far, returns false if the
+	// connection was closed along the way; frames are handled where they lie
+	// in pending, which is only trimmed once they all have been
+	std::string &pending = conn.pending;
+	size_t offset = 0;
+
+	if (conn.format == WireFormat::UNKNOWN) {
+		conn.format = detectWireFormat(pending.data(), pending.size());
+		if (conn.format == WireFormat::UNKNOWN) {
+			return true;
+		}
+		if (conn.format == WireFormat::FRAMED) {
+			// client opened with a HELLO, answer with the version to use
+			Hello hello;
+			if (!decodeHello(pending.data(), pending.size(), hello)) {
+				conn.format = WireFormat::UNKNOWN;
+				return true;
+			}
+			Hello reply;
+			reply.min_version = reply.max_version = negotiateVersion(hello);
+			reply.features = hello.features & SUPPORTED_FEATURES;
+			conn.features = reply.features;
+			queueMessage(socket_fd, std::make_shared<const std::string>(encodeHello(reply)), false);
+			if (reply.max_version == 0) {
+				// nothing in common, fall back to the text protocol
+				conn.format = WireFormat::LEGACY;
+			} else if (conn.features & FEATURE_COMPRESSION) {
+				conn.compression = std::make_shared<FrameCompression>();
+			}
+			offset = HELLO_SIZE;
+		}
+	}
+
+	if (conn.format == WireFormat::FRAMED) {
+		Frame frame;
+		int status = 0;
+		while (!conn.logging_in && (status = decodeFrame(pending, offset, frame)) > 0) {
+			if ((uint8_t)frame.opcode & COMPRESSED_FRAME) {
+				CompressionStats stats = CompressionStats();
+				if (!conn.compression || !conn.compression->decompress(frame, stats)) {
+					status = -1;
+					break;
+				}
+				recordDecompression(stats);
+			}
+			if (!handleConnection(socket_fd, frame)) {
+				return false;
+			}
+		}
+		if (status < 0) {
+			// client sent a frame it is not allowed to, or one that does not
+			// decompress
+			dropConnection(socket_fd);
 			return false;
 		}
+	} else {
+		while (!conn.logging_in && pending.size() - offset >= LEGACY_COMMAND_SIZE) {
+			Frame frame = parseLegacyCommand(pending.data() + offset, LEGACY_COMMAND_SIZE);
+			offset += LEGACY_COMMAND_SIZE;
+			if (!handleConnection(socket_fd, frame)) {
+				return false;
+			}
+		}
 	}
+	pending.erase(0, offset);
 	return true;
 }
 
-bool isUserLoggedIn(const std::string &username)
+void dropConnection(int socket_fd)
 {
-	// check if a user with username is already logged in
-	for (auto itr = online_users.begin(); itr != online_users.end(); ++itr) {
-		if (itr->second->getUsername() == username) {
-			return true;
+	// treat a connection that is gone as a client that terminated, unless
+	// its session is kept for the client to resume
+	if (parkSession(socket_fd)) {
+		return;
+	}
+	Frame terminate;
+	terminate.opcode = Opcode::TERMINATE;
+	handleConnection(socket_fd, terminate);
+}
+
+bool parkSession(int socket_fd)
+{
+	// a client that was given a resume token keeps its session for a while
+	// after its connection drops, and its friends are only told if it does
+	// not come back in time, see expireParkedSessions
+	auto conn_itr = this_reactor->connections.find(socket_fd);
+	if (conn_itr == this_reactor->connections.end() || conn_itr->second.resume_token.empty()) {
+		return false;
+	}
+	std::shared_ptr<User> client = online_users.getUser(socket_fd);
+	if (!client || !online_users.park(socket_fd)) {
+		return false;
+	}
+	// the session is parked before its token is published, so a RESUME
+	// never finds a token for a session it can not take over yet
+	ParkedSession parked;
+	parked.token = conn_itr->second.resume_token;
+	parked.parked = time(nullptr);
+	session_mutex.lock();
+	parked_sessions[client->getUsername()] = parked;
+	session_mutex.unlock();
+	forgetConnection(socket_fd);
+	epoll_ctl(this_reactor->epoll_fd, EPOLL_CTL_DEL, socket_fd, nullptr);
+	close(socket_fd);
+	printf("Online users: %lu\n", online_users.size());
+	return true;
+}
+
+bool claimParkedSession(const std::string &username, const std::string &token)
+{
+	// take a session out of the grace window if it is parked with the token
+	// given, or with any token if none is given; only one caller gets it
+	session_mutex.lock();
+	auto itr = parked_sessions.find(username);
+	bool claimed = itr != parked_sessions.end() && (token.empty() || itr->second.token == token);
+	if (claimed) {
+		parked_sessions.erase(itr);
+	}
+	session_mutex.unlock();
+	return claimed;
+}
+
+void endParkedSession(const std::string &username)
+{
+	// a claimed session that is not resumed ends as if its client had
+	// terminated
+	std::shared_ptr<const FriendSet> friends = online_users.getOnlineFriends(username);
+	if (!online_users.expire(username)) {
+		return;
+	}
+	friends->forEach([&username](const std::string &friend_username, bool) {
+		sendPresenceToUser(friend_username, Opcode::TERMINATE, username, username);
+	});
+	rooms.leaveAll(username);
+	roster_log.record(username);
+}
+
+void expireParkedSessions()
+{
+	uint64_t expirations;
+	while (read(resume_timer_fd, &expirations, sizeof(expirations)) > 0) {
+	}
+	time_t now = time(nullptr);
+	std::vector<std::string> expired;
+	session_mutex.lock();
+	for (auto itr = parked_sessions.begin(); itr != parked_sessions.end();) {
+		if (now - itr->second.parked > RESUME_GRACE_SECONDS) {
+			expired.push_back(itr->first);
+			itr = parked_sessions.erase(itr);
+		} else {
+			++itr;
 		}
 	}
-	return false;
+	session_mutex.unlock();
+	for (auto itr = expired.begin(); itr != expired.end(); ++itr) {
+		endParkedSession(*itr);
+	}
 }
 
-bool isCorrectLogin(const std::string &username, const std::string &password)
+std::string issueResumeToken(Connection &conn)
 {
-	for (auto itr = user_info.begin(); itr != user_info.end(); ++itr) {
-		if ((*itr)->getUsername() == username && (*itr)->getPassword() == password) {
-			return true;
+	// a new token for every login and resume, as each is only good once;
+	// returns it as the end of the reply, empty if the client did not agree
+	// to resuming sessions
+	conn.resume_token.clear();
+	if (conn.features & FEATURE_RESUME) {
+		conn.resume_token = createToken(RESUME_TOKEN_BYTES);
+	}
+	return conn.resume_token.empty() ? "" : " " + conn.resume_token;
+}
+
+void checkConnections()
+{
+	// every connection has a timer that expires once it may have gone
+	// silent; one that has is probed with a HEARTBEAT each interval, and
+	// dropped like any connection that is gone after HEARTBEAT_MISSES
+	// intervals, so its friends are told or its session is parked
+	uint64_t expirations;
+	while (read(this_reactor->heartbeat_timer_fd, &expirations, sizeof(expirations)) > 0) {
+	}
+	std::vector<TimerWheel::Timer> expired;
+	this_reactor->timers.advance(secondsRunning(), expired);
+	uint64_t now = this_reactor->timers.now();
+	for (auto itr = expired.begin(); itr != expired.end(); ++itr) {
+		// the timer of a connection that has since closed, or moved to
+		// another reactor, stands for nothing
+		auto conn_itr = this_reactor->connections.find(itr->fd);
+		if (conn_itr == this_reactor->connections.end() || conn_itr->second.id != itr->id) {
+			continue;
+		}
+		Connection &conn = conn_itr->second;
+		bool heartbeats = conn.format == WireFormat::FRAMED && (conn.features & FEATURE_HEARTBEAT);
+		uint64_t silent = now - conn.last_received;
+		if ((heartbeats || conn.format == WireFormat::UNKNOWN) && silent >= (uint64_t)(HEARTBEAT_MISSES * heartbeat_seconds)) {
+			recordSilentConnection();
+			dropConnection(itr->fd);
+		} else if (heartbeats && silent >= (uint64_t)heartbeat_seconds) {
+			sendCommand(itr->fd, Opcode::HEARTBEAT, std::to_string(heartbeat_seconds));
+			this_reactor->timers.schedule(itr->fd, itr->id, now + heartbeat_seconds);
+		} else if (heartbeats || conn.format == WireFormat::UNKNOWN) {
+			this_reactor->timers.schedule(itr->fd, itr->id, conn.last_received + heartbeat_seconds);
+		} else {
+			// a client that can not answer a probe is left to the kernel
+			keepAlive(itr->fd);
 		}
 	}
-	return false;
 }
 
-void termination_handler(int sig_num)
+void keepAlive(int fd)
+{
+	// have the kernel probe a connection once it has been idle for the
+	// heartbeat interval, and reset it after HEARTBEAT_MISSES probes go
+	// unanswered, which the connection's next read reports
+	int on = 1;
+	int seconds = heartbeat_seconds;
+	int probes = HEARTBEAT_MISSES;
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &seconds, sizeof(seconds));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &seconds, sizeof(seconds));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+}
+
+uint64_t secondsRunning()
+{
+	// the clock the timer wheels tick by
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec - started.tv_sec;
+}
+
+void forgetConnection(int socket_fd)
 {
-	// write user information to file
-	std::ofstream user_file(user_filename);
-	for (auto itr = user_info.begin(); itr != user_info.end(); ++itr) {
-		user_file << (*itr)->infoToString() << '\n';
+	// stop keeping track of a connection this reactor no longer handles
+	auto conn_itr = this_reactor->connections.find(socket_fd);
+	if (conn_itr != this_reactor->connections.end()) {
+		this_reactor->queued_bytes -= conn_itr->second.reported_bytes;
+		this_reactor->connections.erase(conn_itr);
 	}
-	user_file.close();
+	this_reactor->unflushed_connections.erase(socket_fd);
+	this_reactor->dropped_connections.erase(socket_fd);
+	this_reactor->presence_batch.forget(socket_fd);
+}
 
-	// inform clients of shutdown, and close sockets
-	char shutdown_cmd[] = "SHUTDOWN";
-	for (auto itr = all_connections.begin(); itr != all_connections.end(); ++itr) {
-		write(*itr, shutdown_cmd, sizeof(shutdown_cmd));
-		close(*itr);
+void handOverConnection(int socket_fd, Reactor *reactor, const std::function<void(int)> &then)
+{
+	// move a connection to another reactor, which carries on with it; a
+	// client sends nothing after the command that moves it until it is
+	// answered, so there is no pending input to take along
+	auto conn_itr = this_reactor->connections.find(socket_fd);
+	if (conn_itr == this_reactor->connections.end()) {
+		return;
 	}
+	Connection conn = conn_itr->second;
+	conn.pending.clear();
+	conn.reported_bytes = 0;
+	epoll_ctl(this_reactor->epoll_fd, EPOLL_CTL_DEL, socket_fd, nullptr);
+	forgetConnection(socket_fd);
+	fd_owners[socket_fd].store(reactor->index);
+	reactor->tasks.push([socket_fd, conn, then]() {
+		// the connection's timer stays behind with the reactor it leaves
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = conn.events;
+		event.data.fd = socket_fd;
+		if (epoll_ctl(this_reactor->epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) < 0) {
+			close(socket_fd);
+			return;
+		}
+		this_reactor->connections.insert(std::make_pair(socket_fd, conn));
+		this_reactor->unflushed_connections.insert(socket_fd);
+		this_reactor->timers.schedule(socket_fd, conn.id, conn.last_received + heartbeat_seconds);
+		then(socket_fd);
+	});
+}
 
-	close(server_socket);
+bool handleConnection(int socket_fd, const Frame &frame)
+{
+	// time every command, however it ends
+	struct timespec start;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bool open = handleCommand(socket_fd, frame);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	recordCommand(frame.opcode, (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec);
+	return open;
+}
+
+bool handleCommand(int socket_fd, const Frame &frame)
+{
+	PayloadReader strm(frame.payload);
+	Opcode command = frame.opcode;
+	if (command == Opcode::REGISTER) {
+		std::string username;
+		std::string password;
+		strm >> username >> password;
+		// the user is added once a worker has hashed the password, see
+		// finishPasswordJob; the username is claimed under the lock, so two
+		// reactors can not both take it
+		user_info_mutex.lock();
+		bool available = isUsernameAvailable(username);
+		if (available) {
+			registering.insert(username);
+		}
+		user_info_mutex.unlock();
+		if (available) {
+			PasswordJob job;
+			job.kind = PasswordJob::HASH;
+			job.fd = socket_fd;
+			job.connection_id = this_reactor->connections[socket_fd].id;
+			job.username = username;
+			job.password = password;
+			password_workers.submit(job);
+			this_reactor->connections[socket_fd].held_replies++;
+			this_reactor->unflushed_connections.insert(socket_fd);
+		} else {
+			sendCommand(socket_fd, Opcode::REGISTER, username + " 500");
+		}
+	} else if (command == Opcode::LOGIN) {
+		std::string username;
+		std::string password;
+		std::string roster_version;
+		strm >> username >> password >> roster_version;
+		// logging in fails if the user is already logged in, other than in a
+		// parked session; the password is checked by a worker, see
+		// finishPasswordJob
+		std::shared_ptr<User> user = getUserInfo(username);
+		Connection &conn = this_reactor->connections[socket_fd];
+		if (user && !conn.logging_in && (!online_users.isOnline(username) || online_users.isParked(username))) {
+			PasswordJob job;
+			job.kind = PasswordJob::VERIFY;
+			job.fd = socket_fd;
+			job.connection_id = conn.id;
+			job.username = username;
+			job.password = password;
+			job.stored = user->getPassword();
+			password_workers.submit(job);
+			conn.logging_in = true;
+			conn.held_replies++;
+			conn.roster_version = roster_version;
+			this_reactor->unflushed_connections.insert(socket_fd);
+		} else {
+			sendCommand(socket_fd, Opcode::LOGIN, username + " 500");
+		}
+	} else if (command == Opcode::RESUME) {
+		std::string username;
+		std::string token;
+		std::string roster_version;
+		strm >> username >> token >> roster_version;
+		// a parked session carries on on this connection, with its location,
+		// friends and rooms, no credentials checked and nothing sent to friends
+		Connection &conn = this_reactor->connections[socket_fd];
+		if (!token.empty() && !conn.logging_in && !online_users.getUser(socket_fd) && claimParkedSession(username, token)) {
+			if (online_users.resume(username, socket_fd)) {
+				sendCommand(socket_fd, Opcode::RESUME, username + " 200" + issueResumeToken(conn));
+				// presence sent while the session was parked went nowhere
+				if (conn.features & FEATURE_ROSTER) {
+					sendRoster(socket_fd, username, roster_version);
+				}
+				printf("Online users: %lu\n", online_users.size());
+				return true;
+			}
+			endParkedSession(username);
+		}
+		sendCommand(socket_fd, Opcode::RESUME, username + " 500");
+	} else if (command == Opcode::LOCATION) {
+		std::string address;
+		std::string port;
+		unsigned version = 0;
+		strm >> address >> port >> version;
+		// store location information
+		Location client_address;
+		client_address.hostname = address;
+		client_address.port = port;
+		client_address.version = version;
+		client_address.family = 0;
+		std::shared_ptr<User> client = online_users.getUser(socket_fd);
+		if (!client) {
+			return true;
+		}
+		// friends are given the address the client is seen from, so they
+		// connect to it without looking up a name
+		struct sockaddr_storage peer_address;
+		socklen_t peer_address_length = sizeof(peer_address);
+		char numeric_host[NI_MAXHOST];
+		if (getpeername(socket_fd, (struct sockaddr *)&peer_address, &peer_address_length) == 0 && getnameinfo((struct sockaddr *)&peer_address, peer_address_length, numeric_host, sizeof(numeric_host), nullptr, 0, NI_NUMERICHOST) == 0) {
+			client_address.hostname = numeric_host;
+			client_address.family = peer_address.ss_family;
+		}
+		online_users.setLocation(socket_fd, client_address);
+		std::string username = client->getUsername();
+		roster_log.record(username);
+		// exchange location information between client and online friends;
+		// a client that got a roster at login already has theirs
+		bool has_roster = this_reactor->connections[socket_fd].features & FEATURE_ROSTER;
+		std::string location = locationPayload(username, client_address);
+		online_users.getOnlineFriends(username)->forEach([&](const std::string &friend_username, bool) {
+			std::shared_ptr<const Session> session = online_users.getSession(friend_username);
+			if (session) {
+				sendPresenceToUser(friend_username, Opcode::LOCATION, username, location);
+				if (!has_roster) {
+					sendPresence(socket_fd, Opcode::LOCATION, friend_username, locationPayload(friend_username, session->location));
+				}
+			}
+		});
+	} else if (command == Opcode::INVITE) {
+		std::string potential_friend_username;
+		// left in the receive buffer, it is only copied into what is sent
+		TextView message;
+		strm >> potential_friend_username;
+		strm.ignore();
+		strm.getLine(message);
+		std::shared_ptr<User> client = online_users.getUser(socket_fd);
+		if (!client) {
+			return true;
+		}
+		int other_fd = getUserFd(potential_friend_username);
+		if (other_fd < 0) {
+			sendCommand(socket_fd, Opcode::INVITE_FAILED, potential_friend_username);
+		} else {
+			sendToUser(potential_friend_username, Opcode::INVITE_FROM, client->getUsername() + " " + message);
+		}
+	} else if (command == Opcode::INVITE_ACCEPT) {
+		std::string inviter_username;
+		TextView message;
+		strm >> inviter_username;
+		strm.ignore();
+		strm.getLine(message);
+		std::shared_ptr<const Session> inviter = online_users.getSession(inviter_username);
+		std::shared_ptr<const Session> client = online_users.getSession(socket_fd);
+		if (!inviter || !client) {
+			// inviter logged out before the invite was accepted
+			return true;
+		}
+		Location inviter_address = inviter->location;
+		std::string client_username = client->user->getUsername();
+		Location client_address = client->location;
+		// update friend lists; the change is logged while user_info_mutex
+		// keeps a compaction from rotating the log in between, and is not
+		// made if the log refuses it
+		user_info_mutex.lock();
+		bool logged = user_log.logFriendship(inviter_username, client_username) != 0;
+		if (logged) {
+			createFriendship(inviter_username, client_username);
+		}
+		user_info_mutex.unlock();
+		if (!logged) {
+			std::cerr << "Failed to log friendship of " << inviter_username << " and " << client_username << '\n';
+			return true;
+		}
+		// let inviter know client has accepted invite
+		sendToUser(inviter_username, Opcode::INVITE_ACCEPT, client_username + " " + message);
+		online_users.addFriendship(inviter_username, client_username);
+		roster_log.record(inviter_username);
+		roster_log.record(client_username);
+		// send location information of inviter to client
+		sendPresence(socket_fd, Opcode::LOCATION, inviter_username, locationPayload(inviter_username, inviter_address));
+		// send location information of client to inviter
+		sendPresenceToUser(inviter_username, Opcode::LOCATION, client_username, locationPayload(client_username, client_address));
+	} else if (command == Opcode::RELAY) {
+		// client can not connect to a friend directly, so hand both of them a
+		// token to join a relayed connection with
+		std::string friend_username;
+		strm >> friend_username;
+		std::shared_ptr<User> client = online_users.getUser(socket_fd);
+		int friend_fd = getUserFd(friend_username);
+		std::string token = createToken(RELAY_TOKEN_BYTES);
+		if (client && friend_fd >= 0 && !token.empty() && online_users.getOnlineFriends(client->getUsername())->contains(friend_username)) {
+			relay_mutex.lock();
+			expirePendingRelays();
+			PendingRelay relay;
+			relay.created = time(nullptr);
+			relay.fd = -1;
+			relay.connection_id = 0;
+			relay.reactor = nullptr;
+			pending_relays.insert(std::make_pair(token, relay));
+			relay_mutex.unlock();
+			sendToUser(friend_username, Opcode::RELAY_FROM, client->getUsername() + " " + token);
+			sendCommand(socket_fd, Opcode::RELAY, friend_username + " 200 " + token);
+		} else {
+			sendCommand(socket_fd, Opcode::RELAY, friend_username + " 500");
+		}
+	} else if (command == Opcode::RELAY_JOIN) {
+		std::string token;
+		strm >> token;
+		return joinRelay(socket_fd, token);
+	} else if (command == Opcode::ROOM_CREATE || command == Opcode::ROOM_JOIN || command == Opcode::ROOM_LEAVE) {
+		std::string room;
+		strm >> room;
+		std::shared_ptr<User> client = online_users.getUser(socket_fd);
+		if (!client) {
+			return true;
+		}
+		std::string username = client->getUsername();
+		bool done;
+		if (command == Opcode::ROOM_CREATE) {
+			done = !room.empty() && rooms.create(room, username);
+		} else if (command == Opcode::ROOM_JOIN) {
+			done = rooms.join(room, username);
+		} else {
+			done = rooms.leave(room, username);
+		}
+		sendCommand(socket_fd, command, room + (done ? " 200" : " 500"));
+	} else if (command == Opcode::ROOM_POST) {
+		std::string room;
+		TextView message;
+		strm >> room;
+		strm.ignore();
+		strm.getLine(message);
+		std::shared_ptr<User> client = online_users.getUser(socket_fd);
+		if (!client) {
+			return true;
+		}
+		// only members may post, and the post goes to every other member
+		std::string username = client->getUsername();
+		std::shared_ptr<const MemberSet> members = rooms.getMembers(room);
+		if (!members || members->count(username) == 0) {
+			sendCommand(socket_fd, Opcode::ROOM_POST, room + " 500");
+			return true;
+		}
+		std::vector<std::string> recipients;
+		for (auto itr = members->begin(); itr != members->end(); ++itr) {
+			if (*itr != username) {
+				recipients.push_back(*itr);
+			}
+		}
+		sendSharedToUsers(recipients, shareMessage(Opcode::ROOM_MESSAGE, room + " " + username + " " + message));
+	} else if (command == Opcode::STATS) {
+		sendCommand(socket_fd, Opcode::STATS, formatMetrics());
+	} else if (command == Opcode::HEARTBEAT) {
+		// a probe carries the client's interval, an answer to one of ours
+		// nothing; either way the connection is known to be alive
+		if (!frame.payload.empty()) {
+			sendCommand(socket_fd, Opcode::HEARTBEAT, "");
+		}
+	} else if (command == Opcode::LOGOUT) {
+		// client is logging out, but server will still maintain connection
+		std::shared_ptr<User> client = online_users.getUser(socket_fd);
+		if (!client) {
+			return true;
+		}
+		std::string username = client->getUsername();
+		// inform client's friends that client has logged out
+		online_users.getOnlineFriends(username)->forEach([&username](const std::string &friend_username, bool) {
+			sendPresenceToUser(friend_username, Opcode::LOGOUT, username, username);
+		});
+		rooms.leaveAll(username);
+		online_users.logout(socket_fd);
+		roster_log.record(username);
+		this_reactor->connections[socket_fd].resume_token.clear();
+		printf("Online users: %lu\n", online_users.size());
+	} else if (command == Opcode::EXIT || command == Opcode::TERMINATE) {
+		std::shared_ptr<User> client = online_users.getUser(socket_fd);
+		if (command == Opcode::TERMINATE && client) {
+			// if client terminated while logged in, need to inform friends (if any)
+			std::string username = client->getUsername();
+			online_users.getOnlineFriends(username)->forEach([&username](const std::string &friend_username, bool) {
+				sendPresenceToUser(friend_username, Opcode::TERMINATE, username, username);
+			});
+		}
+		if (client) {
+			rooms.leaveAll(client->getUsername());
+		}
+		// the session ends before the descriptor is closed, so a reactor that
+		// accepts a connection on the same descriptor never finds it
+		online_users.logout(socket_fd);
+		if (client) {
+			roster_log.record(client->getUsername());
+		}
+		forgetConnection(socket_fd);
+		// stop watching and close client's file descriptor
+		epoll_ctl(this_reactor->epoll_fd, EPOLL_CTL_DEL, socket_fd, nullptr);
+		close(socket_fd);
+		printf("Online users: %lu\n", online_users.size());
+		return false;
+	}
+	return true;
+}
+
+void sendCommand(int fd, Opcode opcode, const std::string &payload)
+{
+	// encode the command in whichever protocol the client speaks
+	auto conn_itr = this_reactor->connections.find(fd);
+	if (conn_itr == this_reactor->connections.end()) {
+		return;
+	}
+	bool presence = opcode == Opcode::LOCATION || opcode == Opcode::LOGOUT || opcode == Opcode::TERMINATE;
+	queueMessage(fd, std::make_shared<const std::string>(encodeMessage(conn_itr->second.format, opcode, payload)), presence);
+}
+
+void sendPresence(int fd, Opcode opcode, const std::string &username, const std::string &payload)
+{
+	// presence notifications are collected for a short window, so a client
+	// whose friends all reconnect at once gets them in one batch
+	if (presence_window_ms == 0) {
+		sendCommand(fd, opcode, payload);
+		return;
+	}
+	if (this_reactor->presence_batch.add(fd, opcode, username, payload)) {
+		struct itimerspec window;
+		memset(&window, 0, sizeof(window));
+		window.it_value.tv_sec = presence_window_ms / 1000;
+		window.it_value.tv_nsec = presence_window_ms % 1000 * 1000000;
+		timerfd_settime(this_reactor->presence_timer_fd, 0, &window, nullptr);
+	}
+}
+
+void sendToUser(const std::string &username, Opcode opcode, const std::string &payload)
+{
+	runForUser(username, [opcode, payload](int fd) {
+		sendCommand(fd, opcode, payload);
+	});
+}
+
+void sendPresenceToUser(const std::string &username, Opcode opcode, const std::string &subject, const std::string &payload)
+{
+	runForUser(username, [opcode, subject, payload](int fd) {
+		sendPresence(fd, opcode, subject, payload);
+	});
+}
+
+void sendPresenceBatches()
+{
+	uint64_t expirations;
+	while (read(this_reactor->presence_timer_fd, &expirations, sizeof(expirations)) > 0) {
+	}
+	std::map<int, std::vector<PresenceBatch::Event>> batches = this_reactor->presence_batch.take();
+	for (auto itr = batches.begin(); itr != batches.end(); ++itr) {
+		auto conn_itr = this_reactor->connections.find(itr->first);
+		if (conn_itr == this_reactor->connections.end() || itr->second.empty()) {
+			continue;
+		}
+		const std::vector<PresenceBatch::Event> &events = itr->second;
+		if (conn_itr->second.format == WireFormat::FRAMED && (conn_itr->second.features & FEATURE_PRESENCE_BATCH) && events.size() > 1) {
+			// one frame holding every notification, a line each, unless
+			// they do not fit in one
+			std::string lines;
+			for (auto event_itr = events.begin(); event_itr != events.end(); ++event_itr) {
+				std::string line = std::string(opcodeName(event_itr->opcode)) + " " + event_itr->payload + "\n";
+				if (lines.size() + line.size() > MAX_FRAME_PAYLOAD) {
+					queueMessage(itr->first, std::make_shared<const std::string>(encodeFrame(Opcode::PRESENCE, lines)), true);
+					lines.clear();
+				}
+				lines += line;
+			}
+			queueMessage(itr->first, std::make_shared<const std::string>(encodeFrame(Opcode::PRESENCE, lines)), true);
+		} else {
+			for (auto event_itr = events.begin(); event_itr != events.end(); ++event_itr) {
+				sendCommand(itr->first, event_itr->opcode, event_itr->payload);
+			}
+		}
+	}
+}
+
+SharedMessage shareMessage(Opcode opcode, const std::string &payload)
+{
+	SharedMessage message;
+	message.framed = std::make_shared<const std::string>(encodeMessage(WireFormat::FRAMED, opcode, payload));
+	message.legacy = std::make_shared<const std::string>(encodeMessage(WireFormat::LEGACY, opcode, payload));
+	return message;
+}
+
+void sendShared(int fd, const SharedMessage &message)
+{
+	auto conn_itr = this_reactor->connections.find(fd);
+	if (conn_itr == this_reactor->connections.end()) {
+		return;
+	}
+	queueMessage(fd, conn_itr->second.format == WireFormat::FRAMED ? message.framed : message.legacy, false);
+}
+
+void sendSharedToUsers(const std::vector<std::string> &usernames, const SharedMessage &message)
+{
+	// every reactor gets one task for all of the users it serves, which
+	// looks them up again as they may have moved on in the meantime
+	std::map<Reactor*, std::shared_ptr<std::vector<std::string>>> by_reactor;
+	for (auto itr = usernames.begin(); itr != usernames.end(); ++itr) {
+		int fd = online_users.getFd(*itr);
+		if (fd < 0) {
+			continue;
+		}
+		std::shared_ptr<std::vector<std::string>> &served = by_reactor[ownerOf(fd)];
+		if (!served) {
+			served = std::make_shared<std::vector<std::string>>();
+		}
+		served->push_back(*itr);
+	}
+	for (auto itr = by_reactor.begin(); itr != by_reactor.end(); ++itr) {
+		std::shared_ptr<const std::vector<std::string>> served = itr->second;
+		runOn(itr->first, [served, message]() {
+			for (auto user_itr = served->begin(); user_itr != served->end(); ++user_itr) {
+				int fd = online_users.getFd(*user_itr);
+				if (fd >= 0) {
+					sendShared(fd, message);
+				}
+			}
+		});
+	}
+}
+
+void sendSharedToAll(const SharedMessage &message)
+{
+	// every connection of this reactor, logged in or not
+	for (auto itr = this_reactor->connections.begin(); itr != this_reactor->connections.end(); ++itr) {
+		queueMessage(itr->first, itr->second.format == WireFormat::FRAMED ? message.framed : message.legacy, false);
+	}
+}
+
+void broadcast(const std::string &text)
+{
+	// an announcement from the operator goes to every client on every reactor
+	SharedMessage message = shareMessage(Opcode::BROADCAST, text);
+	for (auto itr = reactors.begin(); itr != reactors.end(); ++itr) {
+		runOn(*itr, [message]() {
+			sendSharedToAll(message);
+		});
+	}
+}
+
+void queueMessage(int fd, const std::shared_ptr<const std::string> &message, bool presence)
+{
+	// messages are only queued here, and written by flushConnections once
+	// no locks are held
+	auto conn_itr = this_reactor->connections.find(fd);
+	if (conn_itr == this_reactor->connections.end()) {
+		return;
+	}
+	OutboundQueue &outbound = conn_itr->second.outbound;
+	if (outbound.bytes() + message->size() > max_queued_bytes) {
+		if (overflow_policy == OverflowPolicy::DROP_OLDEST_PRESENCE) {
+			outbound.dropPresence(outbound.bytes() + message->size() - max_queued_bytes);
+		}
+		if (outbound.bytes() + message->size() > max_queued_bytes) {
+			// client is not keeping up, so let it go
+			this_reactor->dropped_connections.insert(fd);
+			return;
+		}
+	}
+	std::shared_ptr<FrameCompression> &compression = conn_itr->second.compression;
+	if (compression && compression->worthCompressing(*message)) {
+		std::string frame = *message;
+		CompressionStats stats = CompressionStats();
+		if (compression->compress(frame, stats)) {
+			// a compressed frame continues the stream, so it can not be
+			// dropped like presence normally can
+			recordCompression(stats);
+			outbound.push(std::make_shared<const std::string>(frame), false);
+			this_reactor->unflushed_connections.insert(fd);
+			return;
+		}
+	}
+	outbound.push(message, presence);
+	this_reactor->unflushed_connections.insert(fd);
+}
+
+void flushConnections()
+{
+	// dropping a connection tells its friends, which queues more messages
+	while (!this_reactor->unflushed_connections.empty() || !this_reactor->dropped_connections.empty()) {
+		std::set<int> unflushed;
+		unflushed.swap(this_reactor->unflushed_connections);
+		for (auto itr = unflushed.begin(); itr != unflushed.end(); ++itr) {
+			flushConnection(*itr);
+		}
+		std::set<int> dropped;
+		dropped.swap(this_reactor->dropped_connections);
+		for (auto itr = dropped.begin(); itr != dropped.end(); ++itr) {
+			if (this_reactor->connections.count(*itr) > 0) {
+				dropConnection(*itr);
+			}
+		}
+	}
+}
+
+void flushConnection(int fd)
+{
+	auto conn_itr = this_reactor->connections.find(fd);
+	if (conn_itr == this_reactor->connections.end()) {
+		return;
+	}
+	Connection &conn = conn_itr->second;
+	ssize_t written = conn.outbound.flush(fd);
+	if (written < 0) {
+		this_reactor->dropped_connections.insert(fd);
+		return;
+	}
+	recordBytesSent(written);
+	// keep the reactor's total of queued bytes up to date for the metrics
+	this_reactor->queued_bytes += conn.outbound.bytes() - conn.reported_bytes;
+	conn.reported_bytes = conn.outbound.bytes();
+	// only wait for the socket to become writable while messages are queued,
+	// and stop reading commands from a client that is not reading the replies
+	uint32_t events = 0;
+	if (!conn.outbound.empty()) {
+		events |= EPOLLOUT;
+	}
+	// a held reply takes at most a text protocol command's worth of queue
+	if (conn.outbound.bytes() + conn.held_replies * LEGACY_COMMAND_SIZE < max_queued_bytes / 2) {
+		events |= EPOLLIN | EPOLLRDHUP;
+	}
+	if (events != conn.events) {
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = events;
+		event.data.fd = fd;
+		epoll_ctl(this_reactor->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+		conn.events = events;
+	}
+}
+
+bool flushNow(int fd)
+{
+	// write out everything queued for a connection, waiting for the socket
+	// if need be
+	auto conn_itr = this_reactor->connections.find(fd);
+	if (conn_itr == this_reactor->connections.end()) {
+		return false;
+	}
+	OutboundQueue &outbound = conn_itr->second.outbound;
+	while (!outbound.empty()) {
+		ssize_t written = outbound.flush(fd);
+		if (written < 0) {
+			return false;
+		}
+		recordBytesSent(written);
+		struct pollfd writable;
+		writable.fd = fd;
+		writable.events = POLLOUT;
+		if (!outbound.empty() && poll(&writable, 1, 1000) <= 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void expirePendingRelays()
+{
+	// forget tokens that were never used by both clients
+	time_t now = time(nullptr);
+	for (auto itr = pending_relays.begin(); itr != pending_relays.end();) {
+		if (now - itr->second.created > RELAY_TIMEOUT_SECONDS) {
+			itr = pending_relays.erase(itr);
+		} else {
+			++itr;
+		}
+	}
+}
+
+bool joinRelay(int socket_fd, const std::string &token)
+{
+	// returns false if the connection is no longer read as commands
+	relay_mutex.lock();
+	auto relay_itr = pending_relays.find(token);
+	if (relay_itr == pending_relays.end()) {
+		relay_mutex.unlock();
+		sendCommand(socket_fd, Opcode::RELAY_JOIN, token + " 500");
+		return true;
+	}
+	PendingRelay &relay = relay_itr->second;
+	if (relay.reactor != nullptr && relay.reactor != this_reactor) {
+		// both ends of a relay are pumped by one reactor, so this connection
+		// moves to the reactor the first client joined on, and joins there
+		Reactor *reactor = relay.reactor;
+		relay_mutex.unlock();
+		handOverConnection(socket_fd, reactor, [token](int fd) {
+			joinRelay(fd, token);
+		});
+		return false;
+	}
+	auto first_itr = this_reactor->connections.find(relay.fd);
+	if (first_itr == this_reactor->connections.end() || first_itr->second.id != relay.connection_id || relay.fd == socket_fd) {
+		// first to join waits for the other one
+		relay.fd = socket_fd;
+		relay.connection_id = this_reactor->connections[socket_fd].id;
+		relay.reactor = this_reactor;
+		relay_mutex.unlock();
+		return true;
+	}
+	int first_fd = relay.fd;
+	pending_relays.erase(relay_itr);
+	relay_mutex.unlock();
+	// the connection is no longer read as commands either way
+	return !startRelay(first_fd, socket_fd, token);
+}
+
+bool startRelay(int fd1, int fd2, const std::string &token)
+{
+	// tell both clients the relay is up, then hand their sockets over to
+	// the relay; returns false, and drops both, if that fails
+	int fds[2] = {fd1, fd2};
+	bool started = true;
+	for (int i = 0; i < 2; ++i) {
+		sendCommand(fds[i], Opcode::RELAY_JOIN, token + " 200");
+		started = started && flushNow(fds[i]);
+	}
+	if (started && this_reactor->relays.add(fd1, fd2)) {
+		// clients wait for the 200 before sending anything to each other, so
+		// there is nothing left in their pending input to pass on
+		for (int i = 0; i < 2; ++i) {
+			forgetConnection(fds[i]);
+		}
+		relayConnection(fd1);
+		return true;
+	}
+	this_reactor->dropped_connections.insert(fd1);
+	this_reactor->dropped_connections.insert(fd2);
+	return false;
+}
+
+void relayConnection(int fd)
+{
+	int peer = this_reactor->relays.peer(fd);
+	if (!this_reactor->relays.pump(fd)) {
+		epoll_ctl(this_reactor->epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+		epoll_ctl(this_reactor->epoll_fd, EPOLL_CTL_DEL, peer, nullptr);
+		this_reactor->relays.remove(fd);
+		return;
+	}
+	int fds[2] = {fd, peer};
+	for (int i = 0; i < 2; ++i) {
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = this_reactor->relays.events(fds[i]);
+		event.data.fd = fds[i];
+		epoll_ctl(this_reactor->epoll_fd, EPOLL_CTL_MOD, fds[i], &event);
+	}
+}
+
+void notifyCommitted()
+{
+	// the user log is shared, but every reactor holds back its own replies
+	uint64_t committed = user_log.committed();
+	for (auto itr = reactors.begin(); itr != reactors.end(); ++itr) {
+		runOn(*itr, [committed]() {
+			releaseCommittedReplies(committed);
+		});
+	}
+}
+
+void releaseCommittedReplies(uint64_t committed)
+{
+	// send the replies whose changes the user log has synced to disk
+	auto end = this_reactor->uncommitted_replies.upper_bound(committed);
+	for (auto itr = this_reactor->uncommitted_replies.begin(); itr != end; ++itr) {
+		const UncommittedReply &reply = itr->second;
+		auto conn_itr = this_reactor->connections.find(reply.fd);
+		if (conn_itr != this_reactor->connections.end() && conn_itr->second.id == reply.connection_id) {
+			conn_itr->second.held_replies--;
+			sendCommand(reply.fd, reply.opcode, reply.payload);
+		}
+	}
+	this_reactor->uncommitted_replies.erase(this_reactor->uncommitted_replies.begin(), end);
+}
+
+void finishPasswordJobs()
+{
+	// every job finishes on the reactor its connection belongs to
+	std::vector<PasswordJob> jobs = password_workers.completed();
+	for (auto itr = jobs.begin(); itr != jobs.end(); ++itr) {
+		PasswordJob job = *itr;
+		runOn(ownerOf(job.fd), [job]() {
+			finishPasswordJob(job);
+		});
+	}
+}
+
+void finishPasswordJob(const PasswordJob &job)
+{
+	auto conn_itr = this_reactor->connections.find(job.fd);
+	bool connected = conn_itr != this_reactor->connections.end() && conn_itr->second.id == job.connection_id;
+	if (job.kind == PasswordJob::HASH) {
+		// a client that went away in the meantime is still registered, unless
+		// the user log refuses the registration
+		user_info_mutex.lock();
+		registering.erase(job.username);
+		uint64_t seq = job.hash.empty() ? 0 : user_log.logRegistration(job.username, job.hash);
+		if (seq == 0) {
+			user_info_mutex.unlock();
+			if (connected) {
+				conn_itr->second.held_replies--;
+				sendCommand(job.fd, Opcode::REGISTER, job.username + " 500");
+			}
+			return;
+		}
+		// only confirm the registration once it is safely on disk
+		user_info.add(std::make_shared<User>(job.username, job.hash));
+		UncommittedReply reply;
+		reply.fd = job.fd;
+		reply.connection_id = job.connection_id;
+		reply.opcode = Opcode::REGISTER;
+		reply.payload = job.username + " 200";
+		this_reactor->uncommitted_replies.insert(std::make_pair(seq, reply));
+		user_info_mutex.unlock();
+	} else if (job.kind == PasswordJob::REHASH) {
+		// nobody waits for this; if the log refuses the new hash, the user is
+		// rehashed on a later login instead
+		user_info_mutex.lock();
+		std::shared_ptr<User> user = getUserInfo(job.username);
+		if (user && user->getPassword() == job.stored && !job.hash.empty() && user_log.logPassword(job.username, job.hash) != 0) {
+			user->setPassword(job.hash);
+		}
+		user_info_mutex.unlock();
+	} else if (connected) {
+		conn_itr->second.logging_in = false;
+		conn_itr->second.held_replies--;
+		// logging in with the password ends a parked session of the user,
+		// which the client that left it can then no longer resume
+		if (job.verified && claimParkedSession(job.username, "")) {
+			endParkedSession(job.username);
+		}
+		// retrieve stored information about this user, particularly
+		// friends; the user may have logged in elsewhere in the meantime
+		if (job.verified && online_users.login(job.fd, getUserInfo(job.username))) {
+			sendCommand(job.fd, Opcode::LOGIN, job.username + " 200" + issueResumeToken(conn_itr->second));
+			if (conn_itr->second.features & FEATURE_ROSTER) {
+				sendRoster(job.fd, job.username, conn_itr->second.roster_version);
+			}
+			std::cout << "Online users: " << online_users.size() << '\n';
+			// passwords stored before hashes were salted are replaced as
+			// their users log in
+			if (!isSaltedHash(job.stored)) {
+				PasswordJob rehash = job;
+				rehash.kind = PasswordJob::REHASH;
+				password_workers.submit(rehash);
+			}
+		} else {
+			sendCommand(job.fd, Opcode::LOGIN, job.username + " 500");
+		}
+		// commands sent after the login were held until now
+		readMessages(job.fd, conn_itr->second);
+	}
+}
+
+void *compactUserFile(void *arg)
+{
+	// rewrite the user file in the background, so the log never grows
+	// without bound and the server does not have to on shutdown
+	while (user_log.waitForCompaction()) {
+		// only the rotation needs the lock: everything logged before it is in
+		// the directory by then, and anything written out on top of that is
+		// logged again after it
+		compaction_mutex.lock();
+		user_info_mutex.lock();
+		bool rotated = user_log.rotate();
+		user_info_mutex.unlock();
+		// a log that can not be written to is compacted once it can again
+		if (rotated && (!writeToUserFile(serializeUsers()) || !user_log.finishRotation())) {
+			std::cerr << "Failed to compact user log into " << user_filename << '\n';
+		}
+		compaction_mutex.unlock();
+	}
+	return nullptr;
+}
+
+std::string serializeUsers()
+{
+	// reads the directory without locks; the user file keeps the format it had
+	return binary_user_file ? user_info.toBinary() : user_info.toText();
+}
+
+bool writeToUserFile(const std::string &users)
+{
+	// write to a temporary file first, so the user file is replaced whole
+	std::string temp_filename = user_filename + ".tmp";
+	std::ofstream user_file(temp_filename, std::ios::trunc);
+	user_file << users;
+	user_file.close();
+	if (!user_file) {
+		return false;
+	}
+	int fd = open(temp_filename.c_str(), O_RDONLY);
+	bool synced = fd >= 0 && fsync(fd) == 0;
+	if (fd >= 0) {
+		close(fd);
+	}
+	return synced && rename(temp_filename.c_str(), user_filename.c_str()) == 0 && syncParentDirectory(user_filename);
+}
+
+std::string locationPayload(const std::string &username, const Location &address)
+{
+	std::string payload = username + " " + address.hostname + " " + address.port;
+	if (address.version > 0 || address.family != 0) {
+		// let friends know they can talk to this user with framed messages
+		payload += " " + std::to_string(address.version);
+	}
+	if (address.family != 0) {
+		// and that the address is numeric
+		payload += address.family == AF_INET6 ? " 6" : " 4";
+	}
+	return payload;
+}
+
+void sendRoster(int fd, const std::string &username, const std::string &since)
+{
+	// the friends online that have told the server where they are, or only
+	// the friends that changed if the client has the roster of a version
+	// still in the log; the version is read before presence, so nothing
+	// that changes in between is missed
+	std::unordered_set<std::string> changed;
+	std::string version;
+	bool delta = roster_log.changedSince(since, changed, version);
+	std::shared_ptr<const FriendSet> friends = online_users.getOnlineFriends(username);
+	std::vector<std::string> lines;
+	if (delta) {
+		std::shared_ptr<User> user = getUserInfo(username);
+		for (auto itr = changed.begin(); itr != changed.end(); ++itr) {
+			if (!user || !user->hasFriend(*itr)) {
+				continue;
+			}
+			std::shared_ptr<const Session> session = online_users.getSession(*itr);
+			if (friends->contains(*itr) && session && !session->location.hostname.empty()) {
+				lines.push_back("LOCATION " + locationPayload(*itr, session->location) + "\n");
+			} else {
+				lines.push_back("LOGOUT " + *itr + "\n");
+			}
+		}
+	} else {
+		friends->forEach([&lines](const std::string &friend_username, bool) {
+			std::shared_ptr<const Session> session = online_users.getSession(friend_username);
+			if (session && !session->location.hostname.empty()) {
+				lines.push_back("LOCATION " + locationPayload(friend_username, session->location) + "\n");
+			}
+		});
+	}
+
+	// as many frames as it takes, the client only takes the version once
+	// it has the last of them
+	size_t body_size = MAX_FRAME_PAYLOAD - version.size() - sizeof(" delta 1\n");
+	std::vector<std::string> bodies(1);
+	for (auto itr = lines.begin(); itr != lines.end(); ++itr) {
+		if (!bodies.back().empty() && bodies.back().size() + itr->size() > body_size) {
+			bodies.push_back("");
+		}
+		bodies.back() += *itr;
+	}
+	for (size_t i = 0; i < bodies.size(); ++i) {
+		std::string header = version + (delta ? " delta " : " full ") + (i + 1 < bodies.size() ? "1" : "0") + "\n";
+		sendCommand(fd, Opcode::ROSTER, header + bodies[i]);
+	}
+}
+
+std::shared_ptr<User> getUserInfo(const std::string &username)
+{
+	// retrieve registered user information; a client needs to successfully
+	// login (to a registered account) for this function to be called
+	return user_info.find(username);
+}
+
+int getUserFd(const std::string &username)
+{
+	return online_users.getFd(username);
+}
+
+bool isUsernameAvailable(const std::string &username)
+{
+	return !user_info.contains(username) && registering.count(username) == 0;
+}
+
+void setUnixAddress(const std::string &path, struct sockaddr_un &address)
+{
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path)) {
+		std::cerr << "Socket path " << path << " is too long\n";
+		exit(EXIT_FAILURE);
+	}
+	strcpy(address.sun_path, path.c_str());
+}
+
+void openAdminSocket()
+{
+	// a socket left behind by a server that did not shut down cleanly is
+	// replaced
+	struct sockaddr_un address;
+	setUnixAddress(admin_socket_path, address);
+	unlink(admin_socket_path.c_str());
+
+	if ((admin_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		std::cerr << "Failed to create admin socket\n";
+		exit(EXIT_FAILURE);
+	}
+
+	if (bind(admin_socket, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(admin_socket, 5) < 0) {
+		std::cerr << "Failed to bind admin socket to " << admin_socket_path << '\n';
+		exit(EXIT_FAILURE);
+	}
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = admin_socket;
+	if (setNonBlocking(admin_socket) < 0 || epoll_ctl(reactors[0]->epoll_fd, EPOLL_CTL_ADD, admin_socket, &event) < 0) {
+		std::cerr << "Failed to register admin socket with epoll\n";
+		exit(EXIT_FAILURE);
+	}
+}
+
+void serveAdmin()
+{
+	// a connection that sends "broadcast message" has the message sent to
+	// every client, e.g.
+	// echo broadcast back in 5 minutes | socat - UNIX-CONNECT:admin_socket_path
+	// and any other gets the metrics and is closed, e.g.
+	// socat - UNIX-CONNECT:admin_socket_path < /dev/null
+	int fd;
+	while ((fd = accept(admin_socket, nullptr, nullptr)) >= 0) {
+		// the accepted socket blocks, but not for long
+		struct timeval timeout;
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		std::istringstream strm(readAdminCommand(fd));
+		std::string command;
+		std::string text;
+		strm >> command;
+		strm.ignore();
+		getline(strm, text);
+		std::string reply;
+		if (command == "broadcast" && !text.empty()) {
+			broadcast(text);
+			reply = "Broadcast sent\n";
+		} else {
+			reply = formatMetrics();
+		}
+		writeAll(fd, reply.data(), reply.size());
+		close(fd);
+	}
+}
+
+std::string readAdminCommand(int fd)
+{
+	// a line, or whatever arrives before the other end stops sending or a
+	// short wait runs out
+	std::string line;
+	char chunk[256];
+	struct pollfd readable;
+	readable.fd = fd;
+	readable.events = POLLIN;
+	while (line.find('\n') == std::string::npos && line.size() < MAX_FRAME_PAYLOAD && poll(&readable, 1, 100) > 0) {
+		ssize_t bytes_read = read(fd, chunk, sizeof(chunk));
+		if (bytes_read <= 0) {
+			break;
+		}
+		line.append(chunk, bytes_read);
+	}
+	return line.substr(0, line.find('\n'));
+}
+
+void takeOverServer(HandoffState &state)
+{
+	// connect to the server running with the handoff socket, if there is
+	// one, and take everything it hands over
+	struct sockaddr_un address;
+	setUnixAddress(handoff_socket_path, address);
+	int fd;
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		std::cerr << "Failed to create handoff socket\n";
+		exit(EXIT_FAILURE);
+	}
+	if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		close(fd);
+		return;
+	}
+	if (!receiveHandoff(fd, state)) {
+		std::cerr << "Failed to take over from the server at " << handoff_socket_path << '\n';
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	std::cout << "Took over " << state.connections.size() << " connections\n";
+}
+
+void adoptHandoff(const HandoffState &state)
+{
+	// runs before the reactor threads start, so their state is set up
+	// directly; connections are spread over the reactors in turn, and both
+	// ends of a relay go to the same one
+	std::map<int, std::pair<int, Reactor*>> adopted;
+	for (size_t i = 0; i < state.connections.size(); ++i) {
+		const HandoffConnection &handed = state.connections[i];
+		Reactor *reactor = reactors[i % reactors.size()];
+		Connection conn;
+		conn.format = handed.format;
+		conn.pending = handed.pending;
+		conn.events = EPOLLIN | EPOLLRDHUP;
+		conn.held_replies = 0;
+		conn.id = next_connection_id++;
+		conn.logging_in = false;
+		conn.features = handed.features;
+		conn.reported_bytes = 0;
+		conn.resume_token = handed.resume_token;
+		conn.last_received = 0;
+		if (conn.format == WireFormat::FRAMED && (conn.features & FEATURE_COMPRESSION)) {
+			// the client carries on with the stream it was sending, while what
+			// is sent to it starts a new one, as any compressed frame may
+			conn.compression = std::make_shared<FrameCompression>();
+			if (!conn.compression->setDictionary(handed.inflate_dictionary)) {
+				close(handed.fd);
+				continue;
+			}
+		}
+		if (!handed.outbound.empty()) {
+			conn.outbound.push(std::make_shared<const std::string>(handed.outbound), false);
+			conn.events |= EPOLLOUT;
+		}
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = conn.events;
+		event.data.fd = handed.fd;
+		if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, handed.fd, &event) < 0) {
+			close(handed.fd);
+			continue;
+		}
+		fd_owners[handed.fd].store(reactor->index);
+
+		std::shared_ptr<User> user = handed.username.empty() ? nullptr : user_info.find(handed.username);
+		if (user && online_users.login(handed.fd, user)) {
+			online_users.setLocation(handed.fd, handed.location);
+		}
+		// password jobs the old server never started are done here instead
+		for (auto itr = handed.jobs.begin(); itr != handed.jobs.end(); ++itr) {
+			PasswordJob job = *itr;
+			job.fd = handed.fd;
+			job.connection_id = conn.id;
+			if (job.kind == PasswordJob::HASH) {
+				registering.insert(job.username);
+			} else {
+				conn.logging_in = true;
+			}
+			conn.held_replies++;
+			password_workers.submit(job);
+		}
+		reactor->connections.insert(std::make_pair(handed.fd, conn));
+		reactor->timers.schedule(handed.fd, conn.id, heartbeat_seconds);
+		adopted[handed.old_fd] = std::make_pair(handed.fd, reactor);
+	}
+
+	std::map<int, int> relay_fds;
+	for (auto itr = state.relay_ends.begin(); itr != state.relay_ends.end(); ++itr) {
+		relay_fds[itr->old_fd] = itr->fd;
+	}
+	for (auto itr = state.relay_ends.begin(); itr != state.relay_ends.end(); ++itr) {
+		Reactor *reactor = reactors[std::min(itr->old_fd, itr->end.peer) % reactors.size()];
+		Relays::End end = itr->end;
+		end.peer = relay_fds[end.peer];
+		reactor->relays.adopt(itr->fd, end);
+		fd_owners[itr->fd].store(reactor->index);
+	}
+	for (auto itr = state.relay_ends.begin(); itr != state.relay_ends.end(); ++itr) {
+		Reactor *reactor = ownerOf(itr->fd);
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = reactor->relays.events(itr->fd);
+		event.data.fd = itr->fd;
+		epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, itr->fd, &event);
+	}
+
+	for (auto itr = state.pending_relays.begin(); itr != state.pending_relays.end(); ++itr) {
+		PendingRelay relay;
+		relay.created = itr->created;
+		relay.fd = -1;
+		relay.connection_id = 0;
+		relay.reactor = nullptr;
+		auto adopted_itr = adopted.find(itr->old_fd);
+		if (adopted_itr != adopted.end()) {
+			relay.fd = adopted_itr->second.first;
+			relay.reactor = adopted_itr->second.second;
+			relay.connection_id = relay.reactor->connections[relay.fd].id;
+		}
+		pending_relays.insert(std::make_pair(itr->token, relay));
+	}
+
+	// a server that has no roster log to hand over starts one of its own,
+	// so versions from before are not taken for versions of this one
+	if (state.roster.instance.empty()) {
+		std::string instance = createToken(ROSTER_INSTANCE_BYTES);
+		roster_log.start(instance.empty() ? std::to_string(time(nullptr)) : instance, 0, std::vector<std::pair<uint64_t, std::string>>());
+	} else {
+		roster_log.start(state.roster.instance, state.roster.last, state.roster.changes);
+	}
+
+	// parked sessions keep the time they were parked, so the grace window
+	// does not start over
+	for (auto itr = state.parked_sessions.begin(); itr != state.parked_sessions.end(); ++itr) {
+		std::shared_ptr<User> user = user_info.find(itr->username);
+		if (user && online_users.loginParked(user, itr->location)) {
+			ParkedSession parked;
+			parked.token = itr->token;
+			parked.parked = itr->parked;
+			parked_sessions[itr->username] = parked;
+		}
+	}
+
+	for (auto itr = state.rooms.begin(); itr != state.rooms.end(); ++itr) {
+		for (auto member_itr = itr->members.begin(); member_itr != itr->members.end(); ++member_itr) {
+			if (member_itr == itr->members.begin()) {
+				rooms.create(itr->name, *member_itr);
+			} else {
+				rooms.join(itr->name, *member_itr);
+			}
+		}
+	}
+}
+
+void openHandoffSocket()
+{
+	// the socket of the server taken over from, if any, is replaced
+	struct sockaddr_un address;
+	setUnixAddress(handoff_socket_path, address);
+	unlink(handoff_socket_path.c_str());
+
+	if ((handoff_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		std::cerr << "Failed to create handoff socket\n";
+		exit(EXIT_FAILURE);
+	}
+
+	if (bind(handoff_socket, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(handoff_socket, 1) < 0) {
+		std::cerr << "Failed to bind handoff socket to " << handoff_socket_path << '\n';
+		exit(EXIT_FAILURE);
+	}
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = handoff_socket;
+	if (setNonBlocking(handoff_socket) < 0 || epoll_ctl(reactors[0]->epoll_fd, EPOLL_CTL_ADD, handoff_socket, &event) < 0) {
+		std::cerr << "Failed to register handoff socket with epoll\n";
+		exit(EXIT_FAILURE);
+	}
+}
+
+void handOffServer()
+{
+	// a new server connected to take over: stop everything, finish what
+	// can be finished, and hand the rest over along with the sockets
+	int fd = accept(handoff_socket, nullptr, nullptr);
+	if (fd < 0) {
+		return;
+	}
+
+	for (size_t i = 1; i < reactors.size(); ++i) {
+		reactors[i]->tasks.push(stopReactor);
+		pthread_join(reactors[i]->thread, nullptr);
+	}
+	// password jobs already started finish here, the others go along with
+	// their connections
+	std::vector<PasswordJob> unstarted = password_workers.stop();
+	finishPasswordJobs();
+	runStoppedReactors();
+	// the new server loads the user file and log once this one is gone, so
+	// everything logged has to be on disk and nothing compacted from here on
+	compaction_mutex.lock();
+	if (!user_log.sync()) {
+		std::cerr << "Failed to sync user log, carrying on\n";
+		abortHandoff(fd);
+		close(fd);
+		resumeServing(std::vector<std::map<int, Relays::End>>(reactors.size()), unstarted);
+		return;
+	}
+	notifyCommitted();
+	runStoppedReactors();
+
+	HandoffState state;
+	// relays given up by each reactor, taken back if the handoff fails
+	std::vector<std::map<int, Relays::End>> released;
+	for (auto reactor_itr = reactors.begin(); reactor_itr != reactors.end(); ++reactor_itr) {
+		Reactor *reactor = *reactor_itr;
+		state.listeners.push_back(reactor->listen_socket);
+		for (auto itr = reactor->connections.begin(); itr != reactor->connections.end(); ++itr) {
+			HandoffConnection handed;
+			handed.fd = itr->first;
+			handed.format = itr->second.format;
+			handed.features = itr->second.features;
+			handed.pending = itr->second.pending;
+			handed.outbound = itr->second.outbound.contents();
+			if (itr->second.compression) {
+				handed.inflate_dictionary = itr->second.compression->dictionary();
+			}
+			handed.resume_token = itr->second.resume_token;
+			handed.location.version = 0;
+			handed.location.family = 0;
+			std::shared_ptr<const Session> session = online_users.getSession(itr->first);
+			if (session) {
+				handed.username = session->user->getUsername();
+				handed.location = session->location;
+			}
+			for (auto job_itr = unstarted.begin(); job_itr != unstarted.end(); ++job_itr) {
+				// a password that is not rehashed now is on the next login
+				if (job_itr->fd == itr->first && job_itr->connection_id == itr->second.id && job_itr->kind != PasswordJob::REHASH) {
+					handed.jobs.push_back(*job_itr);
+				}
+			}
+			state.connections.push_back(handed);
+		}
+		released.push_back(reactor->relays.release());
+		for (auto itr = released.back().begin(); itr != released.back().end(); ++itr) {
+			HandoffRelayEnd relay_end;
+			relay_end.fd = itr->first;
+			relay_end.end = itr->second;
+			state.relay_ends.push_back(relay_end);
+		}
+	}
+	for (auto itr = pending_relays.begin(); itr != pending_relays.end(); ++itr) {
+		HandoffPendingRelay relay;
+		relay.token = itr->first;
+		relay.created = itr->second.created;
+		relay.old_fd = -1;
+		if (itr->second.reactor) {
+			auto conn_itr = itr->second.reactor->connections.find(itr->second.fd);
+			if (conn_itr != itr->second.reactor->connections.end() && conn_itr->second.id == itr->second.connection_id) {
+				relay.old_fd = itr->second.fd;
+			}
+		}
+		state.pending_relays.push_back(relay);
+	}
+	std::vector<std::string> names = rooms.getRooms();
+	for (auto itr = names.begin(); itr != names.end(); ++itr) {
+		std::shared_ptr<const MemberSet> members = rooms.getMembers(*itr);
+		if (members) {
+			HandoffRoom room;
+			room.name = *itr;
+			room.members.assign(members->begin(), members->end());
+			state.rooms.push_back(room);
+		}
+	}
+	for (auto itr = parked_sessions.begin(); itr != parked_sessions.end(); ++itr) {
+		std::shared_ptr<const Session> session = online_users.getSession(itr->first);
+		if (session && session->fd < 0) {
+			HandoffParkedSession parked;
+			parked.username = itr->first;
+			parked.token = itr->second.token;
+			parked.parked = itr->second.parked;
+			parked.location = session->location;
+			state.parked_sessions.push_back(parked);
+		}
+	}
+	state.roster.instance = roster_log.getInstance();
+	state.roster.last = roster_log.getLast();
+	state.roster.changes = roster_log.getChanges();
+
+	if (!sendHandoff(fd, state)) {
+		// nothing was closed, so whatever the new server got of it is
+		// simply dropped along with it
+		std::cerr << "Failed to hand over to the new server, carrying on\n";
+		abortHandoff(fd);
+		close(fd);
+		resumeServing(released, unstarted);
+		return;
+	}
+	// the sockets live on in the new server, so nothing is shut down or
+	// unlinked on the way out
+	std::cout << "Handed over " << state.connections.size() << " connections\n";
+	exit(EXIT_SUCCESS);
+}
+
+void resumeServing(const std::vector<std::map<int, Relays::End>> &released, const std::vector<PasswordJob> &unstarted)
+{
+	// undo what handing over stopped, so everything picks up where it was
+	for (size_t i = 0; i < reactors.size(); ++i) {
+		for (auto itr = released[i].begin(); itr != released[i].end(); ++itr) {
+			reactors[i]->relays.adopt(itr->first, itr->second);
+		}
+	}
+	compaction_mutex.unlock();
+	if (!password_workers.start(hash_threads, hash_rounds)) {
+		std::cerr << "Failed to start password workers\n";
+		exit(EXIT_FAILURE);
+	}
+	for (auto itr = unstarted.begin(); itr != unstarted.end(); ++itr) {
+		password_workers.submit(*itr);
+	}
+	for (size_t i = 1; i < reactors.size(); ++i) {
+		reactors[i]->running = true;
+		if (pthread_create(&reactors[i]->thread, nullptr, runReactor, reactors[i]) != 0) {
+			std::cerr << "Failed to create reactor thread\n";
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+std::string formatMetrics()
+{
+	std::string out;
+	formatCommandMetrics(out);
+
+	// every reactor publishes its own counts
+	size_t connections = 0;
+	size_t queued_bytes = 0;
+	size_t relays = 0;
+	for (auto itr = reactors.begin(); itr != reactors.end(); ++itr) {
+		connections += (*itr)->connection_count.load(std::memory_order_relaxed);
+		queued_bytes += (*itr)->queued_bytes.load(std::memory_order_relaxed);
+		relays += (*itr)->relay_count.load(std::memory_order_relaxed);
+	}
+	formatMetric(out, "messenger_connections", "gauge", "Open client connections.", std::vector<MetricSample>(1, MetricSample{"", (double)connections}));
+	formatMetric(out, "messenger_online_users", "gauge", "Users logged in.", std::vector<MetricSample>(1, MetricSample{"", (double)online_users.size()}));
+	formatMetric(out, "messenger_registered_users", "gauge", "Users registered.", std::vector<MetricSample>(1, MetricSample{"", (double)user_info.size()}));
+	formatMetric(out, "messenger_outbound_queue_bytes", "gauge", "Bytes waiting to be written to clients.", std::vector<MetricSample>(1, MetricSample{"", (double)queued_bytes}));
+	formatMetric(out, "messenger_relays", "gauge", "Relayed peer connections.", std::vector<MetricSample>(1, MetricSample{"", (double)relays}));
+	formatMetric(out, "messenger_rooms", "gauge", "Group chat rooms.", std::vector<MetricSample>(1, MetricSample{"", (double)rooms.size()}));
+	session_mutex.lock();
+	size_t parked = parked_sessions.size();
+	session_mutex.unlock();
+	formatMetric(out, "messenger_parked_sessions", "gauge", "Sessions waiting for their client to resume them.", std::vector<MetricSample>(1, MetricSample{"", (double)parked}));
+
+	// time spent waiting for and holding the locks on the hot path
+	LockStats locks[] = {relay_mutex.stats(), user_info_mutex.stats(), online_users.lockStats(), rooms.lockStats(), roster_log.lockStats(), session_mutex.stats()};
+	std::vector<MetricSample> acquisitions;
+	std::vector<MetricSample> waits;
+	std::vector<MetricSample> holds;
+	std::vector<MetricSample> max_holds;
+	for (size_t i = 0; i < sizeof(locks) / sizeof(locks[0]); ++i) {
+		std::string label = std::string("lock=\"") + locks[i].name + "\"";
+		acquisitions.push_back(MetricSample{label, (double)locks[i].acquisitions});
+		waits.push_back(MetricSample{label, locks[i].wait_ns / 1e9});
+		holds.push_back(MetricSample{label, locks[i].hold_ns / 1e9});
+		max_holds.push_back(MetricSample{label, locks[i].max_hold_ns / 1e9});
+	}
+	formatMetric(out, "messenger_lock_acquisitions_total", "counter", "Times a lock was taken.", acquisitions);
+	formatMetric(out, "messenger_lock_wait_seconds_total", "counter", "Time spent waiting for a lock.", waits);
+	formatMetric(out, "messenger_lock_hold_seconds_total", "counter", "Time a lock was held.", holds);
+	formatMetric(out, "messenger_lock_max_hold_seconds", "gauge", "Longest time a lock was held.", max_holds);
+	return out;
+}
+
+void termination_handler(int sig_num)
+{
+	// runs on the first reactor, once every other one has shut down
+	for (size_t i = 1; i < reactors.size(); ++i) {
+		reactors[i]->tasks.push(shutdownReactor);
+		pthread_join(reactors[i]->thread, nullptr);
+	}
+
+	// user information is already in the user file and log, just make sure
+	// the last of the log is on disk; registrations still being hashed were
+	// never confirmed
+	password_workers.stop();
+	user_log.close();
+
+	shutdownReactor();
+	close(signal_fd);
+	close(resume_timer_fd);
+	if (admin_socket >= 0) {
+		close(admin_socket);
+		unlink(admin_socket_path.c_str());
+	}
 
-	pthread_mutex_destroy(&connections_mutex);
-	pthread_mutex_destroy(&user_info_mutex);
-	pthread_mutex_destroy(&online_users_mutex);
+	// how long the hot path spent under locks
+	std::cout << relay_mutex.report() << '\n';
+	std::cout << user_info_mutex.report() << '\n';
+	std::cout << online_users.lockReport() << '\n';
+	std::cout << rooms.lockReport() << '\n';
+	std::cout << roster_log.lockReport() << '\n';
+	std::cout << session_mutex.report() << '\n';
 
 	exit(EXIT_SUCCESS);
 }
\ No newline at end of file
@@ -0,0 +1,274 @@
+#include "metrics.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#include <pthread.h>
+
+namespace {
+
+const size_t OPCODE_SLOTS = 256;
+// upper bounds of the command duration buckets, in nanoseconds
+const uint64_t DURATION_BOUNDS[] = {
+	10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+	100000000, 250000000, 500000000, 1000000000
+};
+const size_t DURATION_BUCKETS = sizeof(DURATION_BOUNDS) / sizeof(DURATION_BOUNDS[0]) + 1;
+// one for each TimedMutex, there are only a handful
+const size_t LOCK_SLOTS = 16;
+
+// counters of one thread; only that thread writes them, so they are
+// atomic only to be read safely while the metrics are formatted
+struct Shard {
+	std::atomic<uint64_t> commands[OPCODE_SLOTS];
+	std::atomic<uint64_t> duration_ns[OPCODE_SLOTS];
+	std::atomic<uint64_t> durations[OPCODE_SLOTS][DURATION_BUCKETS];
+	std::atomic<uint64_t> bytes_received;
+	std::atomic<uint64_t> bytes_sent;
+	// frames sent compressed, then frames received compressed
+	std::atomic<uint64_t> compressed_frames[2];
+	std::atomic<uint64_t> raw_bytes[2];
+	std::atomic<uint64_t> compressed_bytes[2];
+	std::atomic<uint64_t> compression_ns[2];
+	std::atomic<uint64_t> silent_connections;
+	std::atomic<uint64_t> lock_acquisitions[LOCK_SLOTS];
+	std::atomic<uint64_t> lock_wait_ns[LOCK_SLOTS];
+	std::atomic<uint64_t> lock_hold_ns[LOCK_SLOTS];
+	std::atomic<uint64_t> lock_max_hold_ns[LOCK_SLOTS];
+};
+
+pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+// shards outlive their threads, so nothing counted is ever lost
+std::vector<Shard*> shards;
+thread_local Shard *thread_shard = nullptr;
+std::atomic<size_t> next_lock_slot(0);
+
+Shard &localShard()
+{
+	if (thread_shard == nullptr) {
+		thread_shard = new Shard();
+		pthread_mutex_lock(&shards_mutex);
+		shards.push_back(thread_shard);
+		pthread_mutex_unlock(&shards_mutex);
+	}
+	return *thread_shard;
+}
+
+void add(std::atomic<uint64_t> &counter, uint64_t amount)
+{
+	// no other thread writes the counter, so no locked instruction is needed
+	counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+uint64_t sum(std::atomic<uint64_t> Shard::*counter)
+{
+	// caller holds shards_mutex
+	uint64_t total = 0;
+	for (auto itr = shards.begin(); itr != shards.end(); ++itr) {
+		total += ((*itr)->*counter).load(std::memory_order_relaxed);
+	}
+	return total;
+}
+
+void addCompression(size_t direction, const CompressionStats &stats)
+{
+	Shard &shard = localShard();
+	add(shard.compressed_frames[direction], stats.frames);
+	add(shard.raw_bytes[direction], stats.raw_bytes);
+	add(shard.compressed_bytes[direction], stats.compressed_bytes);
+	add(shard.compression_ns[direction], stats.elapsed_ns);
+}
+
+std::string formatNumber(double value)
+{
+	// counts are printed whole however large they get
+	char number[32];
+	if (value == (double)(uint64_t)value && value < 9007199254740992.0) {
+		snprintf(number, sizeof(number), "%llu", (unsigned long long)value);
+	} else {
+		snprintf(number, sizeof(number), "%.9g", value);
+	}
+	return number;
+}
+
+}
+
+void recordCommand(Opcode opcode, uint64_t elapsed_ns)
+{
+	Shard &shard = localShard();
+	size_t slot = (uint8_t)opcode;
+	size_t bucket = 0;
+	while (bucket < DURATION_BUCKETS - 1 && elapsed_ns > DURATION_BOUNDS[bucket]) {
+		++bucket;
+	}
+	add(shard.commands[slot], 1);
+	add(shard.duration_ns[slot], elapsed_ns);
+	add(shard.durations[slot][bucket], 1);
+}
+
+void recordBytesReceived(size_t bytes)
+{
+	add(localShard().bytes_received, bytes);
+}
+
+void recordBytesSent(size_t bytes)
+{
+	add(localShard().bytes_sent, bytes);
+}
+
+void recordCompression(const CompressionStats &stats)
+{
+	addCompression(0, stats);
+}
+
+void recordDecompression(const CompressionStats &stats)
+{
+	addCompression(1, stats);
+}
+
+void recordSilentConnection()
+{
+	add(localShard().silent_connections, 1);
+}
+
+size_t claimLockSlot()
+{
+	size_t slot = next_lock_slot.fetch_add(1);
+	if (slot >= LOCK_SLOTS) {
+		std::cerr << "Failed to time lock: too many locks\n";
+		exit(EXIT_FAILURE);
+	}
+	return slot;
+}
+
+void recordLockAcquired(size_t slot, uint64_t wait_ns)
+{
+	Shard &shard = localShard();
+	add(shard.lock_acquisitions[slot], 1);
+	add(shard.lock_wait_ns[slot], wait_ns);
+}
+
+void recordLockReleased(size_t slot, uint64_t hold_ns)
+{
+	Shard &shard = localShard();
+	add(shard.lock_hold_ns[slot], hold_ns);
+	if (hold_ns > shard.lock_max_hold_ns[slot].load(std::memory_order_relaxed)) {
+		shard.lock_max_hold_ns[slot].store(hold_ns, std::memory_order_relaxed);
+	}
+}
+
+void sumLockStats(size_t slot, LockStats &stats)
+{
+	stats.acquisitions = 0;
+	stats.wait_ns = 0;
+	stats.hold_ns = 0;
+	stats.max_hold_ns = 0;
+	pthread_mutex_lock(&shards_mutex);
+	for (auto itr = shards.begin(); itr != shards.end(); ++itr) {
+		stats.acquisitions += (*itr)->lock_acquisitions[slot].load(std::memory_order_relaxed);
+		stats.wait_ns += (*itr)->lock_wait_ns[slot].load(std::memory_order_relaxed);
+		stats.hold_ns += (*itr)->lock_hold_ns[slot].load(std::memory_order_relaxed);
+		uint64_t max_hold_ns = (*itr)->lock_max_hold_ns[slot].load(std::memory_order_relaxed);
+		if (max_hold_ns > stats.max_hold_ns) {
+			stats.max_hold_ns = max_hold_ns;
+		}
+	}
+	pthread_mutex_unlock(&shards_mutex);
+}
+
+void formatCommandMetrics(std::string &out)
+{
+	std::vector<MetricSample> commands;
+	std::string durations;
+	pthread_mutex_lock(&shards_mutex);
+	for (size_t slot = 0; slot < OPCODE_SLOTS; ++slot) {
+		uint64_t count = 0;
+		uint64_t total_ns = 0;
+		uint64_t buckets[DURATION_BUCKETS] = {0};
+		for (auto itr = shards.begin(); itr != shards.end(); ++itr) {
+			count += (*itr)->commands[slot].load(std::memory_order_relaxed);
+			total_ns += (*itr)->duration_ns[slot].load(std::memory_order_relaxed);
+			for (size_t bucket = 0; bucket < DURATION_BUCKETS; ++bucket) {
+				buckets[bucket] += (*itr)->durations[slot][bucket].load(std::memory_order_relaxed);
+			}
+		}
+		if (count == 0) {
+			continue;
+		}
+		// messages have no name in the text protocol, and commands the
+		// server does not know are counted together
+		const char *name = opcodeName((Opcode)slot);
+		if (*name == '\0') {
+			name = (Opcode)slot == Opcode::MESSAGE ? "MESSAGE" : "UNKNOWN";
+		}
+		std::string label = std::string("command=\"") + name + "\"";
+		MetricSample sample;
+		sample.labels = label;
+		sample.value = count;
+		commands.push_back(sample);
+
+		// prometheus buckets are cumulative
+		uint64_t cumulative = 0;
+		for (size_t bucket = 0; bucket < DURATION_BUCKETS; ++bucket) {
+			cumulative += buckets[bucket];
+			std::string bound = bucket < DURATION_BUCKETS - 1 ? formatNumber(DURATION_BOUNDS[bucket] / 1e9) : "+Inf";
+			durations += "messenger_command_duration_seconds_bucket{" + label + ",le=\"" + bound + "\"} " + std::to_string(cumulative) + "\n";
+		}
+		durations += "messenger_command_duration_seconds_sum{" + label + "} " + formatNumber(total_ns / 1e9) + "\n";
+		durations += "messenger_command_duration_seconds_count{" + label + "} " + std::to_string(count) + "\n";
+	}
+	uint64_t bytes_received = sum(&Shard::bytes_received);
+	uint64_t bytes_sent = sum(&Shard::bytes_sent);
+	uint64_t silent_connections = sum(&Shard::silent_connections);
+	// compression ratio is raw over compressed bytes, its cost the seconds
+	const char *directions[2] = {"direction=\"sent\"", "direction=\"received\""};
+	std::vector<MetricSample> compressed_frames;
+	std::vector<MetricSample> raw_bytes;
+	std::vector<MetricSample> compressed_bytes;
+	std::vector<MetricSample> compression_seconds;
+	for (size_t direction = 0; direction < 2; ++direction) {
+		uint64_t frames = 0;
+		uint64_t raw = 0;
+		uint64_t compressed = 0;
+		uint64_t elapsed_ns = 0;
+		for (auto itr = shards.begin(); itr != shards.end(); ++itr) {
+			frames += (*itr)->compressed_frames[direction].load(std::memory_order_relaxed);
+			raw += (*itr)->raw_bytes[direction].load(std::memory_order_relaxed);
+			compressed += (*itr)->compressed_bytes[direction].load(std::memory_order_relaxed);
+			elapsed_ns += (*itr)->compression_ns[direction].load(std::memory_order_relaxed);
+		}
+		compressed_frames.push_back(MetricSample{directions[direction], (double)frames});
+		raw_bytes.push_back(MetricSample{directions[direction], (double)raw});
+		compressed_bytes.push_back(MetricSample{directions[direction], (double)compressed});
+		compression_seconds.push_back(MetricSample{directions[direction], elapsed_ns / 1e9});
+	}
+	pthread_mutex_unlock(&shards_mutex);
+
+	formatMetric(out, "messenger_commands_total", "counter", "Commands handled.", commands);
+	out += "# HELP messenger_command_duration_seconds Time spent handling a command.\n";
+	out += "# TYPE messenger_command_duration_seconds histogram\n";
+	out += durations;
+	formatMetric(out, "messenger_received_bytes_total", "counter", "Bytes read from client connections.", std::vector<MetricSample>(1, MetricSample{"", (double)bytes_received}));
+	formatMetric(out, "messenger_sent_bytes_total", "counter", "Bytes written to client connections.", std::vector<MetricSample>(1, MetricSample{"", (double)bytes_sent}));
+	formatMetric(out, "messenger_compressed_frames_total", "counter", "Frames compressed to send or decompressed on arrival.", compressed_frames);
+	formatMetric(out, "messenger_compression_raw_bytes_total", "counter", "Payload bytes of those frames before compression.", raw_bytes);
+	formatMetric(out, "messenger_compression_compressed_bytes_total", "counter", "Payload bytes of those frames after compression.", compressed_bytes);
+	formatMetric(out, "messenger_compression_seconds_total", "counter", "Time spent compressing and decompressing frames.", compression_seconds);
+	formatMetric(out, "messenger_silent_connections_total", "counter", "Connections dropped for going silent.", std::vector<MetricSample>(1, MetricSample{"", (double)silent_connections}));
+}
+
+void formatMetric(std::string &out, const char *name, const char *type, const char *help, const std::vector<MetricSample> &samples)
+{
+	out += std::string("# HELP ") + name + " " + help + "\n";
+	out += std::string("# TYPE ") + name + " " + type + "\n";
+	for (auto itr = samples.begin(); itr != samples.end(); ++itr) {
+		out += name;
+		if (!itr->labels.empty()) {
+			out += "{" + itr->labels + "}";
+		}
+		out += " " + formatNumber(itr->value) + "\n";
+	}
+}
\ No newline at end of file
@@ -0,0 +1,41 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "compression.hpp"
+#include "protocol.hpp"
+#include "timed_mutex.hpp"
+
+/*
+	Metrics
+
+	Every thread that records gets its own set of counters, created the
+	first time it records, so recording is a couple of uncontended stores
+	and never allocates. The sets are only added up when the metrics are
+	formatted, in the Prometheus text format.
+*/
+
+// one sample of a metric, labels as they appear between the braces
+struct MetricSample {
+	std::string labels;
+	double value;
+};
+
+void recordCommand(Opcode, uint64_t);
+void recordBytesReceived(size_t);
+void recordBytesSent(size_t);
+void recordCompression(const CompressionStats&);
+void recordDecompression(const CompressionStats&);
+void recordSilentConnection();
+size_t claimLockSlot();
+void recordLockAcquired(size_t, uint64_t);
+void recordLockReleased(size_t, uint64_t);
+void sumLockStats(size_t, LockStats&);
+void formatCommandMetrics(std::string&);
+void formatMetric(std::string&, const char*, const char*, const char*, const std::vector<MetricSample>&);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,132 @@
+#include "outbound_queue.hpp"
+
+#include <cerrno>
+
+#include <sys/uio.h>
+
+namespace {
+
+// most messages handed to a single writev
+const int MAX_IOVECS = 64;
+
+}
+
+OutboundQueue::OutboundQueue()
+{
+	head = 0;
+	head_offset = 0;
+	queued_bytes = 0;
+}
+
+void OutboundQueue::push(const std::shared_ptr<const std::string> &data, bool presence)
+{
+	Entry entry;
+	entry.data = data;
+	entry.presence = presence;
+	entries.push_back(entry);
+	queued_bytes += data->size();
+}
+
+size_t OutboundQueue::dropPresence(size_t needed)
+{
+	// drop the oldest presence updates until at least needed bytes are
+	// freed, never touching the message that is partly written
+	size_t freed = 0;
+	size_t first = head_offset > 0 ? head + 1 : head;
+	size_t kept = first;
+	for (size_t i = first; i < entries.size(); ++i) {
+		if (freed < needed && entries[i].presence) {
+			freed += entries[i].data->size();
+		} else {
+			entries[kept++] = entries[i];
+		}
+	}
+	entries.resize(kept);
+	queued_bytes -= freed;
+	return freed;
+}
+
+ssize_t OutboundQueue::flush(int fd)
+{
+	// write as much as the socket takes without blocking, returns the number
+	// of bytes written or -1 if the connection failed
+	ssize_t total = 0;
+	while (head < entries.size()) {
+		struct iovec iov[MAX_IOVECS];
+		int count = 0;
+		for (size_t i = head; i < entries.size() && count < MAX_IOVECS; ++i, ++count) {
+			size_t skip = i == head ? head_offset : 0;
+			iov[count].iov_base = (void*)(entries[i].data->data() + skip);
+			iov[count].iov_len = entries[i].data->size() - skip;
+		}
+
+		ssize_t written = writev(fd, iov, count);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			return -1;
+		}
+
+		total += written;
+		queued_bytes -= written;
+		size_t remaining = written;
+		while (remaining > 0) {
+			size_t left = entries[head].data->size() - head_offset;
+			if (remaining < left) {
+				head_offset += remaining;
+				break;
+			}
+			remaining -= left;
+			entries[head++].data.reset();
+			head_offset = 0;
+		}
+	}
+	compact();
+	return total;
+}
+
+bool OutboundQueue::empty() const
+{
+	return head == entries.size();
+}
+
+size_t OutboundQueue::bytes() const
+{
+	return queued_bytes;
+}
+
+std::string OutboundQueue::contents() const
+{
+	// everything not yet written, oldest first
+	std::string out;
+	out.reserve(queued_bytes);
+	for (size_t i = head; i < entries.size(); ++i) {
+		size_t skip = i == head ? head_offset : 0;
+		out.append(*entries[i].data, skip, std::string::npos);
+	}
+	return out;
+}
+
+void OutboundQueue::clear()
+{
+	std::vector<Entry>().swap(entries);
+	head = 0;
+	head_offset = 0;
+	queued_bytes = 0;
+}
+
+void OutboundQueue::compact()
+{
+	// give memory back once everything is written, otherwise only shift
+	// entries down when the written ones make up most of the queue
+	if (empty()) {
+		clear();
+	} else if (head > entries.size() / 2) {
+		entries.erase(entries.begin(), entries.begin() + head);
+		head = 0;
+	}
+}
\ No newline at end of file
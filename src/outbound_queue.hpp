@@ -0,0 +1,38 @@
+#ifndef OUTBOUND_QUEUE_HPP
+#define OUTBOUND_QUEUE_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+// Encoded messages waiting to be written to a connection. Messages are
+// reference counted so the same message can sit in many queues at once.
+class OutboundQueue {
+public:
+	OutboundQueue();
+	void push(const std::shared_ptr<const std::string>&, bool);
+	size_t dropPresence(size_t);
+	ssize_t flush(int);
+	bool empty() const;
+	size_t bytes() const;
+	std::string contents() const;
+	void clear();
+private:
+	struct Entry {
+		std::shared_ptr<const std::string> data;
+		// presence updates may be dropped when the queue overflows
+		bool presence;
+	};
+	void compact();
+	std::vector<Entry> entries;
+	// index of the oldest entry not yet completely written
+	size_t head;
+	// bytes of the oldest entry already written
+	size_t head_offset;
+	size_t queued_bytes;
+};
+
+#endif
\ No newline at end of file
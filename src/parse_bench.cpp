@@ -0,0 +1,178 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "protocol.hpp"
+
+/*
+	Parsing benchmark
+
+	Times the per-message parsing on the server's hot path against the way
+	it used to be done: a legacy command line split and looked up by name,
+	frames decoded from a receive buffer and their arguments read, and the
+	lookup of an opcode by its name. The old way copied every payload out of
+	the buffer, built an istringstream over it and compared a name against
+	every opcode in turn; it is kept here to compare against.
+
+	Numbers only mean something with optimization, e.g. after
+	make clean && make CXXFLAGS="-c -std=c++11 -O2" parse_bench
+*/
+
+const char USAGE[] = "usage: ./parse_bench [iterations]\n";
+const int DEFAULT_ITERATIONS = 2000000;
+
+const char *const LINES[] = {
+	"LOCATION alice 10.0.0.12 40123 1 4",
+	"INVITE_FROM carol hi there, want to chat?",
+	"ROOM_MESSAGE lobby bob hello everyone in the room",
+	"TERMINATE dave",
+	"HEARTBEAT 30",
+	"LOGIN erin 200 3f9a1c0d2b7e4f6a8c1d3e5f7a9b0c2d"
+};
+const size_t LINE_COUNT = sizeof(LINES) / sizeof(LINES[0]);
+
+// keeps the compiler from throwing away what is parsed
+volatile size_t sink;
+// every opcode that has a name, in opcode order
+std::vector<std::string> names;
+std::vector<Opcode> opcodes;
+
+void collectNames()
+{
+	for (int i = 1; i < 256; ++i) {
+		const char *name = opcodeName((Opcode)i);
+		if (*name != '\0') {
+			names.push_back(name);
+			opcodes.push_back((Opcode)i);
+		}
+	}
+}
+
+Opcode linearFromName(const std::string &name)
+{
+	// the lookup before the perfect hash
+	for (size_t i = 0; i < names.size(); ++i) {
+		if (names[i] == name) {
+			return opcodes[i];
+		}
+	}
+	return Opcode::UNKNOWN;
+}
+
+// a frame as it was before payloads were left in the receive buffer
+struct CopiedFrame {
+	Opcode opcode;
+	std::string payload;
+};
+
+CopiedFrame copyingParse(const char *text)
+{
+	// parseLegacyCommand before it parsed in place
+	CopiedFrame frame;
+	std::string command(text);
+	size_t start = command.find_first_not_of(" \t\n");
+	if (start == std::string::npos) {
+		frame.opcode = Opcode::UNKNOWN;
+		return frame;
+	}
+	size_t end = command.find_first_of(" \t\n", start);
+	frame.opcode = linearFromName(command.substr(start, end - start));
+	if (frame.opcode == Opcode::UNKNOWN) {
+		frame.payload = command;
+	} else if (end != std::string::npos) {
+		frame.payload = command.substr(end + 1);
+	}
+	return frame;
+}
+
+template <typename Function>
+double nanosecondsEach(Function function, int iterations)
+{
+	auto started = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; ++i) {
+		function(i);
+	}
+	auto finished = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(finished - started).count() / iterations;
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+	if (argc > 2 || iterations <= 0) {
+		std::cerr << USAGE;
+		exit(EXIT_FAILURE);
+	}
+	collectNames();
+
+	// a legacy line is split, and three arguments taken from its payload
+	double old_line = nanosecondsEach([](int i) {
+		CopiedFrame frame = copyingParse(LINES[i % LINE_COUNT]);
+		std::istringstream strm(frame.payload);
+		std::string first;
+		std::string second;
+		std::string rest;
+		strm >> first >> second;
+		strm.ignore();
+		getline(strm, rest);
+		sink += first.size() + second.size() + rest.size();
+	}, iterations);
+	double new_line = nanosecondsEach([](int i) {
+		Frame frame = parseLegacyCommand(LINES[i % LINE_COUNT]);
+		PayloadReader strm(frame.payload);
+		TextView first;
+		TextView second;
+		TextView rest;
+		strm >> first >> second;
+		strm.ignore();
+		strm.getLine(rest);
+		sink += first.size() + second.size() + rest.size();
+	}, iterations);
+
+	// frames are decoded from a receive buffer and their arguments read
+	std::string received;
+	for (size_t i = 0; i < LINE_COUNT; ++i) {
+		Frame frame = parseLegacyCommand(LINES[i]);
+		received += encodeFrame(frame.opcode, frame.payload.str());
+	}
+	double old_payload = nanosecondsEach([&received](int i) {
+		size_t offset = 0;
+		Frame frame;
+		while (decodeFrame(received, offset, frame) > 0) {
+			std::istringstream strm(frame.payload.str());
+			std::string first;
+			std::string second;
+			int number = 0;
+			strm >> first >> second >> number;
+			sink += first.size() + second.size() + number;
+		}
+	}, iterations) / LINE_COUNT;
+	double new_payload = nanosecondsEach([&received](int i) {
+		size_t offset = 0;
+		Frame frame;
+		while (decodeFrame(received, offset, frame) > 0) {
+			PayloadReader strm(frame.payload);
+			TextView first;
+			TextView second;
+			int number = 0;
+			strm >> first >> second >> number;
+			sink += first.size() + second.size() + number;
+		}
+	}, iterations) / LINE_COUNT;
+
+	double old_lookup = nanosecondsEach([](int i) {
+		sink += (size_t)linearFromName(names[i % names.size()]);
+	}, iterations);
+	double new_lookup = nanosecondsEach([](int i) {
+		sink += (size_t)opcodeFromName(names[i % names.size()]);
+	}, iterations);
+
+	printf("legacy line and arguments: %.1f ns -> %.1f ns\n", old_line, new_line);
+	printf("frame and its arguments:   %.1f ns -> %.1f ns\n", old_payload, new_payload);
+	printf("opcode name lookup:        %.1f ns -> %.1f ns\n", old_lookup, new_lookup);
+	return EXIT_SUCCESS;
+}
\ No newline at end of file
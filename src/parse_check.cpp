@@ -0,0 +1,221 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "protocol.hpp"
+
+/*
+	Parsing check
+
+	Feeds random payloads and commands to the in-place parsers and compares
+	what they read with the way it used to be done: arguments read with an
+	istringstream, legacy commands copied and split, and opcode names looked
+	up one by one. Tokens are made longer than sixteen bytes often enough
+	that whitespace is found by the SSE2 path as well as byte by byte, and
+	frames are decoded back out of a buffer they were encoded into. Prints
+	the first few mismatches and exits with failure if there were any.
+*/
+
+const char USAGE[] = "usage: ./parse_check [cases] [seed]\n";
+const int DEFAULT_CASES = 300000;
+// how many mismatches are printed before the rest are only counted
+const int REPORTED_MISMATCHES = 5;
+
+// bytes payloads are made of: every kind of whitespace, NUL, bytes with the
+// high bit set and a few that are neither
+const char PAYLOAD_BYTES[] = " \t\n\v\f\r\0\x80\xff\x1f" "ab9-+0LOGIN";
+const size_t PAYLOAD_BYTE_COUNT = sizeof(PAYLOAD_BYTES) - 1;
+
+// every opcode that has a name, in opcode order
+std::vector<std::string> names;
+std::vector<Opcode> opcodes;
+int mismatches = 0;
+
+void collectNames()
+{
+	for (int i = 1; i < 256; ++i) {
+		const char *name = opcodeName((Opcode)i);
+		if (*name != '\0') {
+			names.push_back(name);
+			opcodes.push_back((Opcode)i);
+		}
+	}
+}
+
+Opcode linearFromName(const std::string &name)
+{
+	// the lookup before the perfect hash
+	for (size_t i = 0; i < names.size(); ++i) {
+		if (names[i] == name) {
+			return opcodes[i];
+		}
+	}
+	return Opcode::UNKNOWN;
+}
+
+bool copyingParse(const std::string &command, Opcode &opcode, std::string &payload)
+{
+	// parseLegacyCommand before it parsed in place
+	size_t start = command.find_first_not_of(" \t\n");
+	if (start == std::string::npos) {
+		opcode = Opcode::UNKNOWN;
+		return false;
+	}
+	size_t end = command.find_first_of(" \t\n", start);
+	opcode = linearFromName(command.substr(start, end - start));
+	if (opcode == Opcode::UNKNOWN) {
+		payload = command;
+	} else if (end != std::string::npos) {
+		payload = command.substr(end + 1);
+	}
+	return true;
+}
+
+void mismatch(const char *what, const std::string &input, const std::string &expected, const std::string &got)
+{
+	if (mismatches++ < REPORTED_MISMATCHES) {
+		std::cout << what << " mismatch on \"" << input << "\"\n  expected " << expected << "\n  got      " << got << '\n';
+	}
+}
+
+std::string randomPayload()
+{
+	// mostly short, now and then long enough for whole sixteen byte chunks
+	std::string payload;
+	int length = rand() % 4 == 0 ? rand() % 80 : rand() % 24;
+	for (int i = 0; i < length; ++i) {
+		payload += PAYLOAD_BYTES[rand() % PAYLOAD_BYTE_COUNT];
+	}
+	return payload;
+}
+
+void checkReader(const std::string &payload)
+{
+	// the same reads are made from an istringstream and a reader, and what
+	// each of them gives back is written down
+	std::istringstream strm(payload);
+	PayloadReader reader(payload);
+	std::string expected;
+	std::string got;
+	for (int i = 0; i < 6; ++i) {
+		int read = rand() % 5;
+		if (read == 0) {
+			std::string a = "x";
+			std::string b = "x";
+			strm >> a;
+			reader >> b;
+			expected += a + "|";
+			got += b + "|";
+		} else if (read == 1) {
+			std::string a = "x";
+			TextView b("x");
+			strm >> a;
+			reader >> b;
+			expected += a + "|";
+			got += b.str() + "|";
+		} else if (read == 2) {
+			int a = 7;
+			int b = 7;
+			strm >> a;
+			reader >> b;
+			expected += std::to_string(a) + "|";
+			got += std::to_string(b) + "|";
+		} else if (read == 3) {
+			strm.ignore();
+			reader.ignore();
+		} else {
+			std::string a;
+			std::string b;
+			bool read_a = (bool)getline(strm, a);
+			bool read_b = reader.getLine(b);
+			expected += std::to_string(read_a) + a + "|";
+			got += std::to_string(read_b) + b + "|";
+		}
+	}
+	if (expected != got) {
+		mismatch("payload", payload, expected, got);
+	}
+}
+
+void checkLegacyCommand(const std::string &payload)
+{
+	// a name, sometimes one that is not an opcode's, between whitespace
+	std::string command;
+	for (int i = rand() % 3; i > 0; --i) {
+		command += " \t\n\r"[rand() % 4];
+	}
+	command += rand() % 8 == 0 ? "LOGOUTX" : names[rand() % names.size()];
+	for (int i = rand() % 3; i > 0; --i) {
+		command += " \t\n\r"[rand() % 4];
+	}
+	command += payload;
+	// both stop at the first NUL, as a command read into a buffer does
+	command = command.c_str();
+
+	Opcode opcode;
+	std::string payload_copy;
+	copyingParse(command, opcode, payload_copy);
+	Frame frame = parseLegacyCommand(command.c_str());
+	if (frame.opcode != opcode || frame.payload.str() != payload_copy) {
+		mismatch("command", command, std::string(opcodeName(opcode)) + " " + payload_copy, std::string(opcodeName(frame.opcode)) + " " + frame.payload.str());
+	}
+}
+
+void checkFrames(const std::string &payload)
+{
+	// a frame decodes to what it was encoded from, wherever it lies in the
+	// buffer, and a frame cut short is not decoded at all
+	Opcode opcode = opcodes[rand() % opcodes.size()];
+	std::string buffer = encodeFrame(Opcode::HEARTBEAT, "") + encodeFrame(opcode, payload);
+	size_t offset = 0;
+	Frame frame;
+	if (decodeFrame(buffer, offset, frame) <= 0 || decodeFrame(buffer, offset, frame) <= 0 || frame.opcode != opcode || frame.payload.str() != payload || offset != buffer.size()) {
+		mismatch("frame", payload, "a whole frame", "something else");
+	}
+	std::string partial = buffer.substr(0, buffer.size() - 1);
+	offset = 0;
+	if (decodeFrame(partial, offset, frame) <= 0 || decodeFrame(partial, offset, frame) > 0) {
+		mismatch("partial frame", payload, "no frame", "a frame");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int cases = argc > 1 ? atoi(argv[1]) : DEFAULT_CASES;
+	if (argc > 3 || cases <= 0) {
+		std::cerr << USAGE;
+		exit(EXIT_FAILURE);
+	}
+	srand(argc > 2 ? atoi(argv[2]) : 1);
+	collectNames();
+
+	// every name is found, and nothing close to one is
+	for (size_t i = 0; i < names.size(); ++i) {
+		if (opcodeFromName(names[i]) != opcodes[i]) {
+			mismatch("name", names[i], opcodeName(opcodes[i]), opcodeName(opcodeFromName(names[i])));
+		}
+		std::string longer = names[i] + "S";
+		std::string shorter = names[i].substr(0, names[i].size() - 1);
+		std::string lower = names[i];
+		lower[0] = tolower(lower[0]);
+		if (opcodeFromName(longer) != Opcode::UNKNOWN || opcodeFromName(shorter) != linearFromName(shorter) || opcodeFromName(lower) != Opcode::UNKNOWN) {
+			mismatch("name", names[i], "only the name itself", "something close to it");
+		}
+	}
+
+	for (int i = 0; i < cases; ++i) {
+		std::string payload = randomPayload();
+		checkReader(payload);
+		checkLegacyCommand(payload);
+		checkFrames(payload);
+		if (opcodeFromName(payload) != linearFromName(payload)) {
+			mismatch("name", payload, opcodeName(linearFromName(payload)), opcodeName(opcodeFromName(payload)));
+		}
+	}
+
+	std::cout << cases << " cases, " << mismatches << " mismatches\n";
+	return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
\ No newline at end of file
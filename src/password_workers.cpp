@@ -0,0 +1,159 @@
+#include "password_workers.hpp"
+
+#include <cstring>
+#include <memory>
+
+#include <crypt.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "utils.hpp"
+
+namespace {
+
+const char SALTED_HASH_PREFIX[] = "$6$";
+const size_t SALT_BYTES = 8;
+
+bool constantTimeEquals(const std::string &a, const std::string &b)
+{
+	// how long a comparison takes says nothing about where they differ
+	if (a.size() != b.size()) {
+		return false;
+	}
+	unsigned char difference = 0;
+	for (size_t i = 0; i < a.size(); ++i) {
+		difference |= a[i] ^ b[i];
+	}
+	return difference == 0;
+}
+
+}
+
+bool isSaltedHash(const std::string &stored)
+{
+	return stored.compare(0, strlen(SALTED_HASH_PREFIX), SALTED_HASH_PREFIX) == 0;
+}
+
+PasswordWorkers::PasswordWorkers()
+{
+	rounds = DEFAULT_HASH_ROUNDS;
+	completion_fd = -1;
+	stopping = false;
+	pthread_mutex_init(&mutex, nullptr);
+	pthread_cond_init(&queued_cond, nullptr);
+}
+
+bool PasswordWorkers::start(size_t thread_count, unsigned hash_rounds)
+{
+	// a pool that was stopped can be started again, and keeps its
+	// completion file descriptor
+	rounds = hash_rounds;
+	stopping = false;
+	if (completion_fd < 0 && (completion_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+		return false;
+	}
+	for (size_t i = 0; i < thread_count; ++i) {
+		pthread_t worker;
+		if (pthread_create(&worker, nullptr, workerThread, this) != 0) {
+			return false;
+		}
+		workers.push_back(worker);
+	}
+	return true;
+}
+
+void PasswordWorkers::submit(const PasswordJob &job)
+{
+	pthread_mutex_lock(&mutex);
+	queued.push_back(job);
+	pthread_cond_signal(&queued_cond);
+	pthread_mutex_unlock(&mutex);
+}
+
+std::vector<PasswordJob> PasswordWorkers::completed()
+{
+	uint64_t count;
+	while (read(completion_fd, &count, sizeof(count)) > 0) {
+	}
+	std::vector<PasswordJob> jobs;
+	pthread_mutex_lock(&mutex);
+	jobs.swap(finished);
+	pthread_mutex_unlock(&mutex);
+	return jobs;
+}
+
+int PasswordWorkers::completionFd() const
+{
+	return completion_fd;
+}
+
+std::vector<PasswordJob> PasswordWorkers::stop()
+{
+	// jobs that were already started finish, the ones that were not are
+	// returned without being done
+	pthread_mutex_lock(&mutex);
+	stopping = true;
+	std::vector<PasswordJob> unstarted(queued.begin(), queued.end());
+	queued.clear();
+	pthread_cond_broadcast(&queued_cond);
+	pthread_mutex_unlock(&mutex);
+	for (auto itr = workers.begin(); itr != workers.end(); ++itr) {
+		pthread_join(*itr, nullptr);
+	}
+	workers.clear();
+	return unstarted;
+}
+
+void *PasswordWorkers::workerThread(void *arg)
+{
+	PasswordWorkers *pool = (PasswordWorkers*)arg;
+	// crypt_r keeps its state here, it is too big for the stack
+	std::unique_ptr<struct crypt_data> data(new struct crypt_data());
+	pthread_mutex_lock(&pool->mutex);
+	while (true) {
+		while (pool->queued.empty() && !pool->stopping) {
+			pthread_cond_wait(&pool->queued_cond, &pool->mutex);
+		}
+		if (pool->stopping) {
+			break;
+		}
+		PasswordJob job = pool->queued.front();
+		pool->queued.pop_front();
+		pthread_mutex_unlock(&pool->mutex);
+
+		if (job.kind == PasswordJob::HASH || job.kind == PasswordJob::REHASH) {
+			job.hash = pool->hashPassword(job.password, data.get());
+		} else {
+			job.verified = pool->verifyPassword(job.password, job.stored, data.get());
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->finished.push_back(job);
+		uint64_t one = 1;
+		write(pool->completion_fd, &one, sizeof(one));
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return nullptr;
+}
+
+std::string PasswordWorkers::hashPassword(const std::string &password, struct crypt_data *data) const
+{
+	// returns an empty string if no salt could be made
+	std::string salt = createToken(SALT_BYTES);
+	if (salt.empty()) {
+		return "";
+	}
+	std::string setting = std::string(SALTED_HASH_PREFIX) + "rounds=" + std::to_string(rounds) + "$" + salt + "$";
+	const char *hash = crypt_r(password.c_str(), setting.c_str(), data);
+	return hash != nullptr && *hash != '*' ? hash : "";
+}
+
+bool PasswordWorkers::verifyPassword(const std::string &password, const std::string &stored, struct crypt_data *data) const
+{
+	if (!isSaltedHash(stored)) {
+		return constantTimeEquals(password, stored);
+	}
+	// the stored hash carries its own salt and rounds
+	const char *hash = crypt_r(password.c_str(), stored.c_str(), data);
+	return hash != nullptr && constantTimeEquals(hash, stored);
+}
\ No newline at end of file
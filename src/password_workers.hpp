@@ -0,0 +1,73 @@
+#ifndef PASSWORD_WORKERS_HPP
+#define PASSWORD_WORKERS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+struct crypt_data;
+
+/*
+	Password hashing and verification
+
+	Passwords are stored as salted SHA-512 crypt hashes of what the client
+	sends, "$6$rounds=N$salt$hash", with a salt of its own for every user.
+	Working one out takes long enough on purpose that it is done by a pool
+	of worker threads rather than the event loop: jobs are submitted with
+	the connection they are for, and the finished ones are collected once
+	the completion file descriptor becomes readable.
+
+	Passwords stored before hashes were salted are compared as they are, and
+	hashed again by a REHASH job once the user has logged in with them.
+*/
+
+const unsigned DEFAULT_HASH_ROUNDS = 5000;
+
+struct PasswordJob {
+	enum Kind {
+		HASH,
+		VERIFY,
+		// hash for a password that was verified against an unsalted one
+		REHASH
+	} kind;
+	int fd;
+	uint64_t connection_id;
+	std::string username;
+	std::string password;
+	// stored hash to verify the password against
+	std::string stored;
+	// filled in by the worker
+	std::string hash;
+	bool verified;
+};
+
+class PasswordWorkers {
+public:
+	PasswordWorkers();
+	bool start(size_t, unsigned);
+	void submit(const PasswordJob&);
+	std::vector<PasswordJob> completed();
+	int completionFd() const;
+	std::vector<PasswordJob> stop();
+private:
+	static void *workerThread(void*);
+	std::string hashPassword(const std::string&, struct crypt_data*) const;
+	bool verifyPassword(const std::string&, const std::string&, struct crypt_data*) const;
+	unsigned rounds;
+	// becomes readable whenever jobs have finished
+	int completion_fd;
+	bool stopping;
+	std::deque<PasswordJob> queued;
+	std::vector<PasswordJob> finished;
+	std::vector<pthread_t> workers;
+	pthread_mutex_t mutex;
+	pthread_cond_t queued_cond;
+};
+
+bool isSaltedHash(const std::string&);
+
+#endif
\ No newline at end of file
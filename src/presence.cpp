@@ -0,0 +1,245 @@
+#include "presence.hpp"
+
+#include <vector>
+
+namespace {
+
+const std::shared_ptr<const FriendSet> NO_FRIENDS = std::make_shared<const FriendSet>();
+
+}
+
+Presence::Presence() : write_mutex("presence_mutex")
+{
+}
+
+bool Presence::login(int fd, const std::shared_ptr<User> &user)
+{
+	std::shared_ptr<Session> session = std::make_shared<Session>();
+	session->fd = fd;
+	session->user = user;
+	session->location.version = 0;
+	session->location.family = 0;
+	write_mutex.lock();
+	bool added = addSession(session);
+	write_mutex.unlock();
+	return added;
+}
+
+bool Presence::loginParked(const std::shared_ptr<User> &user, const Location &location)
+{
+	// a session that was parked when it was handed over from another server
+	std::shared_ptr<Session> session = std::make_shared<Session>();
+	session->fd = -1;
+	session->user = user;
+	session->location = location;
+	write_mutex.lock();
+	bool added = addSession(session);
+	write_mutex.unlock();
+	return added;
+}
+
+std::shared_ptr<User> Presence::logout(int fd)
+{
+	write_mutex.lock();
+	std::shared_ptr<const Session> session = getSession(fd);
+	if (session) {
+		removeSession(session);
+	}
+	write_mutex.unlock();
+	return session ? session->user : nullptr;
+}
+
+bool Presence::park(int fd)
+{
+	// the user stays online, friends and all, without a connection
+	write_mutex.lock();
+	std::shared_ptr<const Session> session = getSession(fd);
+	if (session) {
+		std::shared_ptr<Session> parked = std::make_shared<Session>(*session);
+		parked->fd = -1;
+		sessions.erase(fd);
+		sessions_by_name.assign(parked->user->getUsername(), parked);
+	}
+	write_mutex.unlock();
+	return session != nullptr;
+}
+
+bool Presence::resume(const std::string &username, int fd)
+{
+	write_mutex.lock();
+	std::shared_ptr<const Session> session = getSession(username);
+	bool resumed = session && session->fd < 0 && !sessions.contains(fd);
+	if (resumed) {
+		std::shared_ptr<Session> updated = std::make_shared<Session>(*session);
+		updated->fd = fd;
+		sessions.insert(fd, updated);
+		sessions_by_name.assign(username, updated);
+	}
+	write_mutex.unlock();
+	return resumed;
+}
+
+std::shared_ptr<User> Presence::expire(const std::string &username)
+{
+	// only ends the session if it is still parked
+	write_mutex.lock();
+	std::shared_ptr<const Session> session = getSession(username);
+	bool parked = session && session->fd < 0;
+	if (parked) {
+		removeSession(session);
+	}
+	write_mutex.unlock();
+	return parked ? session->user : nullptr;
+}
+
+bool Presence::setLocation(int fd, const Location &location)
+{
+	// a session with the new location replaces the old one
+	write_mutex.lock();
+	std::shared_ptr<const Session> session = getSession(fd);
+	if (session) {
+		std::shared_ptr<Session> updated = std::make_shared<Session>(*session);
+		updated->location = location;
+		sessions.assign(fd, updated);
+		sessions_by_name.assign(updated->user->getUsername(), updated);
+	}
+	write_mutex.unlock();
+	return session != nullptr;
+}
+
+void Presence::addFriendship(const std::string &user1, const std::string &user2)
+{
+	write_mutex.lock();
+	if (isOnline(user1) && isOnline(user2)) {
+		link(user1, user2);
+	}
+	write_mutex.unlock();
+}
+
+std::shared_ptr<const Session> Presence::getSession(int fd) const
+{
+	std::shared_ptr<const Session> session;
+	sessions.find(fd, session);
+	return session;
+}
+
+std::shared_ptr<const Session> Presence::getSession(const std::string &username) const
+{
+	std::shared_ptr<const Session> session;
+	sessions_by_name.find(username, session);
+	return session;
+}
+
+std::shared_ptr<User> Presence::getUser(int fd) const
+{
+	std::shared_ptr<const Session> session = getSession(fd);
+	if (!session) {
+		return nullptr;
+	}
+	return session->user;
+}
+
+int Presence::getFd(const std::string &username) const
+{
+	std::shared_ptr<const Session> session = getSession(username);
+	if (!session) {
+		return -1;
+	}
+	return session->fd;
+}
+
+bool Presence::isOnline(const std::string &username) const
+{
+	return sessions_by_name.contains(username);
+}
+
+bool Presence::isParked(const std::string &username) const
+{
+	std::shared_ptr<const Session> session = getSession(username);
+	return session && session->fd < 0;
+}
+
+std::shared_ptr<const FriendSet> Presence::getOnlineFriends(const std::string &username) const
+{
+	// the set returned stays as it is, however friends come and go
+	std::shared_ptr<FriendSet> friends;
+	if (!online_friends.find(username, friends)) {
+		return NO_FRIENDS;
+	}
+	return friends;
+}
+
+size_t Presence::size() const
+{
+	return sessions.size();
+}
+
+std::string Presence::lockReport() const
+{
+	return write_mutex.report();
+}
+
+LockStats Presence::lockStats() const
+{
+	return write_mutex.stats();
+}
+
+bool Presence::addSession(const std::shared_ptr<Session> &session)
+{
+	// caller holds write_mutex
+	std::string username = session->user->getUsername();
+	if (sessions_by_name.contains(username) || (session->fd >= 0 && sessions.contains(session->fd))) {
+		return false;
+	}
+	if (session->fd >= 0) {
+		sessions.insert(session->fd, session);
+	}
+	sessions_by_name.insert(username, session);
+
+	online_friends.assign(username, std::make_shared<FriendSet>());
+
+	// friendships are made in both directions, so only friends that list
+	// this user back are linked
+	std::vector<std::string> friends = session->user->getFriends();
+	for (auto itr = friends.begin(); itr != friends.end(); ++itr) {
+		std::shared_ptr<const Session> friend_session = getSession(*itr);
+		if (friend_session && friend_session->user->hasFriend(username)) {
+			link(username, *itr);
+		}
+	}
+	return true;
+}
+
+void Presence::removeSession(const std::shared_ptr<const Session> &session)
+{
+	// caller holds write_mutex
+	std::string username = session->user->getUsername();
+	getOnlineFriends(username)->forEach([this, &username](const std::string &friend_username, bool) {
+		unlink(friend_username, username);
+	});
+	online_friends.erase(username);
+	sessions_by_name.erase(username);
+	if (session->fd >= 0) {
+		sessions.erase(session->fd);
+	}
+}
+
+void Presence::link(const std::string &user1, const std::string &user2)
+{
+	// caller holds write_mutex; both users are online
+	std::shared_ptr<FriendSet> friends1;
+	std::shared_ptr<FriendSet> friends2;
+	online_friends.find(user1, friends1);
+	online_friends.find(user2, friends2);
+	friends1->insert(user2, true);
+	friends2->insert(user1, true);
+}
+
+void Presence::unlink(const std::string &user, const std::string &gone)
+{
+	// caller holds write_mutex
+	std::shared_ptr<FriendSet> friends;
+	if (online_friends.find(user, friends)) {
+		friends->erase(gone);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,66 @@
+#ifndef PRESENCE_HPP
+#define PRESENCE_HPP
+
+#include <memory>
+#include <string>
+
+#include "cow_map.hpp"
+#include "timed_mutex.hpp"
+#include "user.hpp"
+
+struct Session {
+	int fd;
+	std::shared_ptr<User> user;
+	Location location;
+};
+
+// friends of a user that are online; a friend coming or going changes only
+// its own entry, the way any CowMap changes, and the value is unused
+typedef CowMap<std::string, bool> FriendSet;
+
+// Logged in users, indexed both by the file descriptor of their session and
+// by username. For every online user the set of friends that are also online
+// is kept up to date, so telling friends about a change in presence only
+// costs as much as the number of friends online.
+//
+// A session can be parked when its connection drops: it keeps the user
+// online, with the same location and friends, but has no file descriptor
+// (-1) until it is resumed on another connection or expired.
+//
+// Sessions are never changed once published and friend sets change one
+// friend at a time, so both are read without locks; changes take
+// write_mutex between themselves. Logging in or out costs as much as the
+// number of friends online, whatever their own numbers of friends.
+class Presence {
+public:
+	Presence();
+	bool login(int, const std::shared_ptr<User>&);
+	bool loginParked(const std::shared_ptr<User>&, const Location&);
+	std::shared_ptr<User> logout(int);
+	bool park(int);
+	bool resume(const std::string&, int);
+	std::shared_ptr<User> expire(const std::string&);
+	bool setLocation(int, const Location&);
+	void addFriendship(const std::string&, const std::string&);
+	std::shared_ptr<const Session> getSession(int) const;
+	std::shared_ptr<const Session> getSession(const std::string&) const;
+	std::shared_ptr<User> getUser(int) const;
+	int getFd(const std::string&) const;
+	bool isOnline(const std::string&) const;
+	bool isParked(const std::string&) const;
+	std::shared_ptr<const FriendSet> getOnlineFriends(const std::string&) const;
+	size_t size() const;
+	std::string lockReport() const;
+	LockStats lockStats() const;
+private:
+	bool addSession(const std::shared_ptr<Session>&);
+	void removeSession(const std::shared_ptr<const Session>&);
+	void link(const std::string&, const std::string&);
+	void unlink(const std::string&, const std::string&);
+	CowMap<int, std::shared_ptr<const Session>> sessions;
+	CowMap<std::string, std::shared_ptr<const Session>> sessions_by_name;
+	CowMap<std::string, std::shared_ptr<FriendSet>> online_friends;
+	TimedMutex write_mutex;
+};
+
+#endif
\ No newline at end of file
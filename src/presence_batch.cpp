@@ -0,0 +1,59 @@
+#include "presence_batch.hpp"
+
+bool PresenceBatch::add(int fd, Opcode opcode, const std::string &username, const std::string &payload)
+{
+	// returns true if this started a new batch
+	bool started = pending.empty();
+	Pending &recipient = pending[fd];
+	auto inserted = recipient.latest.insert(std::make_pair(username, std::make_pair((ssize_t)-1, (ssize_t)-1)));
+	std::pair<ssize_t, ssize_t> &latest = inserted.first->second;
+
+	// superseded events stay in place, marked as dropped, so the order of
+	// the others is kept
+	if (latest.second >= 0) {
+		recipient.events[latest.second].opcode = Opcode::UNKNOWN;
+		latest.second = -1;
+	}
+	ssize_t position = recipient.events.size();
+	if (opcode == Opcode::LOCATION) {
+		// an offline event before it stays, so the user's old location is
+		// forgotten before the new one arrives
+		latest.second = position;
+	} else {
+		if (latest.first >= 0) {
+			recipient.events[latest.first].opcode = Opcode::UNKNOWN;
+		}
+		latest.first = position;
+	}
+	Event event;
+	event.opcode = opcode;
+	event.payload = payload;
+	recipient.events.push_back(event);
+	return started;
+}
+
+void PresenceBatch::forget(int fd)
+{
+	// recipient is gone, and its file descriptor may be reused
+	pending.erase(fd);
+}
+
+bool PresenceBatch::empty() const
+{
+	return pending.empty();
+}
+
+std::map<int, std::vector<PresenceBatch::Event>> PresenceBatch::take()
+{
+	std::map<int, std::vector<Event>> batches;
+	for (auto itr = pending.begin(); itr != pending.end(); ++itr) {
+		std::vector<Event> &events = batches[itr->first];
+		for (auto event_itr = itr->second.events.begin(); event_itr != itr->second.events.end(); ++event_itr) {
+			if (event_itr->opcode != Opcode::UNKNOWN) {
+				events.push_back(*event_itr);
+			}
+		}
+	}
+	pending.clear();
+	return batches;
+}
\ No newline at end of file
@@ -0,0 +1,39 @@
+#ifndef PRESENCE_BATCH_HPP
+#define PRESENCE_BATCH_HPP
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "protocol.hpp"
+
+// Presence notifications (LOCATION, LOGOUT and TERMINATE) waiting to be sent,
+// by recipient. A newer notification about a user replaces an older one in
+// the same batch: a location replaces the previous location, and going
+// offline replaces both, so a storm of logins costs each client one batch
+// rather than a message per event.
+class PresenceBatch {
+public:
+	struct Event {
+		Opcode opcode;
+		std::string payload;
+	};
+	bool add(int, Opcode, const std::string&, const std::string&);
+	void forget(int);
+	bool empty() const;
+	std::map<int, std::vector<Event>> take();
+private:
+	struct Pending {
+		std::vector<Event> events;
+		// where the latest offline and location events about each user
+		// are in events, -1 if there is none
+		std::unordered_map<std::string, std::pair<ssize_t, ssize_t>> latest;
+	};
+	std::map<int, Pending> pending;
+};
+
+#endif
\ No newline at end of file
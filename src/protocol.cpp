@@ -0,0 +1,576 @@
+#include "protocol.hpp"
+
+#include <climits>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "utils.hpp"
+
+namespace {
+
+const char HELLO_MAGIC[] = "MSGR";
+// how long to wait for a HELLO answer before assuming the peer predates framing
+const int HELLO_TIMEOUT_SECONDS = 2;
+
+struct OpcodeEntry {
+	Opcode opcode;
+	const char *name;
+};
+
+constexpr OpcodeEntry OPCODE_NAMES[] = {
+	{Opcode::REGISTER, "REGISTER"},
+	{Opcode::LOGIN, "LOGIN"},
+	{Opcode::LOCATION, "LOCATION"},
+	{Opcode::INVITE, "INVITE"},
+	{Opcode::INVITE_ACCEPT, "INVITE_ACCEPT"},
+	{Opcode::INVITE_FROM, "INVITE_FROM"},
+	{Opcode::INVITE_FAILED, "INVITE_FAILED"},
+	{Opcode::LOGOUT, "LOGOUT"},
+	{Opcode::EXIT, "EXIT"},
+	{Opcode::TERMINATE, "TERMINATE"},
+	{Opcode::SHUTDOWN, "SHUTDOWN"},
+	{Opcode::USER, "USER"},
+	{Opcode::RELAY, "RELAY"},
+	{Opcode::RELAY_FROM, "RELAY_FROM"},
+	{Opcode::RELAY_JOIN, "RELAY_JOIN"},
+	{Opcode::PRESENCE, "PRESENCE"},
+	{Opcode::STATS, "STATS"},
+	{Opcode::ROOM_CREATE, "ROOM_CREATE"},
+	{Opcode::ROOM_JOIN, "ROOM_JOIN"},
+	{Opcode::ROOM_LEAVE, "ROOM_LEAVE"},
+	{Opcode::ROOM_POST, "ROOM_POST"},
+	{Opcode::ROOM_MESSAGE, "ROOM_MESSAGE"},
+	{Opcode::BROADCAST, "BROADCAST"},
+	{Opcode::ROSTER, "ROSTER"},
+	{Opcode::RESUME, "RESUME"},
+	{Opcode::HEARTBEAT, "HEARTBEAT"}
+};
+constexpr size_t OPCODE_NAME_COUNT = sizeof(OPCODE_NAMES) / sizeof(OPCODE_NAMES[0]);
+
+// Names are looked up by a perfect hash of their length and first and last
+// characters. It is checked at compile time, so a new name that collides
+// with another fails the build, and needs other multipliers.
+const size_t NAME_SLOTS = 64;
+
+constexpr size_t nameSlot(char first, char last, size_t length)
+{
+	return ((unsigned char)first * 17 + (unsigned char)last * 38 + length) & (NAME_SLOTS - 1);
+}
+
+constexpr size_t nameLength(const char *name)
+{
+	return *name == '\0' ? 0 : 1 + nameLength(name + 1);
+}
+
+constexpr size_t entrySlot(size_t i)
+{
+	return nameSlot(OPCODE_NAMES[i].name[0], OPCODE_NAMES[i].name[nameLength(OPCODE_NAMES[i].name) - 1], nameLength(OPCODE_NAMES[i].name));
+}
+
+constexpr bool collidesAfter(size_t i, size_t j)
+{
+	return j < OPCODE_NAME_COUNT && (entrySlot(i) == entrySlot(j) || collidesAfter(i, j + 1));
+}
+
+constexpr bool anyCollide(size_t i)
+{
+	return i < OPCODE_NAME_COUNT && (collidesAfter(i, i + 1) || anyCollide(i + 1));
+}
+
+static_assert(!anyCollide(0), "opcode names must hash to different slots");
+
+struct NameTable {
+	const OpcodeEntry *slots[NAME_SLOTS];
+};
+
+// the table is filled in at compile time, one slot per index in the pack
+template <size_t... Slots>
+struct SlotIndices {
+};
+
+template <size_t Count, size_t... Slots>
+struct MakeSlotIndices : MakeSlotIndices<Count - 1, Count - 1, Slots...> {
+};
+
+template <size_t... Slots>
+struct MakeSlotIndices<0, Slots...> {
+	typedef SlotIndices<Slots...> type;
+};
+
+constexpr const OpcodeEntry *entryForSlot(size_t slot, size_t i)
+{
+	return i == OPCODE_NAME_COUNT ? nullptr : entrySlot(i) == slot ? &OPCODE_NAMES[i] : entryForSlot(slot, i + 1);
+}
+
+template <size_t... Slots>
+constexpr NameTable buildNameTable(SlotIndices<Slots...>)
+{
+	return NameTable{{entryForSlot(Slots, 0)...}};
+}
+
+constexpr NameTable NAME_TABLE = buildNameTable(MakeSlotIndices<NAME_SLOTS>::type());
+
+bool isSpace(char c)
+{
+	// what isspace takes for whitespace in the C locale, which is what
+	// arguments were split on when they were read with an istringstream
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+bool isCommandSpace(char c)
+{
+	// what the text protocol separates a command name from its arguments with
+	return c == ' ' || c == '\t' || c == '\n';
+}
+
+template <bool (*Space)(char)>
+size_t findSpace(const char *data, size_t length)
+{
+	// offset of the first whitespace byte, or length if there is none; with
+	// SSE2 sixteen bytes at a time are checked for anything up to ' ', and
+	// only those are looked at one by one
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i space = _mm_set1_epi8(' ');
+	for (; i + 16 <= length; i += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i*)(data + i));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(chunk, space), chunk));
+		for (; mask != 0; mask &= mask - 1) {
+			size_t offset = i + __builtin_ctz(mask);
+			if (Space(data[offset])) {
+				return offset;
+			}
+		}
+	}
+#endif
+	while (i < length && !Space(data[i])) {
+		++i;
+	}
+	return i;
+}
+
+void putUint16(std::string &out, uint16_t value)
+{
+	uint16_t net = htons(value);
+	out.append((const char*)&net, sizeof(net));
+}
+
+void putUint32(std::string &out, uint32_t value)
+{
+	uint32_t net = htonl(value);
+	out.append((const char*)&net, sizeof(net));
+}
+
+uint16_t getUint16(const char *data)
+{
+	uint16_t net;
+	memcpy(&net, data, sizeof(net));
+	return ntohs(net);
+}
+
+uint32_t getUint32(const char *data)
+{
+	uint32_t net;
+	memcpy(&net, data, sizeof(net));
+	return ntohl(net);
+}
+
+}
+
+const char *opcodeName(Opcode opcode)
+{
+	for (const OpcodeEntry &entry : OPCODE_NAMES) {
+		if (entry.opcode == opcode) {
+			return entry.name;
+		}
+	}
+	return "";
+}
+
+Opcode opcodeFromName(const TextView &name)
+{
+	size_t length = name.size();
+	if (length == 0) {
+		return Opcode::UNKNOWN;
+	}
+	const OpcodeEntry *entry = NAME_TABLE.slots[nameSlot(name.data()[0], name.data()[length - 1], length)];
+	if (entry && strncmp(entry->name, name.data(), length) == 0 && entry->name[length] == '\0') {
+		return entry->opcode;
+	}
+	return Opcode::UNKNOWN;
+}
+
+WireFormat detectWireFormat(const char *data, size_t length)
+{
+	// the first bytes a peer sends tell which protocol it speaks
+	if (length < HELLO_MAGIC_SIZE) {
+		return WireFormat::UNKNOWN;
+	}
+	if (memcmp(data, HELLO_MAGIC, HELLO_MAGIC_SIZE) == 0) {
+		return WireFormat::FRAMED;
+	}
+	return WireFormat::LEGACY;
+}
+
+std::string encodeHello(const Hello &hello)
+{
+	std::string out(HELLO_MAGIC, HELLO_MAGIC_SIZE);
+	putUint16(out, hello.min_version);
+	putUint16(out, hello.max_version);
+	putUint32(out, hello.features);
+	return out;
+}
+
+bool decodeHello(const char *data, size_t length, Hello &hello)
+{
+	if (length < HELLO_SIZE || detectWireFormat(data, length) != WireFormat::FRAMED) {
+		return false;
+	}
+	hello.min_version = getUint16(data + 4);
+	hello.max_version = getUint16(data + 6);
+	hello.features = getUint32(data + 8);
+	return true;
+}
+
+uint16_t negotiateVersion(const Hello &hello)
+{
+	// pick the newest version both sides speak, or 0 if there is none
+	uint16_t version = hello.max_version < MAX_PROTOCOL_VERSION ? hello.max_version : MAX_PROTOCOL_VERSION;
+	if (version < hello.min_version || version < MIN_PROTOCOL_VERSION) {
+		return 0;
+	}
+	return version;
+}
+
+std::string encodeFrame(Opcode opcode, const std::string &payload)
+{
+	std::string out;
+	out.reserve(FRAME_HEADER_SIZE + payload.size());
+	putUint32(out, payload.size());
+	out += (char)opcode;
+	out += payload;
+	return out;
+}
+
+std::string encodeFrameHeader(Opcode opcode, uint32_t length)
+{
+	// for payloads that are written separately, e.g. straight from a file
+	std::string out;
+	putUint32(out, length);
+	out += (char)opcode;
+	return out;
+}
+
+bool peekFrameHeader(const std::string &buffer, size_t offset, Opcode &opcode, uint32_t &length)
+{
+	if (buffer.size() - offset < FRAME_HEADER_SIZE) {
+		return false;
+	}
+	length = getUint32(buffer.data() + offset);
+	opcode = (Opcode)buffer[offset + 4];
+	return true;
+}
+
+int decodeFrame(const std::string &buffer, size_t &offset, Frame &frame)
+{
+	// returns 1 and advances offset past the frame if a whole frame is
+	// buffered, 0 if more bytes are needed and -1 if the frame is invalid;
+	// the payload is left where it is in buffer
+	if (buffer.size() - offset < FRAME_HEADER_SIZE) {
+		return 0;
+	}
+	uint32_t length = getUint32(buffer.data() + offset);
+	if (length > MAX_FRAME_PAYLOAD) {
+		return -1;
+	}
+	if (buffer.size() - offset < FRAME_HEADER_SIZE + length) {
+		return 0;
+	}
+	frame.opcode = (Opcode)buffer[offset + 4];
+	frame.payload = TextView(buffer.data() + offset + FRAME_HEADER_SIZE, length);
+	offset += FRAME_HEADER_SIZE + length;
+	return 1;
+}
+
+std::string encodeLegacyCommand(Opcode opcode, const std::string &payload)
+{
+	// text protocol messages are always LEGACY_COMMAND_SIZE bytes and
+	// NUL-terminated, so long payloads get cut off
+	std::string out;
+	if (opcode != Opcode::MESSAGE) {
+		out = opcodeName(opcode);
+		if (!payload.empty()) {
+			out += ' ';
+		}
+	}
+	out += payload;
+	out.resize(LEGACY_COMMAND_SIZE - 1);
+	out += '\0';
+	return out;
+}
+
+Frame parseLegacyCommand(const char *text)
+{
+	return parseLegacyCommand(text, strlen(text));
+}
+
+Frame parseLegacyCommand(const char *text, size_t size)
+{
+	// the command ends at the first NUL, if there is one before size; its
+	// name is looked up where it lies, and the payload points into text
+	Frame frame;
+	size_t length = strnlen(text, size);
+	size_t start = 0;
+	while (start < length && isCommandSpace(text[start])) {
+		++start;
+	}
+	if (start == length) {
+		frame.opcode = Opcode::UNKNOWN;
+		return frame;
+	}
+	size_t end = start + findSpace<isCommandSpace>(text + start, length - start);
+	frame.opcode = opcodeFromName(TextView(text + start, end - start));
+	if (frame.opcode == Opcode::UNKNOWN) {
+		frame.payload = TextView(text, length);
+	} else if (end < length) {
+		frame.payload = TextView(text + end + 1, length - end - 1);
+	}
+	return frame;
+}
+
+std::string encodeMessage(WireFormat format, Opcode opcode, const std::string &payload)
+{
+	if (format == WireFormat::FRAMED) {
+		return encodeFrame(opcode, payload);
+	}
+	return encodeLegacyCommand(opcode, payload);
+}
+
+uint16_t sendHello(int fd, uint32_t offered, uint32_t &features)
+{
+	// offer every version this side speaks along with the given features,
+	// and return the version the other side chose (0 if it did not answer,
+	// i.e. it only speaks text) and the features it agreed to
+	features = 0;
+	Hello hello;
+	hello.min_version = MIN_PROTOCOL_VERSION;
+	hello.max_version = MAX_PROTOCOL_VERSION;
+	hello.features = offered;
+	std::string out = encodeHello(hello);
+	if (!writeAll(fd, out.data(), out.size())) {
+		return 0;
+	}
+
+	struct timeval timeout;
+	timeout.tv_sec = HELLO_TIMEOUT_SECONDS;
+	timeout.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	char answer[HELLO_SIZE];
+	Hello reply;
+	bool answered = readAll(fd, answer, sizeof(answer)) && decodeHello(answer, sizeof(answer), reply);
+
+	timeout.tv_sec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	if (!answered) {
+		return 0;
+	}
+	features = reply.features & offered;
+	return reply.max_version;
+}
+
+uint16_t answerHello(int fd)
+{
+	// read the HELLO the other side opened with and answer it with the
+	// chosen version
+	char data[HELLO_SIZE];
+	Hello hello;
+	if (!readAll(fd, data, sizeof(data)) || !decodeHello(data, sizeof(data), hello)) {
+		return 0;
+	}
+	Hello reply;
+	reply.min_version = reply.max_version = negotiateVersion(hello);
+	reply.features = hello.features & SUPPORTED_FEATURES;
+	std::string out = encodeHello(reply);
+	if (!writeAll(fd, out.data(), out.size())) {
+		return 0;
+	}
+	return reply.max_version;
+}
+
+TextView::TextView() : start(""), length(0)
+{
+}
+
+TextView::TextView(const char *data, size_t size) : start(data), length(size)
+{
+}
+
+TextView::TextView(const std::string &text) : start(text.data()), length(text.size())
+{
+}
+
+const char *TextView::data() const
+{
+	return start;
+}
+
+size_t TextView::size() const
+{
+	return length;
+}
+
+bool TextView::empty() const
+{
+	return length == 0;
+}
+
+std::string TextView::str() const
+{
+	return std::string(start, length);
+}
+
+bool TextView::operator==(const TextView &other) const
+{
+	return length == other.length && memcmp(start, other.start, length) == 0;
+}
+
+bool TextView::operator!=(const TextView &other) const
+{
+	return !(*this == other);
+}
+
+std::ostream &operator<<(std::ostream &out, const TextView &text)
+{
+	return out.write(text.data(), text.size());
+}
+
+std::string operator+(std::string text, const TextView &more)
+{
+	return text.append(more.data(), more.size());
+}
+
+PayloadReader::PayloadReader(const TextView &payload) : next(payload.data()), end(payload.data() + payload.size()), failed(false)
+{
+}
+
+PayloadReader &PayloadReader::operator>>(TextView &token)
+{
+	if (skipSpace()) {
+		size_t length = findSpace<isSpace>(next, end - next);
+		token = TextView(next, length);
+		next += length;
+	}
+	return *this;
+}
+
+PayloadReader &PayloadReader::operator>>(std::string &token)
+{
+	if (skipSpace()) {
+		size_t length = findSpace<isSpace>(next, end - next);
+		token.assign(next, length);
+		next += length;
+	}
+	return *this;
+}
+
+PayloadReader &PayloadReader::operator>>(int &value)
+{
+	long long number;
+	if (readInteger(number, INT_MIN, INT_MAX)) {
+		value = number;
+	}
+	return *this;
+}
+
+PayloadReader &PayloadReader::operator>>(unsigned &value)
+{
+	long long number;
+	if (readInteger(number, 0, UINT_MAX)) {
+		value = number;
+	}
+	return *this;
+}
+
+void PayloadReader::ignore()
+{
+	if (!failed && next < end) {
+		++next;
+	}
+}
+
+bool PayloadReader::getLine(TextView &line)
+{
+	// the rest of the line, without the newline that ends it
+	if (failed || next == end) {
+		failed = true;
+		return false;
+	}
+	const char *newline = (const char*)memchr(next, '\n', end - next);
+	const char *line_end = newline ? newline : end;
+	line = TextView(next, line_end - next);
+	next = newline ? newline + 1 : end;
+	return true;
+}
+
+bool PayloadReader::getLine(std::string &line)
+{
+	TextView view;
+	if (!getLine(view)) {
+		return false;
+	}
+	line.assign(view.data(), view.size());
+	return true;
+}
+
+bool PayloadReader::readInteger(long long &value, long long min, long long max)
+{
+	// an optional sign and the digits after it; 0 if there are none, and
+	// the nearest limit if they are out of range, failing the reader either
+	// way as an istream does. Returns false, leaving value alone, if there
+	// is no token to read.
+	if (!skipSpace()) {
+		return false;
+	}
+	const char *digits = next;
+	bool negative = *digits == '-';
+	if (*digits == '-' || *digits == '+') {
+		++digits;
+	}
+	long long magnitude = 0;
+	const char *itr = digits;
+	for (; itr < end && *itr >= '0' && *itr <= '9'; ++itr) {
+		if (magnitude <= max - min) {
+			magnitude = magnitude * 10 + (*itr - '0');
+		}
+	}
+	if (itr == digits) {
+		failed = true;
+		value = 0;
+		return true;
+	}
+	next = itr;
+	value = negative ? -magnitude : magnitude;
+	if (value < min || value > max) {
+		failed = true;
+		value = value < min ? min : max;
+	}
+	return true;
+}
+
+bool PayloadReader::skipSpace()
+{
+	// false, and the reader failed, if there is no token left
+	while (!failed && next < end && isSpace(*next)) {
+		++next;
+	}
+	failed = failed || next == end;
+	return !failed;
+}
\ No newline at end of file
@@ -0,0 +1,188 @@
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+/*
+	Framed wire protocol
+
+	A client opens a connection with a HELLO carrying the range of protocol
+	versions it speaks:
+
+	"MSGR" | min version (u16) | max version (u16) | feature flags (u32)
+
+	and the other side answers with a HELLO naming the chosen version in both
+	version fields (0 if there is none in common). After the handshake every
+	message is a frame:
+
+	payload length (u32) | opcode (u8) | payload
+
+	with integers in network byte order. Payloads are the arguments of the
+	command as text, e.g. "alice 200" for a successful REGISTER of alice.
+
+	Feature flags in the HELLO are the optional extensions a side supports,
+	and the answer carries the ones both sides support.
+
+	Peers that never send a HELLO speak the original text protocol, in which
+	every message is a 256-byte buffer holding "COMMAND arguments".
+*/
+
+const uint16_t MIN_PROTOCOL_VERSION = 1;
+const uint16_t MAX_PROTOCOL_VERSION = 1;
+const size_t LEGACY_COMMAND_SIZE = 256;
+const size_t HELLO_MAGIC_SIZE = 4;
+const size_t HELLO_SIZE = 12;
+const size_t FRAME_HEADER_SIZE = 5;
+const uint32_t MAX_FRAME_PAYLOAD = 64 * 1024;
+
+// presence notifications may arrive batched in a PRESENCE frame
+const uint32_t FEATURE_PRESENCE_BATCH = 1 << 0;
+// frames may arrive compressed, see compression.hpp
+const uint32_t FEATURE_COMPRESSION = 1 << 1;
+// a successful LOGIN is followed by the friends online in ROSTER frames,
+// see roster_log.hpp
+const uint32_t FEATURE_ROSTER = 1 << 2;
+// a successful LOGIN carries a token that gets the session back with a
+// RESUME after the connection drops
+const uint32_t FEATURE_RESUME = 1 << 3;
+// either side probes a connection gone quiet with a HEARTBEAT, and drops it
+// once it has been silent for too long
+const uint32_t FEATURE_HEARTBEAT = 1 << 4;
+const uint32_t SUPPORTED_FEATURES = FEATURE_PRESENCE_BATCH | FEATURE_COMPRESSION | FEATURE_ROSTER | FEATURE_RESUME | FEATURE_HEARTBEAT;
+
+enum class Opcode : uint8_t {
+	UNKNOWN = 0,
+	REGISTER,
+	LOGIN,
+	LOCATION,
+	INVITE,
+	INVITE_ACCEPT,
+	INVITE_FROM,
+	INVITE_FAILED,
+	LOGOUT,
+	EXIT,
+	TERMINATE,
+	SHUTDOWN,
+	// peer to peer
+	USER,
+	MESSAGE,
+	// relayed peer to peer, see relay.hpp
+	RELAY,
+	RELAY_FROM,
+	RELAY_JOIN,
+	// one line per LOCATION, LOGOUT or TERMINATE, each as "COMMAND arguments"
+	PRESENCE,
+	// server metrics in the Prometheus text format
+	STATS,
+	// peer to peer file transfer, framed connections only: an offer of
+	// "crc size name", accepted with "crc 200 offset" to resume from, then the
+	// file in FILE_DATA chunks and a FILE_DONE of "crc status" once checked
+	FILE_OFFER,
+	FILE_ACCEPT,
+	FILE_DATA,
+	FILE_DONE,
+	// group chat rooms, see rooms.hpp; a post is delivered to the other
+	// members as a ROOM_MESSAGE of "room sender message"
+	ROOM_CREATE,
+	ROOM_JOIN,
+	ROOM_LEAVE,
+	ROOM_POST,
+	ROOM_MESSAGE,
+	// announcement from the server operator to every client
+	BROADCAST,
+	// friends online at login: a first line of "version kind more", kind
+	// being full or delta and more 1 if another ROSTER frame follows, then
+	// one line per friend as in PRESENCE
+	ROSTER,
+	// "username token" of a session whose connection dropped, optionally
+	// followed by a roster version as in LOGIN; answered with "username 200
+	// token", the token to resume with next time, or "username 500"
+	RESUME,
+	// probe carrying the sender's heartbeat interval in seconds, answered
+	// with an empty HEARTBEAT, which is not answered
+	HEARTBEAT
+};
+
+enum class WireFormat {
+	UNKNOWN,
+	LEGACY,
+	FRAMED
+};
+
+// Bytes that live somewhere else, e.g. in the buffer a message was received
+// into, and are only valid as long as that buffer is left alone.
+class TextView {
+public:
+	TextView();
+	TextView(const char*, size_t);
+	TextView(const std::string&);
+	const char *data() const;
+	size_t size() const;
+	bool empty() const;
+	std::string str() const;
+	bool operator==(const TextView&) const;
+	bool operator!=(const TextView&) const;
+private:
+	const char *start;
+	size_t length;
+};
+
+std::ostream &operator<<(std::ostream&, const TextView&);
+std::string operator+(std::string, const TextView&);
+
+// the payload points into the buffer the frame was decoded from
+struct Frame {
+	Opcode opcode;
+	TextView payload;
+};
+
+struct Hello {
+	uint16_t min_version;
+	uint16_t max_version;
+	uint32_t features;
+};
+
+// Reads the arguments of a command from its payload the way an
+// istringstream does with >>, ignore and getline, but in place. A token read
+// into a TextView points into the payload and costs no copy; one read into a
+// string is copied into it, reusing what the string has allocated. The
+// payload must outlive the reader and the views read from it.
+class PayloadReader {
+public:
+	explicit PayloadReader(const TextView&);
+	PayloadReader &operator>>(TextView&);
+	PayloadReader &operator>>(std::string&);
+	PayloadReader &operator>>(int&);
+	PayloadReader &operator>>(unsigned&);
+	void ignore();
+	bool getLine(TextView&);
+	bool getLine(std::string&);
+private:
+	bool skipSpace();
+	bool readInteger(long long&, long long, long long);
+	const char *next;
+	const char *end;
+	bool failed;
+};
+
+const char *opcodeName(Opcode);
+Opcode opcodeFromName(const TextView&);
+WireFormat detectWireFormat(const char*, size_t);
+std::string encodeHello(const Hello&);
+bool decodeHello(const char*, size_t, Hello&);
+uint16_t negotiateVersion(const Hello&);
+std::string encodeFrame(Opcode, const std::string&);
+std::string encodeFrameHeader(Opcode, uint32_t);
+bool peekFrameHeader(const std::string&, size_t, Opcode&, uint32_t&);
+int decodeFrame(const std::string&, size_t&, Frame&);
+std::string encodeLegacyCommand(Opcode, const std::string&);
+Frame parseLegacyCommand(const char*);
+Frame parseLegacyCommand(const char*, size_t);
+std::string encodeMessage(WireFormat, Opcode, const std::string&);
+uint16_t sendHello(int, uint32_t, uint32_t&);
+uint16_t answerHello(int);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,167 @@
+#include "relay.hpp"
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+Relays::~Relays()
+{
+	closeAll();
+}
+
+bool Relays::add(int fd1, int fd2)
+{
+	int forward[2];
+	int backward[2];
+	if (pipe2(forward, O_NONBLOCK) < 0) {
+		return false;
+	}
+	if (pipe2(backward, O_NONBLOCK) < 0) {
+		close(forward[0]);
+		close(forward[1]);
+		return false;
+	}
+	End end1 = {fd2, forward[0], forward[1], 0, false, false};
+	End end2 = {fd1, backward[0], backward[1], 0, false, false};
+	ends[fd1] = end1;
+	ends[fd2] = end2;
+	return true;
+}
+
+bool Relays::contains(int fd) const
+{
+	return ends.count(fd) > 0;
+}
+
+size_t Relays::size() const
+{
+	// each relay has two ends
+	return ends.size() / 2;
+}
+
+int Relays::peer(int fd) const
+{
+	auto itr = ends.find(fd);
+	if (itr == ends.end()) {
+		return -1;
+	}
+	return itr->second.peer;
+}
+
+bool Relays::pump(int fd)
+{
+	// move whatever can be moved in both directions, returns false once the
+	// relay has failed or both sides are done
+	auto itr = ends.find(fd);
+	if (itr == ends.end()) {
+		return false;
+	}
+	int other = itr->second.peer;
+	if (!transfer(fd) || !transfer(other)) {
+		return false;
+	}
+	return !(ends[fd].shut && ends[other].shut);
+}
+
+uint32_t Relays::events(int fd) const
+{
+	// read only into an empty pipe, so a slow reader holds up its peer
+	// instead of the server buffering for it
+	auto itr = ends.find(fd);
+	if (itr == ends.end()) {
+		return 0;
+	}
+	uint32_t events = 0;
+	if (!itr->second.eof && itr->second.buffered == 0) {
+		events |= EPOLLIN | EPOLLRDHUP;
+	}
+	auto peer_itr = ends.find(itr->second.peer);
+	if (peer_itr != ends.end() && peer_itr->second.buffered > 0) {
+		events |= EPOLLOUT;
+	}
+	return events;
+}
+
+void Relays::remove(int fd)
+{
+	// closes both sockets of the pair along with the pipes
+	auto itr = ends.find(fd);
+	if (itr == ends.end()) {
+		return;
+	}
+	int fds[2] = {fd, itr->second.peer};
+	for (int i = 0; i < 2; ++i) {
+		auto end_itr = ends.find(fds[i]);
+		if (end_itr != ends.end()) {
+			close(end_itr->second.pipe_read);
+			close(end_itr->second.pipe_write);
+			ends.erase(end_itr);
+		}
+		close(fds[i]);
+	}
+}
+
+void Relays::closeAll()
+{
+	while (!ends.empty()) {
+		remove(ends.begin()->first);
+	}
+}
+
+std::map<int, Relays::End> Relays::release()
+{
+	// gives up every relay without closing anything, so they can be handed
+	// to another process
+	std::map<int, End> released;
+	released.swap(ends);
+	return released;
+}
+
+void Relays::adopt(int fd, const End &end)
+{
+	ends[fd] = end;
+}
+
+bool Relays::transfer(int from)
+{
+	// splice from the socket into its pipe, and from the pipe into the peer
+	End &end = ends[from];
+	while (true) {
+		ssize_t moved;
+		if (end.buffered > 0) {
+			moved = splice(end.pipe_read, nullptr, end.peer, nullptr, end.buffered, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (moved > 0) {
+				end.buffered -= moved;
+				continue;
+			}
+		} else if (!end.eof) {
+			moved = splice(from, nullptr, end.pipe_write, nullptr, RELAY_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (moved > 0) {
+				end.buffered += moved;
+				continue;
+			}
+			if (moved == 0) {
+				end.eof = true;
+				continue;
+			}
+		} else {
+			break;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			break;
+		}
+		return false;
+	}
+	if (end.eof && end.buffered == 0 && !end.shut) {
+		// pass the end of the stream on
+		shutdown(end.peer, SHUT_WR);
+		end.shut = true;
+	}
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,55 @@
+#ifndef RELAY_HPP
+#define RELAY_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+
+/*
+	Relayed peer to peer connections
+
+	A client that can not connect to a friend directly, e.g. because the
+	friend is behind a NAT, asks the server with RELAY friend. The server
+	hands both of them a token (RELAY to the client, RELAY_FROM to the
+	friend), and each opens a new connection to the server and sends
+	RELAY_JOIN token. Once both have joined they are told "token 200" and
+	from then on the two connections carry the peer to peer protocol.
+
+	The server moves relayed bytes with splice through a pipe per direction,
+	so they are never copied into user space.
+*/
+
+// bytes read from one end that may wait for the other end to take them
+const size_t RELAY_PIPE_SIZE = 64 * 1024;
+
+class Relays {
+public:
+	// one socket of a relayed pair, and the pipe holding what was read from
+	// it for the other one
+	struct End {
+		int peer;
+		int pipe_read;
+		int pipe_write;
+		size_t buffered;
+		// nothing more will be read from the socket
+		bool eof;
+		// the other socket has been told there is nothing more
+		bool shut;
+	};
+	~Relays();
+	bool add(int, int);
+	bool contains(int) const;
+	size_t size() const;
+	int peer(int) const;
+	bool pump(int);
+	uint32_t events(int) const;
+	void remove(int);
+	void closeAll();
+	std::map<int, End> release();
+	void adopt(int, const End&);
+private:
+	bool transfer(int);
+	std::map<int, End> ends;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,128 @@
+#include "rooms.hpp"
+
+namespace {
+
+const std::shared_ptr<const RoomSet> NO_ROOMS = std::make_shared<const RoomSet>();
+
+}
+
+Rooms::Rooms() : write_mutex("rooms_mutex")
+{
+}
+
+bool Rooms::create(const std::string &room, const std::string &username)
+{
+	write_mutex.lock();
+	if (rooms.contains(room)) {
+		write_mutex.unlock();
+		return false;
+	}
+	rooms.insert(room, std::make_shared<const MemberSet>());
+	addMember(room, username);
+	write_mutex.unlock();
+	return true;
+}
+
+bool Rooms::join(const std::string &room, const std::string &username)
+{
+	write_mutex.lock();
+	bool exists = rooms.contains(room);
+	if (exists) {
+		addMember(room, username);
+	}
+	write_mutex.unlock();
+	return exists;
+}
+
+bool Rooms::leave(const std::string &room, const std::string &username)
+{
+	write_mutex.lock();
+	std::shared_ptr<const MemberSet> members = getMembers(room);
+	bool member = members && members->count(username) > 0;
+	if (member) {
+		removeMember(room, username);
+	}
+	write_mutex.unlock();
+	return member;
+}
+
+void Rooms::leaveAll(const std::string &username)
+{
+	write_mutex.lock();
+	std::shared_ptr<const RoomSet> joined = getUserRooms(username);
+	for (auto itr = joined->begin(); itr != joined->end(); ++itr) {
+		removeMember(*itr, username);
+	}
+	write_mutex.unlock();
+}
+
+std::shared_ptr<const MemberSet> Rooms::getMembers(const std::string &room) const
+{
+	// the set returned stays as it is, however members come and go
+	std::shared_ptr<const MemberSet> members;
+	rooms.find(room, members);
+	return members;
+}
+
+std::vector<std::string> Rooms::getRooms() const
+{
+	std::vector<std::string> names;
+	rooms.forEach([&names](const std::string &room, const std::shared_ptr<const MemberSet>&) {
+		names.push_back(room);
+	});
+	return names;
+}
+
+size_t Rooms::size() const
+{
+	return rooms.size();
+}
+
+std::string Rooms::lockReport() const
+{
+	return write_mutex.report();
+}
+
+LockStats Rooms::lockStats() const
+{
+	return write_mutex.stats();
+}
+
+void Rooms::addMember(const std::string &room, const std::string &username)
+{
+	// caller holds write_mutex
+	std::shared_ptr<MemberSet> members = std::make_shared<MemberSet>(*getMembers(room));
+	std::shared_ptr<RoomSet> joined = std::make_shared<RoomSet>(*getUserRooms(username));
+	members->insert(username);
+	joined->insert(room);
+	rooms.assign(room, members);
+	user_rooms.assign(username, joined);
+}
+
+void Rooms::removeMember(const std::string &room, const std::string &username)
+{
+	// caller holds write_mutex; a room nobody is left in goes away
+	std::shared_ptr<MemberSet> members = std::make_shared<MemberSet>(*getMembers(room));
+	std::shared_ptr<RoomSet> joined = std::make_shared<RoomSet>(*getUserRooms(username));
+	members->erase(username);
+	joined->erase(room);
+	if (members->empty()) {
+		rooms.erase(room);
+	} else {
+		rooms.assign(room, members);
+	}
+	if (joined->empty()) {
+		user_rooms.erase(username);
+	} else {
+		user_rooms.assign(username, joined);
+	}
+}
+
+std::shared_ptr<const RoomSet> Rooms::getUserRooms(const std::string &username) const
+{
+	std::shared_ptr<const RoomSet> joined;
+	if (!user_rooms.find(username, joined)) {
+		return NO_ROOMS;
+	}
+	return joined;
+}
\ No newline at end of file
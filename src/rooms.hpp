@@ -0,0 +1,44 @@
+#ifndef ROOMS_HPP
+#define ROOMS_HPP
+
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "cow_map.hpp"
+#include "timed_mutex.hpp"
+
+typedef std::unordered_set<std::string> MemberSet;
+typedef std::unordered_set<std::string> RoomSet;
+
+// Group chat rooms, each a named set of users that messages posted to the
+// room go to. The user who creates a room is its first member, and a room
+// is removed once its last member leaves. Users leave every room they are
+// in when they log out.
+//
+// Like Presence, member and room sets are never changed once published, so
+// a post fans out to a snapshot of the members read without locks; changes
+// take write_mutex between themselves.
+class Rooms {
+public:
+	Rooms();
+	bool create(const std::string&, const std::string&);
+	bool join(const std::string&, const std::string&);
+	bool leave(const std::string&, const std::string&);
+	void leaveAll(const std::string&);
+	std::shared_ptr<const MemberSet> getMembers(const std::string&) const;
+	std::vector<std::string> getRooms() const;
+	size_t size() const;
+	std::string lockReport() const;
+	LockStats lockStats() const;
+private:
+	void addMember(const std::string&, const std::string&);
+	void removeMember(const std::string&, const std::string&);
+	std::shared_ptr<const RoomSet> getUserRooms(const std::string&) const;
+	CowMap<std::string, std::shared_ptr<const MemberSet>> rooms;
+	CowMap<std::string, std::shared_ptr<const RoomSet>> user_rooms;
+	TimedMutex write_mutex;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,105 @@
+#include "roster_log.hpp"
+
+#include <cstdlib>
+
+RosterLog::RosterLog(size_t capacity) : capacity(capacity), last(0), mutex("roster_mutex")
+{
+}
+
+void RosterLog::start(const std::string &instance, uint64_t last, const std::vector<std::pair<uint64_t, std::string>> &handed)
+{
+	// called before any thread records, with no changes by a new server and
+	// with the ones handed over, oldest first, by a server taking over
+	mutex.lock();
+	this->instance = instance;
+	this->last = last;
+	changes.assign(handed.begin(), handed.end());
+	while (changes.size() > capacity) {
+		changes.pop_front();
+	}
+	mutex.unlock();
+}
+
+void RosterLog::record(const std::string &username)
+{
+	// callers change the presence first, so anyone who reads the version
+	// after this also sees the change
+	mutex.lock();
+	changes.push_back(std::make_pair(++last, username));
+	if (changes.size() > capacity) {
+		changes.pop_front();
+	}
+	mutex.unlock();
+}
+
+std::string RosterLog::version() const
+{
+	mutex.lock();
+	std::string current = formatVersion(last);
+	mutex.unlock();
+	return current;
+}
+
+bool RosterLog::changedSince(const std::string &version, std::unordered_set<std::string> &changed, std::string &current) const
+{
+	// adds the users that changed after the given version, and returns false
+	// if the changes since then are not all known; current is set to the
+	// version including every change there is
+	size_t separator = version.find('.');
+	bool ours = separator != std::string::npos && version.compare(0, separator, instance) == 0;
+	char *end = nullptr;
+	uint64_t since = ours ? strtoull(version.c_str() + separator + 1, &end, 10) : 0;
+	ours = ours && end != nullptr && *end == '\0';
+
+	mutex.lock();
+	current = formatVersion(last);
+	// the change right after the version has to be the oldest kept or newer
+	uint64_t oldest = changes.empty() ? last + 1 : changes.front().first;
+	bool known = ours && since <= last && since + 1 >= oldest;
+	if (known) {
+		for (auto itr = changes.rbegin(); itr != changes.rend() && itr->first > since; ++itr) {
+			changed.insert(itr->second);
+		}
+	}
+	mutex.unlock();
+	return known;
+}
+
+std::string RosterLog::getInstance() const
+{
+	mutex.lock();
+	std::string current = instance;
+	mutex.unlock();
+	return current;
+}
+
+uint64_t RosterLog::getLast() const
+{
+	mutex.lock();
+	uint64_t current = last;
+	mutex.unlock();
+	return current;
+}
+
+std::vector<std::pair<uint64_t, std::string>> RosterLog::getChanges() const
+{
+	mutex.lock();
+	std::vector<std::pair<uint64_t, std::string>> copy(changes.begin(), changes.end());
+	mutex.unlock();
+	return copy;
+}
+
+std::string RosterLog::lockReport() const
+{
+	return mutex.report();
+}
+
+LockStats RosterLog::lockStats() const
+{
+	return mutex.stats();
+}
+
+std::string RosterLog::formatVersion(uint64_t number) const
+{
+	return instance + "." + std::to_string(number);
+}
\ No newline at end of file
@@ -0,0 +1,44 @@
+#ifndef ROSTER_LOG_HPP
+#define ROSTER_LOG_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "timed_mutex.hpp"
+
+// Numbered log of presence changes, so a client that logs in again can be
+// sent only the friends that changed since the roster it already has. Every
+// time a user comes online somewhere, goes offline or makes a new friend,
+// the username is logged under the next number; a roster version is the
+// number of the last change it includes, prefixed with a token that tells
+// this log apart from those of servers started earlier.
+//
+// Only the most recent changes are kept, a client with an older version
+// than that (or one from another server) gets its whole roster again.
+class RosterLog {
+public:
+	explicit RosterLog(size_t);
+	void start(const std::string&, uint64_t, const std::vector<std::pair<uint64_t, std::string>>&);
+	void record(const std::string&);
+	std::string version() const;
+	bool changedSince(const std::string&, std::unordered_set<std::string>&, std::string&) const;
+	std::string getInstance() const;
+	uint64_t getLast() const;
+	std::vector<std::pair<uint64_t, std::string>> getChanges() const;
+	std::string lockReport() const;
+	LockStats lockStats() const;
+private:
+	std::string formatVersion(uint64_t) const;
+	size_t capacity;
+	std::string instance;
+	uint64_t last;
+	std::deque<std::pair<uint64_t, std::string>> changes;
+	mutable TimedMutex mutex;
+};
+
+#endif
\ No newline at end of file
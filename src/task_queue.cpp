@@ -0,0 +1,78 @@
+#include "task_queue.hpp"
+
+#include <cstdint>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+TaskQueue::TaskQueue()
+{
+	head = nullptr;
+	wake_fd = -1;
+}
+
+TaskQueue::~TaskQueue()
+{
+	Node *node = head.exchange(nullptr);
+	while (node) {
+		Node *next = node->next;
+		delete node;
+		node = next;
+	}
+	if (wake_fd >= 0) {
+		close(wake_fd);
+	}
+}
+
+bool TaskQueue::open()
+{
+	wake_fd = eventfd(0, EFD_NONBLOCK);
+	return wake_fd >= 0;
+}
+
+void TaskQueue::push(const std::function<void()> &task)
+{
+	Node *node = new Node;
+	node->task = task;
+	node->next = head.load(std::memory_order_relaxed);
+	while (!head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed)) {
+	}
+	// only the push that finds the stack empty has to wake the owner, the
+	// others are taken along with it
+	if (!node->next) {
+		uint64_t one = 1;
+		write(wake_fd, &one, sizeof(one));
+	}
+}
+
+bool TaskQueue::run()
+{
+	// returns whether there was anything to run; the wakeup is reset before
+	// the stack is taken, so a task pushed in between wakes the owner again
+	// rather than being missed
+	uint64_t count;
+	while (read(wake_fd, &count, sizeof(count)) > 0) {
+	}
+	Node *node = head.exchange(nullptr, std::memory_order_acquire);
+	bool ran = node != nullptr;
+	// the stack is newest first
+	Node *oldest = nullptr;
+	while (node) {
+		Node *next = node->next;
+		node->next = oldest;
+		oldest = node;
+		node = next;
+	}
+	while (oldest) {
+		Node *next = oldest->next;
+		oldest->task();
+		delete oldest;
+		oldest = next;
+	}
+	return ran;
+}
+
+int TaskQueue::wakeFd() const
+{
+	return wake_fd;
+}
\ No newline at end of file
@@ -0,0 +1,37 @@
+#ifndef TASK_QUEUE_HPP
+#define TASK_QUEUE_HPP
+
+#include <atomic>
+#include <functional>
+
+/*
+	Tasks handed to a thread by other threads
+
+	Any thread can push a task without taking a lock: tasks are pushed onto
+	an atomic stack, and the thread that owns the queue takes the whole
+	stack at once and runs the tasks oldest first. The wake file descriptor
+	becomes readable when the stack goes from empty to not, so the owner
+	can wait for tasks in its event loop, and a burst of tasks costs a
+	single wakeup.
+*/
+
+class TaskQueue {
+public:
+	TaskQueue();
+	~TaskQueue();
+	TaskQueue(const TaskQueue&) = delete;
+	TaskQueue &operator=(const TaskQueue&) = delete;
+	bool open();
+	void push(const std::function<void()>&);
+	bool run();
+	int wakeFd() const;
+private:
+	struct Node {
+		std::function<void()> task;
+		Node *next;
+	};
+	std::atomic<Node*> head;
+	int wake_fd;
+};
+
+#endif
\ No newline at end of file
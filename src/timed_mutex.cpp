@@ -0,0 +1,65 @@
+#include "timed_mutex.hpp"
+
+#include "metrics.hpp"
+
+namespace {
+
+uint64_t elapsedNs(const struct timespec &start, const struct timespec &end)
+{
+	return (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+}
+
+}
+
+TimedMutex::TimedMutex(const char *n)
+{
+	name = n;
+	slot = claimLockSlot();
+	pthread_mutex_init(&mutex, nullptr);
+}
+
+TimedMutex::~TimedMutex()
+{
+	pthread_mutex_destroy(&mutex);
+}
+
+void TimedMutex::lock()
+{
+	// a free mutex is not waited for, so it needs no clock before it
+	if (pthread_mutex_trylock(&mutex) == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &acquired);
+		recordLockAcquired(slot, 0);
+		return;
+	}
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&mutex);
+	clock_gettime(CLOCK_MONOTONIC, &acquired);
+	recordLockAcquired(slot, elapsedNs(start, acquired));
+}
+
+void TimedMutex::unlock()
+{
+	struct timespec released;
+	clock_gettime(CLOCK_MONOTONIC, &released);
+	recordLockReleased(slot, elapsedNs(acquired, released));
+	pthread_mutex_unlock(&mutex);
+}
+
+std::string TimedMutex::report() const
+{
+	LockStats current = stats();
+	return std::string(name) + ": " + std::to_string(current.acquisitions) + " acquisitions, "
+		+ std::to_string(current.wait_ns / 1000) + " us waiting, "
+		+ std::to_string(current.hold_ns / 1000) + " us held, "
+		+ std::to_string(current.acquisitions > 0 ? current.hold_ns / current.acquisitions : 0) + " ns mean hold, "
+		+ std::to_string(current.max_hold_ns / 1000) + " us max hold";
+}
+
+LockStats TimedMutex::stats() const
+{
+	LockStats current;
+	current.name = name;
+	sumLockStats(slot, current);
+	return current;
+}
\ No newline at end of file
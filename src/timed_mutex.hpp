@@ -0,0 +1,41 @@
+#ifndef TIMED_MUTEX_HPP
+#define TIMED_MUTEX_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <pthread.h>
+#include <time.h>
+
+struct LockStats {
+	const char *name;
+	uint64_t acquisitions;
+	uint64_t wait_ns;
+	uint64_t hold_ns;
+	uint64_t max_hold_ns;
+};
+
+// Mutex that keeps track of how long it is waited for and held, so the
+// time spent under locks on the hot path can be measured. The timings are
+// kept with the metrics of the thread that takes the lock.
+class TimedMutex {
+public:
+	explicit TimedMutex(const char*);
+	~TimedMutex();
+	TimedMutex(const TimedMutex&) = delete;
+	TimedMutex &operator=(const TimedMutex&) = delete;
+	void lock();
+	void unlock();
+	std::string report() const;
+	LockStats stats() const;
+private:
+	const char *name;
+	pthread_mutex_t mutex;
+	// where the timings are kept in each thread's metrics
+	size_t slot;
+	// only valid while the mutex is held
+	struct timespec acquired;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,71 @@
+#include "timer_wheel.hpp"
+
+TimerWheel::TimerWheel() : current(0), count(0)
+{
+}
+
+void TimerWheel::schedule(int fd, uint64_t id, uint64_t expires)
+{
+	// a timer already due expires on the next tick, and one further off
+	// than the wheel reaches on the last tick it does
+	const uint64_t reach = (uint64_t)1 << (SLOT_BITS * LEVELS);
+	Timer timer;
+	timer.fd = fd;
+	timer.id = id;
+	timer.expires = expires;
+	if (timer.expires <= current) {
+		timer.expires = current + 1;
+	} else if (timer.expires - current >= reach) {
+		timer.expires = current + reach - 1;
+	}
+	place(timer);
+	++count;
+}
+
+void TimerWheel::advance(uint64_t now, std::vector<Timer> &expired)
+{
+	// one tick at a time up to now, adding the timers that expire to expired
+	while (current < now) {
+		++current;
+		// the slots of higher levels whose span starts with this tick are
+		// spread over the levels below, highest first
+		size_t level = 1;
+		while (level < LEVELS && (current & (((uint64_t)1 << (SLOT_BITS * level)) - 1)) == 0) {
+			++level;
+		}
+		while (--level > 0) {
+			std::vector<Timer> &slot = slots[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)];
+			std::vector<Timer> timers;
+			timers.swap(slot);
+			for (auto itr = timers.begin(); itr != timers.end(); ++itr) {
+				place(*itr);
+			}
+		}
+		std::vector<Timer> &slot = slots[0][current & (SLOTS - 1)];
+		expired.insert(expired.end(), slot.begin(), slot.end());
+		count -= slot.size();
+		// the slot keeps its capacity for the timers to come
+		slot.clear();
+	}
+}
+
+uint64_t TimerWheel::now() const
+{
+	return current;
+}
+
+size_t TimerWheel::size() const
+{
+	return count;
+}
+
+void TimerWheel::place(const Timer &timer)
+{
+	// the lowest level whose span still reaches the timer; its slot is
+	// picked by the timer's own tick, so the slots turn with the wheel
+	size_t level = 0;
+	while (level < LEVELS - 1 && timer.expires - current >= (uint64_t)1 << (SLOT_BITS * (level + 1))) {
+		++level;
+	}
+	slots[level][(timer.expires >> (SLOT_BITS * level)) & (SLOTS - 1)].push_back(timer);
+}
\ No newline at end of file
@@ -0,0 +1,42 @@
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Timers of a reactor's connections, by the tick they expire in. The wheel
+// has LEVELS levels of SLOTS slots each: level 0 holds the timers due in the
+// next SLOTS ticks, one slot a tick, and every level above it covers SLOTS
+// times the span of the one below, one slot a span of the level below. A
+// slot of a higher level is spread over the level below as its time comes
+// up, so scheduling and expiring a timer both cost the same however many
+// timers there are and however far off they are.
+//
+// Timers are never cancelled: whoever set one checks, when it expires,
+// whether it still stands for anything, e.g. that the connection it is for
+// is still open, and sets a new one if need be.
+class TimerWheel {
+public:
+	struct Timer {
+		int fd;
+		// tells connections apart when a file descriptor is reused
+		uint64_t id;
+		uint64_t expires;
+	};
+	TimerWheel();
+	void schedule(int, uint64_t, uint64_t);
+	void advance(uint64_t, std::vector<Timer>&);
+	uint64_t now() const;
+	size_t size() const;
+private:
+	static const size_t LEVELS = 4;
+	static const unsigned SLOT_BITS = 6;
+	static const size_t SLOTS = 1 << SLOT_BITS;
+	void place(const Timer&);
+	std::vector<Timer> slots[LEVELS][SLOTS];
+	uint64_t current;
+	size_t count;
+};
+
+#endif
\ No newline at end of file
@@ -1,27 +1,67 @@
 #include "user.hpp"
 
+#include <cstring>
+
+#include "epoch.hpp"
+
 User::User(const std::string &u, const std::string &p) 
 {
 	username = u;
-	password = p;
+	password = new std::string(p);
+	address.version = 0;
+	address.family = 0;
+	socket_address_length = 0;
+	friends = new Friends;
 }
 
 User::User(const std::string &u, const std::string &h, const std::string &p)
 {
 	username = u;
+	password = new std::string;
 	address.hostname = h;
 	address.port = p;
+	address.version = 0;
+	address.family = 0;
+	socket_address_length = 0;
+	friends = new Friends;
+}
+
+User::~User()
+{
+	delete friends.load();
+	delete password.load();
 }
 
 void User::addFriend(const std::string &uname)
 {
-	friend_list.push_back(uname);
+	addFriends(std::vector<std::string>(1, uname));
 }
 
-void User::setAddressInfo(const std::string &h, const std::string &p)
+void User::addFriends(const std::vector<std::string> &unames)
+{
+	// the friend list is copied once however many friends are added
+	const Friends *current = friends.load(std::memory_order_acquire);
+	Friends *updated = new Friends(*current);
+	for (auto itr = unames.begin(); itr != unames.end(); ++itr) {
+		if (updated->set.insert(*itr).second) {
+			updated->list.push_back(*itr);
+		}
+	}
+	if (updated->list.size() == current->list.size()) {
+		delete updated;
+		return;
+	}
+	friends.store(updated, std::memory_order_release);
+	retireObject(current);
+}
+
+void User::setAddressInfo(const std::string &h, const std::string &p, uint16_t v, int f)
 {
 	address.hostname = h;
 	address.port = p;
+	address.version = v;
+	address.family = f;
+	socket_address_length = 0;
 }
 
 Location User::getAddressInfo() const
@@ -29,19 +69,39 @@ Location User::getAddressInfo() const
 	return address;
 }
 
-bool User::hasFriend(const std::string &uname) const
+void User::setSocketAddress(const struct sockaddr *a, socklen_t length)
 {
-	for (unsigned i = 0; i < friend_list.size(); ++i) {
-		if (friend_list[i] == uname) {
-			return true;
-		}
+	if (length > sizeof(socket_address)) {
+		return;
 	}
-	return false;
+	memcpy(&socket_address, a, length);
+	socket_address_length = length;
+}
+
+socklen_t User::getSocketAddress(struct sockaddr_storage &a) const
+{
+	// returns 0 if the location has not been resolved
+	memcpy(&a, &socket_address, socket_address_length);
+	return socket_address_length;
+}
+
+bool User::hasFriend(const std::string &uname) const
+{
+	EpochGuard guard;
+	return friends.load(std::memory_order_acquire)->set.count(uname) > 0;
+}
+
+std::vector<std::string> User::getFriends() const
+{
+	EpochGuard guard;
+	return friends.load(std::memory_order_acquire)->list;
 }
 
 std::string User::infoToString() const
 {
-	std::string info = username + "|" + password + "|";
+	EpochGuard guard;
+	const std::vector<std::string> &friend_list = friends.load(std::memory_order_acquire)->list;
+	std::string info = username + "|" + *password.load(std::memory_order_acquire) + "|";
 	int num_contacts = friend_list.size();
 	if (num_contacts == 1) {
 		info += friend_list[0];
@@ -62,5 +122,13 @@ std::string User::getUsername() const
 
 std::string User::getPassword() const
 {
-	return password;
+	EpochGuard guard;
+	return *password.load(std::memory_order_acquire);
+}
+
+void User::setPassword(const std::string &p)
+{
+	const std::string *current = password.load(std::memory_order_acquire);
+	password.store(new std::string(p), std::memory_order_release);
+	retireObject(current);
 }
\ No newline at end of file
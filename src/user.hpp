@@ -1,30 +1,58 @@
 #ifndef USER_HPP
 #define USER_HPP
 
+#include <atomic>
+#include <cstdint>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
+#include <sys/socket.h>
+
 struct Location {
 	std::string hostname;
 	std::string port;
+	// newest protocol version the user's client accepts connections with
+	uint16_t version;
+	// AF_INET or AF_INET6 if hostname is a numeric address, otherwise 0
+	int family;
 };
 
+// Friends and the password are read without locks, see epoch.hpp. Adding a
+// friend publishes a new copy of the friend list, and callers make sure only
+// one thread adds friends to or sets the password of a user at a time.
 class User {
 public:
 	User(const std::string&, const std::string&);
 	User(const std::string&, const std::string&, const std::string&);
+	~User();
+	User(const User&) = delete;
+	User &operator=(const User&) = delete;
 	void addFriend(const std::string&);
-	void setAddressInfo(const std::string&, const std::string&);
+	void addFriends(const std::vector<std::string>&);
+	void setAddressInfo(const std::string&, const std::string&, uint16_t = 0, int = 0);
 	Location getAddressInfo() const;
+	void setSocketAddress(const struct sockaddr*, socklen_t);
+	socklen_t getSocketAddress(struct sockaddr_storage&) const;
 	bool hasFriend(const std::string&) const;
+	std::vector<std::string> getFriends() const;
 	std::string infoToString() const;
 	std::string getUsername() const;
 	std::string getPassword() const;
+	void setPassword(const std::string&);
 private:
 	std::string username;
-	std::string password;
+	std::atomic<const std::string*> password;
+	struct Friends {
+		std::vector<std::string> list;
+		// same friends as list, for constant time lookups
+		std::unordered_set<std::string> set;
+	};
 	Location address;
-	std::vector<std::string> friend_list;
+	// address resolved from the location, so connecting needs no lookup
+	struct sockaddr_storage socket_address;
+	socklen_t socket_address_length;
+	std::atomic<const Friends*> friends;
 };
 
 #endif
\ No newline at end of file
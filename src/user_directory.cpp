@@ -0,0 +1,141 @@
+#include "user_directory.hpp"
+
+#include <fstream>
+#include <sstream>
+
+UserDirectory::UserDirectory()
+{
+	pthread_mutex_init(&users_mutex, nullptr);
+}
+
+UserDirectory::~UserDirectory()
+{
+	pthread_mutex_destroy(&users_mutex);
+}
+
+bool UserDirectory::loadText(const std::string &path)
+{
+	std::ifstream user_file(path);
+	if (!user_file.is_open()) {
+		return false;
+	}
+
+	/*
+		Each line of a non-empty user file should be in the format: 
+
+		username|password|friend1;friend2;...;friendN
+
+	*/
+
+	std::string line;
+	while (getline(user_file, line)) {
+		std::istringstream strm(line);
+		std::string username;
+		std::string password;
+		std::string contact;
+		getline(strm, username, '|');
+		getline(strm, password, '|');
+		std::shared_ptr<User> u(new User(username, password));
+		std::vector<std::string> friends;
+		while (getline(strm, contact, ';')) {
+			friends.push_back(contact);
+		}
+		u->addFriends(friends);
+		add(u);
+	}
+	return true;
+}
+
+bool UserDirectory::loadBinary(const std::string &path)
+{
+	// nothing is parsed here, records are read from the mapping on demand
+	return store.open(path);
+}
+
+bool UserDirectory::add(const std::shared_ptr<User> &user)
+{
+	// usernames are unique, so refuse to add a second user with the same one
+	if (store.contains(user->getUsername()) || !index.insert(user->getUsername(), user)) {
+		return false;
+	}
+	pthread_mutex_lock(&users_mutex);
+	users.push_back(user);
+	pthread_mutex_unlock(&users_mutex);
+	return true;
+}
+
+std::shared_ptr<User> UserDirectory::find(const std::string &username)
+{
+	std::shared_ptr<User> user;
+	if (index.find(username, user)) {
+		return user;
+	}
+	// keep the parsed record, so changes to the user are not lost; if
+	// another thread got there first, use its copy
+	user = store.load(username);
+	if (user && !index.insert(username, user)) {
+		index.find(username, user);
+	}
+	return user;
+}
+
+bool UserDirectory::contains(const std::string &username) const
+{
+	return index.contains(username) || store.contains(username);
+}
+
+size_t UserDirectory::size()
+{
+	pthread_mutex_lock(&users_mutex);
+	size_t added = users.size();
+	pthread_mutex_unlock(&users_mutex);
+	return store.size() + added;
+}
+
+std::string UserDirectory::toText()
+{
+	std::string text;
+	store.forEachRecord([&](const std::string &username, const char *record, size_t length) {
+		std::shared_ptr<User> user;
+		if (!index.find(username, user)) {
+			user = UserStore::parseRecord(record, length);
+		}
+		text += user->infoToString();
+		text += '\n';
+	});
+	std::vector<std::shared_ptr<User>> added = addedUsers();
+	for (auto itr = added.begin(); itr != added.end(); ++itr) {
+		text += (*itr)->infoToString();
+		text += '\n';
+	}
+	return text;
+}
+
+std::string UserDirectory::toBinary()
+{
+	// records of users that were never looked up can not have changed, so
+	// they are copied over without being parsed
+	UserStoreWriter writer;
+	store.forEachRecord([&](const std::string &username, const char *record, size_t length) {
+		std::shared_ptr<User> user;
+		if (index.find(username, user)) {
+			writer.add(*user);
+		} else {
+			writer.addRecord(username, record, length);
+		}
+	});
+	std::vector<std::shared_ptr<User>> added = addedUsers();
+	for (auto itr = added.begin(); itr != added.end(); ++itr) {
+		writer.add(**itr);
+	}
+	return writer.finish();
+}
+
+std::vector<std::shared_ptr<User>> UserDirectory::addedUsers()
+{
+	// users added while the copy is written out are left to the next one
+	pthread_mutex_lock(&users_mutex);
+	std::vector<std::shared_ptr<User>> added = users;
+	pthread_mutex_unlock(&users_mutex);
+	return added;
+}
\ No newline at end of file
@@ -0,0 +1,42 @@
+#ifndef USER_DIRECTORY_HPP
+#define USER_DIRECTORY_HPP
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <pthread.h>
+
+#include "cow_map.hpp"
+#include "user.hpp"
+#include "user_store.hpp"
+
+// Registered users, indexed by username. Users from a binary user file stay
+// in the mapped file until they are first looked up; users registered since
+// are kept in the order they registered so the user file is written out in a
+// stable order. Lookups take no locks.
+class UserDirectory {
+public:
+	UserDirectory();
+	~UserDirectory();
+	bool loadText(const std::string&);
+	bool loadBinary(const std::string&);
+	bool add(const std::shared_ptr<User>&);
+	std::shared_ptr<User> find(const std::string&);
+	bool contains(const std::string&) const;
+	size_t size();
+	std::string toText();
+	std::string toBinary();
+private:
+	std::vector<std::shared_ptr<User>> addedUsers();
+	UserStore store;
+	// users registered since the user file was loaded, or every user if
+	// it was a text file
+	std::vector<std::shared_ptr<User>> users;
+	pthread_mutex_t users_mutex;
+	// every user that has been looked up or added
+	CowMap<std::string, std::shared_ptr<User>> index;
+};
+
+#endif
\ No newline at end of file
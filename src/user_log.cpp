@@ -0,0 +1,308 @@
+#include "user_log.hpp"
+
+#include <cerrno>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.hpp"
+
+UserLog::UserLog()
+{
+	log_fd = -1;
+	synced_length = 0;
+	commit_fd = -1;
+	rotated = false;
+	writing = false;
+	failing = false;
+	stopping = false;
+	appended_seq = 0;
+	records_since_rotation = 0;
+	committed_seq = 0;
+	log_length = 0;
+	new_log_length = 0;
+	pthread_mutex_init(&mutex, nullptr);
+	pthread_cond_init(&pending_cond, nullptr);
+	pthread_cond_init(&idle_cond, nullptr);
+	pthread_cond_init(&compaction_cond, nullptr);
+}
+
+size_t UserLog::replay(const std::string &user_filename, UserDirectory &directory)
+{
+	// a log rotated by a compaction that did not finish is replayed last
+	log_path = user_filename + ".log";
+	size_t count = replayFile(log_path, directory, log_length);
+	count += replayFile(log_path + ".new", directory, new_log_length);
+	records_since_rotation = count;
+	return count;
+}
+
+bool UserLog::start()
+{
+	// keep appending to the log that was replayed, the next compaction
+	// moves its records into the user file; a rotated log that was never
+	// renamed is still the newest one
+	std::string path = log_path;
+	off_t length = log_length;
+	if (access((log_path + ".new").c_str(), F_OK) == 0) {
+		path = log_path + ".new";
+		length = new_log_length;
+		rotated = true;
+	}
+	if ((log_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600)) < 0) {
+		return false;
+	}
+	// drop a record that was only partly written, so new records do not
+	// get appended to it
+	if (ftruncate(log_fd, length) < 0) {
+		return false;
+	}
+	synced_length = length;
+	if ((commit_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+		return false;
+	}
+	return pthread_create(&writer, nullptr, writerThread, this) == 0;
+}
+
+// both return the sequence number of the record, or 0 if it was refused
+// because the log can not be written to
+uint64_t UserLog::logRegistration(const std::string &username, const std::string &password)
+{
+	return append("REGISTER " + username + " " + password + "\n");
+}
+
+uint64_t UserLog::logFriendship(const std::string &user1, const std::string &user2)
+{
+	return append("FRIEND " + user1 + " " + user2 + "\n");
+}
+
+uint64_t UserLog::logPassword(const std::string &username, const std::string &password)
+{
+	return append("PASSWORD " + username + " " + password + "\n");
+}
+
+uint64_t UserLog::committed()
+{
+	// every record up to the returned sequence number is safely on disk
+	uint64_t count;
+	while (read(commit_fd, &count, sizeof(count)) > 0) {
+	}
+	return committed_seq;
+}
+
+int UserLog::commitFd() const
+{
+	return commit_fd;
+}
+
+bool UserLog::waitForCompaction()
+{
+	// returns true once enough has been logged to be worth a compaction, or
+	// false if the log is being closed
+	pthread_mutex_lock(&mutex);
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += COMPACTION_INTERVAL_SECONDS;
+	while (!stopping && records_since_rotation < COMPACTION_RECORDS) {
+		if (pthread_cond_timedwait(&compaction_cond, &mutex, &deadline) == ETIMEDOUT) {
+			if (records_since_rotation > 0 || rotated) {
+				break;
+			}
+			deadline.tv_sec += COMPACTION_INTERVAL_SECONDS;
+		}
+	}
+	bool compact = !stopping;
+	pthread_mutex_unlock(&mutex);
+	return compact;
+}
+
+bool UserLog::rotate()
+{
+	// called with the user directory locked, so nothing is appended while
+	// the records logged so far are flushed to the current file; a rotation
+	// that was never finished keeps its file, and nothing is rotated while
+	// the log can not be written to
+	pthread_mutex_lock(&mutex);
+	while ((!pending.empty() || writing) && !failing) {
+		pthread_cond_wait(&idle_cond, &mutex);
+	}
+	bool flushed = !failing;
+	if (flushed && !rotated) {
+		int new_fd = open((log_path + ".new").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+		if (new_fd >= 0) {
+			::close(log_fd);
+			log_fd = new_fd;
+			synced_length = 0;
+			rotated = true;
+		}
+	}
+	if (flushed) {
+		records_since_rotation = 0;
+	}
+	pthread_mutex_unlock(&mutex);
+	return flushed;
+}
+
+bool UserLog::finishRotation()
+{
+	// the new user file is on disk, so the records from before the rotation
+	// are no longer needed
+	pthread_mutex_lock(&mutex);
+	bool finished = !rotated || (rename((log_path + ".new").c_str(), log_path.c_str()) == 0 && syncParentDirectory(log_path));
+	if (finished) {
+		rotated = false;
+	}
+	pthread_mutex_unlock(&mutex);
+	return finished;
+}
+
+bool UserLog::sync()
+{
+	// returns true once every record appended so far is on disk, and leaves
+	// the log open for more, or false if the log can not be written to
+	pthread_mutex_lock(&mutex);
+	while ((!pending.empty() || writing) && !failing) {
+		pthread_cond_wait(&idle_cond, &mutex);
+	}
+	bool synced = !failing;
+	pthread_mutex_unlock(&mutex);
+	return synced;
+}
+
+void UserLog::close()
+{
+	// write out and sync whatever is still pending before returning
+	if (log_fd < 0) {
+		return;
+	}
+	pthread_mutex_lock(&mutex);
+	stopping = true;
+	pthread_cond_broadcast(&pending_cond);
+	pthread_cond_broadcast(&compaction_cond);
+	pthread_mutex_unlock(&mutex);
+	pthread_join(writer, nullptr);
+	::close(log_fd);
+	::close(commit_fd);
+	log_fd = -1;
+}
+
+void *UserLog::writerThread(void *arg)
+{
+	UserLog *log = (UserLog*)arg;
+	pthread_mutex_lock(&log->mutex);
+	while (true) {
+		while (log->pending.empty() && !log->stopping) {
+			pthread_cond_wait(&log->pending_cond, &log->mutex);
+		}
+		if (log->pending.empty()) {
+			break;
+		}
+
+		// take everything appended so far as one batch, records appended
+		// while this batch is synced go into the next one
+		std::string batch;
+		batch.swap(log->pending);
+		uint64_t seq = log->appended_seq;
+		int fd = log->log_fd;
+		off_t length = log->synced_length;
+		log->writing = true;
+		pthread_mutex_unlock(&log->mutex);
+
+		// whatever part of a failed batch made it into the file is cut off,
+		// so the retry does not append to a partly written record
+		bool written = writeAll(fd, batch.data(), batch.size()) && fdatasync(fd) == 0;
+		if (!written) {
+			std::cerr << "Failed to write to user log " << log->log_path << ", retrying\n";
+			ftruncate(fd, length);
+		}
+
+		pthread_mutex_lock(&log->mutex);
+		log->writing = false;
+		log->failing = !written;
+		if (written) {
+			log->synced_length = length + batch.size();
+			log->committed_seq = seq;
+			uint64_t one = 1;
+			write(log->commit_fd, &one, sizeof(one));
+		} else {
+			// records appended while the batch was being written go after it
+			batch += log->pending;
+			log->pending.swap(batch);
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += RETRY_INTERVAL_SECONDS;
+			while (!log->stopping && pthread_cond_timedwait(&log->pending_cond, &log->mutex, &deadline) != ETIMEDOUT) {
+			}
+			if (log->stopping) {
+				// closing gives up on the batch
+				std::cerr << "Failed to sync user log " << log->log_path << " before closing it\n";
+				pthread_cond_broadcast(&log->idle_cond);
+				break;
+			}
+		}
+		pthread_cond_broadcast(&log->idle_cond);
+	}
+	pthread_mutex_unlock(&log->mutex);
+	return nullptr;
+}
+
+uint64_t UserLog::append(const std::string &record)
+{
+	pthread_mutex_lock(&mutex);
+	if (failing) {
+		pthread_mutex_unlock(&mutex);
+		return 0;
+	}
+	pending += record;
+	uint64_t seq = ++appended_seq;
+	if (++records_since_rotation >= COMPACTION_RECORDS) {
+		pthread_cond_signal(&compaction_cond);
+	}
+	pthread_cond_signal(&pending_cond);
+	pthread_mutex_unlock(&mutex);
+	return seq;
+}
+
+size_t UserLog::replayFile(const std::string &path, UserDirectory &directory, off_t &length)
+{
+	// length is set to the size of the records that were whole
+	std::ifstream log_file(path);
+	std::string line;
+	size_t count = 0;
+	length = 0;
+	while (getline(log_file, line)) {
+		if (log_file.eof()) {
+			// last record was only partly written when the server stopped
+			break;
+		}
+		std::istringstream strm(line);
+		std::string type;
+		std::string field1;
+		std::string field2;
+		strm >> type >> field1 >> field2;
+		if (type == "REGISTER") {
+			directory.add(std::make_shared<User>(field1, field2));
+		} else if (type == "FRIEND") {
+			std::shared_ptr<User> u1 = directory.find(field1);
+			std::shared_ptr<User> u2 = directory.find(field2);
+			if (u1 && u2) {
+				u1->addFriend(field2);
+				u2->addFriend(field1);
+			}
+		} else if (type == "PASSWORD") {
+			std::shared_ptr<User> u = directory.find(field1);
+			if (u) {
+				u->setPassword(field2);
+			}
+		}
+		++count;
+		length += line.size() + 1;
+	}
+	return count;
+}
\ No newline at end of file
@@ -0,0 +1,90 @@
+#ifndef USER_LOG_HPP
+#define USER_LOG_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "user_directory.hpp"
+
+/*
+	Write-ahead log of changes to the user file
+
+	Every registration, friendship and changed password is appended to
+	user_file.log as a line:
+
+	REGISTER username password
+	FRIEND username1 username2
+	PASSWORD username password
+
+	A writer thread writes whatever has been appended since its last write
+	and fsyncs it, so records appended while an fsync is in progress share the
+	next one. A batch that fails to be written is cut off the end of the log
+	again and retried until it is written; meanwhile no new records are
+	taken, and nothing from the batch on is reported as committed.
+
+	On startup the log is replayed on top of the user file and then appended
+	to, so starting up never has to write out the whole user file.
+
+	Compaction writes a new user file in the background. Before it starts,
+	the log is rotated to user_file.log.new, and that file replaces
+	user_file.log once the new user file is safely on disk. Replaying a record
+	that is already in the user file changes nothing, so a crash at any point
+	of a compaction loses nothing.
+*/
+
+// compact once this many records have been logged
+const uint64_t COMPACTION_RECORDS = 10000;
+// otherwise compact this often, if anything was logged at all
+const int COMPACTION_INTERVAL_SECONDS = 300;
+// how long the writer waits before writing a failed batch again
+const int RETRY_INTERVAL_SECONDS = 1;
+
+class UserLog {
+public:
+	UserLog();
+	size_t replay(const std::string&, UserDirectory&);
+	bool start();
+	uint64_t logRegistration(const std::string&, const std::string&);
+	uint64_t logFriendship(const std::string&, const std::string&);
+	uint64_t logPassword(const std::string&, const std::string&);
+	uint64_t committed();
+	int commitFd() const;
+	bool waitForCompaction();
+	bool rotate();
+	bool finishRotation();
+	bool sync();
+	void close();
+private:
+	static void *writerThread(void*);
+	uint64_t append(const std::string&);
+	size_t replayFile(const std::string&, UserDirectory&, off_t&);
+	std::string log_path;
+	// size of the whole records found by replay
+	off_t log_length;
+	off_t new_log_length;
+	int log_fd;
+	// size of what has been synced to log_fd
+	off_t synced_length;
+	// becomes readable whenever more records are safely on disk
+	int commit_fd;
+	bool rotated;
+	bool writing;
+	// the last batch failed to be written, new records are refused
+	bool failing;
+	bool stopping;
+	std::string pending;
+	uint64_t appended_seq;
+	uint64_t records_since_rotation;
+	std::atomic<uint64_t> committed_seq;
+	pthread_t writer;
+	pthread_mutex_t mutex;
+	pthread_cond_t pending_cond;
+	pthread_cond_t idle_cond;
+	pthread_cond_t compaction_cond;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,299 @@
+#include "user_store.hpp"
+
+#include <cstring>
+
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+uint64_t hashUsername(const char *username, size_t length)
+{
+	// 64-bit FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < length; ++i) {
+		hash ^= (unsigned char)username[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+uint16_t getUint16(const char *data)
+{
+	uint16_t value;
+	memcpy(&value, data, sizeof(value));
+	return le16toh(value);
+}
+
+uint32_t getUint32(const char *data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return le32toh(value);
+}
+
+uint64_t getUint64(const char *data)
+{
+	uint64_t value;
+	memcpy(&value, data, sizeof(value));
+	return le64toh(value);
+}
+
+void putUint16(std::string &out, uint16_t value)
+{
+	value = htole16(value);
+	out.append((const char*)&value, sizeof(value));
+}
+
+void putUint32(std::string &out, uint32_t value)
+{
+	value = htole32(value);
+	out.append((const char*)&value, sizeof(value));
+}
+
+void putUint64(std::string &out, uint64_t value)
+{
+	value = htole64(value);
+	out.append((const char*)&value, sizeof(value));
+}
+
+void setUint64(std::string &out, size_t offset, uint64_t value)
+{
+	value = htole64(value);
+	memcpy(&out[offset], &value, sizeof(value));
+}
+
+void putString(std::string &out, const std::string &str)
+{
+	putUint16(out, str.size());
+	out += str;
+}
+
+}
+
+bool isUserStoreFile(const std::string &path)
+{
+	char magic[USER_STORE_MAGIC_SIZE];
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	bool binary = read(fd, magic, sizeof(magic)) == sizeof(magic) && memcmp(magic, USER_STORE_MAGIC, sizeof(magic)) == 0;
+	close(fd);
+	return binary;
+}
+
+UserStore::UserStore()
+{
+	data = nullptr;
+	length = 0;
+	user_count = 0;
+	index_offset = 0;
+	bucket_count = 0;
+}
+
+UserStore::~UserStore()
+{
+	if (data != nullptr) {
+		munmap((void*)data, length);
+	}
+}
+
+bool UserStore::open(const std::string &path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat info;
+	if (fstat(fd, &info) < 0 || (size_t)info.st_size < USER_STORE_HEADER_SIZE) {
+		close(fd);
+		return false;
+	}
+	// the mapping outlives the descriptor, and the file itself if a
+	// compaction replaces it
+	void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		return false;
+	}
+	data = (const char*)mapping;
+	length = info.st_size;
+	user_count = getUint64(data + 8);
+	index_offset = getUint64(data + 16);
+	bucket_count = getUint64(data + 24);
+
+	bool valid = memcmp(data, USER_STORE_MAGIC, USER_STORE_MAGIC_SIZE) == 0
+		&& index_offset >= USER_STORE_HEADER_SIZE
+		&& bucket_count > 0 && (bucket_count & (bucket_count - 1)) == 0
+		&& bucket_count <= (length - index_offset) / sizeof(uint64_t)
+		&& index_offset + bucket_count * sizeof(uint64_t) == length;
+	if (!valid) {
+		munmap(mapping, length);
+		data = nullptr;
+		return false;
+	}
+	// lookups touch the index and records in no particular order
+	madvise(mapping, length, MADV_RANDOM);
+	return true;
+}
+
+bool UserStore::isOpen() const
+{
+	return data != nullptr;
+}
+
+size_t UserStore::size() const
+{
+	return user_count;
+}
+
+bool UserStore::contains(const std::string &username) const
+{
+	return findRecord(username) != 0;
+}
+
+std::shared_ptr<User> UserStore::load(const std::string &username) const
+{
+	uint64_t offset = findRecord(username);
+	if (offset == 0) {
+		return nullptr;
+	}
+	return parseRecord(data + offset, recordLength(offset));
+}
+
+void UserStore::forEachRecord(const std::function<void(const std::string&, const char*, size_t)> &callback) const
+{
+	// records are laid out in the order the users were written
+	uint64_t offset = USER_STORE_HEADER_SIZE;
+	while (data != nullptr && offset < index_offset) {
+		size_t record_length = recordLength(offset);
+		if (record_length == 0) {
+			break;
+		}
+		callback(std::string(data + offset + 8, getUint16(data + offset)), data + offset, record_length);
+		offset += record_length;
+	}
+}
+
+std::shared_ptr<User> UserStore::parseRecord(const char *record, size_t record_length)
+{
+	uint16_t username_length = getUint16(record);
+	uint16_t password_length = getUint16(record + 2);
+	uint32_t friend_count = getUint32(record + 4);
+	const char *field = record + 8;
+	std::shared_ptr<User> user = std::make_shared<User>(std::string(field, username_length), std::string(field + username_length, password_length));
+	field += username_length + password_length;
+	std::vector<std::string> friends;
+	friends.reserve(friend_count);
+	for (uint32_t i = 0; i < friend_count; ++i) {
+		uint16_t friend_length = getUint16(field);
+		friends.push_back(std::string(field + 2, friend_length));
+		field += 2 + friend_length;
+	}
+	user->addFriends(friends);
+	return user;
+}
+
+uint64_t UserStore::findRecord(const std::string &username) const
+{
+	// returns the offset of the user's record, or 0 if there is none
+	if (data == nullptr) {
+		return 0;
+	}
+	uint64_t mask = bucket_count - 1;
+	uint64_t bucket = hashUsername(username.data(), username.size()) & mask;
+	for (uint64_t probes = 0; probes < bucket_count; ++probes) {
+		uint64_t offset = getUint64(data + index_offset + bucket * sizeof(uint64_t));
+		if (offset == 0) {
+			return 0;
+		}
+		if (recordLength(offset) > 0 && getUint16(data + offset) == username.size() && memcmp(data + offset + 8, username.data(), username.size()) == 0) {
+			return offset;
+		}
+		bucket = (bucket + 1) & mask;
+	}
+	return 0;
+}
+
+size_t UserStore::recordLength(uint64_t offset) const
+{
+	// returns 0 for a record that would run past the records region, so a
+	// damaged file can not make the server read outside the mapping
+	if (offset < USER_STORE_HEADER_SIZE || offset + 8 > index_offset) {
+		return 0;
+	}
+	uint64_t end = offset + 8 + getUint16(data + offset) + getUint16(data + offset + 2);
+	uint32_t friend_count = getUint32(data + offset + 4);
+	for (uint32_t i = 0; i < friend_count; ++i) {
+		if (end + 2 > index_offset) {
+			return 0;
+		}
+		end += 2 + getUint16(data + end);
+	}
+	if (end > index_offset) {
+		return 0;
+	}
+	return end - offset;
+}
+
+UserStoreWriter::UserStoreWriter()
+{
+	// header is filled in by finish
+	contents.assign(USER_STORE_MAGIC, USER_STORE_MAGIC_SIZE);
+	contents.resize(USER_STORE_HEADER_SIZE);
+}
+
+void UserStoreWriter::add(const User &user)
+{
+	std::string username = user.getUsername();
+	std::string password = user.getPassword();
+	std::vector<std::string> friends = user.getFriends();
+	records.push_back(std::make_pair(hashUsername(username.data(), username.size()), contents.size()));
+	putUint16(contents, username.size());
+	putUint16(contents, password.size());
+	putUint32(contents, friends.size());
+	contents += username;
+	contents += password;
+	for (auto itr = friends.begin(); itr != friends.end(); ++itr) {
+		putString(contents, *itr);
+	}
+}
+
+void UserStoreWriter::addRecord(const std::string &username, const char *record, size_t record_length)
+{
+	// copy a record from an existing user file as it is
+	records.push_back(std::make_pair(hashUsername(username.data(), username.size()), contents.size()));
+	contents.append(record, record_length);
+}
+
+std::string UserStoreWriter::finish()
+{
+	// keep the index at most half full so probe sequences stay short
+	uint64_t bucket_count = 16;
+	while (bucket_count < records.size() * 2) {
+		bucket_count *= 2;
+	}
+	std::vector<uint64_t> buckets(bucket_count, 0);
+	for (auto itr = records.begin(); itr != records.end(); ++itr) {
+		uint64_t bucket = itr->first & (bucket_count - 1);
+		while (buckets[bucket] != 0) {
+			bucket = (bucket + 1) & (bucket_count - 1);
+		}
+		buckets[bucket] = itr->second;
+	}
+
+	setUint64(contents, 8, records.size());
+	setUint64(contents, 16, contents.size());
+	setUint64(contents, 24, bucket_count);
+	contents.reserve(contents.size() + bucket_count * sizeof(uint64_t));
+	for (auto itr = buckets.begin(); itr != buckets.end(); ++itr) {
+		putUint64(contents, *itr);
+	}
+	std::string finished;
+	finished.swap(contents);
+	return finished;
+}
\ No newline at end of file
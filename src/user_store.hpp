@@ -0,0 +1,70 @@
+#ifndef USER_STORE_HPP
+#define USER_STORE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "user.hpp"
+
+/*
+	Binary user file
+
+	header: "MSGRUSR1" | user count (u64) | index offset (u64) | bucket count (u64)
+	records: username length (u16) | password length (u16) | friend count (u32)
+	         | username | password | friend length (u16) | friend | ...
+	index: bucket count record offsets (u64), 0 for an empty bucket
+
+	Integers are little-endian. The index is an open addressing hash table of
+	usernames with linear probing, so a user is found by reading a handful of
+	pages of the mapped file and only that user's record is ever parsed.
+*/
+
+const char USER_STORE_MAGIC[] = "MSGRUSR1";
+const size_t USER_STORE_MAGIC_SIZE = 8;
+const size_t USER_STORE_HEADER_SIZE = 32;
+
+bool isUserStoreFile(const std::string&);
+
+// Read-only view of a memory-mapped binary user file.
+class UserStore {
+public:
+	UserStore();
+	~UserStore();
+	UserStore(const UserStore&) = delete;
+	UserStore &operator=(const UserStore&) = delete;
+	bool open(const std::string&);
+	bool isOpen() const;
+	size_t size() const;
+	bool contains(const std::string&) const;
+	std::shared_ptr<User> load(const std::string&) const;
+	void forEachRecord(const std::function<void(const std::string&, const char*, size_t)>&) const;
+	static std::shared_ptr<User> parseRecord(const char*, size_t);
+private:
+	uint64_t findRecord(const std::string&) const;
+	size_t recordLength(uint64_t) const;
+	const char *data;
+	size_t length;
+	uint64_t user_count;
+	uint64_t index_offset;
+	uint64_t bucket_count;
+};
+
+// Builds the contents of a binary user file.
+class UserStoreWriter {
+public:
+	UserStoreWriter();
+	void add(const User&);
+	void addRecord(const std::string&, const char*, size_t);
+	std::string finish();
+private:
+	std::string contents;
+	// hash of the username and offset of each record
+	std::vector<std::pair<uint64_t, uint64_t>> records;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,311 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "user_directory.hpp"
+#include "user_log.hpp"
+#include "user_store.hpp"
+
+/*
+	User file and user log check
+
+	Writes random users out as a text and a binary user file and reads them
+	back, in every direction, expecting the same users and friends each
+	time. Then logs registrations, friendships and rehashed passwords on top
+	of a binary user file and replays the log into a fresh directory: after
+	a clean close, with a record torn off the end, after a finished
+	compaction and after one that stopped between rotating the log and
+	replacing the user file.
+	Everything happens in a temporary directory that is removed afterwards.
+	Exits with failure on the first thing that is wrong.
+*/
+
+const char USAGE[] = "usage: ./user_store_check [users]\n";
+const int DEFAULT_USERS = 2000;
+// friendships logged on top of the user file in each round
+const int LOGGED_FRIENDSHIPS = 300;
+
+std::string directory_path;
+
+void fail(const std::string &what)
+{
+	std::cerr << "user_store_check: " << what << '\n';
+	exit(EXIT_FAILURE);
+}
+
+std::string randomName(const std::string &prefix, int number)
+{
+	// names of every length, so records are not all the same size
+	std::string name = prefix + std::to_string(number);
+	for (int i = rand() % 12; i > 0; --i) {
+		name += "abcxyz019_"[rand() % 10];
+	}
+	return name;
+}
+
+std::string randomPassword()
+{
+	// salted hashes, as well as the unsalted ones from before them
+	std::string password = rand() % 2 == 0 ? "$6$rounds=1000$" : "";
+	for (int i = 1 + rand() % 60; i > 0; --i) {
+		password += "./ABCXYZabcxyz0189$"[rand() % 19];
+	}
+	return password;
+}
+
+void writeFile(const std::string &path, const std::string &contents)
+{
+	std::ofstream file(path, std::ios::trunc | std::ios::binary);
+	file << contents;
+	file.close();
+	if (!file) {
+		fail("failed to write " + path);
+	}
+}
+
+std::string readFile(const std::string &path)
+{
+	std::ifstream file(path, std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+void compareUsers(UserDirectory &directory, const std::vector<std::shared_ptr<User>> &expected, const std::string &what)
+{
+	if (directory.size() != expected.size()) {
+		fail(what + ": " + std::to_string(directory.size()) + " users instead of " + std::to_string(expected.size()));
+	}
+	for (auto itr = expected.begin(); itr != expected.end(); ++itr) {
+		std::shared_ptr<User> user = directory.find((*itr)->getUsername());
+		if (!user) {
+			fail(what + ": " + (*itr)->getUsername() + " is missing");
+		}
+		if (user->getPassword() != (*itr)->getPassword() || user->getFriends() != (*itr)->getFriends()) {
+			fail(what + ": " + (*itr)->getUsername() + " came back changed");
+		}
+	}
+	if (directory.find("nobody") || directory.contains("nobody")) {
+		fail(what + ": a user that was never added is found");
+	}
+}
+
+std::vector<std::shared_ptr<User>> randomUsers(int count)
+{
+	std::vector<std::shared_ptr<User>> users;
+	for (int i = 0; i < count; ++i) {
+		users.push_back(std::make_shared<User>(randomName("u", i), randomPassword()));
+	}
+	for (int i = 0; i < count; ++i) {
+		for (int j = rand() % 8; j > 0; --j) {
+			users[i]->addFriend(users[rand() % count]->getUsername());
+		}
+	}
+	return users;
+}
+
+void checkFormats(const std::vector<std::shared_ptr<User>> &users)
+{
+	UserDirectory original;
+	for (auto itr = users.begin(); itr != users.end(); ++itr) {
+		original.add(*itr);
+	}
+	std::string text = original.toText();
+	std::string binary = original.toBinary();
+	std::string text_path = directory_path + "/users.txt";
+	std::string binary_path = directory_path + "/users.db";
+	writeFile(text_path, text);
+	writeFile(binary_path, binary);
+
+	UserDirectory from_text;
+	if (isUserStoreFile(text_path) || !from_text.loadText(text_path)) {
+		fail("failed to load the text user file");
+	}
+	compareUsers(from_text, users, "text user file");
+	if (from_text.toText() != text || from_text.toBinary() != binary) {
+		fail("text user file is not written out the way it was read");
+	}
+
+	// records of users that were never looked up are copied as they are,
+	// and the ones that were are written out the same way again
+	UserDirectory from_binary;
+	if (!isUserStoreFile(binary_path) || !from_binary.loadBinary(binary_path)) {
+		fail("failed to load the binary user file");
+	}
+	if (from_binary.toBinary() != binary || from_binary.toText() != text) {
+		fail("binary user file is not written out the way it was read");
+	}
+	compareUsers(from_binary, users, "binary user file");
+	if (from_binary.toBinary() != binary || from_binary.toText() != text) {
+		fail("binary user file changed once its users were looked up");
+	}
+
+	// a file cut short or with a broken index offset is refused
+	UserDirectory truncated;
+	writeFile(binary_path + ".cut", binary.substr(0, binary.size() - 1));
+	writeFile(binary_path + ".bad", binary.substr(0, 16) + std::string(8, '\xff') + binary.substr(24));
+	UserDirectory broken;
+	if (truncated.loadBinary(binary_path + ".cut") || broken.loadBinary(binary_path + ".bad")) {
+		fail("a damaged binary user file was loaded");
+	}
+	unlink((binary_path + ".cut").c_str());
+	unlink((binary_path + ".bad").c_str());
+	unlink(text_path.c_str());
+}
+
+void waitForCommit(UserLog &log, uint64_t seq)
+{
+	for (int i = 0; log.committed() < seq; ++i) {
+		if (i == 5000) {
+			fail("logged records were never committed");
+		}
+		usleep(1000);
+	}
+}
+
+uint64_t logChanges(UserLog &log, UserDirectory &directory, std::vector<std::shared_ptr<User>> &users, int round)
+{
+	// registers a few users and befriends them with everyone else, the way
+	// the server does: logged first, then changed in the directory
+	uint64_t seq = 0;
+	for (int i = 0; i < LOGGED_FRIENDSHIPS; ++i) {
+		if (i % 10 == 0) {
+			std::shared_ptr<User> added = std::make_shared<User>(randomName("r" + std::to_string(round) + "_", i), randomPassword());
+			if ((seq = log.logRegistration(added->getUsername(), added->getPassword())) == 0) {
+				fail("a registration was refused");
+			}
+			directory.add(std::make_shared<User>(added->getUsername(), added->getPassword()));
+			users.push_back(added);
+		}
+		if (i % 25 == 0) {
+			std::shared_ptr<User> rehashed = users[rand() % users.size()];
+			std::string password = randomPassword();
+			if ((seq = log.logPassword(rehashed->getUsername(), password)) == 0) {
+				fail("a password was refused");
+			}
+			rehashed->setPassword(password);
+			directory.find(rehashed->getUsername())->setPassword(password);
+		}
+		std::shared_ptr<User> user1 = users[users.size() - 1 - rand() % 10];
+		std::shared_ptr<User> user2 = users[rand() % users.size()];
+		if (user1 == user2) {
+			continue;
+		}
+		if ((seq = log.logFriendship(user1->getUsername(), user2->getUsername())) == 0) {
+			fail("a friendship was refused");
+		}
+		user1->addFriend(user2->getUsername());
+		user2->addFriend(user1->getUsername());
+		directory.find(user1->getUsername())->addFriend(user2->getUsername());
+		directory.find(user2->getUsername())->addFriend(user1->getUsername());
+	}
+	return seq;
+}
+
+void replay(const std::string &path, std::vector<std::shared_ptr<User>> &users, const std::string &what)
+{
+	UserDirectory directory;
+	UserLog log;
+	if (!directory.loadBinary(path)) {
+		fail(what + ": failed to load the binary user file");
+	}
+	log.replay(path, directory);
+	compareUsers(directory, users, what);
+}
+
+void checkLog(std::vector<std::shared_ptr<User>> users)
+{
+	std::string path = directory_path + "/users.db";
+	std::string log_path = path + ".log";
+
+	// a clean close
+	{
+		UserDirectory directory;
+		UserLog log;
+		if (!directory.loadBinary(path) || log.replay(path, directory) != 0 || !log.start()) {
+			fail("failed to start logging on top of the binary user file");
+		}
+		waitForCommit(log, logChanges(log, directory, users, 1));
+		log.close();
+		compareUsers(directory, users, "logged directory");
+	}
+	replay(path, users, "log replayed after a clean close");
+
+	// a record torn off the end is ignored, and cut off once logging starts
+	std::string whole = readFile(log_path);
+	std::ofstream(log_path, std::ios::app) << "REGISTER torn $6$";
+	{
+		UserDirectory directory;
+		UserLog log;
+		if (!directory.loadBinary(path)) {
+			fail("failed to load the binary user file");
+		}
+		log.replay(path, directory);
+		compareUsers(directory, users, "log replayed with a torn record");
+		if (!log.start() || readFile(log_path) != whole) {
+			fail("the torn record was not cut off");
+		}
+
+		// a compaction that finishes leaves everything in the user file
+		waitForCommit(log, logChanges(log, directory, users, 2));
+		if (!log.rotate()) {
+			fail("failed to rotate the user log");
+		}
+		writeFile(path, directory.toBinary());
+		if (!log.finishRotation()) {
+			fail("failed to finish rotating the user log");
+		}
+		log.close();
+	}
+	if (!readFile(log_path).empty()) {
+		fail("the user log was not emptied by a compaction");
+	}
+	replay(path, users, "user file written by a compaction");
+
+	// a compaction that stops after the rotation leaves both logs behind
+	{
+		UserDirectory directory;
+		UserLog log;
+		if (!directory.loadBinary(path) || log.replay(path, directory) != 0 || !log.start()) {
+			fail("failed to start logging on top of the compacted user file");
+		}
+		waitForCommit(log, logChanges(log, directory, users, 3));
+		if (!log.rotate()) {
+			fail("failed to rotate the user log");
+		}
+		waitForCommit(log, logChanges(log, directory, users, 4));
+		log.close();
+	}
+	replay(path, users, "logs replayed after a compaction stopped");
+	unlink(path.c_str());
+	unlink(log_path.c_str());
+	unlink((log_path + ".new").c_str());
+}
+
+int main(int argc, char *argv[])
+{
+	int count = argc > 1 ? atoi(argv[1]) : DEFAULT_USERS;
+	if (argc > 2 || count <= 0) {
+		std::cerr << USAGE;
+		exit(EXIT_FAILURE);
+	}
+	char directory_template[] = "/tmp/user_store_check.XXXXXX";
+	if (mkdtemp(directory_template) == nullptr) {
+		fail("failed to create a temporary directory");
+	}
+	directory_path = directory_template;
+	srand(1);
+
+	std::vector<std::shared_ptr<User>> users = randomUsers(count);
+	checkFormats(users);
+	checkLog(users);
+	rmdir(directory_path.c_str());
+	std::cout << "User file and user log checks passed\n";
+	return EXIT_SUCCESS;
+}
\ No newline at end of file
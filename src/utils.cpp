@@ -1,5 +1,12 @@
 #include "utils.hpp"
 
+#include <cerrno>
+#include <memory>
+
+#include <crypt.h>
+#include <fcntl.h>
+#include <poll.h>
+
 void trimString(std::string &str)
 {
 	// left trim
@@ -8,7 +15,118 @@ void trimString(std::string &str)
 	str.erase(str.find_last_not_of(" \t") + 1);
 }
 
-char *createHash(const std::string &str)
+std::string createHash(const std::string &str)
+{
+	// what the client sends in place of the password; the server hashes it
+	// again with a salt of its own
+	std::unique_ptr<struct crypt_data> data(new struct crypt_data());
+	const char *hash = crypt_r(str.c_str(), "$1$########$", data.get());
+	return hash != nullptr ? hash : "";
+}
+
+int setNonBlocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0) {
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+bool readAll(int fd, char *data, size_t length)
+{
+	size_t received = 0;
+	while (received < length) {
+		ssize_t n = read(fd, data + received, length - received);
+		if (n > 0) {
+			received += n;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool writeAll(int fd, const char *data, size_t length)
+{
+	size_t written = 0;
+	while (written < length) {
+		ssize_t n = write(fd, data + written, length - written);
+		if (n > 0) {
+			written += n;
+		} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			// non-blocking socket is full, wait until it can take more data
+			struct pollfd pfd;
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, -1);
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool writeSome(int fd, std::string &buffer)
+{
+	// write as much of the buffer as a non-blocking socket takes now, and
+	// leave the rest in it; returns false if the connection is lost
+	size_t written = 0;
+	while (written < buffer.size()) {
+		ssize_t n = write(fd, buffer.data() + written, buffer.size() - written);
+		if (n > 0) {
+			written += n;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else {
+			return false;
+		}
+	}
+	buffer.erase(0, written);
+	return true;
+}
+
+bool syncParentDirectory(const std::string &path)
+{
+	// a rename is only durable once the directory holding the file is synced
+	size_t slash = path.find_last_of('/');
+	std::string directory = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+	int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		return false;
+	}
+	bool synced = fsync(fd) == 0;
+	close(fd);
+	return synced;
+}
+
+std::string createToken(size_t length)
 {
-	return crypt(str.c_str(), "$1$########$");
+	// hex encoded random bytes, or an empty string if there is no randomness
+	unsigned char bytes[64];
+	if (length > sizeof(bytes)) {
+		length = sizeof(bytes);
+	}
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0) {
+		return "";
+	}
+	bool filled = readAll(fd, (char*)bytes, length);
+	close(fd);
+	if (!filled) {
+		return "";
+	}
+	const char digits[] = "0123456789abcdef";
+	std::string token;
+	for (size_t i = 0; i < length; ++i) {
+		token += digits[bytes[i] >> 4];
+		token += digits[bytes[i] & 0xf];
+	}
+	return token;
 }
\ No newline at end of file
@@ -1,10 +1,17 @@
 #ifndef UTILS_HPP
 #define UTILS_HPP
 
+#include <cstddef>
 #include <string>
 #include <unistd.h>
 
 void trimString(std::string&);
-char *createHash(const std::string&);
+std::string createHash(const std::string&);
+int setNonBlocking(int);
+bool readAll(int, char*, size_t);
+bool writeAll(int, const char*, size_t);
+bool writeSome(int, std::string&);
+bool syncParentDirectory(const std::string&);
+std::string createToken(size_t);
 
 #endif
\ No newline at end of file